@@ -0,0 +1,513 @@
+#include "aio.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define AIO_NONE 0
+#define AIO_URING 1
+#define AIO_THREADS_MODE 2
+
+#define AIO_INLINE_IOV 4
+
+// Shared by the requests of one aio_run_batch call
+typedef struct {
+    int pending;
+    int result;
+} aio_batch_t;
+
+typedef struct aio_req {
+    int fd;
+    off_t off;
+    int write;
+    struct iovec *iov;
+    int iovcnt;
+    struct iovec *iov_alloc;        // NULL when iov_inline is used
+    struct iovec iov_inline[AIO_INLINE_IOV];
+    size_t remaining;
+    int result;
+    aio_done_fn fn;
+    void *arg;
+    aio_batch_t *batch;             // set instead of fn for batch requests
+    struct aio_req *next;
+} aio_req_t;
+
+static int mode = AIO_NONE;
+static int inflight = 0;            // updated atomically
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Requests finished without touching the engine (and, in thread mode, by
+// the workers) wait here until aio_reap runs their callbacks
+static aio_req_t *done_head = NULL;
+static aio_req_t *done_tail = NULL;
+
+// io_uring state
+static int ring_fd = -1;
+static void *sq_ptr = NULL;
+static void *cq_ptr = NULL;
+static size_t sq_size = 0;
+static size_t cq_size = 0;
+static struct io_uring_sqe *sqes = NULL;
+static size_t sqes_size = 0;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static unsigned sq_entries = 0;
+static unsigned cq_entries = 0;
+static unsigned to_submit = 0;
+static unsigned ring_pending = 0;   // requests the kernel still owns
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER; // all of the above
+
+// Thread pool state
+static pthread_t workers[AIO_THREADS];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+static aio_req_t *queue_head = NULL;
+static aio_req_t *queue_tail = NULL;
+static int pool_pending = 0;        // queued or being worked on
+static int pool_stop = 0;
+
+static void push_done(aio_req_t *req) {
+    req->next = NULL;
+    if (done_tail) done_tail->next = req;
+    else done_head = req;
+    done_tail = req;
+}
+
+static aio_req_t *pop_done() {
+    aio_req_t *req = done_head;
+    if (req) {
+        done_head = req->next;
+        if (!done_head) done_tail = NULL;
+    }
+    return req;
+}
+
+// Drops the first n bytes from a request's vector after a short transfer
+static void advance_req(aio_req_t *req, size_t n) {
+    req->off += n;
+    req->remaining -= n;
+    while (req->iovcnt > 0 && n >= req->iov[0].iov_len) {
+        n -= req->iov[0].iov_len;
+        req->iov++;
+        req->iovcnt--;
+    }
+    if (req->iovcnt > 0) {
+        req->iov[0].iov_base = (char *)req->iov[0].iov_base + n;
+        req->iov[0].iov_len -= n;
+    }
+}
+
+static void free_req(aio_req_t *req) {
+    free(req->iov_alloc);
+    free(req);
+}
+
+// ---- io_uring ----
+
+static int uring_setup(unsigned depth) {
+    if (depth == 0) depth = AIO_DEFAULT_DEPTH;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (ring_fd < 0) {
+        ring_fd = -1;
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        if (cq_size > sq_size) sq_size = cq_size;
+        cq_size = sq_size;
+    }
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) goto fail;
+    if (single) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) goto fail;
+    }
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) goto fail;
+
+    sq_head = (unsigned *)((char *)sq_ptr + p.sq_off.head);
+    sq_tail = (unsigned *)((char *)sq_ptr + p.sq_off.tail);
+    sq_mask = (unsigned *)((char *)sq_ptr + p.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)sq_ptr + p.sq_off.array);
+    cq_head = (unsigned *)((char *)cq_ptr + p.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_ptr + p.cq_off.tail);
+    cq_mask = (unsigned *)((char *)cq_ptr + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cq_ptr + p.cq_off.cqes);
+    sq_entries = p.sq_entries;
+    cq_entries = p.cq_entries;
+    to_submit = 0;
+    return 0;
+
+fail:
+    if (sqes && sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_ptr && cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+    if (sq_ptr && sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+    sqes = NULL;
+    cq_ptr = sq_ptr = NULL;
+    close(ring_fd);
+    ring_fd = -1;
+    return -1;
+}
+
+static void uring_teardown() {
+    munmap(sqes, sqes_size);
+    if (cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+    munmap(sq_ptr, sq_size);
+    sqes = NULL;
+    cq_ptr = sq_ptr = NULL;
+    close(ring_fd);
+    ring_fd = -1;
+}
+
+static int uring_enter(unsigned submit, unsigned min_complete) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    STAT_INC(syscalls);
+    int ret = syscall(__NR_io_uring_enter, ring_fd, submit, min_complete, flags, NULL, 0);
+    if (ret < 0) return -1;
+    to_submit -= (unsigned)ret < submit ? (unsigned)ret : submit;
+    return 0;
+}
+
+static int uring_queue(aio_req_t *req) {
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+        if (uring_enter(to_submit, 0) == -1) return -1;
+    }
+
+    unsigned idx = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = req->fd;
+    sqe->addr = (uint64_t)(uintptr_t)req->iov;
+    sqe->len = req->iovcnt;
+    sqe->off = req->off;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    to_submit++;
+    return 0;
+}
+
+// Moves finished CQEs to the done list, resubmitting short transfers
+static int uring_drain(unsigned wait) {
+    int found = 0;
+    for (;;) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (found || !wait || ring_pending == 0) return found;
+            if (uring_enter(to_submit, 1) == -1) return -1;
+            continue;
+        }
+
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        aio_req_t *req = (aio_req_t *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (res > 0 && (size_t)res < req->remaining) {
+            advance_req(req, res);
+            if (uring_queue(req) == 0) continue;
+            res = -1;
+        }
+        req->result = (res < 0 || (size_t)res != req->remaining) ? -1 : 0;
+        ring_pending--;
+        if (req->batch) {
+            if (req->result == -1) req->batch->result = -1;
+            __atomic_sub_fetch(&req->batch->pending, 1, __ATOMIC_RELEASE);
+            free_req(req);
+            if (ring_pending == 0 && !found) return 0;
+            continue;
+        }
+        pthread_mutex_lock(&pool_lock);
+        push_done(req);
+        pthread_mutex_unlock(&pool_lock);
+        found++;
+    }
+}
+
+// ---- thread pool ----
+
+static int transfer(aio_req_t *req) {
+    while (req->remaining > 0) {
+        STAT_INC(syscalls);
+        ssize_t n = req->write ? pwritev(req->fd, req->iov, req->iovcnt, req->off)
+                               : preadv(req->fd, req->iov, req->iovcnt, req->off);
+        if (n <= 0) return -1;
+        advance_req(req, n);
+    }
+    return 0;
+}
+
+static void *worker_main(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (!queue_head && !pool_stop) pthread_cond_wait(&work_ready, &pool_lock);
+        if (!queue_head) break;
+
+        aio_req_t *req = queue_head;
+        queue_head = req->next;
+        if (!queue_head) queue_tail = NULL;
+        pthread_mutex_unlock(&pool_lock);
+
+        req->result = transfer(req);
+
+        pthread_mutex_lock(&pool_lock);
+        if (req->batch) {
+            if (req->result == -1) req->batch->result = -1;
+            req->batch->pending--;
+            free_req(req);
+        } else {
+            push_done(req);
+        }
+        pool_pending--;
+        pthread_cond_broadcast(&work_done);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+static int pool_start() {
+    pool_stop = 0;
+    for (int i = 0; i < AIO_THREADS; i++) {
+        if (pthread_create(&workers[i], NULL, worker_main, NULL) != 0) {
+            pthread_mutex_lock(&pool_lock);
+            pool_stop = 1;
+            pthread_cond_broadcast(&work_ready);
+            pthread_mutex_unlock(&pool_lock);
+            for (int j = 0; j < i; j++) pthread_join(workers[j], NULL);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void pool_stop_all() {
+    pthread_mutex_lock(&pool_lock);
+    pool_stop = 1;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < AIO_THREADS; i++) pthread_join(workers[i], NULL);
+}
+
+// ---- public interface ----
+
+int aio_init(unsigned depth) {
+    if (__atomic_load_n(&mode, __ATOMIC_ACQUIRE) != AIO_NONE) return 0;
+    pthread_mutex_lock(&init_lock);
+    int ret = 0;
+    const char *force = getenv("FS_AIO");
+    if (mode != AIO_NONE) {
+        // Another thread got here first
+    } else if (!(force && strcmp(force, "threads") == 0) && uring_setup(depth) == 0) {
+        __atomic_store_n(&mode, AIO_URING, __ATOMIC_RELEASE);
+    } else if (pool_start() == 0) {
+        __atomic_store_n(&mode, AIO_THREADS_MODE, __ATOMIC_RELEASE);
+    } else {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&init_lock);
+    return ret;
+}
+
+void aio_shutdown() {
+    if (mode == AIO_NONE) return;
+    while (aio_inflight() > 0) {
+        if (aio_reap(1) <= 0) break;
+    }
+    if (mode == AIO_URING) uring_teardown();
+    else pool_stop_all();
+    mode = AIO_NONE;
+}
+
+static aio_req_t *new_req(int fd, off_t off, const struct iovec *iov, int iovcnt, int write) {
+    aio_req_t *req = calloc(1, sizeof(aio_req_t));
+    if (!req) return NULL;
+    if (iovcnt <= AIO_INLINE_IOV) {
+        req->iov = req->iov_inline;
+    } else if (!(req->iov = req->iov_alloc = malloc(iovcnt * sizeof(struct iovec)))) {
+        free(req);
+        return NULL;
+    }
+    memcpy(req->iov, iov, iovcnt * sizeof(struct iovec));
+    req->fd = fd;
+    req->off = off;
+    req->write = write;
+    req->iovcnt = iovcnt;
+    for (int i = 0; i < iovcnt; i++) req->remaining += iov[i].iov_len;
+    return req;
+}
+
+static void pool_queue(aio_req_t *req) {
+    req->next = NULL;
+    if (queue_tail) queue_tail->next = req;
+    else queue_head = req;
+    queue_tail = req;
+    pool_pending++;
+    pthread_cond_signal(&work_ready);
+}
+
+int aio_submit(int fd, off_t off, const struct iovec *iov, int iovcnt, int write, aio_done_fn fn, void *arg) {
+    if (mode == AIO_NONE || iovcnt <= 0) return -1;
+
+    aio_req_t *req = new_req(fd, off, iov, iovcnt, write);
+    if (!req) return -1;
+    req->fn = fn;
+    req->arg = arg;
+
+    if (mode == AIO_URING) {
+        // Never let completions outrun the CQ ring
+        while ((unsigned)aio_inflight() >= cq_entries) {
+            if (aio_reap(1) <= 0) break;
+        }
+        pthread_mutex_lock(&ring_lock);
+        int ret = uring_queue(req);
+        if (ret == 0) ring_pending++;
+        pthread_mutex_unlock(&ring_lock);
+        if (ret == -1) {
+            free_req(req);
+            return -1;
+        }
+        __atomic_add_fetch(&inflight, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    pool_queue(req);
+    __atomic_add_fetch(&inflight, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+int aio_run_batch(const aio_io_t *ios, int count) {
+    if (count <= 0) return 0;
+    if (aio_init(AIO_DEFAULT_DEPTH) == -1) return -1;
+
+    aio_batch_t batch = { 0, 0 };
+    if (mode == AIO_URING) {
+        pthread_mutex_lock(&ring_lock);
+        for (int i = 0; i < count; i++) {
+            aio_req_t *req = new_req(ios[i].fd, ios[i].off, ios[i].iov, ios[i].iovcnt, ios[i].write);
+            if (req) req->batch = &batch;
+            if (!req || uring_queue(req) == -1) {
+                if (req) free_req(req);
+                batch.result = -1;
+                break;
+            }
+            ring_pending++;
+            __atomic_add_fetch(&batch.pending, 1, __ATOMIC_RELAXED);
+        }
+        uring_enter(to_submit, 0);
+        pthread_mutex_unlock(&ring_lock);
+
+        // Whoever holds the ring drains it, so our requests may be
+        // finished by another thread
+        while (__atomic_load_n(&batch.pending, __ATOMIC_ACQUIRE) > 0) {
+            pthread_mutex_lock(&ring_lock);
+            if (__atomic_load_n(&batch.pending, __ATOMIC_ACQUIRE) > 0 && uring_drain(0) == 0 &&
+                __atomic_load_n(&batch.pending, __ATOMIC_ACQUIRE) > 0) {
+                uring_enter(to_submit, 1);
+            }
+            pthread_mutex_unlock(&ring_lock);
+        }
+        return batch.result;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    for (int i = 0; i < count; i++) {
+        aio_req_t *req = new_req(ios[i].fd, ios[i].off, ios[i].iov, ios[i].iovcnt, ios[i].write);
+        if (!req) {
+            batch.result = -1;
+            break;
+        }
+        req->batch = &batch;
+        batch.pending++;
+        pool_queue(req);
+    }
+    while (batch.pending > 0) pthread_cond_wait(&work_done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+    return batch.result;
+}
+
+int aio_complete(aio_done_fn fn, void *arg, int result) {
+    aio_req_t *req = calloc(1, sizeof(aio_req_t));
+    if (!req) return -1;
+    req->iov = req->iov_inline;
+    req->fn = fn;
+    req->arg = arg;
+    req->result = result;
+    pthread_mutex_lock(&pool_lock);
+    push_done(req);
+    __atomic_add_fetch(&inflight, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+int aio_kick() {
+    if (mode != AIO_URING) return 0;
+    pthread_mutex_lock(&ring_lock);
+    int ret = to_submit > 0 ? uring_enter(to_submit, 0) : 0;
+    pthread_mutex_unlock(&ring_lock);
+    return ret;
+}
+
+int aio_reap(int min) {
+    int count = 0;
+    if (min > aio_inflight()) min = aio_inflight();
+
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        aio_req_t *req = pop_done();
+        if (!req && count < min && mode == AIO_THREADS_MODE) {
+            while (!done_head && pool_pending > 0) pthread_cond_wait(&work_done, &pool_lock);
+            req = pop_done();
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        if (!req && mode == AIO_URING) {
+            // Only wait while the kernel still has something; another
+            // thread may have reaped what we were counting on
+            pthread_mutex_lock(&ring_lock);
+            int found = uring_drain(count < min && ring_pending > 0);
+            pthread_mutex_unlock(&ring_lock);
+            if (found == -1) return count ? count : -1;
+            if (found > 0) continue;
+        }
+        if (!req) break;
+
+        __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+        count++;
+        req->fn(req->arg, req->result);
+        free_req(req);
+    }
+    return count;
+}
+
+int aio_inflight() {
+    return __atomic_load_n(&inflight, __ATOMIC_RELAXED);
+}
+
+const char *aio_engine() {
+    if (mode == AIO_URING) return "io_uring";
+    if (mode == AIO_THREADS_MODE) return "threads";
+    return "none";
+}
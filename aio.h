@@ -0,0 +1,53 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define AIO_DEFAULT_DEPTH 128
+#define AIO_THREADS 4
+
+// Called from aio_reap with 0 on success or -1 on error
+typedef void (*aio_done_fn)(void *arg, int result);
+
+// Starts the engine: io_uring when the kernel allows it, otherwise a small
+// thread pool. Setting FS_AIO=threads in the environment forces the pool.
+int aio_init(unsigned depth);
+
+// Stops the engine; outstanding requests are completed first
+void aio_shutdown();
+
+// Queues a vectored read or write at off. The iovec array is copied, the
+// buffers it points to must stay valid until the callback runs.
+int aio_submit(int fd, off_t off, const struct iovec *iov, int iovcnt, int write, aio_done_fn fn, void *arg);
+
+// One transfer of an aio_run_batch call
+typedef struct {
+    int fd;
+    off_t off;
+    const struct iovec *iov;
+    int iovcnt;
+    int write;
+} aio_io_t;
+
+// Runs count transfers at once and waits for all of them. No callbacks are
+// involved, so waiting never runs other requests' callbacks. Returns -1 if
+// any transfer failed.
+int aio_run_batch(const aio_io_t *ios, int count);
+
+// Queues a completion for a request that was served synchronously
+int aio_complete(aio_done_fn fn, void *arg, int result);
+
+// Hands queued requests to the kernel or the worker threads
+int aio_kick();
+
+// Waits for at least min completions and runs their callbacks in the calling
+// thread. Returns the number of completions processed. With several threads
+// reaping, a callback runs in whichever thread picked it up, and fewer than
+// min may be returned once nothing is left in flight.
+int aio_reap(int min);
+
+int aio_inflight();
+const char *aio_engine();
+
+#endif
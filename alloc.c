@@ -0,0 +1,204 @@
+#include "alloc.h"
+#include "stats.h"
+#include <stdlib.h>
+
+static uint64_t *words = NULL;      // bit set = block free
+static uint64_t *summary = NULL;    // bit set = word has a free block
+static uint32_t num_blocks = 0;
+static uint32_t num_words = 0;
+static uint32_t num_free = 0;
+
+// Lazy filling, see alloc_set_loader
+static uint8_t *loaded = NULL;      // one flag per region
+static uint32_t region_size = 0;
+static uint32_t num_regions = 0;
+static uint32_t unloaded = 0;
+static int (*region_maybe_free)(uint32_t region) = NULL;
+static void (*region_load)(uint32_t region) = NULL;
+
+int alloc_init(uint32_t nblocks) {
+    alloc_destroy();
+    num_blocks = nblocks;
+    num_words = (nblocks + 63) / 64;
+    words = calloc(num_words, sizeof(uint64_t));
+    summary = calloc((num_words + 63) / 64, sizeof(uint64_t));
+    if (!words || !summary) {
+        alloc_destroy();
+        return -1;
+    }
+    return 0;
+}
+
+void alloc_destroy() {
+    free(words);
+    free(summary);
+    free(loaded);
+    words = NULL;
+    summary = NULL;
+    loaded = NULL;
+    region_size = 0;
+    num_regions = 0;
+    unloaded = 0;
+    region_maybe_free = NULL;
+    region_load = NULL;
+    num_blocks = 0;
+    num_words = 0;
+    num_free = 0;
+}
+
+void alloc_mark_free(uint32_t block) {
+    if (block >= num_blocks) return;
+    if (loaded && !loaded[block / region_size]) return;
+    uint32_t w = block / 64;
+    uint64_t bit = 1ULL << (block % 64);
+    if (words[w] & bit) return;
+    words[w] |= bit;
+    summary[w / 64] |= 1ULL << (w % 64);
+    num_free++;
+}
+
+void alloc_mark_used(uint32_t block) {
+    if (block >= num_blocks) return;
+    uint32_t w = block / 64;
+    uint64_t bit = 1ULL << (block % 64);
+    if (!(words[w] & bit)) return;
+    words[w] &= ~bit;
+    if (!words[w]) summary[w / 64] &= ~(1ULL << (w % 64));
+    num_free--;
+}
+
+int alloc_is_free(uint32_t block) {
+    if (block >= num_blocks) return 0;
+    return (words[block / 64] >> (block % 64)) & 1;
+}
+
+uint32_t alloc_free_count() {
+    return num_free;
+}
+
+int alloc_set_loader(uint32_t region_blocks, int (*maybe_free)(uint32_t region), void (*load)(uint32_t region)) {
+    free(loaded);
+    num_regions = (num_blocks + region_blocks - 1) / region_blocks;
+    loaded = calloc(num_regions, 1);
+    if (!loaded) return -1;
+    region_size = region_blocks;
+    unloaded = num_regions;
+    region_maybe_free = maybe_free;
+    region_load = load;
+    return 0;
+}
+
+static void load_region(uint32_t region) {
+    if (loaded[region]) return;
+    loaded[region] = 1;
+    unloaded--;
+    region_load(region);
+}
+
+void alloc_load(uint32_t block) {
+    if (loaded && block < num_blocks) load_region(block / region_size);
+}
+
+// Loads the next region after the one holding block, wrapping, that may have
+// free blocks. Returns 0 when there is none.
+static int load_next(uint32_t block) {
+    uint32_t first = block / region_size;
+    for (uint32_t i = 1; i <= num_regions && unloaded > 0; i++) {
+        uint32_t region = (first + i) % num_regions;
+        if (loaded[region]) continue;
+        if (!region_maybe_free(region)) continue;
+        load_region(region);
+        return 1;
+    }
+    return 0;
+}
+
+// First free block at or after block, or -1
+static uint32_t next_free(uint32_t block) {
+    if (block >= num_blocks) return (uint32_t)-1;
+
+    uint32_t w = block / 64;
+    uint64_t bits = words[w] & (~0ULL << (block % 64));
+    if (bits) return w * 64 + __builtin_ctzll(bits);
+
+    for (w++; w < num_words; ) {
+        uint64_t sbits = summary[w / 64] & (~0ULL << (w % 64));
+        if (sbits) {
+            w = (w / 64) * 64 + __builtin_ctzll(sbits);
+            return w * 64 + __builtin_ctzll(words[w]);
+        }
+        w = (w / 64 + 1) * 64;
+    }
+    return (uint32_t)-1;
+}
+
+// Number of free blocks starting at block, up to max
+static uint32_t free_run(uint32_t block, uint32_t max) {
+    uint32_t n = 0;
+    while (n < max && block + n < num_blocks) {
+        uint32_t pos = block + n;
+        uint32_t shift = pos % 64;
+        uint64_t used = ~(words[pos / 64] >> shift);
+        uint32_t k = used ? (uint32_t)__builtin_ctzll(used) : 64;
+        if (k > 64 - shift) k = 64 - shift;
+        n += k;
+        if (k < 64 - shift) break;
+    }
+    if (n > max) n = max;
+    if (n > num_blocks - block) n = num_blocks - block;
+    return n;
+}
+
+static void take(uint32_t block, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) alloc_mark_used(block + i);
+}
+
+// The run to take for a request: the first that fits, going forward from
+// hint and wrapping, else the longest seen. *len is 0 when nothing is free.
+static uint32_t find_run(uint32_t hint, uint32_t want, uint32_t *len) {
+    // Right where the caller wants it
+    if (alloc_is_free(hint)) {
+        *len = free_run(hint, want);
+        return hint;
+    }
+
+    uint32_t best = (uint32_t)-1;
+    uint32_t best_len = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t block = pass == 0 ? hint : 0;
+        uint32_t end = pass == 0 ? num_blocks : hint;
+        while ((block = next_free(block)) != (uint32_t)-1 && block < end) {
+            uint32_t n = free_run(block, want);
+            STAT_INC(alloc_scanned);
+            if (n == want) {
+                *len = n;
+                return block;
+            }
+            if (n > best_len) {
+                best = block;
+                best_len = n;
+            }
+            block += n;
+        }
+    }
+    *len = best_len;
+    return best;
+}
+
+uint32_t alloc_blocks(uint32_t hint, uint32_t want, uint32_t *got) {
+    *got = 0;
+    if (want == 0 || (num_free == 0 && unloaded == 0)) return (uint32_t)-1;
+    STAT_INC(alloc_calls);
+    if (hint >= num_blocks) hint = 0;
+    alloc_load(hint);
+
+    // Short runs send it looking through regions not loaded yet
+    uint32_t len;
+    uint32_t block = find_run(hint, want, &len);
+    while (len < want && loaded && load_next(hint)) {
+        block = find_run(hint, want, &len);
+    }
+    *got = len;
+    take(block, len);
+    return block;
+}
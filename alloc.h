@@ -0,0 +1,35 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stdint.h>
+
+// Free-space bitmap for the data region, with one summary bit per bitmap
+// word so full stretches of the disk are skipped 4096 blocks at a time
+
+// Starts with every block marked used
+int alloc_init(uint32_t nblocks);
+void alloc_destroy();
+
+void alloc_mark_free(uint32_t block);
+void alloc_mark_used(uint32_t block);
+int alloc_is_free(uint32_t block);
+
+// Allocates up to want adjacent blocks and returns the first one, or -1 when
+// the disk is full. Tries hint first, then the first run long enough for the
+// whole request (searching forward from hint), then the longest run it saw.
+// *got is set to the number of blocks allocated.
+uint32_t alloc_blocks(uint32_t hint, uint32_t want, uint32_t *got);
+
+uint32_t alloc_free_count();
+
+// Lazy filling. Once a loader is set the bitmap is filled in a region of
+// region_blocks blocks at a time: a region counts as full, and frees in it
+// are dropped, until load(region) has marked its free blocks. alloc_blocks
+// loads the region holding hint, and while it falls short, further regions
+// that maybe_free says may have space.
+int alloc_set_loader(uint32_t region_blocks, int (*maybe_free)(uint32_t region), void (*load)(uint32_t region));
+
+// Loads the region holding block if it is not loaded yet
+void alloc_load(uint32_t block);
+
+#endif
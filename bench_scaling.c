@@ -0,0 +1,151 @@
+#include "fs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+// Throughput of the thread-safe API with 1..N threads:
+//   ./bench_scaling [max_threads] [seconds_per_run]
+
+#define BENCH_DISK "bench.disk"
+#define SHARED_SIZE (8 * 1024 * 1024)
+#define PRIVATE_SIZE (1024 * 1024)
+#define IO_SIZE 4096
+
+enum { READ_SHARED, READ_PRIVATE, WRITE_PRIVATE, CREATE_DELETE, NUM_WORKLOADS };
+
+static const char *workload_names[NUM_WORKLOADS] = {
+    "pread, one shared file",
+    "pread, file per thread",
+    "pwrite, file per thread",
+    "create+delete",
+};
+
+typedef struct {
+    int id;
+    int workload;
+    int shared_fd;
+    int private_fd;
+    int *stop;
+    long ops;
+    int failed;
+} worker_t;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    char buf[IO_SIZE];
+    char name[MAX_FILE_NAME + 1];
+    unsigned seed = w->id * 7919 + 1;
+    memset(buf, 'a' + w->id % 26, sizeof(buf));
+
+    while (!__atomic_load_n(w->stop, __ATOMIC_RELAXED)) {
+        int ret = 0;
+        switch (w->workload) {
+        case READ_SHARED:
+            ret = fs_pread(w->shared_fd, buf, IO_SIZE, (off_t)(rand_r(&seed) % (SHARED_SIZE / IO_SIZE)) * IO_SIZE);
+            break;
+        case READ_PRIVATE:
+            ret = fs_pread(w->private_fd, buf, IO_SIZE, (off_t)(rand_r(&seed) % (PRIVATE_SIZE / IO_SIZE)) * IO_SIZE);
+            break;
+        case WRITE_PRIVATE:
+            ret = fs_pwrite(w->private_fd, buf, IO_SIZE, (off_t)(rand_r(&seed) % (PRIVATE_SIZE / IO_SIZE)) * IO_SIZE);
+            break;
+        case CREATE_DELETE:
+            snprintf(name, sizeof(name), "t%d_%ld", w->id, w->ops % 1000);
+            ret = fs_create(name) == 0 && fs_delete(name) == 0 ? IO_SIZE : -1;
+            break;
+        }
+        if (ret != IO_SIZE) {
+            w->failed = 1;
+            break;
+        }
+        w->ops++;
+    }
+    return NULL;
+}
+
+static int fill(int fd, size_t size) {
+    char buf[IO_SIZE];
+    memset(buf, 'x', sizeof(buf));
+    for (size_t done = 0; done < size; done += IO_SIZE) {
+        if (fs_write(fd, buf, IO_SIZE) != IO_SIZE) return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+    if (max_threads < 1 || max_threads > MAX_FD - 1) max_threads = 8;
+
+    if (make_fs(BENCH_DISK) == -1 || mount_fs(BENCH_DISK) == -1) {
+        printf("Error setting up %s\n", BENCH_DISK);
+        return 1;
+    }
+    // Batch metadata so create+delete measures the directory, not fsync
+    fs_set_sync_interval(-1);
+
+    if (fs_create("shared") == -1) return 1;
+    int shared_fd = fs_open("shared");
+    if (shared_fd == -1 || fill(shared_fd, SHARED_SIZE) == -1) {
+        printf("Error filling the shared file\n");
+        return 1;
+    }
+
+    int private_fd[MAX_FD];
+    for (int i = 0; i < max_threads; i++) {
+        char name[MAX_FILE_NAME + 1];
+        snprintf(name, sizeof(name), "private%d", i);
+        if (fs_create(name) == -1 || (private_fd[i] = fs_open(name)) == -1 ||
+            fill(private_fd[i], PRIVATE_SIZE) == -1) {
+            printf("Error filling %s\n", name);
+            return 1;
+        }
+    }
+
+    printf("%-26s %8s %14s %8s\n", "workload", "threads", "ops/s", "speedup");
+    for (int workload = 0; workload < NUM_WORKLOADS; workload++) {
+        double base = 0;
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            pthread_t tids[MAX_FD];
+            worker_t workers[MAX_FD];
+            int stop = 0;
+
+            for (int i = 0; i < threads; i++) {
+                workers[i] = (worker_t){ i, workload, shared_fd, private_fd[i], &stop, 0, 0 };
+            }
+            double start = now();
+            for (int i = 0; i < threads; i++) {
+                pthread_create(&tids[i], NULL, worker_main, &workers[i]);
+            }
+            while (now() - start < seconds) {
+                struct timespec ts = { 0, 10 * 1000 * 1000 };
+                nanosleep(&ts, NULL);
+            }
+            __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+            long ops = 0;
+            int failed = 0;
+            for (int i = 0; i < threads; i++) {
+                pthread_join(tids[i], NULL);
+                ops += workers[i].ops;
+                failed |= workers[i].failed;
+            }
+            double rate = ops / (now() - start);
+            if (threads == 1) base = rate;
+            printf("%-26s %8d %14.0f %7.2fx%s\n", workload_names[workload], threads, rate,
+                   base > 0 ? rate / base : 0, failed ? "  (errors)" : "");
+            if (threads < max_threads && threads * 2 > max_threads) threads = max_threads / 2;
+        }
+    }
+
+    umount_fs(BENCH_DISK);
+    return 0;
+}
@@ -0,0 +1,175 @@
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+static cache_entry_t *entries = NULL;
+static cache_entry_t **buckets = NULL;
+static char *pool = NULL;
+static size_t num_entries = 0;
+static size_t num_buckets = 0;
+static cache_entry_t lru;           // sentinel: lru.next is MRU, lru.prev is LRU
+static cache_stats_t stats;
+
+static size_t bucket_of(int block) {
+    return ((uint32_t)block * 2654435761u) & (num_buckets - 1);
+}
+
+static void lru_unlink(cache_entry_t *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void lru_push_front(cache_entry_t *e) {
+    e->next = lru.next;
+    e->prev = &lru;
+    lru.next->prev = e;
+    lru.next = e;
+}
+
+static void hash_remove(cache_entry_t *e) {
+    cache_entry_t **p = &buckets[bucket_of(e->block)];
+    while (*p && *p != e) p = &(*p)->hnext;
+    if (*p) *p = e->hnext;
+    e->hnext = NULL;
+}
+
+int cache_init(size_t nblocks, size_t block_size) {
+    cache_destroy();
+    memset(&stats, 0, sizeof(stats));
+    if (nblocks == 0) return 0;
+
+    num_buckets = 1;
+    while (num_buckets < nblocks * 2) num_buckets <<= 1;
+
+    entries = calloc(nblocks, sizeof(cache_entry_t));
+    buckets = calloc(num_buckets, sizeof(cache_entry_t *));
+    pool = malloc(nblocks * block_size);
+    if (!entries || !buckets || !pool) {
+        cache_destroy();
+        return -1;
+    }
+
+    num_entries = nblocks;
+    lru.next = lru.prev = &lru;
+    for (size_t i = 0; i < nblocks; i++) {
+        entries[i].block = -1;
+        entries[i].data = pool + i * block_size;
+        lru_push_front(&entries[i]);
+    }
+    return 0;
+}
+
+void cache_destroy() {
+    free(entries);
+    free(buckets);
+    free(pool);
+    entries = NULL;
+    buckets = NULL;
+    pool = NULL;
+    num_entries = 0;
+    num_buckets = 0;
+    lru.next = lru.prev = &lru;
+}
+
+int cache_enabled() {
+    return num_entries > 0;
+}
+
+cache_entry_t *cache_peek(int block) {
+    if (!num_entries) return NULL;
+    for (cache_entry_t *e = buckets[bucket_of(block)]; e; e = e->hnext) {
+        if (e->block == block) return e;
+    }
+    return NULL;
+}
+
+cache_entry_t *cache_lookup(int block) {
+    cache_entry_t *e = cache_peek(block);
+    if (e) {
+        lru_unlink(e);
+        lru_push_front(e);
+    }
+    return e;
+}
+
+cache_entry_t *cache_victim() {
+    if (!num_entries) return NULL;
+    return lru.prev;
+}
+
+void cache_assign(cache_entry_t *e, int block) {
+    if (e->block != -1) {
+        hash_remove(e);
+        stats.evictions++;
+    }
+    e->block = block;
+    e->dirty = 0;
+    size_t b = bucket_of(block);
+    e->hnext = buckets[b];
+    buckets[b] = e;
+    lru_unlink(e);
+    lru_push_front(e);
+}
+
+void cache_invalidate(int block) {
+    if (!num_entries) return;
+    for (cache_entry_t *e = buckets[bucket_of(block)]; e; e = e->hnext) {
+        if (e->block == block) {
+            hash_remove(e);
+            e->block = -1;
+            e->dirty = 0;
+            // Free slots are reused first
+            lru_unlink(e);
+            e->prev = lru.prev;
+            e->next = &lru;
+            lru.prev->next = e;
+            lru.prev = e;
+            return;
+        }
+    }
+}
+
+static int compare_block(const void *a, const void *b) {
+    const cache_entry_t *x = *(cache_entry_t * const *)a;
+    const cache_entry_t *y = *(cache_entry_t * const *)b;
+    return (x->block > y->block) - (x->block < y->block);
+}
+
+int cache_for_each_dirty(int (*fn)(cache_entry_t *e)) {
+    if (!num_entries) return 0;
+
+    // Visit dirty blocks in disk order so write-back is mostly sequential
+    cache_entry_t **dirty = malloc(num_entries * sizeof(cache_entry_t *));
+    if (!dirty) return -1;
+    size_t n = 0;
+    for (size_t i = 0; i < num_entries; i++) {
+        if (entries[i].block != -1 && entries[i].dirty) dirty[n++] = &entries[i];
+    }
+    qsort(dirty, n, sizeof(cache_entry_t *), compare_block);
+
+    int ret = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (fn(dirty[i]) == -1) {
+            ret = -1;
+            break;
+        }
+    }
+    free(dirty);
+    return ret;
+}
+
+void cache_count_hit() {
+    stats.hits++;
+}
+
+void cache_count_miss() {
+    stats.misses++;
+}
+
+void cache_count_writeback() {
+    stats.writebacks++;
+}
+
+void cache_get_stats(cache_stats_t *out) {
+    *out = stats;
+}
@@ -0,0 +1,55 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CACHE_DEFAULT_BLOCKS 256
+
+// One cached disk block
+typedef struct cache_entry {
+    int block;                      // -1 when the slot is unused
+    uint8_t dirty;
+    char *data;
+    struct cache_entry *hnext;      // hash chain
+    struct cache_entry *prev;       // LRU list, head is most recently used
+    struct cache_entry *next;
+} cache_entry_t;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+} cache_stats_t;
+
+// Not thread-safe; disk.c serializes access
+int cache_init(size_t nblocks, size_t block_size);
+void cache_destroy();
+int cache_enabled();
+
+// Returns the entry holding block and marks it most recently used, or NULL
+cache_entry_t *cache_lookup(int block);
+
+// Same as cache_lookup but leaves the LRU order alone
+cache_entry_t *cache_peek(int block);
+
+// Returns the least recently used entry for reuse; the caller must write it
+// back first if it is dirty
+cache_entry_t *cache_victim();
+
+// Rebinds an entry (usually the victim) to a new block number
+void cache_assign(cache_entry_t *e, int block);
+
+// Drops a block from the cache without writing it back
+void cache_invalidate(int block);
+
+// Calls fn on every dirty entry in ascending block order
+int cache_for_each_dirty(int (*fn)(cache_entry_t *e));
+
+void cache_count_hit();
+void cache_count_miss();
+void cache_count_writeback();
+void cache_get_stats(cache_stats_t *stats);
+
+#endif
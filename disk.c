@@ -4,51 +4,651 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "fs.h"
+#include "cache.h"
+#include "aio.h"
+#include "stats.h"
 
-static int disk_fd = -1;
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static int disk_fds[DISK_MAX_IMAGES];
+static off_t image_sizes[DISK_MAX_IMAGES];
+static int disk_count = 0;          // 0 while closed
+static char *disk_maps[DISK_MAX_IMAGES]; // Whole images when using FS_BACKEND_MMAP
+static int mapped = 0;
+static uint32_t block_size = BLOCK_SIZE;
+static uint32_t disk_blocks = NUM_BLOCKS;
+static uint32_t stripe_blocks = DISK_STRIPE_DEFAULT;
+static size_t cache_blocks = CACHE_DEFAULT_BLOCKS;
+
+// Guards the block cache. Callers keep concurrent requests for the same data
+// block apart, so uncached vectored transfers run outside it.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Which image a block lives in, and its byte offset there
+static int locate(int block, off_t *off) {
+    uint32_t stripe = (uint32_t)block / stripe_blocks;
+    *off = ((off_t)(stripe / disk_count) * stripe_blocks + (uint32_t)block % stripe_blocks) * block_size;
+    return stripe % disk_count;
+}
+
+// Size of each of count images: enough whole stripes for its share
+static off_t image_size(int count) {
+    uint64_t stripes = ((uint64_t)disk_blocks + stripe_blocks - 1) / stripe_blocks;
+    return (off_t)((stripes + count - 1) / count) * stripe_blocks * block_size;
+}
+
+// Whether count blocks from block on are all on the disk
+static int valid_range(int block, int count) {
+    return block >= 0 && count >= 0 && (uint32_t)block <= disk_blocks && (uint32_t)count <= disk_blocks - (uint32_t)block;
+}
+
+static char *map_block(int block) {
+    off_t off;
+    int img = locate(block, &off);
+    return disk_maps[img] + off;
+}
+
+static int dev_read(int block, void *buf) {
+    off_t off;
+    int img = locate(block, &off);
+    STAT_INC(syscalls);
+    return pread(disk_fds[img], buf, block_size, off) == (ssize_t)block_size ? 0 : -1;
+}
+
+static int dev_write(int block, const void *buf) {
+    off_t off;
+    int img = locate(block, &off);
+    STAT_INC(syscalls);
+    return pwrite(disk_fds[img], buf, block_size, off) == (ssize_t)block_size ? 0 : -1;
+}
+
+// preadv/pwritev until the whole vector is transferred
+static int image_rwv(int fd, off_t off, const struct iovec *iov, int iovcnt, size_t total, int write) {
+    struct iovec local[IOV_MAX];
+    const struct iovec *v = iov;
+
+    while (total > 0) {
+        STAT_INC(syscalls);
+        ssize_t n = write ? pwritev(fd, v, iovcnt, off) : preadv(fd, v, iovcnt, off);
+        if (n <= 0) return -1;
+        if ((size_t)n == total) break;
+
+        // Short transfer: drop what was done and retry with the rest
+        total -= n;
+        off += n;
+        if (v != local) {
+            memcpy(local, v, iovcnt * sizeof(struct iovec));
+            v = local;
+        }
+        while ((size_t)n >= local[0].iov_len) {
+            n -= local[0].iov_len;
+            memmove(local, local + 1, --iovcnt * sizeof(struct iovec));
+        }
+        local[0].iov_base = (char *)local[0].iov_base + n;
+        local[0].iov_len -= n;
+    }
+    return 0;
+}
+
+// Cuts a transfer of nblocks blocks from block into one request per image.
+// An image's stripes of the run sit next to each other in it, so its request
+// only has to be split when the vector would pass IOV_MAX. Returns the number
+// of requests; *ios and *vecs must be freed by the caller.
+static int stripe_split(int block, int nblocks, const struct iovec *iov, int iovcnt, int write,
+                        aio_io_t **ios_out, struct iovec **vecs_out) {
+    uint32_t first = block / stripe_blocks;
+    uint32_t last = (block + nblocks - 1) / stripe_blocks;
+    uint32_t chunks = last - first + 1;
+    aio_io_t *ios = malloc(chunks * sizeof(aio_io_t));
+    struct iovec *vecs = malloc((iovcnt + chunks) * sizeof(struct iovec));
+    if (!ios || !vecs) {
+        free(ios);
+        free(vecs);
+        return -1;
+    }
+
+    int count = 0;
+    int used = 0;
+    for (int img = 0; img < disk_count; img++) {
+        aio_io_t *cur = NULL;
+        int i = 0;
+        size_t base = 0;            // offset of iov[i] in the caller's buffer
+        uint32_t s = first + (img + disk_count - first % disk_count) % disk_count;
+        for (; s <= last; s += disk_count) {
+            uint32_t from = s * stripe_blocks > (uint32_t)block ? s * stripe_blocks : (uint32_t)block;
+            uint32_t to = (s + 1) * stripe_blocks < (uint32_t)(block + nblocks) ? (s + 1) * stripe_blocks : (uint32_t)(block + nblocks);
+            size_t pos = (size_t)(from - block) * block_size;
+            size_t end = (size_t)(to - block) * block_size;
+
+            // Slice the part of the caller's vector this stripe covers
+            while (base + iov[i].iov_len <= pos) base += iov[i++].iov_len;
+            int n = 0;
+            for (int j = i; pos < end; j++) {
+                size_t skip = pos - base;
+                size_t len = iov[j].iov_len - skip;
+                if (len > end - pos) len = end - pos;
+                vecs[used + n].iov_base = (char *)iov[j].iov_base + skip;
+                vecs[used + n++].iov_len = len;
+                pos += len;
+                if (pos < end) base += iov[j].iov_len;
+                else i = j;
+            }
+
+            if (!cur || cur->iovcnt + n > IOV_MAX) {
+                cur = &ios[count++];
+                cur->fd = disk_fds[img];
+                locate(from, &cur->off);
+                cur->iov = vecs + used;
+                cur->iovcnt = 0;
+                cur->write = write;
+            }
+            cur->iovcnt += n;
+            used += n;
+        }
+    }
+
+    *ios_out = ios;
+    *vecs_out = vecs;
+    return count;
+}
+
+static int dev_rwv(int block, const struct iovec *iov, int iovcnt, size_t total, int write) {
+    if (disk_count == 1) return image_rwv(disk_fds[0], (off_t)block * block_size, iov, iovcnt, total, write);
+
+    aio_io_t *ios;
+    struct iovec *vecs;
+    int count = stripe_split(block, total / block_size, iov, iovcnt, write, &ios, &vecs);
+    if (count == -1) return -1;
+
+    // Runs inside one stripe go straight to their image
+    int ret;
+    if (count == 1) ret = image_rwv(ios[0].fd, ios[0].off, ios[0].iov, ios[0].iovcnt, total, write);
+    else ret = aio_run_batch(ios, count);
+    free(ios);
+    free(vecs);
+    return ret;
+}
+
+// Copies block index k of a vectored buffer to or from buf
+static void iov_block(const struct iovec *iov, int iovcnt, size_t k, void *buf, int to_iov) {
+    size_t skip = k * block_size;
+    size_t done = 0;
+    for (int i = 0; i < iovcnt && done < block_size; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        size_t n = iov[i].iov_len - skip;
+        if (n > block_size - done) n = block_size - done;
+        char *p = (char *)iov[i].iov_base + skip;
+        if (to_iov) memcpy(p, (char *)buf + done, n);
+        else memcpy((char *)buf + done, p, n);
+        done += n;
+        skip = 0;
+    }
+}
+
+static size_t iov_total(const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    return total;
+}
+
+static int write_back(cache_entry_t *e) {
+    if (dev_write(e->block, e->data) == -1) return -1;
+    e->dirty = 0;
+    cache_count_writeback();
+    return 0;
+}
+
+// Places a block in the cache, writing back whatever it displaces
+static int cache_store(int block, const void *buf, int dirty) {
+    cache_entry_t *e = cache_victim();
+    if (e->block != -1 && e->dirty) {
+        if (write_back(e) == -1) return -1;
+    }
+    cache_assign(e, block);
+    memcpy(e->data, buf, block_size);
+    e->dirty = dirty;
+    return 0;
+}
+
+// Splits a comma separated list of image names in place
+static int split_names(char *list, char **names) {
+    int count = 0;
+    char *save;
+    for (char *p = strtok_r(list, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+        if (count == DISK_MAX_IMAGES) return -1;
+        names[count++] = p;
+    }
+    return count > 0 ? count : -1;
+}
+
+// Unmaps and closes every open image
+static int close_images() {
+    int ret = 0;
+    for (int i = 0; i < disk_count; i++) {
+        if (disk_maps[i]) {
+            if (msync(disk_maps[i], image_sizes[i], MS_SYNC) == -1) ret = -1;
+            munmap(disk_maps[i], image_sizes[i]);
+            disk_maps[i] = NULL;
+        }
+        if (close(disk_fds[i]) == -1) ret = -1;
+    }
+    disk_count = 0;
+    mapped = 0;
+    return ret;
+}
 
 int make_disk(const char *name) {
-    if (disk_fd != -1) return -1;
-    disk_fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
-    if (disk_fd == -1) return -1;
+    if (disk_count != 0) return -1;
+    char *list = strdup(name);
+    char *names[DISK_MAX_IMAGES];
+    int count = list ? split_names(list, names) : -1;
+    if (count == -1) {
+        free(list);
+        return -1;
+    }
     
-    // Initialize disk with zeros
-    char block[BLOCK_SIZE] = {0};
-    for (int i = 0; i < NUM_BLOCKS; i++) {
-        if (write(disk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
-            close(disk_fd);
-            disk_fd = -1;
-            return -1;
+    // Images start out sparse: blocks never written read back as zeros
+    // without taking up space, so formatting costs the same at any size
+    off_t size = image_size(count);
+    int ret = 0;
+    for (int i = 0; i < count && ret == 0; i++) {
+        int fd = open(names[i], O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1) {
+            ret = -1;
+            break;
         }
+        STAT_INC(syscalls);
+        if (ftruncate(fd, size) == -1) ret = -1;
+        close(fd);
     }
     
-    close(disk_fd);
-    disk_fd = -1;
-    return 0;
+    free(list);
+    return ret;
 }
 
 int open_disk(const char *name) {
-    if (disk_fd != -1) return -1;
-    disk_fd = open(name, O_RDWR);
-    return disk_fd == -1 ? -1 : 0;
+    return open_disk_backend(name, FS_BACKEND_FILE);
+}
+
+int open_disk_backend(const char *name, int backend) {
+    if (disk_count != 0) return -1;
+    if (backend != FS_BACKEND_FILE && backend != FS_BACKEND_MMAP) return -1;
+    char *list = strdup(name);
+    char *names[DISK_MAX_IMAGES];
+    int count = list ? split_names(list, names) : -1;
+    if (count == -1) {
+        free(list);
+        return -1;
+    }
+
+    // The geometry is not known yet, so only the superblock is checked for;
+    // disk_set_geometry checks the rest
+    int i;
+    for (i = 0; i < count; i++) {
+        struct stat st;
+        disk_maps[i] = NULL;
+        disk_fds[i] = open(names[i], O_RDWR);
+        if (disk_fds[i] == -1) break;
+        disk_count++;
+        if (fstat(disk_fds[i], &st) == -1 || st.st_size < MIN_BLOCK_SIZE) break;
+        image_sizes[i] = st.st_size;
+
+        // The page cache already holds the blocks, so skip our own cache
+        if (backend == FS_BACKEND_MMAP) {
+            void *map = mmap(NULL, image_sizes[i], PROT_READ | PROT_WRITE, MAP_SHARED, disk_fds[i], 0);
+            if (map == MAP_FAILED) break;
+            disk_maps[i] = map;
+        }
+    }
+    free(list);
+    if (i < count) {
+        close_images();
+        return -1;
+    }
+    if (backend == FS_BACKEND_MMAP) {
+        mapped = 1;
+        return 0;
+    }
+
+    if (cache_init(cache_blocks, block_size) == -1) {
+        close_images();
+        return -1;
+    }
+    return 0;
 }
 
 int close_disk() {
-    if (disk_fd == -1) return -1;
-    int ret = close(disk_fd);
-    disk_fd = -1;
+    if (disk_count == 0) return -1;
+    aio_shutdown();
+    int ret = 0;
+    if (!mapped) {
+        ret = cache_for_each_dirty(write_back);
+        cache_destroy();
+    }
+    if (close_images() == -1) ret = -1;
+    return ret;
+}
+
+int disk_image_count() {
+    return disk_count;
+}
+
+int disk_set_geometry(uint32_t bsize, uint32_t nblocks, uint32_t stripe) {
+    if (bsize < MIN_BLOCK_SIZE || bsize > MAX_BLOCK_SIZE || (bsize & (bsize - 1))) return -1;
+    if (nblocks == 0 || nblocks > INT_MAX || stripe == 0 || stripe > nblocks) return -1;
+
+    // Every open image must be big enough for the new layout
+    uint32_t old_bsize = block_size;
+    uint32_t old_nblocks = disk_blocks;
+    uint32_t old_stripe = stripe_blocks;
+    block_size = bsize;
+    disk_blocks = nblocks;
+    stripe_blocks = stripe;
+    int fits = 1;
+    for (int i = 0; i < disk_count; i++) {
+        if (image_sizes[i] < image_size(disk_count)) fits = 0;
+    }
+    block_size = old_bsize;
+    disk_blocks = old_nblocks;
+    stripe_blocks = old_stripe;
+    if (!fits) return -1;
+
+    // Whatever is cached was read with the old layout
+    int ret = 0;
+    pthread_mutex_lock(&cache_lock);
+    if (disk_count != 0 && !mapped) ret = cache_for_each_dirty(write_back);
+    if (ret == 0) {
+        block_size = bsize;
+        disk_blocks = nblocks;
+        stripe_blocks = stripe;
+        if (disk_count != 0 && !mapped) ret = cache_init(cache_blocks, block_size);
+    }
+    pthread_mutex_unlock(&cache_lock);
     return ret;
 }
 
+uint32_t disk_block_size() {
+    return block_size;
+}
+
+uint32_t disk_contiguous(int block, uint32_t max) {
+    if (disk_count <= 1) return max;
+    uint32_t left = stripe_blocks - (uint32_t)block % stripe_blocks;
+    return left < max ? left : max;
+}
+
 int block_read(int block, void *buf) {
-    if (disk_fd == -1 || block < 0 || block >= NUM_BLOCKS) return -1;
-    if (lseek(disk_fd, block * BLOCK_SIZE, SEEK_SET) == -1) return -1;
-    return read(disk_fd, buf, BLOCK_SIZE) == BLOCK_SIZE ? 0 : -1;
+    STAT_INC(block_reads);
+    if (disk_count == 0 || block < 0 || (uint32_t)block >= disk_blocks) return -1;
+    if (mapped) {
+        memcpy(buf, map_block(block), block_size);
+        return 0;
+    }
+    if (!cache_enabled()) return dev_read(block, buf);
+
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *e = cache_lookup(block);
+    if (e) {
+        cache_count_hit();
+        memcpy(buf, e->data, block_size);
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    cache_count_miss();
+    pthread_mutex_unlock(&cache_lock);
+
+    if (dev_read(block, buf) == -1) return -1;
+
+    // Someone may have cached the block while we were reading it
+    pthread_mutex_lock(&cache_lock);
+    int ret = 0;
+    if ((e = cache_lookup(block))) memcpy(buf, e->data, block_size);
+    else ret = cache_store(block, buf, 0);
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
 }
 
 int block_write(int block, const void *buf) {
-    if (disk_fd == -1 || block < 0 || block >= NUM_BLOCKS) return -1;
-    if (lseek(disk_fd, block * BLOCK_SIZE, SEEK_SET) == -1) return -1;
-    return write(disk_fd, buf, BLOCK_SIZE) == BLOCK_SIZE ? 0 : -1;
+    STAT_INC(block_writes);
+    if (disk_count == 0 || block < 0 || (uint32_t)block >= disk_blocks) return -1;
+    if (mapped) {
+        memcpy(map_block(block), buf, block_size);
+        return 0;
+    }
+    if (!cache_enabled()) return dev_write(block, buf);
+
+    pthread_mutex_lock(&cache_lock);
+    int ret = 0;
+    cache_entry_t *e = cache_lookup(block);
+    if (e) {
+        memcpy(e->data, buf, block_size);
+        e->dirty = 1;
+    } else {
+        ret = cache_store(block, buf, 1);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+int block_readv(int block, const struct iovec *iov, int iovcnt) {
+    STAT_INC(block_readvs);
+    size_t total = iov_total(iov, iovcnt);
+    if (disk_count == 0 || iovcnt <= 0 || iovcnt > IOV_MAX || total % block_size) return -1;
+    int count = total / block_size;
+    if (!valid_range(block, count)) return -1;
+
+    if (mapped) {
+        for (int i = 0; i < count; i++) {
+            iov_block(iov, iovcnt, i, map_block(block + i), 1);
+        }
+        return 0;
+    }
+
+    // Fully cached runs never leave user space
+    pthread_mutex_lock(&cache_lock);
+    int cached = 0;
+    for (int i = 0; i < count; i++) {
+        if (cache_peek(block + i)) cached++;
+    }
+    if (cached == count && count > 0) {
+        for (int i = 0; i < count; i++) {
+            cache_count_hit();
+            iov_block(iov, iovcnt, i, cache_lookup(block + i)->data, 1);
+        }
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+
+    // The cache may hold newer data than the image for some of the blocks;
+    // put it on disk so the read below sees it
+    for (int i = 0; i < count && cached > 0; i++) {
+        cache_entry_t *e = cache_peek(block + i);
+        if (!e) continue;
+        cached--;
+        if (e->dirty && write_back(e) == -1) {
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return dev_rwv(block, iov, iovcnt, total, 0);
+}
+
+int block_writev(int block, const struct iovec *iov, int iovcnt) {
+    STAT_INC(block_writevs);
+    size_t total = iov_total(iov, iovcnt);
+    if (disk_count == 0 || iovcnt <= 0 || iovcnt > IOV_MAX || total % block_size) return -1;
+    int count = total / block_size;
+    if (!valid_range(block, count)) return -1;
+
+    if (mapped) {
+        for (int i = 0; i < count; i++) {
+            iov_block(iov, iovcnt, i, map_block(block + i), 0);
+        }
+        return 0;
+    }
+
+    // Bring cached copies in step first, so no stale dirty copy can be
+    // written back over the new data
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < count; i++) {
+        cache_entry_t *e = cache_peek(block + i);
+        if (!e) continue;
+        iov_block(iov, iovcnt, i, e->data, 0);
+        e->dirty = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return dev_rwv(block, iov, iovcnt, total, 1);
+}
+
+// One async request over several images; fn runs once the last part is done
+typedef struct {
+    int pending;
+    int failed;
+    aio_done_fn fn;
+    void *arg;
+} stripe_op_t;
+
+static void stripe_done(void *arg, int result) {
+    stripe_op_t *op = arg;
+    if (result == -1) __atomic_store_n(&op->failed, 1, __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&op->pending, 1, __ATOMIC_ACQ_REL) > 0) return;
+    op->fn(op->arg, op->failed ? -1 : 0);
+    free(op);
+}
+
+static int stripe_submit(int block, int nblocks, const struct iovec *iov, int iovcnt, int write, aio_done_fn fn, void *arg) {
+    aio_io_t *ios;
+    struct iovec *vecs;
+    stripe_op_t *op = calloc(1, sizeof(stripe_op_t));
+    int count = op ? stripe_split(block, nblocks, iov, iovcnt, write, &ios, &vecs) : -1;
+    if (count == -1) {
+        free(op);
+        return -1;
+    }
+    op->pending = count;
+    op->fn = fn;
+    op->arg = arg;
+
+    int ret = 0;
+    for (int i = 0; i < count; i++) {
+        if (aio_submit(ios[i].fd, ios[i].off, ios[i].iov, ios[i].iovcnt, write, stripe_done, op) == 0) continue;
+        
+        // Nothing went out: fail the call. Otherwise the parts already
+        // queued report the failure.
+        if (i == 0) {
+            free(op);
+            ret = -1;
+        } else {
+            __atomic_store_n(&op->failed, 1, __ATOMIC_RELAXED);
+            if (__atomic_sub_fetch(&op->pending, count - i, __ATOMIC_ACQ_REL) == 0) {
+                ret = aio_complete(fn, arg, -1);
+                free(op);
+            }
+        }
+        break;
+    }
+    free(ios);
+    free(vecs);
+    return ret;
+}
+
+// Async requests bypass the cache, so settle any cached copies first
+static int block_rwv_async(int block, const struct iovec *iov, int iovcnt, int write, aio_done_fn fn, void *arg) {
+    size_t total = iov_total(iov, iovcnt);
+    if (disk_count == 0 || iovcnt <= 0 || iovcnt > IOV_MAX || total % block_size) return -1;
+    int count = total / block_size;
+    if (!valid_range(block, count)) return -1;
+    if (aio_init(AIO_DEFAULT_DEPTH) == -1) return -1;
+
+    if (mapped) {
+        int ret = write ? block_writev(block, iov, iovcnt) : block_readv(block, iov, iovcnt);
+        return aio_complete(fn, arg, ret);
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < count; i++) {
+        cache_entry_t *e = cache_peek(block + i);
+        if (!e) continue;
+        if (write) cache_invalidate(block + i);
+        else if (e->dirty && write_back(e) == -1) {
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (disk_count == 1) return aio_submit(disk_fds[0], (off_t)block * block_size, iov, iovcnt, write, fn, arg);
+    return stripe_submit(block, count, iov, iovcnt, write, fn, arg);
+}
+
+int block_readv_async(int block, const struct iovec *iov, int iovcnt, aio_done_fn fn, void *arg) {
+    STAT_INC(block_readvs);
+    return block_rwv_async(block, iov, iovcnt, 0, fn, arg);
+}
+
+int block_writev_async(int block, const struct iovec *iov, int iovcnt, aio_done_fn fn, void *arg) {
+    STAT_INC(block_writevs);
+    return block_rwv_async(block, iov, iovcnt, 1, fn, arg);
+}
+
+int disk_aio_submit() {
+    return aio_kick();
+}
+
+int disk_aio_reap(int min) {
+    return aio_reap(min);
+}
+
+int disk_aio_inflight() {
+    return aio_inflight();
+}
+
+void *block_ptr(int block) {
+    if (!mapped || block < 0 || (uint32_t)block >= disk_blocks) return NULL;
+    return map_block(block);
+}
+
+int disk_sync() {
+    if (disk_count == 0) return -1;
+    int ret = 0;
+    if (mapped) {
+        for (int i = 0; i < disk_count; i++) {
+            STAT_INC(syscalls);
+            if (msync(disk_maps[i], image_sizes[i], MS_SYNC) == -1) ret = -1;
+        }
+        return ret;
+    }
+    pthread_mutex_lock(&cache_lock);
+    ret = cache_for_each_dirty(write_back);
+    pthread_mutex_unlock(&cache_lock);
+    for (int i = 0; i < disk_count && ret == 0; i++) {
+        STAT_INC(syscalls);
+        if (fsync(disk_fds[i]) == -1) ret = -1;
+    }
+    return ret;
+}
+
+int disk_set_cache_size(size_t nblocks) {
+    if (disk_count != 0) return -1; // Takes effect on the next open_disk
+    cache_blocks = nblocks;
+    return 0;
+}
+
+void disk_get_cache_stats(cache_stats_t *stats) {
+    pthread_mutex_lock(&cache_lock);
+    cache_get_stats(stats);
+    pthread_mutex_unlock(&cache_lock);
 }
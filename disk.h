@@ -1,10 +1,64 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "cache.h"
+#include "aio.h"
+
+#define DISK_MAX_IMAGES 16
+#define DISK_STRIPE_DEFAULT 16      // blocks per stripe
+
+// A disk may span several images, named together as a comma separated list
+// ("a.img,b.img"). Blocks are striped across them RAID-0 style: each run of
+// stripe blocks goes to the next image in turn, and block 0 always lands at
+// the start of the first image.
 int make_disk(const char *name);
 int open_disk(const char *name);
+int open_disk_backend(const char *name, int backend); // FS_BACKEND_* from fs.h
 int close_disk();
+int disk_image_count();
+
+// Block size, disk size in blocks and blocks per stripe. make_disk sizes the
+// images with them; after open_disk they must be set to what the disk was
+// made with before anything past the first MIN_BLOCK_SIZE bytes is used.
+// Fails if an open image is too small for them.
+int disk_set_geometry(uint32_t block_size, uint32_t nblocks, uint32_t stripe_blocks);
+uint32_t disk_block_size();
+
+// How many blocks from block on, up to max, sit next to each other in the
+// same image
+uint32_t disk_contiguous(int block, uint32_t max);
+
 int block_read(int block, void *buf);
 int block_write(int block, const void *buf);
 
-#endif
\ No newline at end of file
+// Transfers consecutive blocks starting at block with a single preadv/pwritev
+// per image; the images of a striped disk are worked on in parallel. The
+// iovec lengths must add up to a whole number of blocks.
+int block_readv(int block, const struct iovec *iov, int iovcnt);
+int block_writev(int block, const struct iovec *iov, int iovcnt);
+
+// Asynchronous versions of block_readv/block_writev. Requests are queued
+// until disk_aio_submit and complete through fn, which runs inside
+// disk_aio_reap.
+int block_readv_async(int block, const struct iovec *iov, int iovcnt, aio_done_fn fn, void *arg);
+int block_writev_async(int block, const struct iovec *iov, int iovcnt, aio_done_fn fn, void *arg);
+int disk_aio_submit();
+int disk_aio_reap(int min);
+int disk_aio_inflight();
+
+// Address of a block inside the mapped image, or NULL when the image is not
+// opened with FS_BACKEND_MMAP
+void *block_ptr(int block);
+
+// Writes back dirty cached blocks and fsyncs the image
+int disk_sync();
+
+// Number of blocks kept in the write-back cache (0 disables it). Applies to
+// the next open_disk.
+int disk_set_cache_size(size_t nblocks);
+void disk_get_cache_stats(cache_stats_t *stats);
+
+#endif
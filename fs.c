@@ -1,15 +1,314 @@
 #include "fs.h"
 #include "disk.h"
+#include "alloc.h"
+#include "journal.h"
+#include "stats.h"
+#include "lz.h"
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+// In-memory index of a file's chain as runs of adjacent blocks, built on
+// first use and kept up to date by extend_chain and fs_truncate
+typedef struct {
+    uint32_t logical;       // first file block covered
+    uint32_t start;         // data block it lives in
+    uint32_t len;
+} extent_t;
+
+// Where a chunk of a compressed file sits in its chain
+typedef struct {
+    uint32_t pos;           // file block its header is in
+    uint32_t blocks;
+    uint32_t raw_len;
+} chunk_t;
+
+typedef struct {
+    extent_t *ext;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t blocks;        // length of the chain
+    uint8_t valid;
+    uint32_t gen;           // bumped by every write and truncate
+    uint32_t wb_pending;    // descriptors with writes buffered for the file
+    uint32_t aio_pending;   // async calls in flight, which hold block numbers
+    uint8_t index_valid;    // chunks[] or map[] is built
+    chunk_t *chunks;        // compressed files
+    uint32_t chunk_count;
+    uint32_t chunk_cap;
+    uint32_t *map;          // dedup files: shared block of each file block
+    uint32_t map_len;
+    uint32_t map_cap;       // a whole number of map blocks
+    uint32_t unshare_gen;   // shared_drops when a cloned file last still shared a block
+    uint32_t unshare_at;    // map entry it shared there
+} extent_map_t;
+
+// One directory block in memory, plus in-memory state for its files. The
+// arrays hold dir_per_block items each and share the chunk's allocation.
+typedef struct {
+    dir_entry_t *entries;
+    extent_map_t *extents;
+    pthread_rwlock_t *locks; // per file: data, size, chain
+    uint32_t logged;        // journal transaction that last wrote it
+    uint8_t dirty;
+    uint8_t referenced;     // used since the clock hand last passed
+} dir_chunk_t;
+
+// The same for a FAT or dedup index block
+typedef struct {
+    uint32_t pins;          // FAT lookups using the page right now
+    uint32_t logged;
+    uint8_t referenced;
+} page_info_t;
+
+// Longest directory chain, which bounds the array of chunks
+#define MAX_DIR_BLOCKS 65536
 
 // Global variables
 static int disk_fd = -1;
 static superblock_t sb;
-static uint32_t *fat = NULL;
-static dir_entry_t *dir = NULL;
+static uint32_t **fat_pages = NULL;    // one per FAT block, read in on first use
+static page_info_t *fat_info = NULL;
+static dir_chunk_t **dir = NULL;        // one per directory block, read in on first use
+static uint32_t *dir_block = NULL;      // data block each directory block is stored in
+static uint32_t dir_entries = 0;        // sb.dir_blocks * dir_per_block
+static uint32_t dir_per_block = 0;      // entries in one directory block
+static uint32_t max_dir_blocks = 0;
 static file_desc_t fd_table[MAX_FD];
 
+// Keys of every directory entry, kept in memory from mount to unmount
+static dir_key_t **key_pages = NULL;    // one per block of the key chain
+static uint32_t *key_block = NULL;      // data block each is stored in
+static uint32_t key_shift = 0;          // log2 of the keys each block holds
+static uint32_t dir_per_key = 0;        // directory blocks whose keys fill one
+
+// Dedup index, paged in like the FAT
+static dedup_slot_t **dedup_pages = NULL;
+static page_info_t *dedup_info = NULL;
+static uint32_t dedup_slots = 0;
+
+// FAT, dedup index and directory blocks in memory, and how many may be
+static uint32_t meta_cached = 0;
+static uint32_t meta_cache_max = 8192;  // see fs_set_meta_cache
+static uint32_t meta_cache_limit = 0;   // for this mount
+
+// Used entries in each FAT block as of the last commit, from the summary
+// region, so mount needs no scan to know where free space is
+static uint32_t *fat_used = NULL;
+
+// Metadata changed since it was last written out
+static uint8_t *fat_dirty = NULL;       // one flag per FAT block
+static uint8_t *dedup_dirty = NULL;     // one flag per dedup index block
+static uint8_t *summary_dirty = NULL;   // one flag per summary block
+static uint8_t *key_dirty = NULL;       // one flag per block of the key chain
+static uint8_t sb_dirty = 0;
+static int sync_interval = 0;           // see fs_set_sync_interval
+static uint32_t stripe_blocks = DISK_STRIPE_DEFAULT; // see fs_set_stripe_blocks
+static uint32_t new_block_size = BLOCK_SIZE;        // see fs_set_geometry
+static uint32_t new_num_blocks = NUM_BLOCKS;
+static time_t last_flush = 0;
+
+// Locks, outermost first. Metadata changes happen under txn_lock held shared
+// so a commit (holding it exclusively) always snapshots whole operations.
+//   defrag_lock one fs_defrag call at a time
+//   dir_lock    name index, free slots, snapshot lists, directory growth
+//   file locks  in dir_chunk_t
+//   txn_lock
+//   tail_lock   packed tail blocks and the slots held for the next commit
+//   dedup_lock  dedup index, reference counts of shared blocks
+//   alloc_lock  free-space bitmap, alloc_goal, sb.free_blocks, freed_blocks;
+//               FAT entries are only zeroed under it, as the bitmap fills
+//               in lazily
+//   fd_lock     descriptor slots
+//   page_lock   reading in FAT, dedup index and directory blocks
+//   ra_lock     readahead queue; never held with a readahead_t lock
+// A descriptor's write buffer is guarded by the lock of its file.
+static pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t txn_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Group commit: callers arriving while a commit is running wait and share
+// the next one
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t commits_started = 0;
+static uint64_t commits_finished = 0;
+static int commit_running = 0;
+static int commit_result = 0;
+
+// Name lookup: open-addressed hash table of directory entry numbers, keyed
+// by snapshot and name. Slots keep the hash too, so probing only reads in
+// the directory blocks of entries it matches.
+#define SLOT_EMPTY -1
+#define SLOT_DELETED -2
+static int32_t *name_index = NULL;
+static uint32_t *name_hashes = NULL;    // entry_hash of each slot's entry
+static uint32_t name_index_size = 0;    // power of two
+static uint32_t name_index_used = 0;    // live and deleted slots
+static uint32_t name_index_live = 0;
+
+// Entries of a clone or snapshot still being made. Left by a crash, they
+// are dropped at mount.
+#define SNAPSHOT_PENDING 255
+
+// The entries of each snapshot, for deleting it
+static int32_t *snapshot_files[FS_MAX_SNAPSHOTS + 1];
+static uint32_t snapshot_count[FS_MAX_SNAPSHOTS + 1];
+
+// Unused directory entries, lowest numbers on top
+static int32_t *free_slots = NULL;
+static uint32_t free_slot_count = 0;
+static uint32_t free_slot_cap = 0;
+
+static dir_entry_t *dent(int dir_index) {
+    return &dir[dir_index / dir_per_block]->entries[dir_index % dir_per_block];
+}
+
+static extent_map_t *dext(int dir_index) {
+    return &dir[dir_index / dir_per_block]->extents[dir_index % dir_per_block];
+}
+
+static pthread_rwlock_t *file_lock(int dir_index) {
+    return &dir[dir_index / dir_per_block]->locks[dir_index % dir_per_block];
+}
+
+// Dirty flags are set by many threads at once and cleared under txn_lock
+static void dir_dirty(int dir_index) {
+    __atomic_store_n(&dir[dir_index / dir_per_block]->dirty, 1, __ATOMIC_RELAXED);
+}
+
+static dir_key_t *dkey(int dir_index) {
+    return &key_pages[dir_index >> key_shift][dir_index & ((1u << key_shift) - 1)];
+}
+
+static void mark_referenced(uint8_t *flag) {
+    if (!__atomic_load_n(flag, __ATOMIC_RELAXED)) __atomic_store_n(flag, 1, __ATOMIC_RELAXED);
+}
+
+// Reads block i of the FAT or dedup index the first time it is needed, or
+// again after trim_cache dropped it. Published pages are read without a
+// lock (see trim_cache).
+static void *page_in(void **pages, page_info_t *info, uint32_t start, uint32_t i) {
+    void *page = __atomic_load_n(&pages[i], __ATOMIC_SEQ_CST);
+    if (!page) {
+        pthread_mutex_lock(&page_lock);
+        page = pages[i];
+        if (!page && (page = malloc(sb.block_size)) && block_read(start + i, page) == -1) {
+            free(page);
+            page = NULL;
+        }
+        if (page && !pages[i]) {
+            __atomic_store_n(&pages[i], page, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&meta_cached, 1, __ATOMIC_RELAXED);
+            STAT_INC(meta_reads);
+        }
+        pthread_mutex_unlock(&page_lock);
+    }
+    if (page) mark_referenced(&info[i].referenced);
+    return page;
+}
+
+static uint32_t fat_per_block() {
+    return sb.block_size / sizeof(uint32_t);
+}
+
+// Returns FAT block i pinned in memory, or NULL if it cannot be read. The
+// pin keeps trim_cache from freeing it while the caller uses it.
+static uint32_t *fat_pin(uint32_t i) {
+    __atomic_add_fetch(&fat_info[i].pins, 1, __ATOMIC_SEQ_CST);
+    return page_in((void **)fat_pages, fat_info, sb.fat_start, i);
+}
+
+static void fat_unpin(uint32_t i) {
+    __atomic_sub_fetch(&fat_info[i].pins, 1, __ATOMIC_RELEASE);
+}
+
+// A FAT block that cannot be read ends every chain through it
+static uint32_t fat_get(uint32_t block) {
+    uint32_t i = block / fat_per_block();
+    uint32_t *page = fat_pin(i);
+    uint32_t value = page ? page[block % fat_per_block()] : (uint32_t)-1;
+    fat_unpin(i);
+    return value;
+}
+
+// Returns -1 if the FAT block cannot be read. A FAT block stays in memory
+// from its first change until that is checkpointed (see drop_page), so
+// while the caller holds txn_lock shared, putting back an entry it set
+// cannot fail.
+static int fat_set(uint32_t block, uint32_t value) {
+    uint32_t i = block / fat_per_block();
+    uint32_t *page = fat_pin(i);
+    if (page) {
+        page[block % fat_per_block()] = value;
+        __atomic_store_n(&fat_dirty[i], 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&sb_dirty, 1, __ATOMIC_RELAXED);
+    }
+    fat_unpin(i);
+    return page ? 0 : -1;
+}
+
+static dir_chunk_t *chunk_new() {
+    size_t per_entry = sizeof(dir_entry_t) + sizeof(extent_map_t) + sizeof(pthread_rwlock_t);
+    dir_chunk_t *chunk = calloc(1, sizeof(dir_chunk_t) + dir_per_block * per_entry);
+    if (!chunk) return NULL;
+    chunk->entries = (dir_entry_t *)(chunk + 1);
+    chunk->extents = (extent_map_t *)(chunk->entries + dir_per_block);
+    chunk->locks = (pthread_rwlock_t *)(chunk->extents + dir_per_block);
+    for (uint32_t i = 0; i < dir_per_block; i++) {
+        pthread_rwlock_init(&chunk->locks[i], NULL);
+    }
+    return chunk;
+}
+
+static void chunk_free(dir_chunk_t *chunk) {
+    if (!chunk) return;
+    for (uint32_t i = 0; i < dir_per_block; i++) {
+        pthread_rwlock_destroy(&chunk->locks[i]);
+    }
+    free(chunk);
+}
+
+// Reads in the directory block holding an entry unless it is in memory. The
+// caller holds dir_lock, which keeps trim_cache from dropping it again; a
+// descriptor open on the entry does that afterwards.
+static int entry_load(int dir_index) {
+    uint32_t i = dir_index / dir_per_block;
+    dir_chunk_t *chunk = __atomic_load_n(&dir[i], __ATOMIC_ACQUIRE);
+    if (!chunk) {
+        pthread_mutex_lock(&page_lock);
+        chunk = dir[i];
+        if (!chunk && (chunk = chunk_new()) && block_read(sb.data_start + dir_block[i], chunk->entries) == -1) {
+            chunk_free(chunk);
+            chunk = NULL;
+        }
+        if (chunk && !dir[i]) {
+            __atomic_store_n(&dir[i], chunk, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&meta_cached, 1, __ATOMIC_RELAXED);
+            STAT_INC(meta_reads);
+        }
+        pthread_mutex_unlock(&page_lock);
+        if (!chunk) return -1;
+    }
+    mark_referenced(&chunk->referenced);
+    return 0;
+}
+
+// Whether an entry is in use, and by a live file if live is set, from its
+// key when its block is not in memory. The caller holds dir_lock.
+static int entry_used(uint32_t dir_index, int live) {
+    dir_chunk_t *chunk = dir[dir_index / dir_per_block];
+    if (!chunk) return dkey(dir_index)->used && (!live || dkey(dir_index)->snapshot == 0);
+    dir_entry_t *d = &chunk->entries[dir_index % dir_per_block];
+    return d->used && (!live || d->snapshot == 0);
+}
+
 // Helper functions
 static int find_free_fd() {
     for (int i = 0; i < MAX_FD; i++) {
@@ -18,498 +317,4511 @@ static int find_free_fd() {
     return -1;
 }
 
-static int find_file(const char *name) {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (dir[i].used && strcmp(dir[i].name, name) == 0) {
-            return i;
-        }
+static int valid_fd(int fildes) {
+    return fildes >= 0 && fildes < MAX_FD && fd_table[fildes].used;
+}
+
+// Descriptors opened in a snapshot are read only
+static int writable_fd(int fildes) {
+    return valid_fd(fildes) && !fd_table[fildes].read_only;
+}
+
+// A file can fill the whole data region
+static uint64_t max_file_size() {
+    return (uint64_t)sb.data_blocks * sb.block_size;
+}
+
+// How much of a file is kept in its chain rather than inline or in a tail
+static uint64_t chain_bytes(dir_entry_t *d) {
+    if (d->flags & ENTRY_INLINE) return 0;
+    if (d->flags & ENTRY_TAIL) return d->size - d->size % sb.block_size;
+    return d->size;
+}
+
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
     }
-    return -1;
+    return h;
 }
 
-static int find_free_dir_entry() {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (!dir[i].used) return i;
+static uint32_t entry_hash(uint8_t snapshot, const char *name) {
+    return name_hash(name) ^ snapshot * 0x9e3779b9u;
+}
+
+// Returns the entry with its block read in, or -1. The caller holds
+// dir_lock.
+static int find_entry(uint8_t snapshot, const char *name) {
+    if (!name_index) return -1;
+    uint32_t hash = entry_hash(snapshot, name);
+    uint32_t mask = name_index_size - 1;
+    for (uint32_t i = hash & mask; name_index[i] != SLOT_EMPTY; i = (i + 1) & mask) {
+        int32_t slot = name_index[i];
+        if (slot < 0 || name_hashes[i] != hash || entry_load(slot) == -1) continue;
+        if (dent(slot)->snapshot == snapshot && strcmp(dent(slot)->name, name) == 0) return slot;
     }
     return -1;
 }
 
-static uint32_t find_free_block() {
-    for (uint32_t i = 0; i < DATA_BLOCKS; i++) {
-        if (fat[i] == 0) return i;
-    }
-    return (uint32_t)-1;
+static int find_file(const char *name) {
+    return find_entry(0, name);
 }
 
-static int write_superblock() {
-    char block[BLOCK_SIZE];
-    memcpy(block, &sb, sizeof(superblock_t));
-    return block_write(0, block);
+static void index_put(int dir_index, uint32_t hash) {
+    uint32_t mask = name_index_size - 1;
+    uint32_t i = hash & mask;
+    while (name_index[i] >= 0) i = (i + 1) & mask;
+    if (name_index[i] == SLOT_EMPTY) name_index_used++;
+    name_index[i] = dir_index;
+    name_hashes[i] = hash;
+    name_index_live++;
 }
 
-static int read_superblock() {
-    char block[BLOCK_SIZE];
-    if (block_read(0, block) == -1) return -1;
-    memcpy(&sb, block, sizeof(superblock_t));
+// Moves the name index to a table sized for live entries, leaving deleted
+// slots behind
+static int index_resize(uint32_t live) {
+    uint32_t size = 16;
+    while (size < live * 4) size *= 2;
+    
+    int32_t *table = malloc(size * sizeof(int32_t));
+    uint32_t *hashes = malloc(size * sizeof(uint32_t));
+    if (!table || !hashes) {
+        free(table);
+        free(hashes);
+        return -1;
+    }
+    int32_t *old = name_index;
+    uint32_t *old_hashes = name_hashes;
+    uint32_t old_size = name_index_size;
+    name_index = table;
+    name_hashes = hashes;
+    name_index_size = size;
+    name_index_used = 0;
+    name_index_live = 0;
+    for (uint32_t i = 0; i < size; i++) name_index[i] = SLOT_EMPTY;
+    for (uint32_t i = 0; i < old_size; i++) {
+        if (old[i] >= 0) index_put(old[i], old_hashes[i]);
+    }
+    free(old);
+    free(old_hashes);
     return 0;
 }
 
-static int write_fat() {
-    for (uint32_t i = 0; i < sb.fat_blocks; i++) {
-        char block[BLOCK_SIZE];
-        memcpy(block, fat + i * (BLOCK_SIZE / sizeof(uint32_t)), BLOCK_SIZE);
-        if (block_write(sb.fat_start + i, block) == -1) return -1;
+// Indexes count entries at once
+static int index_insert_many(const int32_t *entries, uint32_t count) {
+    // Keep at least a quarter of the slots empty so probes stay short
+    if ((name_index_used + count) * 4 > name_index_size * 3 && index_resize(name_index_live + count) == -1) return -1;
+    for (uint32_t i = 0; i < count; i++) {
+        dir_entry_t *d = dent(entries[i]);
+        index_put(entries[i], entry_hash(d->snapshot, d->name));
     }
     return 0;
 }
 
-static int read_fat() {
-    for (uint32_t i = 0; i < sb.fat_blocks; i++) {
-        char block[BLOCK_SIZE];
-        if (block_read(sb.fat_start + i, block) == -1) return -1;
-        memcpy(fat + i * (BLOCK_SIZE / sizeof(uint32_t)), block, BLOCK_SIZE);
+static int index_insert(int dir_index) {
+    int32_t entry = dir_index;
+    return index_insert_many(&entry, 1);
+}
+
+static void index_remove(int dir_index) {
+    uint32_t mask = name_index_size - 1;
+    for (uint32_t i = entry_hash(dent(dir_index)->snapshot, dent(dir_index)->name) & mask; name_index[i] != SLOT_EMPTY; i = (i + 1) & mask) {
+        if (name_index[i] == dir_index) {
+            name_index[i] = SLOT_DELETED;
+            name_index_live--;
+            return;
+        }
     }
-    return 0;
 }
 
-static int write_dir() {
-    for (uint32_t i = 0; i < sb.dir_blocks; i++) {
-        char block[BLOCK_SIZE];
-        memcpy(block, dir + i * (BLOCK_SIZE / sizeof(dir_entry_t)), BLOCK_SIZE);
-        if (block_write(sb.dir_start + i, block) == -1) return -1;
+static int push_free_slot(int dir_index) {
+    if (free_slot_count == free_slot_cap) {
+        uint32_t cap = free_slot_cap ? free_slot_cap * 2 : dir_per_block;
+        int32_t *slots = realloc(free_slots, cap * sizeof(int32_t));
+        if (!slots) return -1;
+        free_slots = slots;
+        free_slot_cap = cap;
     }
+    free_slots[free_slot_count++] = dir_index;
     return 0;
 }
 
-static int read_dir() {
-    for (uint32_t i = 0; i < sb.dir_blocks; i++) {
-        char block[BLOCK_SIZE];
-        if (block_read(sb.dir_start + i, block) == -1) return -1;
-        memcpy(dir + i * (BLOCK_SIZE / sizeof(dir_entry_t)), block, BLOCK_SIZE);
+static void free_snapshots() {
+    for (int i = 0; i <= FS_MAX_SNAPSHOTS; i++) {
+        free(snapshot_files[i]);
+        snapshot_files[i] = NULL;
+        snapshot_count[i] = 0;
     }
-    return 0;
 }
 
-// File system management
-int make_fs(char *disk_name) {
-    if (make_disk(disk_name) == -1) return -1;
-    if (open_disk(disk_name) == -1) return -1;
-    
-    // Initialize superblock
-    sb.magic = MAGIC_NUMBER;
-    sb.fat_start = 1;
-    sb.fat_blocks = 4;
-    sb.dir_start = sb.fat_start + sb.fat_blocks;
-    sb.dir_blocks = 1;
-    sb.data_start = sb.dir_start + sb.dir_blocks;
-    sb.free_blocks = DATA_BLOCKS;
-    sb.created = time(NULL);
-    sb.last_mounted = sb.created;
-    
-    // Allocate memory for FAT and directory
-    fat = malloc(sb.fat_blocks * BLOCK_SIZE);
-    dir = malloc(sb.dir_blocks * BLOCK_SIZE);
-    
-    if (!fat || !dir) {
-        free(fat);
-        free(dir);
-        close_disk();
-        return -1;
+// Builds the name index, the free-slot list and the snapshot lists from the
+// keys in two passes: one to size them, one to fill them. Unused entries
+// are collected from the top so the lowest numbered one is handed out
+// first; pending ones are not indexed.
+static int load_keys() {
+    uint32_t count[FS_MAX_SNAPSHOTS + 1] = { 0 };
+    free_slot_count = 0;
+    for (uint32_t i = dir_entries; i-- > 0; ) {
+        dir_key_t *key = dkey(i);
+        if (!key->used) {
+            if (push_free_slot(i) == -1) return -1;
+        } else if (key->snapshot != SNAPSHOT_PENDING) {
+            count[key->snapshot]++;
+        }
     }
     
-    // Initialize FAT (all blocks free)
-    memset(fat, 0, sb.fat_blocks * BLOCK_SIZE);
-    
-    // Initialize directory (all entries free)
-    memset(dir, 0, sb.dir_blocks * BLOCK_SIZE);
-    
-    // Write metadata to disk
-    if (write_superblock() == -1 || write_fat() == -1 || write_dir() == -1) {
-        free(fat);
-        free(dir);
-        close_disk();
-        return -1;
+    uint32_t live = 0;
+    int snapshots = 0;
+    for (int i = 0; i <= FS_MAX_SNAPSHOTS; i++) {
+        live += count[i];
+        if (i > 0 && count[i] > 0) {
+            if (!(snapshot_files[i] = malloc(count[i] * sizeof(int32_t)))) return -1;
+            snapshots = 1;
+        }
+    }
+    if (index_resize(live) == -1) return -1;
+    for (uint32_t i = 0; i < dir_entries; i++) {
+        dir_key_t *key = dkey(i);
+        if (!key->used || key->snapshot == SNAPSHOT_PENDING) continue;
+        index_put(i, key->hash);
+        if (snapshots && key->snapshot) snapshot_files[key->snapshot][snapshot_count[key->snapshot]++] = i;
     }
-    
-    free(fat);
-    free(dir);
-    close_disk();
     return 0;
 }
 
-int mount_fs(char *disk_name) {
-    if (disk_fd != -1) return -1; // Already mounted
-    
-    if (open_disk(disk_name) == -1) return -1;
-    disk_fd = 1; // Mark as mounted
-    
-    // Read superblock
-    if (read_superblock() == -1) {
-        close_disk();
-        disk_fd = -1;
-        return -1;
-    }
-    
-    // Verify magic number
-    if (sb.magic != MAGIC_NUMBER) {
-        close_disk();
-        disk_fd = -1;
-        return -1;
+// Data block 0 is never handed out: a FAT entry of 0 means "free", so no
+// chain may link to it
+#define RESERVED_BLOCK 0
+
+// Where files with no blocks yet start looking for space
+static uint32_t alloc_goal = 0;
+
+// Data blocks the FAT block maps; the last one is cut short
+static uint32_t fat_block_entries(uint32_t i) {
+    uint32_t first = i * fat_per_block();
+    if (first >= sb.data_blocks) return 0;
+    return sb.data_blocks - first < fat_per_block() ? sb.data_blocks - first : fat_per_block();
+}
+
+// Whether a FAT block has free entries. A block changed since the last
+// commit may have freed some, so it is looked at either way.
+static int fat_maybe_free(uint32_t i) {
+    return fat_used[i] < fat_block_entries(i) || __atomic_load_n(&fat_dirty[i], __ATOMIC_RELAXED);
+}
+
+// Marks the free blocks of one FAT block in the bitmap. The caller holds
+// alloc_lock.
+static void fat_load_free(uint32_t i) {
+    if (fat_used[i] == fat_block_entries(i) && !__atomic_load_n(&fat_dirty[i], __ATOMIC_RELAXED)) return;
+    uint32_t *page = fat_pin(i);
+    uint32_t first = i * fat_per_block();
+    for (uint32_t j = 0; page && j < fat_block_entries(i); j++) {
+        if (page[j] == 0 && first + j != RESERVED_BLOCK) alloc_mark_free(first + j);
     }
-    
-    // Allocate memory for FAT and directory
-    fat = malloc(sb.fat_blocks * BLOCK_SIZE);
-    dir = malloc(sb.dir_blocks * BLOCK_SIZE);
-    
-    if (!fat || !dir) {
-        free(fat);
-        free(dir);
-        close_disk();
-        disk_fd = -1;
+    fat_unpin(i);
+}
+
+// Sets up the free-space bitmap to fill in from the FAT a block at a time as
+// the allocator gets to it. The free count comes from the summaries.
+static int load_free_map() {
+    if (alloc_init(sb.data_blocks) == -1 ||
+        alloc_set_loader(fat_per_block(), fat_maybe_free, fat_load_free) == -1) {
         return -1;
     }
-    
-    // Read FAT and directory
-    if (read_fat() == -1 || read_dir() == -1) {
-        free(fat);
-        free(dir);
-        close_disk();
-        disk_fd = -1;
-        return -1;
+    sb.free_blocks = 0;
+    for (uint32_t i = 0; i < sb.fat_blocks; i++) {
+        sb.free_blocks += fat_block_entries(i) - fat_used[i];
     }
-    
-    // Initialize file descriptor table
-    memset(fd_table, 0, sizeof(fd_table));
-    
-    // Update last mounted time
-    sb.last_mounted = time(NULL);
-    write_superblock();
-    
     return 0;
 }
 
-int umount_fs(char *disk_name) {
-    if (disk_fd == -1) return -1; // Not mounted
-    
-    // Close all open file descriptors
-    for (int i = 0; i < MAX_FD; i++) {
-        if (fd_table[i].used) {
-            fd_table[i].used = 0;
+// Blocks freed since the last commit. Until it is on disk a crash brings
+// back whatever used them, so they stay taken in the bitmap till then.
+static uint32_t *freed_blocks = NULL;   // under alloc_lock
+static uint32_t freed_count = 0;
+static uint32_t freed_cap = 0;
+
+// Without room to note it a block stays taken until the next mount, which
+// finds it free in the FAT. The caller holds alloc_lock.
+static void note_freed(uint32_t block) {
+    if (freed_count == freed_cap) {
+        uint32_t cap = freed_cap ? freed_cap * 2 : 256;
+        uint32_t *blocks = realloc(freed_blocks, cap * sizeof(uint32_t));
+        if (!blocks) return;
+        freed_blocks = blocks;
+        freed_cap = cap;
+    }
+    freed_blocks[freed_count++] = block;
+}
+
+// Frees a block in the FAT and holds it back from the allocator until the
+// next commit. Its part of the bitmap is filled in first, while the FAT
+// still says it is taken. If its FAT block cannot be read the block just
+// stays taken, which costs the space but leaves every chain whole, so
+// callers carry on. The caller holds alloc_lock and txn_lock shared.
+static void free_block(uint32_t block) {
+    alloc_load(block);
+    if (fat_set(block, 0) == 0) note_freed(block);
+}
+
+// Lends the journal free data blocks for a transaction bigger than its
+// region. They are only written by the journal and only until the
+// checkpoint right after, and a crash leaves them free in the FAT.
+static uint32_t spill_alloc(uint32_t want, uint32_t *got) {
+    pthread_mutex_lock(&alloc_lock);
+    uint32_t block = alloc_blocks(alloc_goal, want, got);
+    if (block != (uint32_t)-1) sb.free_blocks -= *got;
+    pthread_mutex_unlock(&alloc_lock);
+    return block == (uint32_t)-1 ? block : sb.data_start + block;
+}
+
+static void spill_release(uint32_t start, uint32_t n) {
+    pthread_mutex_lock(&alloc_lock);
+    for (uint32_t i = 0; i < n; i++) alloc_mark_free(start - sb.data_start + i);
+    sb.free_blocks += n;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Frees every block of a chain
+static void free_chain(uint32_t block) {
+    pthread_mutex_lock(&alloc_lock);
+    while (block != (uint32_t)-1 && block < sb.data_blocks) {
+        uint32_t next_block = fat_get(block);
+        STAT_INC(fat_hops);
+        free_block(block);
+        block = next_block;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Async calls still in flight finish after a delete, so their count stays
+static void extents_clear(int dir_index) {
+    uint32_t aio_pending = dext(dir_index)->aio_pending;
+    free(dext(dir_index)->ext);
+    free(dext(dir_index)->chunks);
+    free(dext(dir_index)->map);
+    memset(dext(dir_index), 0, sizeof(extent_map_t));
+    dext(dir_index)->aio_pending = aio_pending;
+}
+
+// Adds the next block of the chain to a file's extent map
+static int extents_append(extent_map_t *m, uint32_t block) {
+    if (m->count > 0) {
+        extent_t *last = &m->ext[m->count - 1];
+        if (last->start + last->len == block) {
+            last->len++;
+            m->blocks++;
+            return 0;
         }
     }
-    
-    // Write metadata to disk
-    if (write_fat() == -1 || write_dir() == -1 || write_superblock() == -1) {
-        free(fat);
-        free(dir);
-        close_disk();
-        disk_fd = -1;
-        return -1;
+    if (m->count == m->cap) {
+        uint32_t cap = m->cap ? m->cap * 2 : 4;
+        extent_t *ext = realloc(m->ext, cap * sizeof(extent_t));
+        if (!ext) return -1;
+        m->ext = ext;
+        m->cap = cap;
+    }
+    m->ext[m->count].logical = m->blocks;
+    m->ext[m->count].start = block;
+    m->ext[m->count].len = 1;
+    m->count++;
+    m->blocks++;
+    return 0;
+}
+
+// Drops everything past the first nblocks blocks of a file
+static void extents_truncate(extent_map_t *m, uint32_t nblocks) {
+    while (m->count > 0 && m->ext[m->count - 1].logical >= nblocks) m->count--;
+    if (m->count > 0) {
+        extent_t *last = &m->ext[m->count - 1];
+        if (last->logical + last->len > nblocks) last->len = nblocks - last->logical;
     }
+    if (m->blocks > nblocks) m->blocks = nblocks;
+}
+
+static extent_map_t *get_extents(int dir_index) {
+    extent_map_t *m = dext(dir_index);
+    if (m->valid) return m;
     
-    free(fat);
-    free(dir);
-    fat = NULL;
-    dir = NULL;
+    m->count = 0;
+    m->blocks = 0;
+    for (uint32_t block = dent(dir_index)->first_block; block != (uint32_t)-1; block = fat_get(block)) {
+        if (extents_append(m, block) == -1) return NULL;
+        STAT_INC(fat_hops);
+    }
+    m->valid = 1;
+    return m;
+}
+
+// Finds file block lblock: stores its data block in *block and returns how
+// many adjacent blocks from there on belong to the file, capped at max, or 0
+// past the end of the chain. A descriptor's cursor remembers the last extent
+// so sequential access skips the binary search.
+static uint32_t map_run(int dir_index, file_desc_t *cursor, uint32_t lblock, uint32_t max, uint32_t *block) {
+    extent_map_t *m = get_extents(dir_index);
+    if (!m || lblock >= m->blocks) return 0;
     
-    if (close_disk() == -1) {
-        disk_fd = -1;
-        return -1;
+    uint32_t i = cursor ? cursor->extent : 0;
+    if (i < m->count && lblock >= m->ext[i].logical + m->ext[i].len &&
+        i + 1 < m->count && lblock < m->ext[i + 1].logical + m->ext[i + 1].len) {
+        i++;
+    } else if (i >= m->count || lblock < m->ext[i].logical || lblock >= m->ext[i].logical + m->ext[i].len) {
+        uint32_t lo = 0;
+        uint32_t hi = m->count - 1;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo + 1) / 2;
+            if (m->ext[mid].logical <= lblock) lo = mid;
+            else hi = mid - 1;
+        }
+        i = lo;
     }
+    if (cursor) cursor->extent = i;
     
-    disk_fd = -1;
-    return 0;
+    uint32_t skip = lblock - m->ext[i].logical;
+    uint32_t n = m->ext[i].len - skip;
+    *block = m->ext[i].start + skip;
+    return n < max ? n : max;
 }
 
-// File operations
-int fs_create(char *name) {
-    if (disk_fd == -1) return -1;
-    if (strlen(name) > MAX_FILE_NAME) return -1;
-    if (find_file(name) != -1) return -1;
+// How a transfer of len bytes, starting skip bytes into a run of data blocks,
+// maps onto the caller's buffer. Whole blocks point straight into buf; only
+// partial first and last blocks go through the head and tail bounce buffers.
+typedef struct {
+    uint32_t block;
+    uint32_t run;
+    size_t skip;
+    char *buf;
+    size_t len;
+    char *head;
+    char *tail;
+    int head_partial;
+    int tail_partial;
+    struct iovec iov[3];
+    int iovcnt;
+} run_io_t;
+
+static void run_setup(run_io_t *r, uint32_t block, uint32_t run, size_t skip, char *buf, size_t len, char *head, char *tail) {
+    size_t end = skip + len;
+    uint32_t last = run - 1;
     
-    int dir_index = find_free_dir_entry();
-    if (dir_index == -1) return -1;
+    r->block = block;
+    r->run = run;
+    r->skip = skip;
+    r->buf = buf;
+    r->len = len;
+    r->head = head;
+    r->tail = tail;
+    r->head_partial = skip != 0 || end < sb.block_size;
+    r->tail_partial = end % sb.block_size != 0 && !(last == 0 && r->head_partial);
+    r->iovcnt = 0;
     
-    // Initialize directory entry
-    strncpy(dir[dir_index].name, name, MAX_FILE_NAME);
-    dir[dir_index].name[MAX_FILE_NAME] = '\0';
-    dir[dir_index].size = 0;
-    dir[dir_index].first_block = (uint32_t)-1;
-    dir[dir_index].created = time(NULL);
-    dir[dir_index].modified = dir[dir_index].created;
-    dir[dir_index].used = 1;
+    uint32_t full_start = r->head_partial ? 1 : 0;
+    uint32_t full_end = r->tail_partial ? last : run;
     
-    if (write_dir() == -1) {
-        dir[dir_index].used = 0;
-        return -1;
+    if (r->head_partial) {
+        r->iov[r->iovcnt].iov_base = head;
+        r->iov[r->iovcnt++].iov_len = sb.block_size;
+    }
+    if (full_end > full_start) {
+        r->iov[r->iovcnt].iov_base = buf + ((size_t)full_start * sb.block_size - skip);
+        r->iov[r->iovcnt++].iov_len = (size_t)(full_end - full_start) * sb.block_size;
+    }
+    if (r->tail_partial) {
+        r->iov[r->iovcnt].iov_base = tail;
+        r->iov[r->iovcnt++].iov_len = sb.block_size;
     }
-    
-    return 0;
 }
 
-int fs_delete(char *name) {
-    if (disk_fd == -1) return -1;
-    
-    int dir_index = find_file(name);
-    if (dir_index == -1) return -1;
-    
-    // Check if file is open
-    for (int i = 0; i < MAX_FD; i++) {
-        if (fd_table[i].used && fd_table[i].dir_index == dir_index) {
-            return -1;
+// An fs_read_async/fs_write_async call in flight
+typedef struct {
+    int fildes;
+    int dir_index;
+    int write;
+    size_t bytes;
+    size_t copied;          // inline or tail data, already in place
+    int pending;            // block requests not yet completed
+    int failed;
+    int runs;
+    run_io_t first;         // only the first and last runs can have
+    run_io_t last;          // partial blocks
+    char *head;             // one block each, allocated with the op
+    char *tail;
+    fs_aio_callback cb;
+    void *arg;
+} fs_aio_op_t;
+
+static int aio_ops_done = 0;
+
+static fs_aio_op_t *aio_op_new() {
+    fs_aio_op_t *op = calloc(1, sizeof(fs_aio_op_t) + 2 * (size_t)sb.block_size);
+    if (!op) return NULL;
+    op->head = (char *)(op + 1);
+    op->tail = op->head + sb.block_size;
+    return op;
+}
+
+// Scratch space for the partial blocks of a transfer: two of the largest
+// blocks per thread, kept between calls since they are too big for the stack
+static pthread_key_t bounce_key;
+static pthread_once_t bounce_once = PTHREAD_ONCE_INIT;
+
+static void bounce_key_init() {
+    pthread_key_create(&bounce_key, free);
+}
+
+static char *bounce_get() {
+    pthread_once(&bounce_once, bounce_key_init);
+    char *buf = pthread_getspecific(bounce_key);
+    if (!buf) {
+        buf = malloc(2 * MAX_BLOCK_SIZE);
+        if (buf && pthread_setspecific(bounce_key, buf) != 0) {
+            free(buf);
+            buf = NULL;
         }
     }
-    
-    // Free all blocks in the FAT chain
-    uint32_t block = dir[dir_index].first_block;
-    while (block != (uint32_t)-1 && block < DATA_BLOCKS) {
-        uint32_t next_block = fat[block];
-        fat[block] = 0;
-        sb.free_blocks++;
-        block = next_block;
+    return buf;
+}
+
+// Before a write: partial blocks keep whatever else they held
+static int run_fill_partials(run_io_t *r) {
+    uint32_t last = r->run - 1;
+    if (r->head_partial) {
+        STAT_INC(rmw_blocks);
+        if (block_read(sb.data_start + r->block, r->head) == -1) return -1;
+        size_t n = r->len < sb.block_size - r->skip ? r->len : sb.block_size - r->skip;
+        memcpy(r->head + r->skip, r->buf, n);
     }
-    
-    // Mark directory entry as free
-    dir[dir_index].used = 0;
-    
-    // Update metadata
-    if (write_fat() == -1 || write_dir() == -1 || write_superblock() == -1) {
-        return -1;
+    if (r->tail_partial) {
+        STAT_INC(rmw_blocks);
+        if (block_read(sb.data_start + r->block + last, r->tail) == -1) return -1;
+        memcpy(r->tail, r->buf + ((size_t)last * sb.block_size - r->skip), r->skip + r->len - (size_t)last * sb.block_size);
     }
-    
     return 0;
 }
 
-int fs_open(char *name) {
-    if (disk_fd == -1) return -1;
-    
-    int dir_index = find_file(name);
-    if (dir_index == -1) return -1;
+// After a read: hand the wanted part of the partial blocks to the caller
+static void run_copy_partials(run_io_t *r) {
+    uint32_t last = r->run - 1;
+    if (r->head_partial) {
+        size_t n = r->len < sb.block_size - r->skip ? r->len : sb.block_size - r->skip;
+        memcpy(r->buf, r->head + r->skip, n);
+    }
+    if (r->tail_partial) {
+        memcpy(r->buf + ((size_t)last * sb.block_size - r->skip), r->tail, r->skip + r->len - (size_t)last * sb.block_size);
+    }
+}
+
+// Moves len bytes between buf and the run of data blocks starting at block,
+// beginning skip bytes into the first block
+static int transfer_run(uint32_t block, uint32_t run, size_t skip, char *buf, size_t len, int write) {
+    run_io_t r;
     
-    int fd = find_free_fd();
-    if (fd == -1) return -1;
+    if (len == 0) return 0;
+    char *bounce = bounce_get();
+    if (!bounce) return -1;
+    run_setup(&r, block, run, skip, buf, len, bounce, bounce + sb.block_size);
     
-    fd_table[fd].dir_index = dir_index;
-    fd_table[fd].offset = 0;
-    fd_table[fd].used = 1;
+    if (write && run_fill_partials(&r) == -1) return -1;
     
-    return fd;
-}
-
-int fs_close(int fildes) {
-    if (disk_fd == -1) return -1;
-    if (fildes < 0 || fildes >= MAX_FD || !fd_table[fildes].used) return -1;
+    // Single blocks stay on the cached path
+    if (run == 1) {
+        char *data = r.head_partial ? r.head : buf;
+        if (write) return block_write(sb.data_start + block, data);
+        if (block_read(sb.data_start + block, data) == -1) return -1;
+    } else if (write) {
+        return block_writev(sb.data_start + block, r.iov, r.iovcnt);
+    } else if (block_readv(sb.data_start + block, r.iov, r.iovcnt) == -1) {
+        return -1;
+    }
     
-    fd_table[fildes].used = 0;
+    run_copy_partials(&r);
     return 0;
 }
 
-int fs_read(int fildes, void *buf, size_t nbyte) {
-    if (disk_fd == -1) return -1;
-    if (fildes < 0 || fildes >= MAX_FD || !fd_table[fildes].used) return -1;
+// Grows the chain of a file to at least nblocks blocks and returns how many
+// it ends up with (fewer when the disk fills up or the FAT cannot be read)
+static uint32_t extend_chain(int dir_index, uint32_t nblocks) {
+    extent_map_t *m = get_extents(dir_index);
+    if (!m) return 0;
     
-    int dir_index = fd_table[fildes].dir_index;
-    uint32_t offset = fd_table[fildes].offset;
-    uint32_t size = dir[dir_index].size;
+    uint32_t count = m->blocks;
+    uint32_t last = (uint32_t)-1;
+    if (m->count > 0) {
+        last = m->ext[m->count - 1].start + m->ext[m->count - 1].len - 1;
+    }
+    
+    // Ask for everything at once, right after the current last block, so
+    // the file stays in as few runs as possible
+    while (count < nblocks) {
+        uint32_t got;
+        pthread_mutex_lock(&alloc_lock);
+        uint32_t hint = last == (uint32_t)-1 ? alloc_goal : last + 1;
+        uint32_t new_block = alloc_blocks(hint, nblocks - count, &got);
+        if (new_block != (uint32_t)-1) {
+            sb.free_blocks -= got;
+            alloc_goal = new_block + got;
+        }
+        pthread_mutex_unlock(&alloc_lock);
+        if (new_block == (uint32_t)-1) break;
+        
+        for (uint32_t i = 0; i < got; i++) {
+            // Each block is ended before it is linked in. What cannot be
+            // linked goes back.
+            if (fat_set(new_block + i, (uint32_t)-1) == -1 ||
+                (last != (uint32_t)-1 && fat_set(last, new_block + i) == -1)) {
+                fat_set(new_block + i, 0);
+                pthread_mutex_lock(&alloc_lock);
+                for (uint32_t j = i; j < got; j++) alloc_mark_free(new_block + j);
+                sb.free_blocks += got - i;
+                pthread_mutex_unlock(&alloc_lock);
+                return count + i;
+            }
+            if (last == (uint32_t)-1) {
+                dent(dir_index)->first_block = new_block + i;
+                dir_dirty(dir_index);
+            }
+            if (m->valid && extents_append(m, new_block + i) == -1) {
+                m->valid = 0; // Rebuilt from the FAT on next use
+            }
+            last = new_block + i;
+        }
+        count += got;
+    }
+    return count;
+}
+
+// Packed tails: data blocks shared by the last, partial blocks of files,
+// each cut into TAIL_SLOTS slots. A tail takes a run of slots in one block.
+// Kept sorted by block number; rebuilt from the directory at mount.
+#define TAIL_SLOTS 32
+#define TAIL_MAX_SLOTS 16       // longer tails keep their own block
+#define TAIL_SEARCH 64          // tail blocks looked at before starting a new one
+
+typedef struct {
+    uint32_t block;
+    uint32_t used;              // one bit per slot
+    uint32_t held;              // given up, but not reused before a commit
+} tail_block_t;
+
+static tail_block_t *tails = NULL;
+static uint32_t tail_count = 0;
+static uint32_t tail_cap = 0;
+static uint32_t tail_hint = 0;  // where the last tail went
+static pthread_mutex_t tail_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Slots given up since the last commit, as a block and the held bits
+static tail_block_t *tails_freed = NULL;
+static uint32_t tails_freed_count = 0;
+static uint32_t tails_freed_cap = 0;
+
+static uint32_t tail_slot_size() {
+    return sb.block_size / TAIL_SLOTS;
+}
+
+static uint32_t tail_slots(uint32_t len) {
+    return (len + tail_slot_size() - 1) / tail_slot_size();
+}
+
+static uint32_t slot_mask(uint32_t slot, uint32_t nslots) {
+    return ((1u << nslots) - 1) << slot;
+}
+
+// Index of block in tails, or where it would go
+static uint32_t tail_find(uint32_t block) {
+    uint32_t lo = 0;
+    uint32_t hi = tail_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (tails[mid].block < block) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int tail_insert(uint32_t i, uint32_t block) {
+    if (tail_count == tail_cap) {
+        uint32_t cap = tail_cap ? tail_cap * 2 : 16;
+        tail_block_t *t = realloc(tails, cap * sizeof(tail_block_t));
+        if (!t) return -1;
+        tails = t;
+        tail_cap = cap;
+    }
+    memmove(&tails[i + 1], &tails[i], (tail_count - i) * sizeof(tail_block_t));
+    tails[i].block = block;
+    tails[i].used = 0;
+    tails[i].held = 0;
+    tail_count++;
+    return 0;
+}
+
+// The caller holds tail_lock.
+static void note_tail_freed(uint32_t block, uint32_t held) {
+    if (tails_freed_count == tails_freed_cap) {
+        uint32_t cap = tails_freed_cap ? tails_freed_cap * 2 : 16;
+        tail_block_t *t = realloc(tails_freed, cap * sizeof(tail_block_t));
+        if (!t) return;
+        tails_freed = t;
+        tails_freed_cap = cap;
+    }
+    tails_freed[tails_freed_count++] = (tail_block_t){ block, 0, held };
+}
+
+// Gives back nslots slots from slot on, and frees the block once no tail
+// uses it. The slots are held until the change is committed, so a tail
+// written meanwhile cannot land on one a crash would bring back; without
+// room to note them they stay held until the next mount. The caller holds
+// txn_lock shared.
+static void tail_release(uint32_t block, uint32_t slot, uint32_t nslots) {
+    pthread_mutex_lock(&tail_lock);
+    uint32_t i = tail_find(block);
+    if (i < tail_count && tails[i].block == block) {
+        tails[i].used &= ~slot_mask(slot, nslots);
+        tails[i].held |= slot_mask(slot, nslots);
+        note_tail_freed(block, slot_mask(slot, nslots));
+        if (tails[i].used == 0) {
+            memmove(&tails[i], &tails[i + 1], (tail_count - i - 1) * sizeof(tail_block_t));
+            tail_count--;
+            pthread_mutex_lock(&alloc_lock);
+            free_block(block);
+            pthread_mutex_unlock(&alloc_lock);
+        }
+    }
+    pthread_mutex_unlock(&tail_lock);
+}
+
+// Lets the slots held for a commit that is on disk be used again
+static void tails_release(tail_block_t *freed, uint32_t count) {
+    pthread_mutex_lock(&tail_lock);
+    for (uint32_t n = 0; n < count; n++) {
+        uint32_t i = tail_find(freed[n].block);
+        if (i < tail_count && tails[i].block == freed[n].block) tails[i].held &= ~freed[n].held;
+    }
+    pthread_mutex_unlock(&tail_lock);
+}
+
+// Copies len bytes into free slots of a tail block, starting a new block if
+// none of the ones near the last tail has room. The caller holds txn_lock
+// shared.
+static int tail_store(const char *data, uint32_t len, uint32_t *block_out, uint8_t *slot_out) {
+    uint32_t nslots = tail_slots(len);
+    char *image = bounce_get();
+    if (!image) return -1;
+    image += MAX_BLOCK_SIZE; // the lower half holds data
+    
+    pthread_mutex_lock(&tail_lock);
+    uint32_t i = tail_count;
+    uint32_t slot = 0;
+    for (uint32_t n = 0; n < tail_count && n < TAIL_SEARCH && i == tail_count; n++) {
+        uint32_t t = (tail_hint + n) % tail_count;
+        for (slot = 0; slot + nslots <= TAIL_SLOTS; slot++) {
+            if (!((tails[t].used | tails[t].held) & slot_mask(slot, nslots))) {
+                i = t;
+                break;
+            }
+        }
+    }
+    
+    // Other tails in the block must survive, so it is read first
+    int fresh = i == tail_count;
+    if (fresh) {
+        uint32_t got;
+        pthread_mutex_lock(&alloc_lock);
+        uint32_t block = alloc_blocks(alloc_goal, 1, &got);
+        if (block != (uint32_t)-1) sb.free_blocks--;
+        pthread_mutex_unlock(&alloc_lock);
+        if (block == (uint32_t)-1 || tail_insert(i = tail_find(block), block) == -1 ||
+            fat_set(block, (uint32_t)-1) == -1) {
+            if (i < tail_count && tails[i].block == block) {
+                memmove(&tails[i], &tails[i + 1], (tail_count - i - 1) * sizeof(tail_block_t));
+                tail_count--;
+            }
+            if (block != (uint32_t)-1) {
+                pthread_mutex_lock(&alloc_lock);
+                alloc_mark_free(block);
+                sb.free_blocks++;
+                pthread_mutex_unlock(&alloc_lock);
+            }
+            pthread_mutex_unlock(&tail_lock);
+            return -1;
+        }
+        slot = 0;
+        memset(image, 0, sb.block_size);
+    } else if (block_read(sb.data_start + tails[i].block, image) == -1) {
+        pthread_mutex_unlock(&tail_lock);
+        return -1;
+    }
+    
+    tails[i].used |= slot_mask(slot, nslots);
+    memcpy(image + (size_t)slot * tail_slot_size(), data, len);
+    uint32_t block = tails[i].block;
+    int ret = block_write(sb.data_start + block, image);
+    tail_hint = i;
+    pthread_mutex_unlock(&tail_lock);
+    
+    if (ret == -1) {
+        tail_release(block, slot, nslots);
+        return -1;
+    }
+    *block_out = block;
+    *slot_out = slot;
+    return 0;
+}
+
+// Marks the slots of every packed tail in the directory as used, from the
+// keys
+static int load_tails() {
+    tail_count = 0;
+    tail_hint = 0;
+    for (uint32_t i = 0; i < dir_entries; i++) {
+        dir_key_t *k = dkey(i);
+        if (!k->used || k->tail_slots == 0) continue;
+        uint32_t t = tail_find(k->tail_block);
+        if ((t == tail_count || tails[t].block != k->tail_block) && tail_insert(t, k->tail_block) == -1) return -1;
+        tails[t].used |= slot_mask(k->tail_slot, k->tail_slots);
+    }
+    return 0;
+}
+
+static void free_tails() {
+    free(tails);
+    free(tails_freed);
+    tails = NULL;
+    tail_count = 0;
+    tail_cap = 0;
+    tails_freed = NULL;
+    tails_freed_count = 0;
+    tails_freed_cap = 0;
+}
+
+// Reads len bytes from off into a file's packed tail. Uses the upper half of
+// the bounce buffer.
+static int read_tail(dir_entry_t *d, uint64_t off, char *buf, size_t len) {
+    char *image = bounce_get();
+    if (!image) return -1;
+    image += MAX_BLOCK_SIZE;
+    if (block_read(sb.data_start + d->tail_block, image) == -1) return -1;
+    memcpy(buf, image + (size_t)d->tail_slot * tail_slot_size() + off, len);
+    return 0;
+}
+
+// Moves a small file into its directory entry, or the last partial block of
+// a bigger one into a tail slot, and frees the block it was in. Files with
+// blocks reserved past their end are left alone. The caller holds the file
+// lock exclusively and txn_lock shared.
+static int pack_file(int dir_index) {
+    dir_entry_t *d = dent(dir_index);
+    uint64_t size = d->size;
+    uint32_t tail = size % sb.block_size;
+    if (d->flags || size == 0) return 0;
+    if (size > INLINE_MAX && (tail == 0 || tail > TAIL_MAX_SLOTS * tail_slot_size())) return 0;
+    
+    extent_map_t *m = get_extents(dir_index);
+    uint32_t full = size / sb.block_size;
+    if (!m || m->blocks != full + 1) return 0;
+    
+    uint32_t block;
+    char *data = bounce_get();
+    map_run(dir_index, NULL, full, 1, &block);
+    if (!data || block_read(sb.data_start + block, data) == -1) return -1;
+    
+    // The chain is cut first, and joined again if the data cannot move
+    uint32_t prev = (uint32_t)-1;
+    if (full > 0) {
+        map_run(dir_index, NULL, full - 1, 1, &prev);
+        if (fat_set(prev, (uint32_t)-1) == -1) return -1;
+    }
+    if (size <= INLINE_MAX) {
+        memcpy(d->inline_data, data, size);
+        d->flags = ENTRY_INLINE;
+    } else if (tail_store(data, tail, &d->tail_block, &d->tail_slot) == 0) {
+        d->flags = ENTRY_TAIL;
+    } else {
+        if (prev != (uint32_t)-1) fat_set(prev, block);
+        return -1;
+    }
+    
+    if (full == 0) d->first_block = (uint32_t)-1;
+    free_chain(block);
+    extents_truncate(m, full);
+    dir_dirty(dir_index);
+    return 0;
+}
+
+// Puts inline or tail data back into a block at the end of the chain, so
+// the file can be written in place. The caller holds the file lock
+// exclusively and txn_lock shared.
+static int unpack_file(int dir_index) {
+    dir_entry_t *d = dent(dir_index);
+    if (!(d->flags & (ENTRY_INLINE | ENTRY_TAIL))) return 0;
+    
+    // A failure below leaves the new block on the chain; the next try
+    // reuses it
+    uint32_t full = d->size / sb.block_size;
+    if (extend_chain(dir_index, full + 1) < full + 1) return -1;
+    
+    uint32_t block;
+    uint32_t tail = d->size % sb.block_size;
+    char *data = bounce_get();
+    map_run(dir_index, NULL, full, 1, &block);
+    if (!data) return -1;
+    memset(data, 0, sb.block_size);
+    if (d->flags & ENTRY_INLINE) memcpy(data, d->inline_data, d->size);
+    else if (read_tail(d, 0, data, tail) == -1) return -1;
+    if (block_write(sb.data_start + block, data) == -1) return -1;
+    
+    if (d->flags & ENTRY_TAIL) tail_release(d->tail_block, d->tail_slot, tail_slots(tail));
+    d->flags = 0;
+    dir_dirty(dir_index);
+    return 0;
+}
+
+// Compressed files: the chain is a sequence of chunks, each CHUNK_BLOCKS
+// blocks of file data squeezed into as few blocks as it takes. Chunk i
+// always covers file bytes from i * chunk_size(), so the chunk index built
+// from the headers gives random access. A chunk is rewritten whole into new
+// blocks that are then swapped into the chain for the old ones.
+static uint32_t chunk_size() {
+    return CHUNK_BLOCKS * sb.block_size;
+}
+
+// Blocks taken by a chunk with stored_len bytes after its header
+static uint32_t chunk_blocks(uint32_t stored_len) {
+    return (sizeof(chunk_header_t) + stored_len + sb.block_size - 1) / sb.block_size;
+}
+
+// Scratch for one chunk: its file data, then its on-disk image
+static char *chunk_buffers() {
+    return malloc((size_t)chunk_size() + (size_t)(CHUNK_BLOCKS + 1) * sb.block_size);
+}
+
+static int chunks_append(extent_map_t *m, uint32_t pos, uint32_t blocks, uint32_t raw_len) {
+    if (m->chunk_count == m->chunk_cap) {
+        uint32_t cap = m->chunk_cap ? m->chunk_cap * 2 : 4;
+        chunk_t *chunks = realloc(m->chunks, cap * sizeof(chunk_t));
+        if (!chunks) return -1;
+        m->chunks = chunks;
+        m->chunk_cap = cap;
+    }
+    m->chunks[m->chunk_count++] = (chunk_t){ pos, blocks, raw_len };
+    return 0;
+}
+
+// Builds the extent map and chunk index of a compressed file by reading
+// the header of each chunk
+static extent_map_t *get_chunks(int dir_index) {
+    extent_map_t *m = get_extents(dir_index);
+    if (!m || m->index_valid) return m;
+    
+    char *image = bounce_get();
+    if (!image) return NULL;
+    m->chunk_count = 0;
+    for (uint32_t pos = 0; pos < m->blocks;) {
+        uint32_t block;
+        chunk_header_t h;
+        map_run(dir_index, NULL, pos, 1, &block);
+        if (block_read(sb.data_start + block, image) == -1) return NULL;
+        memcpy(&h, image, sizeof(h));
+        if (h.magic != CHUNK_MAGIC || h.raw_len > chunk_size() || h.stored_len > h.raw_len) return NULL;
+        uint32_t n = chunk_blocks(h.stored_len);
+        if (n > m->blocks - pos || chunks_append(m, pos, n, h.raw_len) == -1) return NULL;
+        pos += n;
+    }
+    m->index_valid = 1;
+    return m;
+}
+
+// Reads chunk c of a file and unpacks its data into raw
+static int load_chunk(int dir_index, extent_map_t *m, uint32_t c, char *raw, char *image) {
+    chunk_t *ch = &m->chunks[c];
+    for (uint32_t done = 0; done < ch->blocks;) {
+        uint32_t block;
+        uint32_t run = map_run(dir_index, NULL, ch->pos + done, ch->blocks - done, &block);
+        if (run == 0) return -1;
+        if (transfer_run(block, run, 0, image + (size_t)done * sb.block_size, (size_t)run * sb.block_size, 0) == -1) {
+            return -1;
+        }
+        done += run;
+    }
+    
+    chunk_header_t h;
+    memcpy(&h, image, sizeof(h));
+    if (h.magic != CHUNK_MAGIC || h.raw_len != ch->raw_len || h.stored_len > h.raw_len ||
+        chunk_blocks(h.stored_len) != ch->blocks) {
+        return -1;
+    }
+    char *payload = image + sizeof(h);
+    if (h.stored_len == h.raw_len) memcpy(raw, payload, h.raw_len);
+    else if (lz_decompress(payload, h.stored_len, raw, h.raw_len) != (long)h.raw_len) return -1;
+    return 0;
+}
+
+// Gives back blocks taken for a chunk that never made it into the chain
+static void chunk_blocks_free(uint32_t *blocks, uint32_t count) {
+    pthread_mutex_lock(&alloc_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        alloc_mark_free(blocks[i]);
+        sb.free_blocks++;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Compresses raw_len bytes of raw into chunk c, which may be one past the
+// last. The new image is written to fresh blocks first, so the old chunk
+// stays whole until the chain is relinked. The caller holds the file lock
+// exclusively.
+static int store_chunk(int dir_index, extent_map_t *m, uint32_t c, const char *raw, uint32_t raw_len, char *image) {
+    chunk_header_t h = { CHUNK_MAGIC, raw_len, 0 };
+    
+    // Kept as is unless compression saves something
+    size_t packed = raw_len > 1 ? lz_compress(raw, raw_len, image + sizeof(h), raw_len - 1) : 0;
+    if (packed == 0) memcpy(image + sizeof(h), raw, raw_len);
+    h.stored_len = packed ? packed : raw_len;
+    memcpy(image, &h, sizeof(h));
+    uint32_t nblocks = chunk_blocks(h.stored_len);
+    size_t used = sizeof(h) + h.stored_len;
+    memset(image + used, 0, (size_t)nblocks * sb.block_size - used);
+    
+    uint32_t pos = c < m->chunk_count ? m->chunks[c].pos : m->blocks;
+    uint32_t old = c < m->chunk_count ? m->chunks[c].blocks : 0;
+    uint32_t prev = (uint32_t)-1;
+    if (pos > 0) map_run(dir_index, NULL, pos - 1, 1, &prev);
+    
+    // New blocks go right after the previous chunk when there is room
+    uint32_t blocks[CHUNK_BLOCKS + 1];
+    uint32_t count = 0;
+    pthread_mutex_lock(&alloc_lock);
+    uint32_t hint = prev == (uint32_t)-1 ? alloc_goal : prev + 1;
+    while (count < nblocks) {
+        uint32_t got;
+        uint32_t block = alloc_blocks(hint, nblocks - count, &got);
+        if (block == (uint32_t)-1) break;
+        sb.free_blocks -= got;
+        for (uint32_t i = 0; i < got; i++) blocks[count++] = block + i;
+        hint = block + got;
+    }
+    if (count > 0 && prev == (uint32_t)-1) alloc_goal = hint;
+    pthread_mutex_unlock(&alloc_lock);
+    if (count < nblocks) {
+        chunk_blocks_free(blocks, count);
+        return -1;
+    }
+    
+    for (uint32_t i = 0; i < nblocks;) {
+        uint32_t run = 1;
+        while (i + run < nblocks && blocks[i + run] == blocks[i] + run) run++;
+        if (transfer_run(blocks[i], run, 0, image + (size_t)i * sb.block_size, (size_t)run * sb.block_size, 1) == -1) {
+            chunk_blocks_free(blocks, count);
+            return -1;
+        }
+        i += run;
+    }
+    
+    // Swap the new blocks in between the previous chunk and the next one:
+    // link them up, cut the old chunk off the rest and put them in its place.
+    // A step that fails undoes the ones before it.
+    pthread_rwlock_rdlock(&txn_lock);
+    uint32_t first_old = (uint32_t)-1;
+    uint32_t last_old = (uint32_t)-1;
+    uint32_t next = (uint32_t)-1;
+    if (old > 0) {
+        map_run(dir_index, NULL, pos, 1, &first_old);
+        map_run(dir_index, NULL, pos + old - 1, 1, &last_old);
+        next = fat_get(last_old);
+    }
+    uint32_t linked = 0;
+    while (linked < nblocks && fat_set(blocks[linked], linked + 1 < nblocks ? blocks[linked + 1] : next) == 0) linked++;
+    int failed = linked < nblocks;
+    if (!failed && last_old != (uint32_t)-1 && fat_set(last_old, (uint32_t)-1) == -1) failed = 1;
+    if (!failed && prev != (uint32_t)-1 && fat_set(prev, blocks[0]) == -1) {
+        if (last_old != (uint32_t)-1) fat_set(last_old, next);
+        failed = 1;
+    }
+    if (failed) {
+        while (linked > 0) fat_set(blocks[--linked], 0);
+        pthread_rwlock_unlock(&txn_lock);
+        chunk_blocks_free(blocks, count);
+        return -1;
+    }
+    if (prev == (uint32_t)-1) {
+        dent(dir_index)->first_block = blocks[0];
+        dir_dirty(dir_index);
+    }
+    free_chain(first_old);
+    pthread_rwlock_unlock(&txn_lock);
+    STAT_ADD(chunk_bytes_in, raw_len);
+    STAT_ADD(chunk_bytes_out, used);
+    
+    // Later chunks move along the chain by the change in length
+    if (c == m->chunk_count) {
+        if (chunks_append(m, pos, nblocks, raw_len) == -1) m->index_valid = 0;
+    } else {
+        m->chunks[c].blocks = nblocks;
+        m->chunks[c].raw_len = raw_len;
+        for (uint32_t i = c + 1; i < m->chunk_count; i++) m->chunks[i].pos += nblocks - old;
+    }
+    
+    // The last chunk is just replaced at the end of the extent map; anywhere
+    // else the map is rebuilt
+    if (pos + old == m->blocks) {
+        extents_truncate(m, pos);
+        for (uint32_t i = 0; i < nblocks; i++) {
+            if (extents_append(m, blocks[i]) == -1) m->valid = 0;
+        }
+    } else {
+        m->valid = 0;
+    }
+    return m->valid && m->index_valid ? 0 : get_chunks(dir_index) ? 0 : -1;
+}
+
+// Reads like read_at, a chunk at a time. The caller holds the file lock.
+static int read_compressed(int dir_index, char *buf, size_t to_read, uint64_t offset) {
+    extent_map_t *m = dext(dir_index);
+    char *raw = chunk_buffers();
+    if (!raw) return -1;
+    char *image = raw + chunk_size();
+    
+    size_t read = 0;
+    while (read < to_read) {
+        uint64_t pos = offset + read;
+        uint32_t c = pos / chunk_size();
+        uint32_t in = pos % chunk_size();
+        if (c >= m->chunk_count || in >= m->chunks[c].raw_len) break;
+        size_t n = m->chunks[c].raw_len - in;
+        if (n > to_read - read) n = to_read - read;
+        if (load_chunk(dir_index, m, c, raw, image) == -1) break;
+        memcpy(buf + read, raw + in, n);
+        read += n;
+    }
+    free(raw);
+    if (read == 0 && to_read > 0) return -1;
+    return read;
+}
+
+// Writes like write_at, recompressing every chunk the range touches. The
+// caller holds the file lock exclusively.
+static int write_compressed(int dir_index, const char *buf, size_t nbyte, uint64_t offset) {
+    extent_map_t *m = get_chunks(dir_index);
+    char *raw = m ? chunk_buffers() : NULL;
+    if (!raw) return -1;
+    char *image = raw + chunk_size();
+    
+    size_t written = 0;
+    while (written < nbyte) {
+        uint64_t pos = offset + written;
+        uint32_t c = pos / chunk_size();
+        uint32_t in = pos % chunk_size();
+        size_t n = chunk_size() - in;
+        if (n > nbyte - written) n = nbyte - written;
+        
+        // What the chunk holds now, unless all of it is being replaced
+        uint32_t len = c < m->chunk_count ? m->chunks[c].raw_len : 0;
+        if (len > 0 && (in > 0 || n < len) && load_chunk(dir_index, m, c, raw, image) == -1) break;
+        memcpy(raw + in, buf + written, n);
+        if (in + n > len) len = in + n;
+        if (store_chunk(dir_index, m, c, raw, len, image) == -1) break;
+        written += n;
+    }
+    free(raw);
+    
+    pthread_rwlock_rdlock(&txn_lock);
+    if (offset + written > dent(dir_index)->size) {
+        dent(dir_index)->size = offset + written;
+    }
+    dent(dir_index)->modified = time(NULL);
+    dir_dirty(dir_index);
+    pthread_rwlock_unlock(&txn_lock);
+    if (written == 0 && nbyte > 0) return -1;
+    return written;
+}
+
+// Cuts a compressed file down to length bytes: whole chunks past it go, and
+// the one it ends in is rewritten shorter. If that cannot be, the file ends
+// with the chunk and the call fails. The caller holds the file lock
+// exclusively.
+static int truncate_compressed(int dir_index, uint64_t length) {
+    extent_map_t *m = get_chunks(dir_index);
+    if (!m) return -1;
+    uint32_t keep = (length + chunk_size() - 1) / chunk_size();
+    
+    if (keep < m->chunk_count) {
+        uint32_t pos = m->chunks[keep].pos;
+        uint32_t block;
+        pthread_rwlock_rdlock(&txn_lock);
+        if (pos == 0) {
+            block = dent(dir_index)->first_block;
+            dent(dir_index)->first_block = (uint32_t)-1;
+            dir_dirty(dir_index);
+        } else {
+            uint32_t prev_block;
+            map_run(dir_index, NULL, pos - 1, 1, &prev_block);
+            block = fat_get(prev_block);
+            if (fat_set(prev_block, (uint32_t)-1) == -1) {
+                pthread_rwlock_unlock(&txn_lock);
+                return -1;
+            }
+        }
+        free_chain(block);
+        pthread_rwlock_unlock(&txn_lock);
+        extents_truncate(m, pos);
+        m->chunk_count = keep;
+    }
+    
+    uint32_t cut = length % chunk_size();
+    if (cut > 0 && m->chunks[keep - 1].raw_len > cut) {
+        char *raw = chunk_buffers();
+        if (!raw) return -1;
+        char *image = raw + chunk_size();
+        int result = load_chunk(dir_index, m, keep - 1, raw, image);
+        if (result == 0) result = store_chunk(dir_index, m, keep - 1, raw, cut, image);
+        free(raw);
+        if (result == -1) {
+            length = (uint64_t)(keep - 1) * chunk_size() + m->chunks[keep - 1].raw_len;
+            if (length < dent(dir_index)->size) {
+                pthread_rwlock_rdlock(&txn_lock);
+                dent(dir_index)->size = length;
+                dir_dirty(dir_index);
+                pthread_rwlock_unlock(&txn_lock);
+            }
+            return -1;
+        }
+    }
+    
+    pthread_rwlock_rdlock(&txn_lock);
+    dent(dir_index)->size = length;
+    dent(dir_index)->modified = time(NULL);
+    dir_dirty(dir_index);
+    pthread_rwlock_unlock(&txn_lock);
+    return 0;
+}
+
+// Dedup files: the chain is the file's block map, and the blocks it points
+// at are shared, reference counted in the FAT and found by content through
+// the dedup index. Shared blocks are immutable while referenced, so a write
+// stores new blocks and drops its references to the old ones.
+static uint32_t map_per_block() {
+    return sb.block_size / sizeof(uint32_t);
+}
+
+static int is_shared(uint32_t entry) {
+    return entry >= FAT_SHARED && entry != (uint32_t)-1;
+}
+
+// Whether an index entry still names a shared block. The caller holds
+// dedup_lock.
+static int dedup_live(uint32_t block) {
+    return block != 0 && block < sb.data_blocks && is_shared(fat_get(block));
+}
+
+// Bumped whenever a shared block is left with one reference, which may have
+// made a cloned file the only user of all its blocks
+static uint32_t shared_drops = 1;
+
+// 64-bit hash of a block's contents, eight bytes at a time
+static uint64_t block_hash(const char *data) {
+    uint64_t h = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < sb.block_size; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+// Drops a reference to a shared block, freeing it with the last one. Like
+// a block free_block cannot free, a reference that cannot be dropped just
+// keeps the block. The caller holds txn_lock shared.
+static void dedup_release(uint32_t block) {
+    pthread_mutex_lock(&dedup_lock);
+    uint32_t entry = fat_get(block);
+    if (entry == (FAT_SHARED | 1)) {
+        pthread_mutex_lock(&alloc_lock);
+        free_block(block);
+        pthread_mutex_unlock(&alloc_lock);
+    } else if (is_shared(entry)) {
+        fat_set(block, entry - 1);
+        if (entry == (FAT_SHARED | 2)) __atomic_add_fetch(&shared_drops, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&dedup_lock);
+}
+
+// Returns a shared block holding data with a reference taken for the caller:
+// one with the same contents if the index knows of it, else a new one near
+// hint. scratch holds a block.
+static uint32_t dedup_store(const char *data, uint32_t hint, char *scratch) {
+    uint64_t h = block_hash(data);
+    uint32_t per_block = sb.block_size / sizeof(dedup_slot_t);
+    uint32_t first = h % (dedup_slots / DEDUP_WAYS) * DEDUP_WAYS;
+    
+    // The reference is taken before comparing so the block cannot be freed
+    // and reused meanwhile. Index pages are only used under dedup_lock, which
+    // keeps trim_cache from dropping them.
+    pthread_rwlock_rdlock(&txn_lock);
+    pthread_mutex_lock(&dedup_lock);
+    dedup_slot_t *page = page_in((void **)dedup_pages, dedup_info, sb.dedup_start, first / per_block);
+    dedup_slot_t *bucket = page ? page + first % per_block : NULL;
+    uint32_t block = 0;
+    for (int i = 0; bucket && i < DEDUP_WAYS && block == 0; i++) {
+        if (bucket[i].hash == h && dedup_live(bucket[i].block)) block = bucket[i].block;
+    }
+    if (block != 0 && (fat_get(block) + 1 == (uint32_t)-1 || fat_set(block, fat_get(block) + 1) == -1)) block = 0;
+    pthread_mutex_unlock(&dedup_lock);
+    pthread_rwlock_unlock(&txn_lock);
+    if (!page) return -1;
+    if (block != 0) {
+        if (block_read(sb.data_start + block, scratch) == 0 && memcmp(scratch, data, sb.block_size) == 0) {
+            STAT_INC(dedup_hits);
+            return block;
+        }
+        pthread_rwlock_rdlock(&txn_lock);
+        dedup_release(block);
+        pthread_rwlock_unlock(&txn_lock);
+    }
+    
+    uint32_t got;
+    pthread_mutex_lock(&alloc_lock);
+    block = alloc_blocks(hint, 1, &got);
+    if (block != (uint32_t)-1) sb.free_blocks--;
+    pthread_mutex_unlock(&alloc_lock);
+    if (block == (uint32_t)-1) return -1;
+    if (block_write(sb.data_start + block, data) == -1) {
+        pthread_mutex_lock(&alloc_lock);
+        alloc_mark_free(block);
+        sb.free_blocks++;
+        pthread_mutex_unlock(&alloc_lock);
+        return -1;
+    }
+    
+    // Into a free or dead slot of the bucket if there is one. Without its
+    // page the block is stored but not indexed.
+    pthread_rwlock_rdlock(&txn_lock);
+    pthread_mutex_lock(&dedup_lock);
+    if (fat_set(block, FAT_SHARED | 1) == -1) {
+        pthread_mutex_unlock(&dedup_lock);
+        pthread_rwlock_unlock(&txn_lock);
+        pthread_mutex_lock(&alloc_lock);
+        alloc_mark_free(block);
+        sb.free_blocks++;
+        pthread_mutex_unlock(&alloc_lock);
+        return -1;
+    }
+    page = page_in((void **)dedup_pages, dedup_info, sb.dedup_start, first / per_block);
+    if (page) {
+        bucket = page + first % per_block;
+        dedup_slot_t *slot = &bucket[(h >> 32) % DEDUP_WAYS];
+        for (int i = 0; i < DEDUP_WAYS; i++) {
+            if (!dedup_live(bucket[i].block)) {
+                slot = &bucket[i];
+                break;
+            }
+        }
+        slot->hash = h;
+        slot->block = block;
+        __atomic_store_n(&dedup_dirty[first / per_block], 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    pthread_rwlock_unlock(&txn_lock);
+    return block;
+}
+
+// Makes room for n map entries; new ones read as 0
+static int map_reserve(extent_map_t *m, uint32_t n) {
+    if (n <= m->map_cap) return 0;
+    uint64_t cap = m->map_cap ? m->map_cap : map_per_block();
+    while (cap < n) cap *= 2;
+    uint32_t *map = realloc(m->map, cap * sizeof(uint32_t));
+    if (!map) return -1;
+    memset(map + m->map_cap, 0, (cap - m->map_cap) * sizeof(uint32_t));
+    m->map = map;
+    m->map_cap = cap;
+    return 0;
+}
+
+// Moves the map blocks holding entries first to end - 1 between disk and
+// the in-memory map
+static int map_transfer(int dir_index, extent_map_t *m, uint32_t first, uint32_t end, int write) {
+    uint32_t pos = first / map_per_block();
+    uint32_t last = (end - 1) / map_per_block();
+    while (pos <= last) {
+        uint32_t block;
+        uint32_t run = map_run(dir_index, NULL, pos, last - pos + 1, &block);
+        if (run == 0) return -1;
+        char *data = (char *)(m->map + (size_t)pos * map_per_block());
+        if (transfer_run(block, run, 0, data, (size_t)run * sb.block_size, write) == -1) return -1;
+        pos += run;
+    }
+    return 0;
+}
+
+// Writes map block pos to a new block and swaps that into the chain. The old
+// one is freed with the next commit, so until then a crash finds the map
+// that matches the references the last commit counted. The caller holds the
+// file lock exclusively.
+static int map_store(int dir_index, extent_map_t *m, uint32_t pos) {
+    uint32_t old;
+    if (map_run(dir_index, NULL, pos, 1, &old) == 0) return -1;
+    uint32_t got;
+    pthread_mutex_lock(&alloc_lock);
+    uint32_t block = alloc_blocks(old + 1, 1, &got);
+    if (block != (uint32_t)-1) sb.free_blocks--;
+    pthread_mutex_unlock(&alloc_lock);
+    if (block == (uint32_t)-1) return -1;
+    char *data = (char *)(m->map + (size_t)pos * map_per_block());
+    if (transfer_run(block, 1, 0, data, sb.block_size, 1) == -1) {
+        pthread_mutex_lock(&alloc_lock);
+        alloc_mark_free(block);
+        sb.free_blocks++;
+        pthread_mutex_unlock(&alloc_lock);
+        return -1;
+    }
+    
+    pthread_rwlock_rdlock(&txn_lock);
+    uint32_t prev = (uint32_t)-1;
+    if (pos > 0) map_run(dir_index, NULL, pos - 1, 1, &prev);
+    if (fat_set(block, fat_get(old)) == -1 || (prev != (uint32_t)-1 && fat_set(prev, block) == -1)) {
+        fat_set(block, 0);
+        pthread_rwlock_unlock(&txn_lock);
+        pthread_mutex_lock(&alloc_lock);
+        alloc_mark_free(block);
+        sb.free_blocks++;
+        pthread_mutex_unlock(&alloc_lock);
+        return -1;
+    }
+    if (pos == 0) {
+        dent(dir_index)->first_block = block;
+        dir_dirty(dir_index);
+    }
+    pthread_mutex_lock(&alloc_lock);
+    free_block(old);
+    pthread_mutex_unlock(&alloc_lock);
+    pthread_rwlock_unlock(&txn_lock);
+    m->valid = 0; // Rebuilt from the FAT on next use
+    return 0;
+}
+
+// Builds the extent map and block map of a dedup file
+static extent_map_t *get_map(int dir_index) {
+    extent_map_t *m = get_extents(dir_index);
+    if (!m || m->index_valid) return m;
+    
+    uint64_t n = (dent(dir_index)->size + sb.block_size - 1) / sb.block_size;
+    if (n > (uint64_t)m->blocks * map_per_block() || map_reserve(m, n) == -1) return NULL;
+    if (n > 0 && map_transfer(dir_index, m, 0, n, 0) == -1) return NULL;
+    for (uint32_t i = 0; i < n; i++) {
+        if (m->map[i] >= sb.data_blocks || !is_shared(fat_get(m->map[i]))) return NULL;
+    }
+    m->map_len = n;
+    m->index_valid = 1;
+    return m;
+}
+
+// Reads like read_at through the block map. The caller holds the file lock.
+static int read_dedup(int dir_index, char *buf, size_t to_read, uint64_t offset) {
+    extent_map_t *m = dext(dir_index);
+    uint32_t lblock = offset / sb.block_size;
+    uint32_t byte_in_block = offset % sb.block_size;
+    size_t read = 0;
+    
+    // Blocks the map lists one after another are read as one run
+    while (read < to_read && lblock < m->map_len) {
+        size_t len = to_read - read;
+        uint32_t want = (byte_in_block + len + sb.block_size - 1) / sb.block_size;
+        uint32_t run = 1;
+        while (run < want && lblock + run < m->map_len && m->map[lblock + run] == m->map[lblock] + run) run++;
+        if (len > (size_t)run * sb.block_size - byte_in_block) {
+            len = (size_t)run * sb.block_size - byte_in_block;
+        }
+        if (transfer_run(m->map[lblock], run, byte_in_block, buf + read, len, 0) == -1) break;
+        read += len;
+        byte_in_block = 0;
+        lblock += run;
+    }
+    if (read == 0 && to_read > 0) return -1;
+    return read;
+}
+
+// Writes like write_at, a map block's worth at a time: the data, then the
+// map, and only then are the replaced blocks released. The caller holds the
+// file lock exclusively.
+static int write_dedup(int dir_index, const char *buf, size_t nbyte, uint64_t offset) {
+    extent_map_t *m = get_map(dir_index);
+    if (!m) return -1;
+    
+    // Room in the map chain first
+    uint64_t nblocks = (offset + nbyte + sb.block_size - 1) / sb.block_size;
+    uint32_t want = (nblocks + map_per_block() - 1) / map_per_block();
+    if (want > m->blocks) {
+        pthread_rwlock_rdlock(&txn_lock);
+        uint32_t got = extend_chain(dir_index, want);
+        pthread_rwlock_unlock(&txn_lock);
+        if (got < want) {
+            uint64_t room = (uint64_t)got * map_per_block() * sb.block_size;
+            if (room <= offset && nbyte > 0) return -1; // Disk full
+            if (offset + nbyte > room) nbyte = room - offset;
+            nblocks = (offset + nbyte + sb.block_size - 1) / sb.block_size;
+        }
+    }
+    char *data = bounce_get();
+    uint32_t *old = malloc(map_per_block() * sizeof(uint32_t));
+    if (!data || !old || map_reserve(m, nblocks) == -1) {
+        free(old);
+        return -1;
+    }
+    char *scratch = data + MAX_BLOCK_SIZE;
+    
+    uint64_t size = dent(dir_index)->size;
+    uint32_t lblock = offset / sb.block_size;
+    uint32_t hint;
+    if (lblock > 0 && lblock <= m->map_len) {
+        hint = m->map[lblock - 1] + 1;
+    } else {
+        pthread_mutex_lock(&alloc_lock);
+        hint = alloc_goal;
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    size_t written = 0;
+    int failed = 0;
+    while (written < nbyte && !failed) {
+        uint32_t first = lblock;
+        uint32_t had_len = m->map_len;
+        size_t had_written = written;
+        uint32_t nold = 0;
+        do {
+            uint32_t in = (offset + written) % sb.block_size;
+            size_t n = sb.block_size - in < nbyte - written ? sb.block_size - in : nbyte - written;
+            
+            // Start from what the block holds unless all of it is replaced,
+            // and keep it zeroed past the end of the file so equal files
+            // end in equal blocks
+            uint64_t base = (uint64_t)lblock * sb.block_size;
+            uint64_t end = offset + written + n > size ? offset + written + n : size;
+            if (lblock < m->map_len && n < sb.block_size) {
+                if (block_read(sb.data_start + m->map[lblock], data) == -1) {
+                    failed = 1;
+                    break;
+                }
+            } else {
+                memset(data, 0, sb.block_size);
+            }
+            memcpy(data + in, buf + written, n);
+            if (end - base < sb.block_size) memset(data + (end - base), 0, sb.block_size - (end - base));
+            
+            uint32_t block = dedup_store(data, hint, scratch);
+            if (block == (uint32_t)-1) {
+                failed = 1;
+                break;
+            }
+            if (lblock < m->map_len) old[nold++] = m->map[lblock];
+            else m->map_len = lblock + 1;
+            m->map[lblock++] = block;
+            hint = block + 1;
+            written += n;
+        } while (written < nbyte && lblock % map_per_block() != 0);
+        
+        // If the map block cannot be stored, the one on disk still lists the
+        // old blocks, so they stay and the new ones are let go instead
+        if (lblock > first && map_store(dir_index, m, first / map_per_block()) == -1) {
+            for (uint32_t i = first; i < lblock; i++) {
+                uint32_t block = m->map[i];
+                m->map[i] = i - first < nold ? old[i - first] : 0;
+                old[i - first] = block;
+            }
+            nold = lblock - first;
+            m->map_len = had_len;
+            written = had_written;
+            failed = 1;
+        }
+        pthread_rwlock_rdlock(&txn_lock);
+        for (uint32_t i = 0; i < nold; i++) dedup_release(old[i]);
+        if (offset + written > dent(dir_index)->size) dent(dir_index)->size = offset + written;
+        pthread_rwlock_unlock(&txn_lock);
+    }
+    free(old);
+    
+    pthread_rwlock_rdlock(&txn_lock);
+    dent(dir_index)->modified = time(NULL);
+    dir_dirty(dir_index);
+    pthread_rwlock_unlock(&txn_lock);
+    if (written == 0 && nbyte > 0) return -1;
+    return written;
+}
+
+// Drops the map entries past length bytes and the map blocks no longer
+// needed. The caller holds the file lock exclusively and txn_lock shared.
+static int truncate_dedup(int dir_index, uint64_t length) {
+    extent_map_t *m = get_map(dir_index);
+    if (!m) return -1;
+    uint32_t keep = (length + sb.block_size - 1) / sb.block_size;
+    uint32_t keep_map = (keep + map_per_block() - 1) / map_per_block();
+    
+    if (keep_map < m->blocks) {
+        uint32_t block;
+        if (keep_map == 0) {
+            block = dent(dir_index)->first_block;
+            dent(dir_index)->first_block = (uint32_t)-1;
+        } else {
+            uint32_t prev_block;
+            map_run(dir_index, NULL, keep_map - 1, 1, &prev_block);
+            block = fat_get(prev_block);
+            if (fat_set(prev_block, (uint32_t)-1) == -1) return -1;
+        }
+        free_chain(block);
+        extents_truncate(m, keep_map);
+    }
+    for (uint32_t i = keep; i < m->map_len; i++) {
+        dedup_release(m->map[i]);
+        m->map[i] = 0;
+    }
+    if (keep < m->map_len) m->map_len = keep;
+    
+    dent(dir_index)->size = length;
+    dent(dir_index)->modified = time(NULL);
+    dir_dirty(dir_index);
+    return 0;
+}
+
+// Turns a file share_file made a dedup file back into a plain chain once no
+// other file shares any of its blocks: the map entries are linked in the
+// FAT in file order and the map chain is freed. Looked at again only after
+// some block drops to one reference, starting from the entry that was still
+// shared last time. The caller holds the file lock exclusively.
+static void unshare_file(int dir_index) {
+    dir_entry_t *d = dent(dir_index);
+    extent_map_t *m = dext(dir_index);
+    uint32_t drops = __atomic_load_n(&shared_drops, __ATOMIC_RELAXED);
+    if (!(d->flags & ENTRY_CLONED) || m->unshare_gen == drops) return;
+    m->unshare_gen = drops;
+    if (!get_map(dir_index)) return;
+    
+    pthread_rwlock_rdlock(&txn_lock);
+    pthread_mutex_lock(&dedup_lock);
+    uint32_t n = m->map_len;
+    uint32_t at = m->unshare_at < n ? m->unshare_at : 0;
+    uint32_t checked = 0;
+    while (checked < n && fat_get(m->map[at]) == (FAT_SHARED | 1)) {
+        at = at + 1 < n ? at + 1 : 0;
+        checked++;
+    }
+    m->unshare_at = at;
+    
+    // If that cannot be done in full the file stays shared, and is looked
+    // at again after the next drop
+    if (checked == n) {
+        uint32_t i = 0;
+        while (i < n && fat_set(m->map[i], i + 1 < n ? m->map[i + 1] : (uint32_t)-1) == 0) i++;
+        if (i < n) {
+            while (i > 0) fat_set(m->map[--i], FAT_SHARED | 1);
+            checked = 0;
+        }
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    if (checked == n) {
+        free_chain(d->first_block);
+        d->first_block = n > 0 ? m->map[0] : (uint32_t)-1;
+        d->flags = 0;
+        dir_dirty(dir_index);
+        m->valid = 0;
+        m->index_valid = 0;
+        m->map_len = 0;
+    }
+    pthread_rwlock_unlock(&txn_lock);
+}
+
+// Files whose chain is not simply their data
+#define ENTRY_INDEXED (ENTRY_COMPRESSED | ENTRY_DEDUP)
+
+// Builds what a file needs before it can be read under a shared lock
+static extent_map_t *get_index(int dir_index) {
+    if (dent(dir_index)->flags & ENTRY_COMPRESSED) return get_chunks(dir_index);
+    if (dent(dir_index)->flags & ENTRY_DEDUP) return get_map(dir_index);
+    return get_extents(dir_index);
+}
+
+static int read_indexed(int dir_index, char *buf, size_t to_read, uint64_t offset) {
+    if (dent(dir_index)->flags & ENTRY_DEDUP) return read_dedup(dir_index, buf, to_read, offset);
+    return read_compressed(dir_index, buf, to_read, offset);
+}
+
+static int write_indexed(int dir_index, const char *buf, size_t nbyte, uint64_t offset) {
+    if (dent(dir_index)->flags & ENTRY_DEDUP) return write_dedup(dir_index, buf, nbyte, offset);
+    return write_compressed(dir_index, buf, nbyte, offset);
+}
+
+// Superblock I/O uses whatever block size the disk is set to, so it also
+// works before the volume's own geometry is known
+static int write_superblock() {
+    char *block = calloc(1, disk_block_size());
+    if (!block) return -1;
+    memcpy(block, &sb, sizeof(superblock_t));
+    int ret = block_write(0, block);
+    free(block);
+    return ret;
+}
+
+static int read_superblock() {
+    char *block = malloc(disk_block_size());
+    if (!block) return -1;
+    int ret = block_read(0, block);
+    if (ret == 0) memcpy(&sb, block, sizeof(superblock_t));
+    free(block);
+    return ret;
+}
+
+static void free_tables() {
+    for (uint32_t i = 0; fat_pages && i < sb.fat_blocks; i++) free(fat_pages[i]);
+    for (uint32_t i = 0; dedup_pages && i < sb.dedup_blocks; i++) free(dedup_pages[i]);
+    free(fat_pages);
+    free(fat_info);
+    free(fat_dirty);
+    free(dedup_pages);
+    free(dedup_info);
+    free(dedup_dirty);
+    free(fat_used);
+    free(summary_dirty);
+    free(freed_blocks);
+    fat_pages = NULL;
+    fat_info = NULL;
+    fat_dirty = NULL;
+    dedup_pages = NULL;
+    dedup_info = NULL;
+    dedup_dirty = NULL;
+    fat_used = NULL;
+    summary_dirty = NULL;
+    freed_blocks = NULL;
+    freed_count = 0;
+    freed_cap = 0;
+    dedup_slots = 0;
+}
+
+// Reads a metadata region straight into a table, many blocks per call
+#define FAT_READ_BLOCKS 256
+
+static int read_region(uint32_t start, uint32_t nblocks, void *table) {
+    for (uint32_t i = 0; i < nblocks; i += FAT_READ_BLOCKS) {
+        uint32_t n = nblocks - i < FAT_READ_BLOCKS ? nblocks - i : FAT_READ_BLOCKS;
+        struct iovec iov = { (char *)table + (size_t)i * sb.block_size, (size_t)n * sb.block_size };
+        if (block_readv(start + i, &iov, 1) == -1) return -1;
+    }
+    return 0;
+}
+
+// Brings the keys of directory block i up to date with its entries
+static void keys_update(uint32_t i) {
+    for (uint32_t j = i * dir_per_block; j < (i + 1) * dir_per_block; j++) {
+        dir_entry_t *d = dent(j);
+        dir_key_t key;
+        memset(&key, 0, sizeof(key));
+        if (d->used) {
+            key.hash = entry_hash(d->snapshot, d->name);
+            key.used = 1;
+            key.snapshot = d->snapshot;
+        }
+        if (d->used && d->flags & ENTRY_TAIL) {
+            key.tail_block = d->tail_block;
+            key.tail_slot = d->tail_slot;
+            key.tail_slots = tail_slots(d->size % sb.block_size);
+        }
+        if (memcmp(&key, dkey(j), sizeof(key)) != 0) {
+            *dkey(j) = key;
+            key_dirty[i / dir_per_key] = 1;
+        }
+    }
+}
+
+// Copies every changed metadata block and clears the dirty flags. The caller
+// holds txn_lock exclusively, so no operation is half done. What is copied
+// is noted as logged by the transaction that will take it.
+static int snapshot_metadata(uint32_t **blocks_out, char **images_out, uint32_t *count_out) {
+    size_t bsize = sb.block_size;
+    uint32_t seq = journal_next_seq();
+    uint32_t max = sb_dirty ? 1 : 0;
+    for (uint32_t i = 0; i < sb.fat_blocks; i++) max += fat_dirty[i];
+    max += sb.summary_blocks;            // recounted below
+    for (uint32_t i = 0; i < sb.dedup_blocks; i++) max += dedup_dirty[i];
+    for (uint32_t i = 0; i < sb.dir_blocks; i++) max += dir[i] && dir[i]->dirty;
+    max += sb.keys_blocks;               // updated below
+    
+    uint32_t *blocks = malloc((max + 1) * sizeof(uint32_t));
+    char *images = malloc((size_t)(max + 1) * bsize);
+    if (!blocks || !images) {
+        free(blocks);
+        free(images);
+        return -1;
+    }
+    
+    // A changed FAT block gets its summary counted again
+    uint32_t count = 0;
+    uint32_t per_summary = bsize / sizeof(uint32_t);
+    for (uint32_t i = 0; i < sb.fat_blocks; i++) {
+        if (!fat_dirty[i]) continue;
+        uint32_t used = 0;
+        for (uint32_t j = 0; j < fat_per_block(); j++) used += fat_pages[i][j] != 0;
+        if (used != fat_used[i]) summary_dirty[i / per_summary] = 1;
+        fat_used[i] = used;
+        memcpy(images + (size_t)count * bsize, fat_pages[i], bsize);
+        blocks[count++] = sb.fat_start + i;
+        fat_dirty[i] = 0;
+        fat_info[i].logged = seq;
+    }
+    for (uint32_t i = 0; i < sb.summary_blocks; i++) {
+        if (!summary_dirty[i]) continue;
+        memcpy(images + (size_t)count * bsize, (char *)fat_used + (size_t)i * bsize, bsize);
+        blocks[count++] = sb.summary_start + i;
+        summary_dirty[i] = 0;
+    }
+    for (uint32_t i = 0; i < sb.dedup_blocks; i++) {
+        if (!dedup_dirty[i]) continue;
+        memcpy(images + (size_t)count * bsize, dedup_pages[i], bsize);
+        blocks[count++] = sb.dedup_start + i;
+        dedup_dirty[i] = 0;
+        dedup_info[i].logged = seq;
+    }
+    for (uint32_t i = 0; i < sb.dir_blocks; i++) {
+        if (!dir[i] || !dir[i]->dirty) continue;
+        char *image = images + (size_t)count * bsize;
+        memset(image, 0, bsize);
+        memcpy(image, dir[i]->entries, dir_per_block * sizeof(dir_entry_t));
+        blocks[count++] = sb.data_start + dir_block[i];
+        dir[i]->dirty = 0;
+        dir[i]->logged = seq;
+        keys_update(i);
+    }
+    for (uint32_t i = 0; i < sb.keys_blocks; i++) {
+        if (!key_dirty[i]) continue;
+        memcpy(images + (size_t)count * bsize, key_pages[i], bsize);
+        blocks[count++] = sb.data_start + key_block[i];
+        key_dirty[i] = 0;
+    }
+    if (sb_dirty) {
+        char *image = images + (size_t)count * bsize;
+        memset(image, 0, bsize);
+        memcpy(image, &sb, sizeof(superblock_t));
+        blocks[count++] = 0;
+        sb_dirty = 0;
+    }
+    
+    *blocks_out = blocks;
+    *images_out = images;
+    *count_out = count;
+    return 0;
+}
+
+// Logs a snapshot as one transaction, however big. Whatever does not make it
+// goes out with the next commit.
+static int log_snapshot(uint32_t *blocks, char *images, uint32_t count) {
+    char **data = malloc((count + 1) * sizeof(char *));
+    int result = data ? 0 : -1;
+    for (uint32_t i = 0; i < count && data; i++) {
+        data[i] = images + (size_t)i * sb.block_size;
+    }
+    if (result == 0) result = journal_commit(blocks, data, count);
+    free(data);
+    if (result == 0) return 0;
+    
+    pthread_rwlock_wrlock(&txn_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        if (blocks[i] >= sb.fat_start && blocks[i] < sb.fat_start + sb.fat_blocks) {
+            fat_dirty[blocks[i] - sb.fat_start] = 1;
+        }
+        if (blocks[i] >= sb.dedup_start && blocks[i] < sb.dedup_start + sb.dedup_blocks) {
+            dedup_dirty[blocks[i] - sb.dedup_start] = 1;
+        }
+        if (blocks[i] >= sb.summary_start && blocks[i] < sb.summary_start + sb.summary_blocks) {
+            summary_dirty[blocks[i] - sb.summary_start] = 1;
+        }
+    }
+    for (uint32_t i = 0; i < sb.dir_blocks; i++) {
+        if (dir[i]) dir[i]->dirty = 1;
+    }
+    memset(key_dirty, 1, sb.keys_blocks);
+    sb_dirty = 1;
+    pthread_rwlock_unlock(&txn_lock);
+    return -1;
+}
+
+// Takes a snapshot and logs it. Only one runs at a time.
+static int commit_metadata() {
+    uint32_t *blocks;
+    char *images;
+    uint32_t count;
+    
+    // What was freed before the snapshot can be handed out again once it is
+    // on disk. Taking the lists first means the FAT changes freeing them are
+    // in it.
+    pthread_rwlock_wrlock(&txn_lock);
+    pthread_mutex_lock(&tail_lock);
+    tail_block_t *slots = tails_freed;
+    uint32_t nslots = tails_freed_count;
+    tails_freed = NULL;
+    tails_freed_count = 0;
+    tails_freed_cap = 0;
+    pthread_mutex_unlock(&tail_lock);
+    pthread_mutex_lock(&alloc_lock);
+    uint32_t *freed = freed_blocks;
+    uint32_t nfreed = freed_count;
+    freed_blocks = NULL;
+    freed_count = 0;
+    freed_cap = 0;
+    pthread_mutex_unlock(&alloc_lock);
+    int result = snapshot_metadata(&blocks, &images, &count);
+    pthread_rwlock_unlock(&txn_lock);
+    if (result == 0) {
+        result = log_snapshot(blocks, images, count);
+        free(blocks);
+        free(images);
+    }
+    
+    // Otherwise they wait for the next commit
+    if (result == 0) {
+        tails_release(slots, nslots);
+    } else {
+        pthread_mutex_lock(&tail_lock);
+        for (uint32_t i = 0; i < nslots; i++) note_tail_freed(slots[i].block, slots[i].held);
+        pthread_mutex_unlock(&tail_lock);
+    }
+    pthread_mutex_lock(&alloc_lock);
+    for (uint32_t i = 0; i < nfreed; i++) {
+        if (result == 0) alloc_mark_free(freed[i]);
+        else note_freed(freed[i]);
+    }
+    if (result == 0) sb.free_blocks += nfreed;
+    pthread_mutex_unlock(&alloc_lock);
+    free(slots);
+    free(freed);
+    return result;
+}
+
+// Commits every metadata change made before the call to the journal. Their
+// home copies are written when the journal is checkpointed.
+static int flush_metadata() {
+    pthread_mutex_lock(&commit_lock);
+    
+    // A commit already running may have snapshotted before our changes, so
+    // wait for the one after it; whoever finds none running leads it
+    uint64_t need = commits_started + 1;
+    while (commits_finished < need) {
+        if (commit_running) {
+            pthread_cond_wait(&commit_cond, &commit_lock);
+            continue;
+        }
+        uint64_t gen = ++commits_started;
+        commit_running = 1;
+        pthread_mutex_unlock(&commit_lock);
+        
+        int result = commit_metadata();
+        
+        pthread_mutex_lock(&commit_lock);
+        commit_running = 0;
+        commits_finished = gen;
+        commit_result = result;
+        pthread_cond_broadcast(&commit_cond);
+    }
+    
+    int result = commit_result;
+    last_flush = time(NULL);
+    pthread_mutex_unlock(&commit_lock);
+    return result;
+}
+
+// Clock hand of trim_cache, over the FAT pages, then the dedup index pages,
+// then the directory blocks
+static uint32_t trim_hand = 0;
+static uint32_t trim_retry = 0;         // cache size worth another try
+static uint32_t trim_home = 0;          // journal_home_seq at the last one
+
+// Drops a FAT or dedup index page unless it changed since it was last
+// checkpointed or was used since the hand last passed. The caller holds
+// page_lock and dedup_lock, and txn_lock shared.
+static void drop_page(void **pages, page_info_t *info, uint8_t *dirty, uint32_t i, uint32_t home) {
+    void *page = pages[i];
+    if (!page || __atomic_load_n(&dirty[i], __ATOMIC_RELAXED) || info[i].logged >= home) return;
+    if (__atomic_exchange_n(&info[i].referenced, 0, __ATOMIC_RELAXED)) return;
+    
+    // FAT pages are read without a lock, so the page is unpublished before
+    // its pins are looked at: a reader pinning it after that finds it gone
+    // and waits on page_lock to read it in again
+    __atomic_store_n(&pages[i], NULL, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&info[i].pins, __ATOMIC_SEQ_CST) > 0 || __atomic_load_n(&dirty[i], __ATOMIC_RELAXED)) {
+        __atomic_store_n(&pages[i], page, __ATOMIC_SEQ_CST);
+        return;
+    }
+    free(page);
+    __atomic_sub_fetch(&meta_cached, 1, __ATOMIC_RELAXED);
+    STAT_INC(meta_drops);
+}
+
+// The same for directory block i, which also stays while a descriptor is
+// open on any of its files or async calls on one are in flight. The caller
+// also holds dir_lock exclusively and fd_lock.
+static void drop_dir(uint32_t i, uint32_t home) {
+    dir_chunk_t *chunk = dir[i];
+    if (!chunk || __atomic_load_n(&chunk->dirty, __ATOMIC_RELAXED) || chunk->logged >= home) return;
+    if (__atomic_exchange_n(&chunk->referenced, 0, __ATOMIC_RELAXED)) return;
+    for (uint32_t j = 0; j < dir_per_block; j++) {
+        if (__atomic_load_n(&chunk->extents[j].aio_pending, __ATOMIC_ACQUIRE) > 0) return;
+    }
+    for (int fd = 0; fd < MAX_FD; fd++) {
+        if (fd_table[fd].used && (uint32_t)fd_table[fd].dir_index / dir_per_block == i) return;
+    }
+    for (uint32_t j = i * dir_per_block; j < (i + 1) * dir_per_block; j++) extents_clear(j);
+    dir[i] = NULL;
+    chunk_free(chunk);
+    __atomic_sub_fetch(&meta_cached, 1, __ATOMIC_RELAXED);
+    STAT_INC(meta_drops);
+}
+
+// Brings the FAT, dedup index and directory blocks in memory back under
+// the limit set by fs_set_meta_cache, with a clock sweep. Blocks are only
+// dropped once the journal transaction that last logged them has been
+// checkpointed, as it is their home copies that get read back; so when
+// nothing more can go, it waits for the cache to grow or a checkpoint
+// before trying again. The caller holds no locks.
+static void trim_cache() {
+    uint32_t limit = meta_cache_limit;
+    uint32_t cached = __atomic_load_n(&meta_cached, __ATOMIC_RELAXED);
+    uint32_t home = journal_home_seq();
+    if (limit == 0 || cached <= limit) return;
+    if (cached < __atomic_load_n(&trim_retry, __ATOMIC_RELAXED) && home == __atomic_load_n(&trim_home, __ATOMIC_RELAXED)) return;
+    
+    pthread_rwlock_wrlock(&dir_lock);
+    pthread_rwlock_rdlock(&txn_lock);
+    pthread_mutex_lock(&dedup_lock);
+    pthread_mutex_lock(&fd_lock);
+    pthread_mutex_lock(&page_lock);
+    
+    // Down to seven eighths of the limit, so it does not run every call
+    uint32_t target = limit - limit / 8;
+    uint32_t total = sb.fat_blocks + sb.dedup_blocks + sb.dir_blocks;
+    for (uint32_t n = 0; n < 2 * total && meta_cached > target; n++) {
+        uint32_t i = trim_hand;
+        trim_hand = (trim_hand + 1) % total;
+        if (i < sb.fat_blocks) {
+            drop_page((void **)fat_pages, fat_info, fat_dirty, i, home);
+        } else if ((i -= sb.fat_blocks) < sb.dedup_blocks) {
+            drop_page((void **)dedup_pages, dedup_info, dedup_dirty, i, home);
+        } else {
+            drop_dir(i - sb.dedup_blocks, home);
+        }
+    }
+    __atomic_store_n(&trim_retry, meta_cached + limit / 8 + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&trim_home, home, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&page_lock);
+    pthread_mutex_unlock(&fd_lock);
+    pthread_mutex_unlock(&dedup_lock);
+    pthread_rwlock_unlock(&txn_lock);
+    pthread_rwlock_unlock(&dir_lock);
+}
+
+// Flushes metadata when the sync interval has run out
+static int flush_if_due() {
+    trim_cache();
+    pthread_mutex_lock(&commit_lock);
+    int due = sync_interval > 0 && time(NULL) - last_flush >= sync_interval;
+    pthread_mutex_unlock(&commit_lock);
+    return due ? flush_metadata() : 0;
+}
+
+// Called after a create or delete, which are written out straight away
+// unless the caller asked for deferred metadata
+static int metadata_changed() {
+    pthread_mutex_lock(&commit_lock);
+    int now = sync_interval == 0;
+    pthread_mutex_unlock(&commit_lock);
+    if (!now) return flush_if_due();
+    int result = flush_metadata();
+    trim_cache();
+    return result;
+}
+
+// Commits when there are blocks or tail slots waiting on a commit to be
+// reused, for a caller that ran out of space. Returns whether it did.
+static int reclaim_freed() {
+    pthread_mutex_lock(&tail_lock);
+    int waiting = tails_freed_count > 0;
+    pthread_mutex_unlock(&tail_lock);
+    pthread_mutex_lock(&alloc_lock);
+    waiting |= freed_count > 0;
+    pthread_mutex_unlock(&alloc_lock);
+    return waiting && flush_metadata() == 0;
+}
+
+static void free_dir() {
+    for (uint32_t i = 0; i < sb.dir_blocks && dir; i++) {
+        if (!dir[i]) continue;
+        for (uint32_t j = i * dir_per_block; j < (i + 1) * dir_per_block; j++) extents_clear(j);
+        chunk_free(dir[i]);
+    }
+    for (uint32_t i = 0; i < sb.keys_blocks && key_pages; i++) {
+        free(key_pages[i]);
+    }
+    free(dir);
+    free(dir_block);
+    free(key_pages);
+    free(key_block);
+    free(key_dirty);
+    free(name_index);
+    free(name_hashes);
+    free(free_slots);
+    dir = NULL;
+    dir_block = NULL;
+    key_pages = NULL;
+    key_block = NULL;
+    key_dirty = NULL;
+    dir_entries = 0;
+    name_index = NULL;
+    name_hashes = NULL;
+    name_index_size = 0;
+    name_index_used = 0;
+    name_index_live = 0;
+    free_slots = NULL;
+    free_slot_count = 0;
+    free_slot_cap = 0;
+    free_snapshots();
+}
+
+// Frees a directory entry and everything it holds. The caller holds
+// dir_lock exclusively and txn_lock shared.
+static int remove_entry(int dir_index) {
+    // Drop the references of a dedup file, then free all blocks in the FAT
+    // chain, and the tail slots
+    dir_entry_t *d = dent(dir_index);
+    if (d->flags & ENTRY_DEDUP) {
+        extent_map_t *m = get_map(dir_index);
+        if (!m) return -1;
+        for (uint32_t i = 0; i < m->map_len; i++) dedup_release(m->map[i]);
+    }
+    free_chain(d->first_block);
+    if (d->flags & ENTRY_TAIL) tail_release(d->tail_block, d->tail_slot, tail_slots(d->size % sb.block_size));
+    
+    // Mark directory entry as free
+    if (d->snapshot != SNAPSHOT_PENDING) index_remove(dir_index);
+    dent(dir_index)->used = 0;
+    extents_clear(dir_index);
+    push_free_slot(dir_index);
+    dir_dirty(dir_index);
+    return 0;
+}
+
+static void drop_pending() {
+    pthread_rwlock_rdlock(&txn_lock);
+    for (uint32_t i = 0; i < dir_entries; i++) {
+        if (dkey(i)->used && dkey(i)->snapshot == SNAPSHOT_PENDING && entry_load(i) == 0) remove_entry(i);
+    }
+    pthread_rwlock_unlock(&txn_lock);
+}
+
+// Follows a chain of count blocks from first, noting each in blocks
+static int walk_chain(uint32_t first, uint32_t count, uint32_t *blocks) {
+    uint32_t block = first;
+    for (uint32_t i = 0; i < count; i++) {
+        if (block >= sb.data_blocks) return -1;
+        blocks[i] = block;
+        block = fat_get(block);
+        STAT_INC(fat_hops);
+    }
+    return 0;
+}
+
+// Reads the key chain, a run of adjacent blocks per call
+static int read_keys() {
+    struct iovec iov[FAT_READ_BLOCKS];
+    for (uint32_t i = 0; i < sb.keys_blocks; ) {
+        uint32_t n = 0;
+        do {
+            if (!(key_pages[i + n] = malloc(sb.block_size))) return -1;
+            iov[n].iov_base = key_pages[i + n];
+            iov[n].iov_len = sb.block_size;
+            n++;
+        } while (i + n < sb.keys_blocks && n < FAT_READ_BLOCKS && key_block[i + n] == key_block[i] + n);
+        if (block_readv(sb.data_start + key_block[i], iov, n) == -1) return -1;
+        i += n;
+    }
+    return 0;
+}
+
+// Finds the blocks of the directory and reads in its keys, then builds the
+// name index, free-slot list and snapshot lists from them. Directory blocks
+// themselves are read as their entries are needed.
+static int read_dir() {
+    // Room for the largest possible directory, so growing it never moves
+    // the arrays under other threads
+    dir_per_block = sb.block_size / sizeof(dir_entry_t);
+    for (key_shift = 0; (2u << key_shift) * sizeof(dir_key_t) <= sb.block_size; key_shift++);
+    dir_per_key = (1u << key_shift) / dir_per_block;
+    max_dir_blocks = sb.data_blocks < MAX_DIR_BLOCKS ? sb.data_blocks : MAX_DIR_BLOCKS;
+    uint32_t max_keys = (max_dir_blocks + dir_per_key - 1) / dir_per_key;
+    if (sb.dir_blocks == 0 || sb.dir_blocks > max_dir_blocks || sb.keys_blocks > max_keys ||
+        (uint64_t)sb.keys_blocks * dir_per_key < sb.dir_blocks) {
+        return -1;
+    }
+    dir = calloc(max_dir_blocks, sizeof(dir_chunk_t *));
+    dir_block = malloc(max_dir_blocks * sizeof(uint32_t));
+    key_pages = calloc(max_keys, sizeof(dir_key_t *));
+    key_block = malloc(max_keys * sizeof(uint32_t));
+    key_dirty = calloc(max_keys, 1);
+    if (!dir || !dir_block || !key_pages || !key_block || !key_dirty) return -1;
+    
+    if (walk_chain(sb.dir_start, sb.dir_blocks, dir_block) == -1 ||
+        walk_chain(sb.keys_start, sb.keys_blocks, key_block) == -1 || read_keys() == -1) {
+        return -1;
+    }
+    dir_entries = sb.dir_blocks * dir_per_block;
+    return load_keys();
+}
+
+// Adds a block after last, the end of a chain, and returns it
+static uint32_t chain_append(uint32_t last) {
+    uint32_t got;
+    pthread_mutex_lock(&alloc_lock);
+    uint32_t block = alloc_blocks(last + 1, 1, &got);
+    if (block != (uint32_t)-1) sb.free_blocks--;
+    pthread_mutex_unlock(&alloc_lock);
+    if (block == (uint32_t)-1) return -1;
+    if (fat_set(block, (uint32_t)-1) == -1 || fat_set(last, block) == -1) {
+        fat_set(block, 0);
+        pthread_mutex_lock(&alloc_lock);
+        alloc_mark_free(block);
+        sb.free_blocks++;
+        pthread_mutex_unlock(&alloc_lock);
+        return -1;
+    }
+    return block;
+}
+
+// Adds a block to the end of the directory chain, and one to the key chain
+// first if the new block's keys need it. A key block left over when the
+// directory block cannot be had is used by the next try.
+static int grow_dir() {
+    if (sb.dir_blocks >= max_dir_blocks) return -1;
+    if (sb.keys_blocks * dir_per_key == sb.dir_blocks) {
+        dir_key_t *page = calloc(1, sb.block_size);
+        uint32_t block = page ? chain_append(key_block[sb.keys_blocks - 1]) : (uint32_t)-1;
+        if (block == (uint32_t)-1) {
+            free(page);
+            return -1;
+        }
+        key_pages[sb.keys_blocks] = page;
+        key_block[sb.keys_blocks] = block;
+        key_dirty[sb.keys_blocks++] = 1;
+    }
+    
+    dir_chunk_t *chunk = chunk_new();
+    uint32_t block = chunk ? chain_append(dir_block[sb.dir_blocks - 1]) : (uint32_t)-1;
+    if (block == (uint32_t)-1) {
+        chunk_free(chunk);
+        return -1;
+    }
+    chunk->dirty = 1;
+    
+    // Entries are numbered in chain order, so the new ones come last
+    uint32_t first = dir_entries;
+    dir_block[sb.dir_blocks] = block;
+    __atomic_store_n(&dir[sb.dir_blocks++], chunk, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&meta_cached, 1, __ATOMIC_RELAXED);
+    dir_entries += dir_per_block;
+    for (uint32_t i = dir_entries; i-- > first; ) {
+        if (push_free_slot(i) == -1) return -1;
+    }
+    return 0;
+}
+
+// Hands out the lowest unused entry, its block read in. The caller holds
+// dir_lock exclusively.
+static int find_free_dir_entry() {
+    if (free_slot_count == 0 && grow_dir() == -1) return -1;
+    if (entry_load(free_slots[free_slot_count - 1]) == -1) return -1;
+    return free_slots[--free_slot_count];
+}
+
+// Lays out a volume of nblocks blocks of bsize bytes: the superblock, the
+// FAT, the journal, then the data region, with the FAT just big enough to
+// map every data block
+static int plan_layout(uint32_t bsize, uint32_t nblocks, superblock_t *layout) {
+    if (bsize < MIN_BLOCK_SIZE || bsize > MAX_BLOCK_SIZE || (bsize & (bsize - 1))) return -1;
+    if (nblocks > INT_MAX || nblocks < 1 + JOURNAL_BLOCKS + 6) return -1;
+    
+    // The dedup index gets a slot per DEDUP_SPAN blocks. Each FAT block maps
+    // per_block data blocks and takes one from them. The summaries hold a
+    // count per FAT block.
+    uint32_t per_block = bsize / sizeof(uint32_t);
+    uint32_t rest = nblocks - 1 - JOURNAL_BLOCKS;
+    uint64_t slots_per_block = (uint64_t)DEDUP_SPAN * (bsize / sizeof(dedup_slot_t));
+    uint32_t dedup_blocks = (uint32_t)((rest + slots_per_block - 1) / slots_per_block);
+    rest -= dedup_blocks;
+    uint32_t fat_blocks = (uint32_t)(((uint64_t)rest + per_block) / (per_block + 1));
+    uint32_t summary_blocks = (fat_blocks + per_block - 1) / per_block;
+    
+    memset(layout, 0, sizeof(superblock_t));
+    layout->block_size = bsize;
+    layout->num_blocks = nblocks;
+    layout->fat_start = 1;
+    layout->fat_blocks = fat_blocks;
+    layout->dedup_start = layout->fat_start + fat_blocks;
+    layout->dedup_blocks = dedup_blocks;
+    layout->summary_start = layout->dedup_start + dedup_blocks;
+    layout->summary_blocks = summary_blocks;
+    layout->journal_start = layout->summary_start + summary_blocks;
+    layout->journal_blocks = JOURNAL_BLOCKS;
+    layout->data_start = layout->journal_start + JOURNAL_BLOCKS;
+    layout->data_blocks = nblocks - layout->data_start;
+    return 0;
+}
+
+// Reads up to nbyte bytes from offset. The caller holds the file lock.
+static int read_at(int dir_index, file_desc_t *cursor, void *buf, size_t nbyte, uint64_t offset) {
+    dir_entry_t *d = dent(dir_index);
+    uint64_t size = d->size;
     
     if (offset >= size) return 0;
+    if (nbyte > INT_MAX) nbyte = INT_MAX;
+    
+    // Calculate how many bytes we can actually read
+    size_t remaining = size - offset;
+    size_t to_read = nbyte < remaining ? nbyte : remaining;
+    size_t read = 0;
+    
+    // Small files come straight from the directory entry
+    if (d->flags & ENTRY_INLINE) {
+        memcpy(buf, d->inline_data + offset, to_read);
+        STAT_ADD(bytes_read, to_read);
+        return to_read;
+    }
+    if (d->flags & ENTRY_INDEXED) {
+        int result = read_indexed(dir_index, buf, to_read, offset);
+        if (result > 0) STAT_ADD(bytes_read, result);
+        return result;
+    }
+    uint64_t chain_end = chain_bytes(d);
+    size_t from_chain = offset >= chain_end ? 0 : chain_end - offset < to_read ? chain_end - offset : to_read;
+    
+    // Find starting block and offset within block
+    uint32_t lblock = offset / sb.block_size;
+    uint32_t byte_in_block = offset % sb.block_size;
+    
+    // Read data one contiguous run at a time
+    while (read < from_chain) {
+        size_t len = from_chain - read;
+        uint32_t block;
+        uint32_t run = map_run(dir_index, cursor, lblock, (byte_in_block + len + sb.block_size - 1) / sb.block_size, &block);
+        if (run == 0) break;
+        if (len > (size_t)run * sb.block_size - byte_in_block) {
+            len = (size_t)run * sb.block_size - byte_in_block;
+        }
+        
+        if (transfer_run(block, run, byte_in_block, (char*)buf + read, len, 0) == -1) {
+            if (read == 0) return -1;
+            break;
+        }
+        
+        read += len;
+        byte_in_block = 0;
+        lblock += run;
+    }
+    
+    // Then whatever part of the packed tail was asked for
+    if (read == from_chain && read < to_read) {
+        if (read_tail(d, offset + read - chain_end, (char*)buf + read, to_read - read) == 0) read = to_read;
+        else if (read == 0) return -1;
+    }
+    
+    STAT_ADD(bytes_read, read);
+    return read;
+}
+
+// Writes nbyte bytes at offset, growing the file as needed. The caller holds
+// the file lock exclusively.
+static int write_once(int dir_index, file_desc_t *cursor, void *buf, size_t nbyte, uint64_t offset) {
+    dir_entry_t *d = dent(dir_index);
+    if (nbyte > INT_MAX) nbyte = INT_MAX;
+    if (offset + nbyte > max_file_size()) {
+        nbyte = max_file_size() - offset;
+    }
+    
+    unshare_file(dir_index);
+    if (d->flags & ENTRY_INDEXED) {
+        int result = write_indexed(dir_index, buf, nbyte, offset);
+        if (result > 0) STAT_ADD(bytes_written, result);
+        return result;
+    }
+    
+    // Small files that stay small are written into the directory entry
+    pthread_rwlock_rdlock(&txn_lock);
+    int inline_ok = d->flags == ENTRY_INLINE || (d->flags == 0 && d->size == 0 && d->first_block == (uint32_t)-1);
+    if (inline_ok && offset + nbyte <= INLINE_MAX) {
+        memcpy(d->inline_data + offset, buf, nbyte);
+        if (offset + nbyte > d->size) d->size = offset + nbyte;
+        d->flags = ENTRY_INLINE;
+        d->modified = time(NULL);
+        dir_dirty(dir_index);
+        pthread_rwlock_unlock(&txn_lock);
+        STAT_ADD(bytes_written, nbyte);
+        return nbyte;
+    }
+    
+    // Otherwise allocate the whole chain up front so the data can move in
+    // runs
+    if (unpack_file(dir_index) == -1) {
+        pthread_rwlock_unlock(&txn_lock);
+        return -1;
+    }
+    uint32_t blocks = extend_chain(dir_index, (offset + nbyte + sb.block_size - 1) / sb.block_size);
+    pthread_rwlock_unlock(&txn_lock);
+    if ((uint64_t)blocks * sb.block_size < offset + nbyte) {
+        if ((uint64_t)blocks * sb.block_size <= offset && nbyte > 0) return -1; // Disk full
+        nbyte = (uint64_t)blocks * sb.block_size - offset;
+    }
+    
+    size_t written = 0;
+    
+    // Find starting block and offset within block
+    uint32_t lblock = offset / sb.block_size;
+    uint32_t byte_in_block = offset % sb.block_size;
+    
+    // Write data one contiguous run at a time
+    while (written < nbyte) {
+        size_t len = nbyte - written;
+        uint32_t block;
+        uint32_t run = map_run(dir_index, cursor, lblock, (byte_in_block + len + sb.block_size - 1) / sb.block_size, &block);
+        if (run == 0) break;
+        if (len > (size_t)run * sb.block_size - byte_in_block) {
+            len = (size_t)run * sb.block_size - byte_in_block;
+        }
+        
+        if (transfer_run(block, run, byte_in_block, (char*)buf + written, len, 1) == -1) {
+            break;
+        }
+        
+        written += len;
+        byte_in_block = 0;
+        lblock += run;
+    }
+    
+    pthread_rwlock_rdlock(&txn_lock);
+    if (offset + written > dent(dir_index)->size) {
+        dent(dir_index)->size = offset + written;
+    }
+    dent(dir_index)->modified = time(NULL);
+    dir_dirty(dir_index);
+    pthread_rwlock_unlock(&txn_lock);
+    STAT_ADD(bytes_written, written);
+    return written;
+}
+
+// Like write_once, but when the disk fills up commits to get back what was
+// freed since the last commit and carries on
+static int write_at(int dir_index, file_desc_t *cursor, void *buf, size_t nbyte, uint64_t offset) {
+    if (nbyte > INT_MAX) nbyte = INT_MAX;
+    int written = write_once(dir_index, cursor, buf, nbyte, offset);
+    size_t done = written > 0 ? written : 0;
+    if (done < nbyte && offset + done < max_file_size() && reclaim_freed()) {
+        int more = write_once(dir_index, cursor, (char *)buf + done, nbyte - done, offset + done);
+        if (more > 0) written = done + more;
+    }
+    return written;
+}
+
+// Readahead. fs_read tracks each descriptor's offsets, and once it has seen
+// RA_TRIGGER sequential reads in a row, background threads read the next
+// window of the file into a buffer of the descriptor's. The window starts at
+// RA_MIN_WINDOW and doubles each time one is queued while the pattern holds;
+// a jump halves it.
+#define RA_THREADS 2
+#define RA_TRIGGER 2
+#define RA_MIN_WINDOW 65536
+
+typedef struct {
+    pthread_mutex_t lock;   // buf, start, len, gen
+    char *buf;              // window ready for fs_read
+    uint64_t start;         // file offset of buf[0]
+    uint32_t len;
+    uint32_t gen;           // file generation buf was read at
+    char *fill;             // the next window is read into this
+    uint64_t want;          // the next window, under ra_lock
+    uint32_t want_len;
+    uint8_t queued;
+    uint8_t busy;
+} readahead_t;
+
+static readahead_t ra[MAX_FD];
+static uint32_t ra_max = 1 << 20;       // see fs_set_readahead
+static uint32_t ra_size = 0;            // buffer size for this mount
+static pthread_t ra_threads[RA_THREADS];
+static int ra_nthreads = 0;
+static int ra_running = 0;
+static int ra_next = 0;                 // where threads look for work first
+static pthread_once_t ra_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;  // window queued, or stopping
+static pthread_cond_t ra_idle = PTHREAD_COND_INITIALIZER;  // window done
+
+static void ra_locks_init() {
+    for (int i = 0; i < MAX_FD; i++) {
+        pthread_mutex_init(&ra[i].lock, NULL);
+    }
+}
+
+// Stops the threads and drops every buffer, at unmount
+static void ra_stop() {
+    pthread_mutex_lock(&ra_lock);
+    ra_running = 0;
+    pthread_cond_broadcast(&ra_cond);
+    pthread_mutex_unlock(&ra_lock);
+    for (int i = 0; i < ra_nthreads; i++) {
+        pthread_join(ra_threads[i], NULL);
+    }
+    ra_nthreads = 0;
+    
+    for (int i = 0; i < MAX_FD; i++) {
+        free(ra[i].buf);
+        free(ra[i].fill);
+        ra[i].buf = NULL;
+        ra[i].fill = NULL;
+        ra[i].len = 0;
+        ra[i].queued = 0;
+        ra[i].busy = 0;
+    }
+}
+
+// Waits out a window being read for a descriptor and forgets its buffer
+static void ra_reset(int fildes) {
+    pthread_mutex_lock(&ra_lock);
+    ra[fildes].queued = 0;
+    while (ra[fildes].busy) pthread_cond_wait(&ra_idle, &ra_lock);
+    pthread_mutex_unlock(&ra_lock);
+    
+    pthread_mutex_lock(&ra[fildes].lock);
+    ra[fildes].len = 0;
+    pthread_mutex_unlock(&ra[fildes].lock);
+}
+
+// Write coalescing. fs_write calls that carry on where the descriptor's
+// last one ended collect in a buffer of its own and reach the file a block
+// at a time, so a stream of small appends is not a read-modify-write each.
+// Buffered bytes are not part of the file yet, its size included: any other
+// use of the file writes them out first, as do fs_close and fs_sync, and so
+// does fs_write once they are WB_AGE seconds old.
+#define WB_AGE 1
+
+typedef struct {
+    char *buf;
+    uint64_t start;         // file offset of buf[0]
+    uint32_t len;
+    time_t since;           // when buf started filling
+    uint8_t failed;         // writing buf out for someone else failed
+} write_buf_t;
+
+static write_buf_t wb[MAX_FD];
+static uint32_t wb_max = 65536;         // see fs_set_write_buffer
+static uint32_t wb_size = 0;            // buffer size for this mount
+
+// Writes out the whole blocks a descriptor has buffered, or everything when
+// all is set. The caller holds the file lock exclusively. Buffered data that
+// cannot be written is dropped.
+static int wb_flush(int fildes, int all) {
+    write_buf_t *w = &wb[fildes];
+    int dir_index = fd_table[fildes].dir_index;
+    uint64_t end = all ? w->start + w->len : (w->start + w->len) / sb.block_size * sb.block_size;
+    if (end <= w->start) return 0;
+    
+    uint32_t n = end - w->start;
+    dext(dir_index)->gen++;
+    int written = write_at(dir_index, &fd_table[fildes], w->buf, n, w->start);
+    if (written != (int)n) {
+        w->len = 0;
+        dext(dir_index)->wb_pending--;
+        return -1;
+    }
+    
+    memmove(w->buf, w->buf + n, w->len - n);
+    w->start += n;
+    w->len -= n;
+    w->since = time(NULL);
+    if (w->len == 0) dext(dir_index)->wb_pending--;
+    return 0;
+}
+
+// Writes out what other descriptors have buffered for a file, all of them
+// if except is -1. The caller holds the file lock exclusively, so none of
+// the file's descriptors can close meanwhile. Failures are left for each
+// descriptor's next fs_write or fs_close to report.
+static void wb_flush_file(int dir_index, int except) {
+    if (dext(dir_index)->wb_pending <= (uint32_t)(except != -1 && wb[except].len > 0)) return;
+    
+    int open[MAX_FD];
+    int count = 0;
+    pthread_mutex_lock(&fd_lock);
+    for (int i = 0; i < MAX_FD; i++) {
+        if (i != except && fd_table[i].used && fd_table[i].dir_index == dir_index) open[count++] = i;
+    }
+    pthread_mutex_unlock(&fd_lock);
+    
+    for (int i = 0; i < count; i++) {
+        if (wb[open[i]].len > 0 && wb_flush(open[i], 1) == -1) wb[open[i]].failed = 1;
+    }
+}
+
+// Writes out every descriptor's buffer, for fs_sync and umount_fs
+static int wb_flush_all() {
+    int result = 0;
+    for (int i = 0; i < MAX_FD; i++) {
+        pthread_mutex_lock(&fd_lock);
+        int dir_index = fd_table[i].used ? fd_table[i].dir_index : -1;
+        pthread_mutex_unlock(&fd_lock);
+        if (dir_index == -1) continue;
+        
+        // fs_close needs the file lock, so the descriptor stays on the file
+        pthread_rwlock_wrlock(file_lock(dir_index));
+        pthread_mutex_lock(&fd_lock);
+        int same = fd_table[i].used && fd_table[i].dir_index == dir_index;
+        pthread_mutex_unlock(&fd_lock);
+        if (same && wb[i].len > 0 && wb_flush(i, 1) == -1) {
+            wb[i].failed = 1;
+            result = -1;
+        }
+        pthread_rwlock_unlock(file_lock(dir_index));
+    }
+    return result;
+}
+
+// fs_write at the descriptor's offset. Writes that continue the buffer go
+// into it; anything else writes the buffer out first, and writes of a whole
+// buffer or more go straight to the file. The caller holds the file lock
+// exclusively.
+static int wb_write(int fildes, const char *buf, size_t nbyte) {
+    write_buf_t *w = &wb[fildes];
+    int dir_index = fd_table[fildes].dir_index;
+    uint64_t offset = fd_table[fildes].offset;
+    if (w->failed) {
+        w->failed = 0;
+        return -1;
+    }
+    wb_flush_file(dir_index, fildes);
+    
+    if (nbyte > INT_MAX) nbyte = INT_MAX;
+    if (offset + nbyte > max_file_size()) {
+        nbyte = max_file_size() - offset;
+    }
+    if (w->len > 0 && (offset != w->start + w->len || nbyte >= wb_size || time(NULL) - w->since >= WB_AGE)) {
+        if (wb_flush(fildes, 1) == -1) return -1;
+    }
+    if (nbyte >= wb_size || (!w->buf && !(w->buf = malloc(wb_size)))) {
+        dext(dir_index)->gen++;
+        return write_at(dir_index, &fd_table[fildes], (char *)buf, nbyte, offset);
+    }
+    
+    size_t done = 0;
+    while (done < nbyte) {
+        if (w->len == 0) {
+            w->start = offset + done;
+            w->since = time(NULL);
+            dext(dir_index)->wb_pending++;
+        }
+        size_t n = wb_size - w->len < nbyte - done ? wb_size - w->len : nbyte - done;
+        memcpy(w->buf + w->len, buf + done, n);
+        w->len += n;
+        done += n;
+        if (w->len == wb_size && wb_flush(fildes, 0) == -1) return -1;
+    }
+    STAT_INC(coalesced_writes);
+    return nbyte;
+}
+
+// File system management
+static int do_make(char *disk_name) {
+    if (disk_fd != -1) return -1; // Mounted
+    if (plan_layout(new_block_size, new_num_blocks, &sb) == -1) return -1;
+    if (disk_set_geometry(sb.block_size, sb.num_blocks, stripe_blocks) == -1) return -1;
+    if (make_disk(disk_name) == -1) return -1;
+    if (open_disk(disk_name) == -1) return -1;
+    
+    // Fill in the superblock. The directory and its keys live in the data
+    // region as chains, starting with the first blocks after the reserved
+    // one.
+    sb.magic = MAGIC_NUMBER;
+    sb.version = FS_VERSION;
+    sb.dir_start = RESERVED_BLOCK + 1;
+    sb.dir_blocks = 1;
+    sb.keys_start = sb.dir_start + 1;
+    sb.keys_blocks = 1;
+    sb.free_blocks = sb.data_blocks - 3;
+    sb.created = time(NULL);
+    sb.last_mounted = sb.created;
+    sb.stripe_images = disk_image_count();
+    sb.stripe_blocks = stripe_blocks;
+    
+    // The image starts out zeroed: every FAT entry free and every directory
+    // entry and key unused. Only the first FAT block, which holds the
+    // reserved block and both chains, and the first summary block need
+    // writing.
+    uint32_t *first = calloc(1, sb.block_size);
+    uint32_t *summary = calloc(1, sb.block_size);
+    if (!first || !summary) {
+        free(first);
+        free(summary);
+        close_disk();
+        return -1;
+    }
+    first[RESERVED_BLOCK] = (uint32_t)-1;
+    first[sb.dir_start] = (uint32_t)-1;
+    first[sb.keys_start] = (uint32_t)-1;
+    summary[0] = 3;
+    
+    int result = 0;
+    if (write_superblock() == -1 || block_write(sb.fat_start, first) == -1 ||
+        block_write(sb.summary_start, summary) == -1 ||
+        journal_format(sb.journal_start, sb.journal_blocks) == -1) {
+        result = -1;
+    }
+    
+    free(first);
+    free(summary);
+    if (close_disk() == -1) result = -1;
+    return result;
+}
+
+static int do_mount(char *disk_name, int backend) {
+    if (disk_fd != -1) return -1; // Already mounted
+    
+    if (open_disk_backend(disk_name, backend) == -1) return -1;
+    disk_fd = 1; // Mark as mounted
+    
+    // The superblock sits at the start of the first image whatever the
+    // geometry, so read it with the smallest block size there is
+    if (disk_set_geometry(MIN_BLOCK_SIZE, 1, 1) == -1 || read_superblock() == -1) {
+        close_disk();
+        disk_fd = -1;
+        return -1;
+    }
+    
+    // Verify magic number and layout version, then switch the disk to the
+    // geometry the volume was made with
+    superblock_t layout;
+    if (sb.magic != MAGIC_NUMBER || sb.version != FS_VERSION ||
+        sb.stripe_images != (uint32_t)disk_image_count() ||
+        plan_layout(sb.block_size, sb.num_blocks, &layout) == -1 || layout.data_start != sb.data_start ||
+        layout.data_blocks != sb.data_blocks || layout.fat_blocks != sb.fat_blocks ||
+        layout.dedup_start != sb.dedup_start || layout.dedup_blocks != sb.dedup_blocks ||
+        layout.summary_start != sb.summary_start || layout.summary_blocks != sb.summary_blocks ||
+        disk_set_geometry(sb.block_size, sb.num_blocks, sb.stripe_blocks) == -1) {
+        close_disk();
+        disk_fd = -1;
+        return -1;
+    }
+    
+    // Bring home anything committed before the last crash
+    int replayed = journal_open(sb.journal_start, sb.journal_blocks);
+    if (replayed == -1 || (replayed > 0 && read_superblock() == -1)) {
+        journal_close();
+        close_disk();
+        disk_fd = -1;
+        return -1;
+    }
+    
+    // FAT, dedup index and directory blocks are read in as they are used;
+    // only the summaries and the directory's keys are read now
+    fat_pages = calloc(sb.fat_blocks, sizeof(uint32_t *));
+    fat_info = calloc(sb.fat_blocks, sizeof(page_info_t));
+    fat_dirty = calloc(sb.fat_blocks, 1);
+    dedup_pages = calloc(sb.dedup_blocks, sizeof(dedup_slot_t *));
+    dedup_info = calloc(sb.dedup_blocks, sizeof(page_info_t));
+    dedup_dirty = calloc(sb.dedup_blocks, 1);
+    fat_used = malloc((size_t)sb.summary_blocks * sb.block_size);
+    summary_dirty = calloc(sb.summary_blocks, 1);
+    dedup_slots = (size_t)sb.dedup_blocks * sb.block_size / sizeof(dedup_slot_t);
+    meta_cached = 0;
+    meta_cache_limit = meta_cache_max;
+    trim_hand = 0;
+    trim_retry = 0;
+    
+    if (!fat_pages || !fat_info || !fat_dirty || !dedup_pages || !dedup_info || !dedup_dirty || !fat_used || !summary_dirty) {
+        free_tables();
+        journal_close();
+        close_disk();
+        disk_fd = -1;
+        return -1;
+    }
+    
+    // Read the summaries and the keys, then set up the free space
+    if (read_region(sb.summary_start, sb.summary_blocks, fat_used) == -1 ||
+        read_dir() == -1 || load_tails() == -1 || load_free_map() == -1) {
+        free_dir();
+        free_tails();
+        alloc_destroy();
+        free_tables();
+        journal_close();
+        close_disk();
+        disk_fd = -1;
+        return -1;
+    }
+    journal_set_spill(spill_alloc, spill_release);
+    drop_pending();
+    
+    // Initialize file descriptor table; readahead starts with the first
+    // sequential reader. Write buffers hold whole blocks.
+    memset(fd_table, 0, sizeof(fd_table));
+    pthread_once(&ra_once, ra_locks_init);
+    ra_size = ra_max;
+    wb_size = wb_max == 0 ? 0 : wb_max < sb.block_size ? sb.block_size : wb_max / sb.block_size * sb.block_size;
+    
+    // Update last mounted time
+    sb.last_mounted = time(NULL);
+    sb_dirty = 0;
+    last_flush = sb.last_mounted;
+    write_superblock();
+    
+    return 0;
+}
+
+static int do_umount() {
+    if (disk_fd == -1) return -1; // Not mounted
+    
+    // Let outstanding async I/O finish and report back
+    while (disk_aio_inflight() > 0) {
+        if (disk_aio_reap(1) <= 0) break;
+    }
+    
+    // Write out buffered data and close all open file descriptors
+    int result = wb_flush_all();
+    ra_stop();
+    for (int i = 0; i < MAX_FD; i++) {
+        if (fd_table[i].used) {
+            fd_table[i].used = 0;
+        }
+        free(wb[i].buf);
+        memset(&wb[i], 0, sizeof(write_buf_t));
+    }
+    
+    // Commit what is left, then move it all home so the journal is empty
+    if (flush_metadata() == -1 || journal_checkpoint() == -1) {
+        result = -1;
+    }
+    journal_close();
+    
+    free_dir();
+    free_tails();
+    alloc_destroy();
+    free_tables();
+    
+    if (result == -1) {
+        close_disk();
+        disk_fd = -1;
+        return -1;
+    }
+    
+    if (close_disk() == -1) {
+        disk_fd = -1;
+        return -1;
+    }
+    
+    disk_fd = -1;
+    return 0;
+}
+
+static int do_sync() {
+    if (disk_fd == -1) return -1;
+    
+    // Push buffered writes and changed metadata into the block cache, then
+    // flush it all
+    int result = wb_flush_all();
+    if (flush_metadata() == -1 || disk_sync() == -1) return -1;
+    return result;
+}
+
+int fs_set_stripe_blocks(uint32_t blocks) {
+    if (blocks == 0 || blocks > INT_MAX) return -1;
+    stripe_blocks = blocks;
+    return 0;
+}
+
+int fs_set_geometry(uint32_t block_size, uint32_t num_blocks) {
+    superblock_t layout;
+    if (plan_layout(block_size, num_blocks, &layout) == -1) return -1;
+    new_block_size = block_size;
+    new_num_blocks = num_blocks;
+    return 0;
+}
+
+int fs_set_readahead(uint32_t max_bytes) {
+    ra_max = max_bytes;
+    return 0;
+}
+
+int fs_set_write_buffer(uint32_t max_bytes) {
+    wb_max = max_bytes;
+    return 0;
+}
+
+int fs_set_meta_cache(uint32_t blocks) {
+    meta_cache_max = blocks;
+    return 0;
+}
+
+int fs_set_sync_interval(int seconds) {
+    if (seconds < -1) return -1;
+    sync_interval = seconds;
+    if (disk_fd != -1) return flush_if_due();
+    return 0;
+}
+
+// File operations
+// Adds a directory entry and returns its number. Entries of a snapshot stay
+// out of the name index. The caller holds dir_lock exclusively.
+static int create_entry(const char *name, uint8_t snapshot) {
+    if (!snapshot && find_file(name) != -1) return -1;
+    
+    int dir_index = find_free_dir_entry();
+    if (dir_index == -1) return -1;
+    
+    // Initialize directory entry
+    strncpy(dent(dir_index)->name, name, MAX_FILE_NAME);
+    dent(dir_index)->name[MAX_FILE_NAME] = '\0';
+    dent(dir_index)->size = 0;
+    dent(dir_index)->first_block = (uint32_t)-1;
+    dent(dir_index)->flags = 0;
+    dent(dir_index)->snapshot = snapshot;
+    dent(dir_index)->created = time(NULL);
+    dent(dir_index)->modified = dent(dir_index)->created;
+    
+    if (!snapshot && index_insert(dir_index) == -1) {
+        push_free_slot(dir_index);
+        return -1;
+    }
+    dent(dir_index)->used = 1;
+    dir_dirty(dir_index);
+    return dir_index;
+}
+
+static int file_is_open(int dir_index) {
+    pthread_mutex_lock(&fd_lock);
+    int open = 0;
+    for (int i = 0; i < MAX_FD && !open; i++) {
+        open = fd_table[i].used && fd_table[i].dir_index == dir_index;
+    }
+    pthread_mutex_unlock(&fd_lock);
+    return open;
+}
+
+// Removes a file by name unless it is open; the caller holds dir_lock
+// exclusively
+static int delete_entry(const char *name) {
+    int dir_index = find_file(name);
+    if (dir_index == -1 || file_is_open(dir_index)) return -1;
+    return remove_entry(dir_index);
+}
+
+static int do_create(char *name) {
+    if (disk_fd == -1) return -1;
+    if (strlen(name) > MAX_FILE_NAME) return -1;
+    
+    pthread_rwlock_wrlock(&dir_lock);
+    pthread_rwlock_rdlock(&txn_lock);
+    int result = create_entry(name, 0);
+    pthread_rwlock_unlock(&txn_lock);
+    pthread_rwlock_unlock(&dir_lock);
+    
+    if (result == -1) return -1;
+    return metadata_changed();
+}
+
+static int do_delete(char *name) {
+    if (disk_fd == -1) return -1;
+    
+    pthread_rwlock_wrlock(&dir_lock);
+    pthread_rwlock_rdlock(&txn_lock);
+    int result = delete_entry(name);
+    pthread_rwlock_unlock(&txn_lock);
+    pthread_rwlock_unlock(&dir_lock);
+    
+    if (result == -1) return -1;
+    return metadata_changed();
+}
+
+// Creates or deletes a batch of files with one commit for all of them
+static int change_many(char **names, int count, int create) {
+    if (disk_fd == -1) return -1;
+    if (count < 0 || (count > 0 && !names)) return -1;
+    
+    pthread_rwlock_wrlock(&dir_lock);
+    pthread_rwlock_rdlock(&txn_lock);
+    int done = 0;
+    for (int i = 0; i < count; i++) {
+        if (!names[i] || strlen(names[i]) > MAX_FILE_NAME) continue;
+        if ((create ? create_entry(names[i], 0) : delete_entry(names[i])) != -1) done++;
+    }
+    pthread_rwlock_unlock(&txn_lock);
+    pthread_rwlock_unlock(&dir_lock);
+    
+    if (done > 0 && metadata_changed() == -1) return -1;
+    return done;
+}
+
+// Takes a descriptor for an entry; the caller holds dir_lock
+static int open_entry(int dir_index, uint8_t read_only) {
+    pthread_mutex_lock(&fd_lock);
+    int fd = find_free_fd();
+    if (fd != -1) {
+        fd_table[fd].dir_index = dir_index;
+        fd_table[fd].offset = 0;
+        fd_table[fd].extent = 0;
+        fd_table[fd].ra_expect = 0;
+        fd_table[fd].ra_seq = 0;
+        fd_table[fd].ra_window = 0;
+        fd_table[fd].read_only = read_only;
+        fd_table[fd].used = 1;
+        wb[fd].len = 0;
+        wb[fd].failed = 0;
+    }
+    pthread_mutex_unlock(&fd_lock);
+    return fd;
+}
+
+static int do_open(char *name) {
+    if (disk_fd == -1) return -1;
+    
+    pthread_rwlock_rdlock(&dir_lock);
+    int dir_index = find_file(name);
+    int fd = dir_index == -1 ? -1 : open_entry(dir_index, 0);
+    pthread_rwlock_unlock(&dir_lock);
+    trim_cache();
+    return fd;
+}
+
+static int do_close(int fildes) {
+    if (disk_fd == -1) return -1;
+    if (!valid_fd(fildes)) return -1;
+    ra_reset(fildes);
+    int dir_index = fd_table[fildes].dir_index;
+    
+    // dir_lock keeps the file from being deleted until it is packed. Buffered
+    // writes go out first; if that fails the descriptor still closes, but
+    // the call reports it.
+    pthread_rwlock_rdlock(&dir_lock);
+    pthread_rwlock_wrlock(file_lock(dir_index));
+    int failed = wb[fildes].failed || (wb[fildes].len > 0 && wb_flush(fildes, 1) == -1);
+    wb[fildes].failed = 0;
+    
+    pthread_mutex_lock(&fd_lock);
+    int ok = valid_fd(fildes);
+    int last = ok;
+    if (ok) fd_table[fildes].used = 0;
+    for (int i = 0; i < MAX_FD && last; i++) {
+        if (fd_table[i].used && fd_table[i].dir_index == dir_index) last = 0;
+    }
+    pthread_mutex_unlock(&fd_lock);
+    
+    // Small files and tails are packed once nobody has the file open. If
+    // that fails the file just stays as it is.
+    if (last) {
+        pthread_rwlock_rdlock(&txn_lock);
+        pack_file(dir_index);
+        pthread_rwlock_unlock(&txn_lock);
+    }
+    pthread_rwlock_unlock(file_lock(dir_index));
+    pthread_rwlock_unlock(&dir_lock);
+    return ok && !failed ? 0 : -1;
+}
+
+// Takes a file's lock shared, with its extent map (and chunk index or block
+// map, if it has one) already built so readers never have to change them,
+// nothing buffered for it by any descriptor, and a clone that no longer
+// shares anything made plain again
+static int lock_file_shared(int dir_index) {
+    pthread_rwlock_t *lock = file_lock(dir_index);
+    pthread_rwlock_rdlock(lock);
+    while (!dext(dir_index)->valid || (dent(dir_index)->flags & ENTRY_INDEXED && !dext(dir_index)->index_valid) ||
+           dext(dir_index)->wb_pending > 0 || (dent(dir_index)->flags & ENTRY_CLONED &&
+           dext(dir_index)->unshare_gen != __atomic_load_n(&shared_drops, __ATOMIC_RELAXED))) {
+        pthread_rwlock_unlock(lock);
+        pthread_rwlock_wrlock(lock);
+        wb_flush_file(dir_index, -1);
+        unshare_file(dir_index);
+        extent_map_t *m = get_index(dir_index);
+        pthread_rwlock_unlock(lock);
+        if (!m) return -1;
+        pthread_rwlock_rdlock(lock);
+    }
+    return 0;
+}
+
+// Reads a queued window: whatever the current buffer already holds of it is
+// kept, the rest comes from the file, and the result replaces the buffer
+static void ra_fill(int dir_index, readahead_t *r, uint64_t want, uint32_t len) {
+    uint32_t have = 0;
+    pthread_mutex_lock(&r->lock);
+    uint32_t had_gen = r->gen;
+    if (r->len > 0 && want >= r->start && want < r->start + r->len) {
+        have = r->start + r->len - want < len ? r->start + r->len - want : len;
+        memcpy(r->fill, r->buf + (want - r->start), have);
+    }
+    pthread_mutex_unlock(&r->lock);
+    
+    file_desc_t cursor = { .extent = 0 };
+    if (lock_file_shared(dir_index) == -1) return;
+    uint32_t gen = dext(dir_index)->gen;
+    if (had_gen != gen) have = 0;
+    int read = have < len ? read_at(dir_index, &cursor, r->fill + have, len - have, want + have) : 0;
+    pthread_rwlock_unlock(file_lock(dir_index));
+    if (read == -1 || have + read == 0) return;
+    
+    // Counted as read when fs_read takes them, not now
+    STAT_ADD(bytes_read, -(uint64_t)read);
+    STAT_ADD(ra_bytes, read);
+    
+    pthread_mutex_lock(&r->lock);
+    char *buf = r->buf;
+    r->buf = r->fill;
+    r->fill = buf;
+    r->start = want;
+    r->len = have + read;
+    r->gen = gen;
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Reads queued windows until unmount
+static void *ra_main(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&ra_lock);
+    while (ra_running) {
+        int i = 0;
+        while (i < MAX_FD && !ra[(ra_next + i) % MAX_FD].queued) i++;
+        if (i == MAX_FD) {
+            pthread_cond_wait(&ra_cond, &ra_lock);
+            continue;
+        }
+        int fildes = (ra_next + i) % MAX_FD;
+        readahead_t *r = &ra[fildes];
+        ra_next = fildes + 1;
+        r->queued = 0;
+        r->busy = 1;
+        int dir_index = fd_table[fildes].dir_index;
+        uint64_t want = r->want;
+        uint32_t len = r->want_len;
+        pthread_mutex_unlock(&ra_lock);
+        
+        ra_fill(dir_index, r, want, len);
+        
+        pthread_mutex_lock(&ra_lock);
+        r->busy = 0;
+        pthread_cond_broadcast(&ra_idle);
+    }
+    pthread_mutex_unlock(&ra_lock);
+    return NULL;
+}
+
+// Before a read from offset: waits for a window being read that covers it,
+// or reads a queued one right away, rather than read the same blocks twice
+static void ra_wait(int fildes, uint64_t offset) {
+    readahead_t *r = &ra[fildes];
+    pthread_mutex_lock(&ra_lock);
+    while ((r->queued || r->busy) && offset >= r->want && offset < r->want + r->want_len) {
+        if (r->busy) {
+            pthread_cond_wait(&ra_idle, &ra_lock);
+            continue;
+        }
+        uint64_t want = r->want;
+        uint32_t len = r->want_len;
+        r->queued = 0;
+        r->busy = 1;
+        pthread_mutex_unlock(&ra_lock);
+        ra_fill(fd_table[fildes].dir_index, r, want, len);
+        pthread_mutex_lock(&ra_lock);
+        r->busy = 0;
+        pthread_cond_broadcast(&ra_idle);
+    }
+    pthread_mutex_unlock(&ra_lock);
+}
+
+// Copies what the readahead buffer holds from offset on. The caller holds
+// the file lock.
+static size_t ra_serve(int fildes, int dir_index, char *buf, size_t nbyte, uint64_t offset) {
+    readahead_t *r = &ra[fildes];
+    size_t n = 0;
+    pthread_mutex_lock(&r->lock);
+    if (r->len > 0 && r->gen == dext(dir_index)->gen && offset >= r->start && offset < r->start + r->len) {
+        n = r->start + r->len - offset < nbyte ? r->start + r->len - offset : nbyte;
+        memcpy(buf, r->buf + (offset - r->start), n);
+    }
+    pthread_mutex_unlock(&r->lock);
+    STAT_ADD(bytes_read, n);
+    STAT_ADD(ra_hit_bytes, n);
+    return n;
+}
+
+// Follows a descriptor's pattern after it read offset to end, and queues
+// the next window once less than half the current one is left ahead
+static void ra_update(int fildes, uint64_t offset, uint64_t end) {
+    file_desc_t *f = &fd_table[fildes];
+    readahead_t *r = &ra[fildes];
+    if (ra_size == 0) return;
+    
+    if (offset == f->ra_expect) {
+        if (f->ra_seq < RA_TRIGGER) f->ra_seq++;
+    } else {
+        f->ra_seq = 0;
+        f->ra_window /= 2;
+    }
+    f->ra_expect = end;
+    if (f->ra_seq < RA_TRIGGER) return;
+    
+    pthread_mutex_lock(&r->lock);
+    uint64_t ahead = r->len > 0 && end >= r->start && end < r->start + r->len ? r->start + r->len - end : 0;
+    pthread_mutex_unlock(&r->lock);
+    
+    pthread_mutex_lock(&ra_lock);
+    uint32_t min = RA_MIN_WINDOW < ra_size ? RA_MIN_WINDOW : ra_size;
+    if (!r->queued && !r->busy && ahead < f->ra_window / 2 + 1) {
+        if (!r->buf) {
+            r->buf = malloc(ra_size);
+            r->fill = malloc(ra_size);
+        }
+        if (!ra_running) {
+            ra_running = 1;
+            while (ra_nthreads < RA_THREADS && pthread_create(&ra_threads[ra_nthreads], NULL, ra_main, NULL) == 0) {
+                ra_nthreads++;
+            }
+        }
+        if (r->buf && r->fill && ra_nthreads > 0) {
+            f->ra_window = f->ra_window < min ? min : f->ra_window * 2 < ra_size ? f->ra_window * 2 : ra_size;
+            r->want = end;
+            r->want_len = f->ra_window;
+            r->queued = 1;
+            pthread_cond_signal(&ra_cond);
+        }
+    }
+    pthread_mutex_unlock(&ra_lock);
+}
+
+static int do_read(int fildes, void *buf, size_t nbyte) {
+    if (disk_fd == -1) return -1;
+    if (!valid_fd(fildes)) return -1;
+    
+    int dir_index = fd_table[fildes].dir_index;
+    uint64_t offset = fd_table[fildes].offset;
+    if (nbyte > INT_MAX) nbyte = INT_MAX;
+    ra_wait(fildes, offset);
+    if (lock_file_shared(dir_index) == -1) return -1;
+    
+    // Whatever was read ahead first, then the rest from the file
+    int read = ra_serve(fildes, dir_index, buf, nbyte, offset);
+    if ((size_t)read < nbyte) {
+        int more = read_at(dir_index, &fd_table[fildes], (char*)buf + read, nbyte - read, offset + read);
+        if (more > 0) read += more;
+        else if (read == 0) read = more;
+    }
+    if (read > 0) {
+        ra_update(fildes, offset, offset + read);
+        fd_table[fildes].offset += read;
+    }
+    pthread_rwlock_unlock(file_lock(dir_index));
+    return read;
+}
+
+static int do_write(int fildes, void *buf, size_t nbyte) {
+    if (disk_fd == -1) return -1;
+    if (!writable_fd(fildes)) return -1;
+    
+    int dir_index = fd_table[fildes].dir_index;
+    pthread_rwlock_wrlock(file_lock(dir_index));
+    int written = wb_write(fildes, buf, nbyte);
+    if (written > 0) fd_table[fildes].offset += written;
+    pthread_rwlock_unlock(file_lock(dir_index));
+    
+    flush_if_due();
+    return written;
+}
+
+// fs_read over several buffers, with one lock of the file for all of them
+static int do_readv(int fildes, const struct iovec *iov, int iovcnt) {
+    if (disk_fd == -1) return -1;
+    if (!valid_fd(fildes) || iovcnt < 0 || (iovcnt > 0 && !iov)) return -1;
+    
+    int dir_index = fd_table[fildes].dir_index;
+    uint64_t offset = fd_table[fildes].offset;
+    ra_wait(fildes, offset);
+    if (lock_file_shared(dir_index) == -1) return -1;
+    
+    size_t total = 0;
+    int failed = 0;
+    for (int i = 0; i < iovcnt && total < INT_MAX; i++) {
+        size_t want = iov[i].iov_len < INT_MAX - total ? iov[i].iov_len : INT_MAX - total;
+        char *buf = iov[i].iov_base;
+        size_t got = ra_serve(fildes, dir_index, buf, want, offset + total);
+        if (got < want) {
+            int more = read_at(dir_index, &fd_table[fildes], buf + got, want - got, offset + total + got);
+            if (more > 0) got += more;
+            else if (more == -1 && total + got == 0) failed = 1;
+        }
+        total += got;
+        if (got < want) break;
+    }
+    if (total > 0) {
+        ra_update(fildes, offset, offset + total);
+        fd_table[fildes].offset += total;
+    }
+    pthread_rwlock_unlock(file_lock(dir_index));
+    return failed ? -1 : (int)total;
+}
+
+// fs_write over several buffers; small ones are coalesced by the write
+// buffer like separate fs_write calls would be
+static int do_writev(int fildes, const struct iovec *iov, int iovcnt) {
+    if (disk_fd == -1) return -1;
+    if (!writable_fd(fildes) || iovcnt < 0 || (iovcnt > 0 && !iov)) return -1;
+    
+    int dir_index = fd_table[fildes].dir_index;
+    pthread_rwlock_wrlock(file_lock(dir_index));
+    size_t total = 0;
+    int failed = 0;
+    for (int i = 0; i < iovcnt && total < INT_MAX; i++) {
+        size_t want = iov[i].iov_len < INT_MAX - total ? iov[i].iov_len : INT_MAX - total;
+        int written = wb_write(fildes, iov[i].iov_base, want);
+        if (written > 0) {
+            fd_table[fildes].offset += written;
+            total += written;
+        }
+        if (written == -1 && total == 0) failed = 1;
+        if (written < (int)want) break;
+    }
+    pthread_rwlock_unlock(file_lock(dir_index));
+    
+    flush_if_due();
+    return failed ? -1 : (int)total;
+}
+
+static int do_pread(int fildes, void *buf, size_t nbyte, off_t offset) {
+    if (disk_fd == -1) return -1;
+    if (!valid_fd(fildes) || offset < 0) return -1;
+    if ((uint64_t)offset >= max_file_size()) return 0;
+    
+    // A cursor of our own, so concurrent callers never share one
+    file_desc_t cursor = { .extent = 0 };
+    int dir_index = fd_table[fildes].dir_index;
+    if (lock_file_shared(dir_index) == -1) return -1;
+    int read = read_at(dir_index, &cursor, buf, nbyte, offset);
+    pthread_rwlock_unlock(file_lock(dir_index));
+    return read;
+}
+
+// Data block holding offset of a file, to sort reads by; 0 for data kept in
+// the directory. The caller holds the file lock.
+static uint32_t disk_position(int dir_index, uint64_t offset) {
+    dir_entry_t *d = dent(dir_index);
+    extent_map_t *m = dext(dir_index);
+    uint32_t lblock = offset / sb.block_size;
+    uint32_t block = 0;
+    if (d->flags & ENTRY_INLINE) return 0;
+    if (d->flags & ENTRY_DEDUP) return lblock < m->map_len ? m->map[lblock] : 0;
+    if (d->flags & ENTRY_COMPRESSED) {
+        uint32_t c = offset / chunk_size();
+        if (c >= m->chunk_count) return 0;
+        lblock = m->chunks[c].pos;
+    } else if (offset >= chain_bytes(d)) {
+        return d->flags & ENTRY_TAIL ? d->tail_block : 0;
+    }
+    map_run(dir_index, NULL, lblock, 1, &block);
+    return block;
+}
+
+typedef struct {
+    uint32_t block;
+    int req;
+} batch_slot_t;
+
+static int batch_cmp(const void *a, const void *b) {
+    const batch_slot_t *x = a;
+    const batch_slot_t *y = b;
+    if (x->block != y->block) return x->block < y->block ? -1 : 1;
+    return x->req - y->req;
+}
+
+// Looks up where each read starts, then serves them in disk order. Files are
+// locked one at a time, so a batch never holds two file locks at once.
+static int do_read_batch(fs_read_req_t *reqs, int count) {
+    if (disk_fd == -1) return -1;
+    if (count < 0 || (count > 0 && !reqs)) return -1;
+    
+    batch_slot_t *order = malloc((count ? count : 1) * sizeof(batch_slot_t));
+    if (!order) return -1;
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        fs_read_req_t *r = &reqs[i];
+        r->result = -1;
+        if (!valid_fd(r->fildes) || r->offset < 0) continue;
+        int dir_index = fd_table[r->fildes].dir_index;
+        if (lock_file_shared(dir_index) == -1) continue;
+        order[n].block = disk_position(dir_index, r->offset);
+        order[n++].req = i;
+        pthread_rwlock_unlock(file_lock(dir_index));
+    }
+    qsort(order, n, sizeof(batch_slot_t), batch_cmp);
+    
+    int done = 0;
+    for (int i = 0; i < n; i++) {
+        fs_read_req_t *r = &reqs[order[i].req];
+        r->result = do_pread(r->fildes, r->buf, r->nbyte, r->offset);
+        if (r->result != -1) done++;
+    }
+    free(order);
+    return done;
+}
+
+static int do_pwrite(int fildes, void *buf, size_t nbyte, off_t offset) {
+    if (disk_fd == -1) return -1;
+    if (!writable_fd(fildes) || offset < 0) return -1;
+    
+    file_desc_t cursor = { .extent = 0 };
+    int dir_index = fd_table[fildes].dir_index;
+    pthread_rwlock_wrlock(file_lock(dir_index));
+    wb_flush_file(dir_index, -1);
+    dext(dir_index)->gen++;
+    
+    // Like fs_lseek, no writing past the end of the file
+    int written = -1;
+    if ((uint64_t)offset <= dent(dir_index)->size) {
+        written = write_at(dir_index, &cursor, buf, nbyte, offset);
+    }
+    pthread_rwlock_unlock(file_lock(dir_index));
+    
+    flush_if_due();
+    return written;
+}
+
+static int do_read_view(int fildes, struct iovec *iov, int iovcnt, size_t nbyte) {
+    if (disk_fd == -1) return -1;
+    if (!valid_fd(fildes)) return -1;
+    if (iovcnt <= 0 || block_ptr(sb.data_start) == NULL) return -1;
+    
+    int dir_index = fd_table[fildes].dir_index;
+    if (lock_file_shared(dir_index) == -1) return -1;
+    uint64_t offset = fd_table[fildes].offset;
+    uint64_t size = dent(dir_index)->size;
+    
+    // Compressed and dedup files are not read in place
+    if (dent(dir_index)->flags & ENTRY_INDEXED) {
+        pthread_rwlock_unlock(file_lock(dir_index));
+        return -1;
+    }
+    if (offset >= size) {
+        pthread_rwlock_unlock(file_lock(dir_index));
+        return 0;
+    }
+    
+    size_t remaining = size - offset;
+    size_t to_view = nbyte < remaining ? nbyte : remaining;
+    size_t viewed = 0;
+    int count = 0;
+    
+    dir_entry_t *d = dent(dir_index);
+    uint64_t chain_end = chain_bytes(d);
+    size_t from_chain = offset >= chain_end ? 0 : chain_end - offset < to_view ? chain_end - offset : to_view;
+    
+    uint32_t lblock = offset / sb.block_size;
+    uint32_t byte_in_block = offset % sb.block_size;
+    
+    // One span per contiguous run, trimmed to the requested range
+    while (viewed < from_chain && count < iovcnt) {
+        size_t len = from_chain - viewed;
+        uint32_t block;
+        uint32_t run = map_run(dir_index, &fd_table[fildes], lblock, (byte_in_block + len + sb.block_size - 1) / sb.block_size, &block);
+        if (run == 0) break;
+        run = disk_contiguous(sb.data_start + block, run); // A stripe ends the span
+        if (len > (size_t)run * sb.block_size - byte_in_block) {
+            len = (size_t)run * sb.block_size - byte_in_block;
+        }
+        
+        iov[count].iov_base = (char*)block_ptr(sb.data_start + block) + byte_in_block;
+        iov[count].iov_len = len;
+        count++;
+        
+        viewed += len;
+        byte_in_block = 0;
+        lblock += run;
+    }
+    
+    // Inline data and packed tails make one more span
+    if (viewed == from_chain && viewed < to_view && count < iovcnt) {
+        uint64_t off = offset + viewed - chain_end;
+        if (d->flags & ENTRY_INLINE) {
+            iov[count].iov_base = d->inline_data + off;
+        } else {
+            iov[count].iov_base = (char*)block_ptr(sb.data_start + d->tail_block) + (size_t)d->tail_slot * tail_slot_size() + off;
+        }
+        iov[count].iov_len = to_view - viewed;
+        count++;
+        viewed = to_view;
+    }
+    
+    fd_table[fildes].offset += viewed;
+    STAT_ADD(bytes_read, viewed);
+    pthread_rwlock_unlock(file_lock(dir_index));
+    return count;
+}
+
+// Block requests of one operation can complete in different reaping threads
+static void aio_run_done(void *arg, int result) {
+    fs_aio_op_t *op = arg;
+    if (result == -1) __atomic_store_n(&op->failed, 1, __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&op->pending, 1, __ATOMIC_ACQ_REL) > 0) return;
+    
+    if (!op->write && !op->failed && op->runs > 0) {
+        run_copy_partials(&op->first);
+        if (op->runs > 1) run_copy_partials(&op->last);
+    }
+    if (op->write && !op->failed) STAT_ADD(bytes_written, op->bytes + op->copied);
+    else if (!op->failed) STAT_ADD(bytes_read, op->bytes + op->copied);
+    __atomic_add_fetch(&aio_ops_done, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&dext(op->dir_index)->aio_pending, 1, __ATOMIC_RELEASE);
+    op->cb(op->fildes, op->failed ? -1 : (int)(op->bytes + op->copied), op->arg);
+    free(op);
+}
+
+// Queues one block request per contiguous run covering len bytes from offset.
+// The caller holds the file lock.
+static int aio_submit_chain(fs_aio_op_t *op, int dir_index, uint64_t offset, char *buf, size_t len) {
+    uint32_t lblock = offset / sb.block_size;
+    uint32_t byte_in_block = offset % sb.block_size;
+    size_t done = 0;
+    
+    // Completes the operation even if nothing ends up submitted, and keeps
+    // fs_defrag off the file until then
+    op->pending = 1;
+    op->dir_index = dir_index;
+    __atomic_add_fetch(&dext(dir_index)->aio_pending, 1, __ATOMIC_RELAXED);
+    
+    while (done < len) {
+        size_t n = len - done;
+        uint32_t block;
+        uint32_t run = map_run(dir_index, &fd_table[op->fildes], lblock, (byte_in_block + n + sb.block_size - 1) / sb.block_size, &block);
+        if (run == 0) break;
+        if (n > (size_t)run * sb.block_size - byte_in_block) {
+            n = (size_t)run * sb.block_size - byte_in_block;
+        }
+        
+        // A short final block counts as a partial head of its own run, so
+        // every run after the first bounces through the tail buffer
+        run_io_t *r = op->runs == 0 ? &op->first : &op->last;
+        run_setup(r, block, run, byte_in_block, buf + done, n, op->runs == 0 ? op->head : op->tail, op->tail);
+        if (op->write && run_fill_partials(r) == -1) {
+            __atomic_store_n(&op->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        
+        __atomic_add_fetch(&op->pending, 1, __ATOMIC_ACQ_REL);
+        int ret = op->write
+            ? block_writev_async(sb.data_start + block, r->iov, r->iovcnt, aio_run_done, op)
+            : block_readv_async(sb.data_start + block, r->iov, r->iovcnt, aio_run_done, op);
+        if (ret == -1) {
+            __atomic_sub_fetch(&op->pending, 1, __ATOMIC_ACQ_REL);
+            __atomic_store_n(&op->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        op->runs++;
+        
+        done += n;
+        byte_in_block = 0;
+        lblock += run;
+    }
+    
+    op->bytes = done;
+    if (aio_complete(aio_run_done, op, 0) == -1) return -1;
+    return disk_aio_submit();
+}
+
+static int do_read_async(int fildes, void *buf, size_t nbyte, fs_aio_callback cb, void *arg) {
+    if (disk_fd == -1 || !cb) return -1;
+    if (!valid_fd(fildes)) return -1;
+    
+    fs_aio_op_t *op = aio_op_new();
+    if (!op) return -1;
+    op->fildes = fildes;
+    op->cb = cb;
+    op->arg = arg;
+    
+    // The lock covers submission; the requests then run on their own
+    int dir_index = fd_table[fildes].dir_index;
+    if (lock_file_shared(dir_index) == -1) {
+        free(op);
+        return -1;
+    }
+    uint64_t offset = fd_table[fildes].offset;
+    uint64_t size = dent(dir_index)->size;
+    uint64_t to_read = offset >= size ? 0 : size - offset;
+    if (nbyte < to_read) to_read = nbyte;
+    if (to_read > INT_MAX) to_read = INT_MAX;
+    
+    // Inline data and packed tails are copied now; only the chain is
+    // read asynchronously. Compressed and dedup files are read whole right
+    // away.
+    uint64_t chain_end = chain_bytes(dent(dir_index));
+    size_t from_chain = offset >= chain_end ? 0 : chain_end - offset < to_read ? chain_end - offset : to_read;
+    if (dent(dir_index)->flags & ENTRY_INDEXED) {
+        int result = to_read > 0 ? read_indexed(dir_index, buf, to_read, offset) : 0;
+        if (result == -1) {
+            pthread_rwlock_unlock(file_lock(dir_index));
+            free(op);
+            return -1;
+        }
+        to_read = result;
+        from_chain = 0;
+        op->copied = to_read;
+    } else if (from_chain < to_read) {
+        dir_entry_t *d = dent(dir_index);
+        uint64_t off = offset + from_chain - chain_end;
+        if (d->flags & ENTRY_INLINE) {
+            memcpy((char*)buf + from_chain, d->inline_data + off, to_read - from_chain);
+        } else if (read_tail(d, off, (char*)buf + from_chain, to_read - from_chain) == -1) {
+            pthread_rwlock_unlock(file_lock(dir_index));
+            free(op);
+            return -1;
+        }
+        op->copied = to_read - from_chain;
+    }
+    
+    fd_table[fildes].offset += to_read;
+    int ret = aio_submit_chain(op, dir_index, offset, buf, from_chain);
+    pthread_rwlock_unlock(file_lock(dir_index));
+    return ret;
+}
+
+static int do_write_async(int fildes, void *buf, size_t nbyte, fs_aio_callback cb, void *arg) {
+    if (disk_fd == -1 || !cb) return -1;
+    if (!writable_fd(fildes)) return -1;
+    
+    int dir_index = fd_table[fildes].dir_index;
+    pthread_rwlock_wrlock(file_lock(dir_index));
+    wb_flush_file(dir_index, -1);
+    dext(dir_index)->gen++;
+    uint64_t offset = fd_table[fildes].offset;
+    
+    if (nbyte > INT_MAX) nbyte = INT_MAX;
+    if (offset + nbyte > max_file_size()) {
+        nbyte = max_file_size() - offset;
+    }
+    
+    // Compressed and dedup files are written before returning
+    unshare_file(dir_index);
+    if (dent(dir_index)->flags & ENTRY_INDEXED) {
+        int written = write_indexed(dir_index, buf, nbyte, offset);
+        fs_aio_op_t *op = written == -1 ? NULL : aio_op_new();
+        int ret = -1;
+        if (op) {
+            op->fildes = fildes;
+            op->write = 1;
+            op->cb = cb;
+            op->arg = arg;
+            op->copied = written;
+            fd_table[fildes].offset += written;
+            ret = aio_submit_chain(op, dir_index, offset, buf, 0);
+        }
+        pthread_rwlock_unlock(file_lock(dir_index));
+        flush_if_due();
+        return ret;
+    }
     
-    // Calculate how many bytes we can actually read
-    size_t remaining = size - offset;
-    size_t to_read = nbyte < remaining ? nbyte : remaining;
-    size_t read = 0;
+    // Blocks and the new size are settled at submit time
+    pthread_rwlock_rdlock(&txn_lock);
+    int full = unpack_file(dir_index) == -1;
+    uint32_t blocks = full ? 0 : extend_chain(dir_index, (offset + nbyte + sb.block_size - 1) / sb.block_size);
+    if (!full && (uint64_t)blocks * sb.block_size < offset + nbyte) {
+        if ((uint64_t)blocks * sb.block_size <= offset && nbyte > 0) full = 1;
+        else nbyte = (uint64_t)blocks * sb.block_size - offset;
+    }
+    fs_aio_op_t *op = full ? NULL : aio_op_new();
+    if (op) {
+        if (offset + nbyte > dent(dir_index)->size) {
+            dent(dir_index)->size = offset + nbyte;
+        }
+        dent(dir_index)->modified = time(NULL);
+        dir_dirty(dir_index);
+    }
+    pthread_rwlock_unlock(&txn_lock);
+    if (!op) {
+        pthread_rwlock_unlock(file_lock(dir_index));
+        return -1;
+    }
+    op->fildes = fildes;
+    op->write = 1;
+    op->cb = cb;
+    op->arg = arg;
     
-    // Find starting block and offset within block
-    uint32_t block = dir[dir_index].first_block;
-    uint32_t block_offset = offset / BLOCK_SIZE;
-    uint32_t byte_in_block = offset % BLOCK_SIZE;
+    fd_table[fildes].offset += nbyte;
+    int ret = aio_submit_chain(op, dir_index, offset, buf, nbyte);
+    pthread_rwlock_unlock(file_lock(dir_index));
+    
+    flush_if_due();
+    return ret;
+}
+
+static int do_aio_wait(int min_completions) {
+    if (disk_fd == -1) return -1;
     
-    // Skip to the starting block
-    for (uint32_t i = 0; i < block_offset && block != (uint32_t)-1; i++) {
-        block = fat[block];
+    int start = __atomic_load_n(&aio_ops_done, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&aio_ops_done, __ATOMIC_RELAXED) - start < min_completions && disk_aio_inflight() > 0) {
+        if (disk_aio_reap(1) == -1) return -1;
     }
     
-    // Read data block by block
-    while (read < to_read && block != (uint32_t)-1) {
-        char data[BLOCK_SIZE];
-        if (block_read(sb.data_start + block, data) == -1) return -1;
-        
-        size_t bytes_in_this_block = BLOCK_SIZE - byte_in_block;
-        size_t bytes_needed = to_read - read;
-        size_t bytes_to_copy = bytes_in_this_block < bytes_needed ? bytes_in_this_block : bytes_needed;
+    // Pick up anything else that is already finished
+    if (disk_aio_inflight() > 0 && disk_aio_reap(0) == -1) return -1;
+    return __atomic_load_n(&aio_ops_done, __ATOMIC_RELAXED) - start;
+}
+
+static off_t do_get_filesize(int fildes) {
+    if (disk_fd == -1) return -1;
+    if (!valid_fd(fildes)) return -1;
+    
+    int dir_index = fd_table[fildes].dir_index;
+    if (lock_file_shared(dir_index) == -1) return -1;
+    off_t size = dent(dir_index)->size;
+    pthread_rwlock_unlock(file_lock(dir_index));
+    return size;
+}
+
+static int do_lseek(int fildes, off_t offset) {
+    if (disk_fd == -1) return -1;
+    if (!valid_fd(fildes)) return -1;
+    
+    // Staying put keeps the write buffer going
+    if (offset >= 0 && (uint64_t)offset == fd_table[fildes].offset) return 0;
+    int dir_index = fd_table[fildes].dir_index;
+    if (lock_file_shared(dir_index) == -1) return -1;
+    uint64_t size = dent(dir_index)->size;
+    pthread_rwlock_unlock(file_lock(dir_index));
+    if (offset < 0 || (uint64_t)offset > size) return -1;
+    
+    fd_table[fildes].offset = offset;
+    return 0;
+}
+
+// Cuts a file down to length bytes. The caller holds the file lock
+// exclusively and txn_lock shared.
+static int truncate_file(int fildes, int dir_index, uint64_t length) {
+    // Inline data is cut in place; a packed tail goes back into a block first
+    if (!(dent(dir_index)->flags & ENTRY_INLINE) && unpack_file(dir_index) == -1) return -1;
+    
+    // Keep every block that still holds part of the file
+    extent_map_t *m = get_extents(dir_index);
+    if (!m) return -1;
+    uint32_t keep = (length + sb.block_size - 1) / sb.block_size;
+    
+    // Free all remaining blocks
+    if (keep < m->blocks) {
+        uint32_t block;
+        if (keep == 0) {
+            block = dent(dir_index)->first_block;
+            dent(dir_index)->first_block = (uint32_t)-1;
+        } else {
+            uint32_t prev_block;
+            map_run(dir_index, &fd_table[fildes], keep - 1, 1, &prev_block);
+            block = fat_get(prev_block);
+            if (fat_set(prev_block, (uint32_t)-1) == -1) return -1;
+        }
         
-        memcpy((char*)buf + read, data + byte_in_block, bytes_to_copy);
-        read += bytes_to_copy;
-        byte_in_block = 0;
-        block = fat[block];
+        free_chain(block);
+        extents_truncate(m, keep);
     }
     
-    fd_table[fildes].offset += read;
-    return read;
+    // Update file size and offset if needed
+    dent(dir_index)->size = length;
+    if (fd_table[fildes].offset > length) {
+        fd_table[fildes].offset = length;
+    }
+    
+    dent(dir_index)->modified = time(NULL);
+    dir_dirty(dir_index);
+    return 0;
 }
 
-int fs_write(int fildes, void *buf, size_t nbyte) {
+static int do_truncate(int fildes, off_t length) {
+    if (disk_fd == -1) return -1;
+    if (!writable_fd(fildes)) return -1;
+    
+    int dir_index = fd_table[fildes].dir_index;
+    pthread_rwlock_wrlock(file_lock(dir_index));
+    wb_flush_file(dir_index, -1);
+    dext(dir_index)->gen++;
+    uint64_t size = dent(dir_index)->size;
+    
+    int result = 0;
+    if (length < 0 || (uint64_t)length > size) {
+        result = -1;
+    } else if ((uint64_t)length < size && dent(dir_index)->flags & ENTRY_DEDUP) {
+        pthread_rwlock_rdlock(&txn_lock);
+        result = truncate_dedup(dir_index, length);
+        pthread_rwlock_unlock(&txn_lock);
+        if (result == 0 && fd_table[fildes].offset > (uint64_t)length) fd_table[fildes].offset = length;
+    } else if ((uint64_t)length < size && dent(dir_index)->flags & ENTRY_COMPRESSED) {
+        result = truncate_compressed(dir_index, length);
+        if (result == 0 && fd_table[fildes].offset > (uint64_t)length) fd_table[fildes].offset = length;
+    } else if ((uint64_t)length < size) {
+        pthread_rwlock_rdlock(&txn_lock);
+        result = truncate_file(fildes, dir_index, length);
+        pthread_rwlock_unlock(&txn_lock);
+    }
+    pthread_rwlock_unlock(file_lock(dir_index));
+    
+    if (result == -1 || (uint64_t)length == size) return result;
+    return flush_if_due();
+}
+
+// Sets how an empty file is stored
+static int set_layout(int fildes, uint8_t flags) {
+    if (disk_fd == -1) return -1;
+    if (!writable_fd(fildes)) return -1;
+    
+    int dir_index = fd_table[fildes].dir_index;
+    pthread_rwlock_wrlock(file_lock(dir_index));
+    wb_flush_file(dir_index, -1);
+    pthread_rwlock_rdlock(&txn_lock);
+    dir_entry_t *d = dent(dir_index);
+    int result = -1;
+    if (d->size == 0 && d->first_block == (uint32_t)-1) {
+        d->flags = flags;
+        dext(dir_index)->index_valid = 0;
+        dir_dirty(dir_index);
+        result = 0;
+    }
+    pthread_rwlock_unlock(&txn_lock);
+    pthread_rwlock_unlock(file_lock(dir_index));
+    
+    if (result == -1) return -1;
+    return flush_if_due();
+}
+
+static int do_set_compression(int fildes, int enable) {
+    return set_layout(fildes, enable ? ENTRY_COMPRESSED : 0);
+}
+
+static int do_set_dedup(int fildes, int enable) {
+    return set_layout(fildes, enable ? ENTRY_DEDUP : 0);
+}
+
+// Reserves blocks for length bytes, giving them all back if the disk runs
+// out. The caller holds the file lock exclusively and txn_lock shared.
+static int fallocate_file(int dir_index, uint64_t length) {
+    if (dent(dir_index)->flags & ENTRY_INDEXED) return -1;
+    if (unpack_file(dir_index) == -1) return -1;
+    extent_map_t *m = get_extents(dir_index);
+    if (!m) return -1;
+    
+    uint32_t had = m->blocks;
+    uint32_t want = (length + sb.block_size - 1) / sb.block_size;
+    if (extend_chain(dir_index, want) >= want) return 0;
+    
+    // Not enough space: give back what this call took
+    m = get_extents(dir_index);
+    if (!m) return -1;
+    if (had == 0) {
+        free_chain(dent(dir_index)->first_block);
+        dent(dir_index)->first_block = (uint32_t)-1;
+        dir_dirty(dir_index);
+    } else {
+        uint32_t last;
+        map_run(dir_index, NULL, had - 1, 1, &last);
+        uint32_t rest = fat_get(last);
+        if (fat_set(last, (uint32_t)-1) == -1) return -1;
+        free_chain(rest);
+    }
+    extents_truncate(m, had);
+    return -1;
+}
+
+static int do_fallocate(int fildes, off_t length) {
     if (disk_fd == -1) return -1;
-    if (fildes < 0 || fildes >= MAX_FD || !fd_table[fildes].used) return -1;
+    if (!writable_fd(fildes)) return -1;
+    if (length < 0 || (uint64_t)length > max_file_size()) return -1;
     
     int dir_index = fd_table[fildes].dir_index;
-    uint32_t offset = fd_table[fildes].offset;
-    uint32_t size = dir[dir_index].size;
+    pthread_rwlock_wrlock(file_lock(dir_index));
+    unshare_file(dir_index);
+    pthread_rwlock_rdlock(&txn_lock);
+    int result = fallocate_file(dir_index, length);
+    pthread_rwlock_unlock(&txn_lock);
+    
+    // Blocks freed since the last commit may make up the difference
+    if (result == -1 && reclaim_freed()) {
+        pthread_rwlock_rdlock(&txn_lock);
+        result = fallocate_file(dir_index, length);
+        pthread_rwlock_unlock(&txn_lock);
+    }
+    pthread_rwlock_unlock(file_lock(dir_index));
+    
+    if (result == -1) return -1;
+    return flush_if_due();
+}
+
+// Defragmentation. Each fs_defrag call moves up to a budget of blocks of one
+// file toward a single run: the file's first run grows in place when the
+// blocks after it are free, otherwise the file starts over in a free run big
+// enough for all of it. The copies are synced before the FAT points at them,
+// and the blocks they replace are only reused once that is committed, so a
+// crash leaves the file on one set of blocks or the other.
+#define DEFRAG_COPY_BLOCKS 256          // copied per transfer
+
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t defrag_next = 0;        // file the next call starts with
+
+// Moves up to budget blocks of a file, using old to note the blocks given
+// up, and returns how many moved: 0 when the file is one run already or no
+// free run would help. The caller holds the file lock exclusively.
+static int defrag_file(int dir_index, uint32_t budget, uint32_t *old, char *buf) {
+    dir_entry_t *d = dent(dir_index);
+    if (d->flags & (ENTRY_INLINE | ENTRY_DEDUP) || d->first_block == (uint32_t)-1) return 0;
+    if (__atomic_load_n(&dext(dir_index)->aio_pending, __ATOMIC_ACQUIRE) > 0) return 0;
+    extent_map_t *m = get_extents(dir_index);
+    if (!m) return -1;
+    if (m->count < 2) return 0;
+    
+    // Where the blocks go, and which file blocks they are
+    extent_t head = m->ext[0];
+    uint32_t hint = head.start + head.len;
+    uint32_t first = head.len;
+    uint32_t got;
+    pthread_mutex_lock(&alloc_lock);
+    uint32_t to;
+    alloc_load(hint);
+    if (hint < sb.data_blocks && alloc_is_free(hint)) {
+        to = alloc_blocks(hint, m->blocks - head.len < budget ? m->blocks - head.len : budget, &got);
+    } else {
+        to = alloc_blocks(hint, m->blocks, &got);
+        uint32_t keep = got < m->blocks ? 0 : m->blocks < budget ? m->blocks : budget;
+        for (uint32_t i = keep; i < got; i++) alloc_mark_free(to + i);
+        got = keep;
+        first = 0;
+    }
+    if (got > 0) sb.free_blocks -= got;
+    pthread_mutex_unlock(&alloc_lock);
+    if (got == 0) return 0;
     
-    // Check if we're extending the file
-    if (offset + nbyte > size) {
-        if (offset + nbyte > DATA_BLOCKS * BLOCK_SIZE) {
-            nbyte = DATA_BLOCKS * BLOCK_SIZE - offset;
+    // Copy them over a run at a time and make sure the copies are on disk
+    int result = 0;
+    for (uint32_t done = 0; done < got && result == 0;) {
+        uint32_t from;
+        uint32_t run = map_run(dir_index, NULL, first + done, got - done < DEFRAG_COPY_BLOCKS ? got - done : DEFRAG_COPY_BLOCKS, &from);
+        size_t len = (size_t)run * sb.block_size;
+        if (run == 0 || transfer_run(from, run, 0, buf, len, 0) == -1 || transfer_run(to + done, run, 0, buf, len, 1) == -1) {
+            result = -1;
         }
-        dir[dir_index].size = offset + nbyte;
+        for (uint32_t i = 0; i < run; i++) old[done + i] = from + i;
+        done += run;
+    }
+    if (result == 0) result = disk_sync();
+    if (result == -1) {
+        pthread_mutex_lock(&alloc_lock);
+        for (uint32_t i = 0; i < got; i++) alloc_mark_free(to + i);
+        sb.free_blocks += got;
+        pthread_mutex_unlock(&alloc_lock);
+        return -1;
     }
     
-    size_t written = 0;
+    // Then splice the new blocks into the chain in place of the old ones,
+    // or give them back if the FAT cannot take them
+    pthread_rwlock_rdlock(&txn_lock);
+    uint32_t after = fat_get(old[got - 1]);
+    uint32_t linked = 0;
+    while (linked < got && fat_set(to + linked, linked + 1 < got ? to + linked + 1 : after) == 0) linked++;
+    if (linked < got || (first > 0 && fat_set(hint - 1, to) == -1)) {
+        while (linked > 0) fat_set(to + --linked, 0);
+        pthread_rwlock_unlock(&txn_lock);
+        pthread_mutex_lock(&alloc_lock);
+        for (uint32_t i = 0; i < got; i++) alloc_mark_free(to + i);
+        sb.free_blocks += got;
+        pthread_mutex_unlock(&alloc_lock);
+        return -1;
+    }
+    if (first == 0) {
+        d->first_block = to;
+        dir_dirty(dir_index);
+    }
+    pthread_mutex_lock(&alloc_lock);
+    for (uint32_t i = 0; i < got; i++) free_block(old[i]);
+    pthread_mutex_unlock(&alloc_lock);
+    pthread_rwlock_unlock(&txn_lock);
     
-    // Find starting block and offset within block
-    uint32_t block = dir[dir_index].first_block;
-    uint32_t block_offset = offset / BLOCK_SIZE;
-    uint32_t byte_in_block = offset % BLOCK_SIZE;
-    
-    // If file is empty, allocate first block
-    if (block == (uint32_t)-1 && nbyte > 0) {
-        block = find_free_block();
-        if (block == (uint32_t)-1) return -1;
-        dir[dir_index].first_block = block;
-        fat[block] = (uint32_t)-1;
-        sb.free_blocks--;
-        block_offset = 0;
-    }
-    
-    // Skip to the starting block
-    uint32_t prev_block = (uint32_t)-1;
-    for (uint32_t i = 0; i < block_offset && block != (uint32_t)-1; i++) {
-        prev_block = block;
-        block = fat[block];
-    }
-    
-    // If we need to extend the block chain
-    if (block == (uint32_t)-1 && nbyte > written) {
-        block = find_free_block();
-        if (block == (uint32_t)-1) {
-            dir[dir_index].size = offset + written;
-            goto done;
+    m->valid = 0;
+    get_extents(dir_index);
+    STAT_ADD(defrag_blocks, got);
+    return got;
+}
+
+static int do_defrag(uint32_t max_blocks) {
+    if (disk_fd == -1 || max_blocks == 0) return -1;
+    uint32_t copy = max_blocks < DEFRAG_COPY_BLOCKS ? max_blocks : DEFRAG_COPY_BLOCKS;
+    uint32_t *old = malloc((size_t)max_blocks * sizeof(uint32_t));
+    char *buf = malloc((size_t)copy * sb.block_size);
+    if (!old || !buf) {
+        free(old);
+        free(buf);
+        return -1;
+    }
+    
+    // The first file from where the last call left off that can be improved
+    pthread_mutex_lock(&defrag_lock);
+    pthread_rwlock_rdlock(&dir_lock);
+    int moved = 0;
+    uint32_t start = defrag_next;
+    for (uint32_t i = 0; i < dir_entries && moved == 0; i++) {
+        uint32_t dir_index = (start + i) % dir_entries;
+        if (!entry_used(dir_index, 0) || entry_load(dir_index) == -1) continue;
+        pthread_rwlock_wrlock(file_lock(dir_index));
+        unshare_file(dir_index);
+        moved = defrag_file(dir_index, max_blocks, old, buf);
+        pthread_rwlock_unlock(file_lock(dir_index));
+        defrag_next = dir_index;
+    }
+    pthread_rwlock_unlock(&dir_lock);
+    
+    // The blocks moved out of are free once the new chain is committed
+    if (moved > 0 && flush_metadata() == -1) moved = -1;
+    pthread_mutex_unlock(&defrag_lock);
+    trim_cache();
+    
+    free(old);
+    free(buf);
+    return moved;
+}
+
+static int do_fragmentation(fs_frag_t *files, int max) {
+    if (disk_fd == -1 || max < 0 || (max > 0 && !files)) return -1;
+    
+    // Runs are counted straight from the FAT
+    pthread_rwlock_rdlock(&dir_lock);
+    int count = 0;
+    for (uint32_t i = 0; i < dir_entries; i++) {
+        if (!entry_used(i, 1) || entry_load(i) == -1) continue;
+        pthread_rwlock_rdlock(file_lock(i));
+        uint32_t blocks = 0;
+        uint32_t extents = 0;
+        for (uint32_t block = dent(i)->first_block, prev = (uint32_t)-1; block != (uint32_t)-1; prev = block, block = fat_get(block)) {
+            if (block != prev + 1) extents++;
+            blocks++;
         }
-        fat[prev_block] = block;
-        fat[block] = (uint32_t)-1;
-        sb.free_blocks--;
-        byte_in_block = 0;
+        if (blocks > 0 && count < max) {
+            memcpy(files[count].name, dent(i)->name, sizeof(files[count].name));
+            files[count].blocks = blocks;
+            files[count].extents = extents;
+        }
+        pthread_rwlock_unlock(file_lock(i));
+        if (blocks > 0) count++;
+    }
+    pthread_rwlock_unlock(&dir_lock);
+    trim_cache();
+    return count;
+}
+
+// Clones and snapshots share blocks the way dedup files do. New entries are
+// made pending and only show up, by name or in their snapshot, once
+// complete, so a crash halfway through leaves nothing behind.
+
+// Takes n blocks for a chain the caller links later. Until then the FAT
+// does not list them, so after a crash they are free again.
+static int alloc_loose(uint32_t *blocks, uint32_t n) {
+    uint32_t count = 0;
+    pthread_mutex_lock(&alloc_lock);
+    while (count < n) {
+        uint32_t got;
+        uint32_t block = alloc_blocks(count > 0 ? blocks[count - 1] + 1 : alloc_goal, n - count, &got);
+        if (block == (uint32_t)-1) break;
+        for (uint32_t i = 0; i < got; i++) blocks[count++] = block + i;
+    }
+    if (count == n) {
+        sb.free_blocks -= n;
+    } else {
+        for (uint32_t i = 0; i < count; i++) alloc_mark_free(blocks[i]);
     }
+    pthread_mutex_unlock(&alloc_lock);
+    return count == n ? 0 : -1;
+}
+
+// Turns a plain file into a dedup file over the blocks it already has: each
+// becomes a shared block with one reference, listed by a map chain written
+// before the switch. Blocks reserved past the end are freed. ENTRY_CLONED
+// lets unshare_file turn it back. The caller holds the file lock
+// exclusively.
+static int share_file(int dir_index) {
+    dir_entry_t *d = dent(dir_index);
+    pthread_rwlock_rdlock(&txn_lock);
+    int result = unpack_file(dir_index);
+    pthread_rwlock_unlock(&txn_lock);
+    extent_map_t *m = get_extents(dir_index);
+    uint32_t n = (d->size + sb.block_size - 1) / sb.block_size;
+    if (result == -1 || !m || m->blocks < n) return -1;
     
-    // Write data block by block
-    while (written < nbyte && block != (uint32_t)-1) {
-        char data[BLOCK_SIZE] = {0};
-        
-        // Read existing block if we're not writing it completely
-        if (byte_in_block != 0 || (nbyte - written) < BLOCK_SIZE) {
-            if (block_read(sb.data_start + block, data) == -1) {
-                dir[dir_index].size = offset + written;
-                goto done;
-            }
+    uint32_t nmap = (n + map_per_block() - 1) / map_per_block();
+    uint32_t *map = calloc((size_t)nmap * map_per_block() + 1, sizeof(uint32_t));
+    uint32_t *chain = malloc(((size_t)nmap + 1) * sizeof(uint32_t));
+    if (!map || !chain) result = -1;
+    for (uint32_t lblock = 0; lblock < n && result == 0; ) {
+        uint32_t block;
+        uint32_t run = map_run(dir_index, NULL, lblock, n - lblock, &block);
+        if (run == 0) result = -1;
+        for (uint32_t i = 0; i < run; i++) map[lblock + i] = block + i;
+        lblock += run;
+    }
+    int loose = result == 0 && alloc_loose(chain, nmap) == 0;
+    if (!loose) result = -1;
+    for (uint32_t i = 0; i < nmap && result == 0; i++) {
+        result = block_write(sb.data_start + chain[i], (char *)(map + (size_t)i * map_per_block()));
+    }
+    if (result == 0) result = disk_sync();
+    if (result == -1) {
+        if (loose) {
+            pthread_mutex_lock(&alloc_lock);
+            for (uint32_t i = 0; i < nmap; i++) alloc_mark_free(chain[i]);
+            sb.free_blocks += nmap;
+            pthread_mutex_unlock(&alloc_lock);
         }
-        
-        size_t bytes_in_this_block = BLOCK_SIZE - byte_in_block;
-        size_t bytes_needed = nbyte - written;
-        size_t bytes_to_copy = bytes_in_this_block < bytes_needed ? bytes_in_this_block : bytes_needed;
-        
-        memcpy(data + byte_in_block, (char*)buf + written, bytes_to_copy);
-        if (block_write(sb.data_start + block, data) == -1) {
-            dir[dir_index].size = offset + written;
-            goto done;
+        free(map);
+        free(chain);
+        return -1;
+    }
+    
+    // The map chain is linked first, then the blocks turn shared. Undoing
+    // that puts back the links they had, in file order up to rest.
+    pthread_rwlock_rdlock(&txn_lock);
+    uint32_t rest = n > 0 ? fat_get(map[n - 1]) : d->first_block;
+    uint32_t linked = 0;
+    while (linked < nmap && fat_set(chain[linked], linked + 1 < nmap ? chain[linked + 1] : (uint32_t)-1) == 0) linked++;
+    uint32_t shared = 0;
+    pthread_mutex_lock(&dedup_lock);
+    while (linked == nmap && shared < n && fat_set(map[shared], FAT_SHARED | 1) == 0) shared++;
+    if (linked < nmap || shared < n) {
+        while (shared > 0) {
+            shared--;
+            fat_set(map[shared], shared + 1 < n ? map[shared + 1] : rest);
         }
-        
-        written += bytes_to_copy;
-        byte_in_block = 0;
-        
-        // If we need another block
-        if (written < nbyte && fat[block] == (uint32_t)-1) {
-            uint32_t new_block = find_free_block();
-            if (new_block == (uint32_t)-1) {
-                dir[dir_index].size = offset + written;
-                goto done;
-            }
-            fat[block] = new_block;
-            fat[new_block] = (uint32_t)-1;
-            sb.free_blocks--;
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    if (linked < nmap || shared < n) {
+        while (linked > 0) fat_set(chain[--linked], 0);
+        pthread_rwlock_unlock(&txn_lock);
+        pthread_mutex_lock(&alloc_lock);
+        for (uint32_t i = 0; i < nmap; i++) alloc_mark_free(chain[i]);
+        sb.free_blocks += nmap;
+        pthread_mutex_unlock(&alloc_lock);
+        free(map);
+        free(chain);
+        return -1;
+    }
+    d->first_block = nmap > 0 ? chain[0] : (uint32_t)-1;
+    d->flags = ENTRY_DEDUP | ENTRY_CLONED;
+    dir_dirty(dir_index);
+    free_chain(rest);
+    pthread_rwlock_unlock(&txn_lock);
+    
+    m->valid = 0;
+    m->index_valid = 0;
+    free(map);
+    free(chain);
+    return 0;
+}
+
+// Gives dst a map chain of its own listing the blocks of dedup file src,
+// and a reference to each
+static int share_map(int src, int dst) {
+    extent_map_t *m = get_map(src);
+    if (!m) return -1;
+    uint32_t n = m->map_len;
+    uint32_t nmap = (n + map_per_block() - 1) / map_per_block();
+    pthread_rwlock_rdlock(&txn_lock);
+    uint32_t got = extend_chain(dst, nmap);
+    pthread_rwlock_unlock(&txn_lock);
+    extent_map_t *dm = dext(dst);
+    if (got < nmap || map_reserve(dm, n) == -1) return -1;
+    if (n > 0) {
+        memcpy(dm->map, m->map, (size_t)n * sizeof(uint32_t));
+        if (map_transfer(dst, dm, 0, n, 1) == -1) return -1;
+    }
+    
+    // The references go with the size, so the entry is whole or empty
+    pthread_rwlock_rdlock(&txn_lock);
+    pthread_mutex_lock(&dedup_lock);
+    int result = 0;
+    for (uint32_t i = 0; i < n && result == 0; i++) {
+        if (fat_get(m->map[i]) + 1 == (uint32_t)-1) result = -1;
+    }
+    uint32_t taken = 0;
+    while (result == 0 && taken < n && fat_set(m->map[taken], fat_get(m->map[taken]) + 1) == 0) taken++;
+    if (result == 0 && taken < n) {
+        while (taken > 0) {
+            taken--;
+            fat_set(m->map[taken], fat_get(m->map[taken]) - 1);
         }
-        
-        block = fat[block];
+        result = -1;
     }
+    pthread_mutex_unlock(&dedup_lock);
+    if (result == 0) {
+        dm->map_len = n;
+        dm->index_valid = 1;
+        dent(dst)->size = dent(src)->size;
+        dir_dirty(dst);
+    }
+    pthread_rwlock_unlock(&txn_lock);
+    return result;
+}
 
-done:
-    fd_table[fildes].offset += written;
-    dir[dir_index].modified = time(NULL);
-    return written;
+// Copies a compressed file into dst a chunk at a time
+static int copy_file(int src, int dst) {
+    char *buf = malloc(chunk_size());
+    if (!buf || !get_index(src)) {
+        free(buf);
+        return -1;
+    }
+    uint64_t size = dent(src)->size;
+    int result = 0;
+    for (uint64_t off = 0; off < size && result == 0; ) {
+        size_t len = size - off < chunk_size() ? size - off : chunk_size();
+        if (read_at(src, NULL, buf, len, off) != (int)len || write_at(dst, NULL, buf, len, off) != (int)len) {
+            result = -1;
+        }
+        off += len;
+    }
+    free(buf);
+    return result;
 }
 
-int fs_get_filesize(int fildes) {
-    if (disk_fd == -1) return -1;
-    if (fildes < 0 || fildes >= MAX_FD || !fd_table[fildes].used) return -1;
+// Makes a pending entry called name with the contents of src and returns
+// it. The caller holds dir_lock and the lock of src exclusively, and makes
+// the entry visible.
+static int clone_entry(int src, const char *name) {
+    dir_entry_t *s = dent(src);
+    if (dext(src)->aio_pending > 0) return -1;
+    wb_flush_file(src, -1);
+    if (!(s->flags & (ENTRY_INLINE | ENTRY_INDEXED)) && s->size > 0 && share_file(src) == -1) return -1;
     
-    int dir_index = fd_table[fildes].dir_index;
-    return dir[dir_index].size;
+    pthread_rwlock_rdlock(&txn_lock);
+    int dst = create_entry(name, SNAPSHOT_PENDING);
+    if (dst != -1) {
+        dent(dst)->flags = s->flags;
+        if (s->flags & ENTRY_INLINE) {
+            memcpy(dent(dst)->inline_data, s->inline_data, INLINE_MAX);
+            dent(dst)->size = s->size;
+        }
+    }
+    pthread_rwlock_unlock(&txn_lock);
+    if (dst == -1) return -1;
+    
+    int result = 0;
+    if (s->flags & ENTRY_DEDUP) result = share_map(src, dst);
+    else if (s->flags & ENTRY_COMPRESSED) result = copy_file(src, dst);
+    pthread_rwlock_rdlock(&txn_lock);
+    if (result == -1) {
+        remove_entry(dst);
+    } else {
+        dent(dst)->modified = s->modified;
+        dir_dirty(dst);
+    }
+    pthread_rwlock_unlock(&txn_lock);
+    return result == -1 ? -1 : dst;
 }
 
-int fs_lseek(int fildes, off_t offset) {
+static int do_clone(char *src, char *dst) {
     if (disk_fd == -1) return -1;
-    if (fildes < 0 || fildes >= MAX_FD || !fd_table[fildes].used) return -1;
+    if (strlen(dst) > MAX_FILE_NAME) return -1;
     
-    int dir_index = fd_table[fildes].dir_index;
-    if (offset < 0 || offset > dir[dir_index].size) return -1;
+    pthread_rwlock_wrlock(&dir_lock);
+    int from = find_file(src);
+    int result = -1;
+    if (from != -1 && find_file(dst) == -1) {
+        pthread_rwlock_wrlock(file_lock(from));
+        int to = clone_entry(from, dst);
+        pthread_rwlock_unlock(file_lock(from));
+        
+        if (to != -1) {
+            pthread_rwlock_rdlock(&txn_lock);
+            dent(to)->snapshot = 0;
+            result = index_insert(to);
+            if (result == -1) {
+                dent(to)->snapshot = SNAPSHOT_PENDING;
+                remove_entry(to);
+            }
+            dir_dirty(to);
+            pthread_rwlock_unlock(&txn_lock);
+        }
+    }
+    pthread_rwlock_unlock(&dir_lock);
     
-    fd_table[fildes].offset = offset;
-    return 0;
+    if (result == -1) return -1;
+    return metadata_changed();
 }
 
-int fs_truncate(int fildes, off_t length) { // off_t 
+// Clones every live file into the lowest free snapshot number. All the
+// files stay locked throughout so the copy is of one moment.
+static int do_snapshot() {
     if (disk_fd == -1) return -1;
-    if (fildes < 0 || fildes >= MAX_FD || !fd_table[fildes].used) return -1;
-    
-    int dir_index = fd_table[fildes].dir_index;
-    uint32_t size = dir[dir_index].size;
     
-    if (length > size) return -1;
-    if (length == size) return 0;
+    pthread_rwlock_wrlock(&dir_lock);
+    uint32_t live = 0;
+    for (uint32_t i = 0; i < dir_entries; i++) {
+        if (entry_used(i, 1)) live++;
+    }
+    int id = 1;
+    while (id <= FS_MAX_SNAPSHOTS && snapshot_count[id] > 0) id++;
     
-    // Find the block where truncation happens
-    uint32_t block = dir[dir_index].first_block;
-    uint32_t trunc_block = length / BLOCK_SIZE;
-    uint32_t i = 0;
-    uint32_t prev_block = (uint32_t)-1;
+    int32_t *files = malloc((live + 1) * sizeof(int32_t));
+    int32_t *made = malloc((live + 1) * sizeof(int32_t));
+    int result = id <= FS_MAX_SNAPSHOTS && files && made ? 0 : -1;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < dir_entries && result == 0; i++) {
+        if (!entry_used(i, 1)) continue;
+        if (entry_load(i) == -1) {
+            result = -1;
+            break;
+        }
+        pthread_rwlock_wrlock(file_lock(i));
+        files[count++] = i;
+        if (dext(i)->aio_pending > 0) result = -1;
+    }
     
-    while (i < trunc_block && block != (uint32_t)-1) {
-        prev_block = block;
-        block = fat[block];
-        i++;
+    uint32_t done = 0;
+    for (; done < count && result == 0; done++) {
+        made[done] = clone_entry(files[done], dent(files[done])->name);
+        if (made[done] == -1) result = -1;
     }
+    if (result == -1 && done > 0) done--;
     
-    // Free all remaining blocks
-    if (block != (uint32_t)-1) {
-        if (prev_block != (uint32_t)-1) {
-            fat[prev_block] = (uint32_t)-1;
+    // The new entries become the snapshot's list
+    pthread_rwlock_rdlock(&txn_lock);
+    for (uint32_t i = 0; i < done && result == 0; i++) dent(made[i])->snapshot = id;
+    if (result == 0 && done > 0 && index_insert_many(made, done) == -1) result = -1;
+    for (uint32_t i = 0; i < done; i++) {
+        if (result == 0) {
+            dir_dirty(made[i]);
         } else {
-            dir[dir_index].first_block = (uint32_t)-1;
-        }
-        
-        while (block != (uint32_t)-1) {
-            uint32_t next_block = fat[block];
-            fat[block] = 0;
-            sb.free_blocks++;
-            block = next_block;
+            dent(made[i])->snapshot = SNAPSHOT_PENDING;
+            remove_entry(made[i]);
         }
     }
+    pthread_rwlock_unlock(&txn_lock);
+    if (result == 0 && done > 0) {
+        snapshot_files[id] = made;
+        snapshot_count[id] = done;
+        made = NULL;
+    }
+    for (uint32_t i = 0; i < count; i++) pthread_rwlock_unlock(file_lock(files[i]));
+    pthread_rwlock_unlock(&dir_lock);
+    free(files);
+    free(made);
     
-    // Update file size and offset if needed
-    dir[dir_index].size = length;
-    if (fd_table[fildes].offset > length) {
-        fd_table[fildes].offset = length;
+    if (result == -1 || metadata_changed() == -1) return -1;
+    return id;
+}
+
+static int do_open_snapshot(int snapshot, char *name) {
+    if (disk_fd == -1 || snapshot < 1 || snapshot > FS_MAX_SNAPSHOTS) return -1;
+    
+    pthread_rwlock_rdlock(&dir_lock);
+    int dir_index = find_entry(snapshot, name);
+    int fd = dir_index == -1 ? -1 : open_entry(dir_index, 1);
+    pthread_rwlock_unlock(&dir_lock);
+    trim_cache();
+    return fd;
+}
+
+static int do_delete_snapshot(int snapshot) {
+    if (disk_fd == -1 || snapshot < 1 || snapshot > FS_MAX_SNAPSHOTS) return -1;
+    
+    pthread_rwlock_wrlock(&dir_lock);
+    int32_t *files = snapshot_files[snapshot];
+    uint32_t count = snapshot_count[snapshot];
+    int result = count > 0 ? 0 : -1;
+    for (uint32_t i = 0; i < count && result == 0; i++) {
+        if (file_is_open(files[i])) result = -1;
+    }
+    pthread_rwlock_rdlock(&txn_lock);
+    uint32_t done = 0;
+    for (; done < count && result == 0; done++) {
+        if (entry_load(files[done]) == -1 || remove_entry(files[done]) == -1) result = -1;
     }
+    pthread_rwlock_unlock(&txn_lock);
     
-    dir[dir_index].modified = time(NULL);
-    return 0;
-}
\ No newline at end of file
+    // What could not be removed stays listed
+    if (result == 0) {
+        free(files);
+        snapshot_files[snapshot] = NULL;
+        snapshot_count[snapshot] = 0;
+    } else if (done > 0) {
+        done--;
+        memmove(files, files + done, (count - done) * sizeof(int32_t));
+        snapshot_count[snapshot] = count - done;
+    }
+    pthread_rwlock_unlock(&dir_lock);
+    
+    if (result == -1) return -1;
+    return metadata_changed();
+}
+
+// Entry points, timed when built with FS_STATS
+int make_fs(char *disk_name) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_MAKE, t, do_make(disk_name));
+}
+
+int mount_fs(char *disk_name) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_MOUNT, t, do_mount(disk_name, FS_BACKEND_FILE));
+}
+
+int mount_fs_backend(char *disk_name, int backend) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_MOUNT, t, do_mount(disk_name, backend));
+}
+
+int umount_fs(char *disk_name) {
+    (void)disk_name;
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_UMOUNT, t, do_umount());
+}
+
+int fs_sync() {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_SYNC, t, do_sync());
+}
+
+int fs_create(char *name) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_CREATE, t, do_create(name));
+}
+
+int fs_delete(char *name) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_DELETE, t, do_delete(name));
+}
+
+int fs_open(char *name) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_OPEN, t, do_open(name));
+}
+
+int fs_close(int fildes) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_CLOSE, t, do_close(fildes));
+}
+
+int fs_read(int fildes, void *buf, size_t nbyte) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_READ, t, do_read(fildes, buf, nbyte));
+}
+
+int fs_write(int fildes, void *buf, size_t nbyte) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_WRITE, t, do_write(fildes, buf, nbyte));
+}
+
+int fs_pread(int fildes, void *buf, size_t nbyte, off_t offset) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_PREAD, t, do_pread(fildes, buf, nbyte, offset));
+}
+
+int fs_pwrite(int fildes, void *buf, size_t nbyte, off_t offset) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_PWRITE, t, do_pwrite(fildes, buf, nbyte, offset));
+}
+
+off_t fs_get_filesize(int fildes) {
+    uint64_t t = stat_begin();
+    off_t size = do_get_filesize(fildes);
+    stat_end(FS_OP_GET_FILESIZE, t, size == -1 ? -1 : 0);
+    return size;
+}
+
+int fs_lseek(int fildes, off_t offset) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_LSEEK, t, do_lseek(fildes, offset));
+}
+
+int fs_truncate(int fildes, off_t length) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_TRUNCATE, t, do_truncate(fildes, length));
+}
+
+int fs_fallocate(int fildes, off_t length) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_FALLOCATE, t, do_fallocate(fildes, length));
+}
+
+int fs_read_view(int fildes, struct iovec *iov, int iovcnt, size_t nbyte) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_READ_VIEW, t, do_read_view(fildes, iov, iovcnt, nbyte));
+}
+
+int fs_read_async(int fildes, void *buf, size_t nbyte, fs_aio_callback cb, void *arg) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_READ_ASYNC, t, do_read_async(fildes, buf, nbyte, cb, arg));
+}
+
+int fs_write_async(int fildes, void *buf, size_t nbyte, fs_aio_callback cb, void *arg) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_WRITE_ASYNC, t, do_write_async(fildes, buf, nbyte, cb, arg));
+}
+
+int fs_aio_wait(int min_completions) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_AIO_WAIT, t, do_aio_wait(min_completions));
+}
+
+int fs_defrag(uint32_t max_blocks) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_DEFRAG, t, do_defrag(max_blocks));
+}
+
+int fs_clone(char *src, char *dst) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_CLONE, t, do_clone(src, dst));
+}
+
+int fs_snapshot() {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_SNAPSHOT, t, do_snapshot());
+}
+
+int fs_create_many(char **names, int count) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_CREATE_MANY, t, change_many(names, count, 1));
+}
+
+int fs_delete_many(char **names, int count) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_DELETE_MANY, t, change_many(names, count, 0));
+}
+
+int fs_readv(int fildes, const struct iovec *iov, int iovcnt) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_READV, t, do_readv(fildes, iov, iovcnt));
+}
+
+int fs_writev(int fildes, const struct iovec *iov, int iovcnt) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_WRITEV, t, do_writev(fildes, iov, iovcnt));
+}
+
+int fs_read_batch(fs_read_req_t *reqs, int count) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_READ_BATCH, t, do_read_batch(reqs, count));
+}
+
+int fs_set_compression(int fildes, int enable) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_SET_COMPRESSION, t, do_set_compression(fildes, enable));
+}
+
+int fs_set_dedup(int fildes, int enable) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_SET_DEDUP, t, do_set_dedup(fildes, enable));
+}
+
+int fs_fragmentation(fs_frag_t *files, int max) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_FRAGMENTATION, t, do_fragmentation(files, max));
+}
+
+int fs_open_snapshot(int snapshot, char *name) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_OPEN_SNAPSHOT, t, do_open_snapshot(snapshot, name));
+}
+
+int fs_delete_snapshot(int snapshot) {
+    uint64_t t = stat_begin();
+    return stat_end(FS_OP_DELETE_SNAPSHOT, t, do_delete_snapshot(snapshot));
+}
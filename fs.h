@@ -4,47 +4,183 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
+// Geometry is chosen at make_fs time (fs_set_geometry); these are the defaults
 #define BLOCK_SIZE 4096
 #define NUM_BLOCKS 8192
-#define DATA_BLOCKS 4096
-#define MAX_FILES 64
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE 65536
+#define JOURNAL_BLOCKS 1024
 #define MAX_FILE_NAME 15
 #define MAX_FD 32
 #define MAGIC_NUMBER 0x46534653 // "FSFS" in hex
+#define FS_VERSION 12 // Bumped whenever the on-disk layout changes
+
+// Disk backends for mount_fs_backend
+#define FS_BACKEND_FILE 0 // pread/pwrite through the block cache
+#define FS_BACKEND_MMAP 1 // whole image mapped into memory
 
 // File system structures
 typedef struct {
     uint32_t magic;
     uint32_t fat_start;
     uint32_t fat_blocks;
-    uint32_t dir_start;
-    uint32_t dir_blocks;
+    uint32_t dir_start;  // First data block of the directory chain
+    uint32_t dir_blocks; // Length of the directory chain
     uint32_t data_start;
     uint32_t free_blocks;
     uint32_t created;
     uint32_t last_mounted;
+    uint32_t version;
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    uint32_t stripe_images;  // Backing images the volume is striped across
+    uint32_t stripe_blocks;  // Blocks per stripe
+    uint32_t block_size;
+    uint32_t num_blocks;     // Whole volume, superblock included
+    uint32_t data_blocks;    // Data region, from data_start to the end
+    uint32_t dedup_start;    // Hash index of shared blocks, after the FAT
+    uint32_t dedup_blocks;
+    uint32_t summary_start;  // Used entries per FAT block, after the dedup index
+    uint32_t summary_blocks;
+    uint32_t keys_start;     // First data block of the directory's key chain
+    uint32_t keys_blocks;
 } superblock_t;
 
+// Where a file's data lives, in dir_entry_t.flags. With neither flag the
+// chain holds all of it.
+#define ENTRY_INLINE 0x1 // all in inline_data, no chain
+#define ENTRY_TAIL 0x2   // whole blocks in the chain, the rest in a tail slot
+#define ENTRY_COMPRESSED 0x4 // chain holds compressed chunks
+#define ENTRY_DEDUP 0x8      // chain holds a map of shared blocks
+#define ENTRY_CLONED 0x10    // dedup only since it was cloned; plain again once it shares nothing
+#define INLINE_MAX 84    // fills the entry out to 128 bytes
+
 typedef struct {
     char name[MAX_FILE_NAME + 1];
-    uint32_t size;
+    uint64_t size;
     uint32_t first_block;
     uint32_t created;
     uint32_t modified;
+    uint32_t tail_block;     // Data block shared by packed tails
+    uint8_t tail_slot;       // First slot of ours in it
+    uint8_t flags;
     uint8_t used;
+    uint8_t snapshot;        // 0 for a live file, else the snapshot it is in
+    char inline_data[INLINE_MAX];
 } dir_entry_t;
 
+// The key chain holds one of these per directory entry, in entry order, so
+// mount can index names and find free entries and used tail slots without
+// reading the directory. A directory block's keys are rewritten whenever
+// it is.
+typedef struct {
+    uint32_t hash;           // Of snapshot and name
+    uint32_t tail_block;
+    uint8_t used;
+    uint8_t snapshot;
+    uint8_t tail_slot;
+    uint8_t tail_slots;      // 0 without a packed tail
+} dir_key_t;
+
+// A compressed file is cut into chunks of CHUNK_BLOCKS blocks of data. Each
+// one is stored in as few blocks as it compresses into, led by this header,
+// one after another along the chain.
+#define CHUNK_BLOCKS 16
+#define CHUNK_MAGIC 0x4b4e4843 // "CHNK" in hex
+
+typedef struct {
+    uint32_t magic;
+    uint32_t raw_len;        // File bytes in the chunk
+    uint32_t stored_len;     // Bytes after the header, raw_len if stored as is
+} chunk_header_t;
+
+// A dedup file's chain is an array of uint32_t block numbers, one per block
+// of the file, pointing at shared blocks. Instead of a link, the FAT entry of
+// a shared block holds FAT_SHARED plus the number of references to it.
+#define FAT_SHARED 0x80000000u
+
+// The dedup index is a hash table of shared blocks by content hash, with one
+// slot per DEDUP_SPAN data blocks in buckets of DEDUP_WAYS. A full bucket
+// forgets an old entry to make room. Entries are hints, checked against the
+// block before use.
+#define DEDUP_SPAN 2
+#define DEDUP_WAYS 8
+
+typedef struct {
+    uint64_t hash;
+    uint32_t block;          // 0 when empty
+    uint32_t unused;
+} dedup_slot_t;
+
 typedef struct {
     int32_t dir_index;
-    uint32_t offset;
+    uint64_t offset;
+    uint32_t extent; // Extent of the last block accessed, a lookup hint
     uint8_t used;
+    uint64_t ra_expect;  // Offset a sequential fs_read would continue from
+    uint32_t ra_seq;     // Sequential fs_reads in a row, up to the trigger
+    uint32_t ra_window;  // Current readahead window in bytes, 0 when off
+    uint8_t read_only;   // Opened in a snapshot
 } file_desc_t;
 
 // File system API
+//
+// Every call except make_fs, mount_fs and umount_fs may be made from several
+// threads at once. Each file has a reader/writer lock, so reads of any files
+// run in parallel and writes to different files do too. A descriptor's
+// offset is not locked: threads sharing a descriptor should use
+// fs_pread/fs_pwrite.
+//
+// disk_name may list several images separated by commas, one per device, to
+// stripe the volume across them. mount_fs must be given the same list in the
+// same order.
 int make_fs(char *disk_name);
 int mount_fs(char *disk_name);
+int mount_fs_backend(char *disk_name, int backend);
 int umount_fs(char *disk_name);
+int fs_sync();
+
+// Blocks per stripe for volumes made by later make_fs calls, 16 by default.
+// Transfers covering several stripes run on all of their images at once.
+int fs_set_stripe_blocks(uint32_t blocks);
+
+// Block size (a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE) and
+// volume size in blocks for volumes made by later make_fs calls. The FAT is
+// sized to match. Defaults to BLOCK_SIZE and NUM_BLOCKS.
+int fs_set_geometry(uint32_t block_size, uint32_t num_blocks);
+
+// Largest readahead window in bytes, 1 MiB by default; 0 turns readahead
+// off. Once fs_read sees a descriptor reading sequentially, background
+// threads read ahead of it into memory, starting with a small window that
+// doubles while the pattern holds and halves when it breaks. Applies from
+// the next mount_fs.
+int fs_set_readahead(uint32_t max_bytes);
+
+// Size of each descriptor's write buffer in bytes, 64 KiB by default and
+// rounded to whole blocks; 0 turns it off. fs_write calls smaller than the
+// buffer that continue where the last one ended are collected in it and
+// written a block at a time. Everything else that uses the file, fs_close
+// and fs_sync write it out first. An error writing out buffered data is
+// reported by the descriptor's next fs_write or fs_close. Applies from the
+// next mount_fs.
+int fs_set_write_buffer(uint32_t max_bytes);
+
+// Most FAT, dedup index and directory blocks kept in memory, 8192 by
+// default; 0 keeps them all. Blocks are read in as they are needed, and
+// past the limit clean ones are dropped again, least recently used first,
+// once their last change has been checkpointed out of the journal.
+// Directory blocks of open files stay. Applies from the next mount_fs.
+int fs_set_meta_cache(uint32_t blocks);
+
+// Controls when metadata changes (FAT, directory, superblock) are committed
+// to the journal. 0, the default, commits them as part of every create and
+// delete. A positive value batches them until that many seconds have passed,
+// checked on each call that changes metadata. -1 batches them until fs_sync
+// or umount_fs. Only changed blocks are logged, and each commit costs a
+// single fsync however many operations it covers.
+int fs_set_sync_interval(int seconds);
 
 // File operations
 int fs_open(char *name);
@@ -53,8 +189,183 @@ int fs_create(char *name);
 int fs_delete(char *name);
 int fs_read(int fildes, void *buf, size_t nbyte);
 int fs_write(int fildes, void *buf, size_t nbyte);
-int fs_get_filesize(int fildes);
+
+// Like fs_read/fs_write at an explicit offset, leaving the descriptor's
+// offset alone. fs_pwrite cannot start past the end of the file.
+int fs_pread(int fildes, void *buf, size_t nbyte, off_t offset);
+int fs_pwrite(int fildes, void *buf, size_t nbyte, off_t offset);
+off_t fs_get_filesize(int fildes);
 int fs_lseek(int fildes, off_t offset);
 int fs_truncate(int fildes, off_t length);
 
-#endif // FS_H
\ No newline at end of file
+// Turns LZ compression of an empty file on or off. Reads and fs_lseek stay
+// random access; a write recompresses each chunk it touches. Compressed
+// files cannot be fs_fallocate'd or mapped by fs_read_view, and async calls
+// on them run before returning.
+int fs_set_compression(int fildes, int enable);
+
+// Turns block deduplication of an empty file on or off. Each block written is
+// hashed and, if a block with the same contents is already stored by any
+// dedup file, shared with it instead of written. Shared blocks are never
+// changed in place: rewriting one stores a new block. Like compressed
+// files, dedup files cannot be fs_fallocate'd or mapped by fs_read_view,
+// and async calls on them run before returning.
+int fs_set_dedup(int fildes, int enable);
+
+// Reserves blocks, as contiguous as possible, for the first length bytes of a
+// file without changing its size. Fails without reserving anything if the
+// disk does not have room.
+int fs_fallocate(int fildes, off_t length);
+
+// Zero-copy read for FS_BACKEND_MMAP mounts. Fills iov with pointers into the
+// mapped image covering up to nbyte bytes from the current offset, one entry
+// per physically contiguous run, and advances the offset past them. Returns
+// the number of entries used. The pointers are valid until the file is next
+// written, truncated, deleted or defragmented, or the file system is
+// unmounted.
+int fs_read_view(int fildes, struct iovec *iov, int iovcnt, size_t nbyte);
+
+// Asynchronous I/O. The whole request is split into one block request per
+// contiguous run and queued at once; the offset moves immediately. cb runs
+// from fs_aio_wait with the byte count, or -1 on failure. buf must stay valid
+// until then.
+typedef void (*fs_aio_callback)(int fildes, int result, void *arg);
+int fs_read_async(int fildes, void *buf, size_t nbyte, fs_aio_callback cb, void *arg);
+int fs_write_async(int fildes, void *buf, size_t nbyte, fs_aio_callback cb, void *arg);
+
+// Waits until at least min_completions async calls have finished and returns
+// how many did
+int fs_aio_wait(int min_completions);
+
+// How fragmented one file's chain is
+typedef struct {
+    char name[MAX_FILE_NAME + 1];
+    uint32_t blocks;
+    uint32_t extents;    // runs of adjacent blocks, 1 when contiguous
+} fs_frag_t;
+
+// Fills in up to max entries, one per file with blocks in a chain, and
+// returns how many such files there are
+int fs_fragmentation(fs_frag_t *files, int max);
+
+// One step of online defragmentation: moves up to max_blocks blocks of a
+// fragmented file toward a single run and returns how many moved, or 0 once
+// no file can be improved. Call it until it returns 0, between other work if
+// need be: the file is only locked while its blocks are copied, and open
+// descriptors carry on as before. Each step is synced and committed before
+// the blocks it vacated are reused. Dedup files and files with async calls
+// in flight are left alone.
+int fs_defrag(uint32_t max_blocks);
+
+// Copies file src to a new file dst without copying its data: both end up
+// dedup files sharing every block, and a write to either stores new blocks
+// for the part written (see fs_set_dedup). A file that is not a dedup file
+// yet is turned into one in place, which costs a map block per
+// block_size / 4 blocks of file and gives back blocks reserved past its end.
+// Once nothing shares its blocks any more it is made a plain file again on
+// its next read or write. Compressed files are the exception and are copied.
+// Fails if dst exists or src has async calls in flight.
+int fs_clone(char *src, char *dst);
+
+// Read-only point-in-time copy of every file, made like fs_clone, so it
+// takes no data blocks until the files are changed. Returns the snapshot's
+// number, from 1 to FS_MAX_SNAPSHOTS. Fails if any file has async calls in
+// flight.
+#define FS_MAX_SNAPSHOTS 254
+int fs_snapshot();
+
+// Opens a file as it was when the snapshot was taken. The descriptor can be
+// read, seeked and closed; writes, truncation and layout changes fail.
+int fs_open_snapshot(int snapshot, char *name);
+
+// Deletes a snapshot, freeing the blocks only it still uses. Fails if any of
+// its files is open.
+int fs_delete_snapshot(int snapshot);
+
+// Batched directory changes: the named files are created or deleted under
+// one directory lock and committed together, once, at the end. Names that
+// cannot be (too long, taken, missing or open) are skipped. Returns how many
+// succeeded.
+int fs_create_many(char **names, int count);
+int fs_delete_many(char **names, int count);
+
+// fs_read and fs_write over several buffers, filled or drained in order from
+// the current offset while the file is locked once
+int fs_readv(int fildes, const struct iovec *iov, int iovcnt);
+int fs_writev(int fildes, const struct iovec *iov, int iovcnt);
+
+// One read of an fs_read_batch call, done like fs_pread; result gets the
+// byte count or -1
+typedef struct {
+    int fildes;
+    off_t offset;
+    size_t nbyte;
+    void *buf;
+    int result;
+} fs_read_req_t;
+
+// Serves count reads, possibly of different files, in the order their data
+// sits on disk rather than the order given. Returns how many succeeded.
+int fs_read_batch(fs_read_req_t *reqs, int count);
+
+// Instrumentation, compiled in with -DFS_STATS (make STATS=1). Without it the
+// hooks compile to nothing and these calls return -1.
+enum {
+    FS_OP_MAKE, FS_OP_MOUNT, FS_OP_UMOUNT, FS_OP_SYNC,
+    FS_OP_CREATE, FS_OP_DELETE, FS_OP_OPEN, FS_OP_CLOSE,
+    FS_OP_READ, FS_OP_WRITE, FS_OP_PREAD, FS_OP_PWRITE,
+    FS_OP_GET_FILESIZE, FS_OP_LSEEK, FS_OP_TRUNCATE, FS_OP_FALLOCATE,
+    FS_OP_READ_VIEW, FS_OP_READ_ASYNC, FS_OP_WRITE_ASYNC, FS_OP_AIO_WAIT,
+    FS_OP_DEFRAG, FS_OP_CLONE, FS_OP_SNAPSHOT, FS_OP_CREATE_MANY,
+    FS_OP_DELETE_MANY, FS_OP_READV, FS_OP_WRITEV, FS_OP_READ_BATCH,
+    FS_OP_SET_COMPRESSION, FS_OP_SET_DEDUP, FS_OP_FRAGMENTATION, FS_OP_OPEN_SNAPSHOT,
+    FS_OP_DELETE_SNAPSHOT, FS_OP_COUNT
+};
+
+#define FS_STATS_BUCKETS 32
+
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t total_ns;
+    uint64_t hist[FS_STATS_BUCKETS]; // hist[i]: calls taking 2^i to 2^(i+1) ns
+} fs_op_stats_t;
+
+typedef struct {
+    fs_op_stats_t ops[FS_OP_COUNT];
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t block_reads;       // block_read calls
+    uint64_t block_writes;      // block_write calls
+    uint64_t block_readvs;      // block_readv calls, async ones included
+    uint64_t block_writevs;
+    uint64_t syscalls;          // reads, writes, syncs and io_uring_enter calls
+    uint64_t rmw_blocks;        // partial blocks read back before being written
+    uint64_t fat_hops;          // FAT links followed walking chains
+    uint64_t alloc_calls;       // free-space searches
+    uint64_t alloc_scanned;     // free runs they looked at
+    uint64_t meta_flushes;      // journal transactions written
+    uint64_t meta_flush_bytes;  // bytes they wrote, header and commit included
+    uint64_t chunk_bytes_in;    // compressed-file data stored
+    uint64_t chunk_bytes_out;   // what it took on disk, headers included
+    uint64_t dedup_hits;        // blocks shared instead of written
+    uint64_t ra_bytes;          // bytes read ahead
+    uint64_t ra_hit_bytes;      // bytes fs_read found already read ahead
+    uint64_t coalesced_writes;  // fs_write calls taken into a write buffer
+    uint64_t defrag_blocks;     // blocks moved by fs_defrag
+    uint64_t meta_reads;        // FAT, dedup index and directory blocks read in
+    uint64_t meta_drops;        // and dropped again to stay within fs_set_meta_cache
+} fs_stats_t;
+
+// Totals over all threads since the start or the last fs_reset_stats
+int fs_get_stats(fs_stats_t *stats);
+int fs_reset_stats();
+
+// Writes the counters as text to fd
+int fs_dump_stats(int fd);
+
+// Dumps the counters to stderr every seconds seconds from a background
+// thread; 0 stops it
+int fs_set_stats_dump(int seconds);
+
+#endif // FS_H
\ No newline at end of file
@@ -0,0 +1,549 @@
+#include "fs.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+// Benchmark suite. Every run does a fixed amount of work from a fixed seed,
+// so two runs of the same build are comparable. One CSV row per result:
+//   ./fs_bench [-f file_sizes] [-b io_sizes] [-t threads] [-a append_size]
+//              [-n files] [-m mounts] [-y sync_interval] [-S seed]
+//              [-w workloads] [-d disk] [-B block_size] [-V volume_size]
+//              [-R readahead] [-W write_buffer] [-k batch] [-s]
+// Sizes take K and M suffixes and lists are comma separated, e.g.
+//   ./fs_bench -f 1M,4M -b 4K,64K -t 1,4 -w seqread,randread
+
+#define MAX_LIST 16
+#define BENCH_DISK "fs_bench.disk"
+#define MAX_BATCH 1024
+
+enum {
+    SEQ_WRITE, SEQ_READ, RAND_WRITE, RAND_READ, APPEND,
+    CREATE, OPEN, DELETE, MOUNT, UMOUNT, NUM_WORKLOADS
+};
+
+static const char *workload_names[NUM_WORKLOADS] = {
+    "seqwrite", "seqread", "randwrite", "randread", "append",
+    "create", "open", "delete", "mount", "umount",
+};
+
+typedef struct {
+    size_t file_sizes[MAX_LIST];
+    int num_file_sizes;
+    size_t io_sizes[MAX_LIST];
+    int num_io_sizes;
+    int threads[MAX_LIST];
+    int num_threads;
+    size_t append_size;
+    int files;
+    int mounts;
+    int sync_interval;
+    unsigned seed;
+    int enabled[NUM_WORKLOADS];
+    char *disk;
+    size_t block_size;
+    size_t volume_size;
+    size_t readahead;
+    size_t write_buffer;
+    int batch;
+    int stats;
+} config_t;
+
+static config_t cfg;
+
+// Latencies of one run, in nanoseconds
+typedef struct {
+    uint64_t *ns;
+    size_t count;
+} samples_t;
+
+typedef struct {
+    int id;
+    int workload;
+    int fd;
+    size_t file_size;
+    size_t io_size;
+    samples_t lat;
+    pthread_barrier_t *start;
+    uint64_t began;
+    uint64_t ended;
+    int failed;
+} worker_t;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Sorts the samples and prints the row for them
+static void report(int workload, size_t file_size, size_t io_size, int threads, samples_t *s, size_t bytes, uint64_t elapsed, int failed) {
+    double seconds = elapsed / 1e9;
+    double p50 = 0;
+    double p99 = 0;
+    if (s->count > 0) {
+        qsort(s->ns, s->count, sizeof(uint64_t), cmp_u64);
+        p50 = s->ns[s->count / 2] / 1e3;
+        p99 = s->ns[s->count * 99 / 100 < s->count - 1 ? s->count * 99 / 100 : s->count - 1] / 1e3;
+    }
+    printf("%s,%zu,%zu,%d,%zu,%zu,%.6f,%.2f,%.0f,%.2f,%.2f,%d\n", workload_names[workload], file_size, io_size,
+           threads, s->count, bytes, seconds, seconds > 0 ? bytes / seconds / (1024 * 1024) : 0,
+           seconds > 0 ? s->count / seconds : 0, p50, p99, failed);
+    fflush(stdout);
+
+    // Library counters for the run, with a build made with FS_STATS
+    if (cfg.stats) {
+        fs_dump_stats(STDERR_FILENO);
+        fs_reset_stats();
+    }
+}
+
+static int setup_fs() {
+    if (make_fs(cfg.disk) == -1 || mount_fs(cfg.disk) == -1) {
+        fprintf(stderr, "Error setting up %s\n", cfg.disk);
+        return -1;
+    }
+    fs_set_sync_interval(cfg.sync_interval);
+    return 0;
+}
+
+// ---- data workloads ----
+
+static void *data_worker(void *arg) {
+    worker_t *w = arg;
+    size_t ops = w->workload == APPEND ? w->file_size / cfg.append_size : w->file_size / w->io_size;
+    size_t io = w->workload == APPEND ? cfg.append_size : w->io_size;
+    size_t slots = w->file_size / w->io_size;
+    unsigned seed = cfg.seed * 7919 + w->id;
+    char *buf = malloc(io);
+    w->lat.ns = malloc(ops * sizeof(uint64_t));
+    w->lat.count = 0;
+    if (!buf || !w->lat.ns) {
+        w->failed = 1;
+        free(buf);
+        pthread_barrier_wait(w->start);
+        w->began = w->ended = now_ns();
+        return NULL;
+    }
+    memset(buf, 'a' + w->id % 26, io);
+
+    pthread_barrier_wait(w->start);
+    w->began = now_ns();
+    for (size_t i = 0; i < ops; i++) {
+        off_t off = (off_t)i * io;
+        if (w->workload == RAND_READ || w->workload == RAND_WRITE) {
+            off = (off_t)(rand_r(&seed) % slots) * io;
+        }
+
+        uint64_t t0 = now_ns();
+        int ret;
+        switch (w->workload) {
+        case SEQ_READ:
+        case RAND_READ:
+            ret = fs_pread(w->fd, buf, io, off);
+            break;
+        case APPEND:
+            ret = fs_write(w->fd, buf, io);
+            break;
+        default:
+            ret = fs_pwrite(w->fd, buf, io, off);
+            break;
+        }
+        w->lat.ns[w->lat.count++] = now_ns() - t0;
+        if (ret != (int)io) {
+            w->failed = 1;
+            break;
+        }
+    }
+    w->ended = now_ns();
+    free(buf);
+    return NULL;
+}
+
+// Runs one data workload with a file per thread and prints its row
+static int run_data(int workload, size_t file_size, size_t io_size, int threads, int *fds) {
+    pthread_t tids[MAX_FD];
+    worker_t workers[MAX_FD];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, threads + 1);
+
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (worker_t){ .id = i, .workload = workload, .fd = fds[i], .file_size = file_size,
+                                 .io_size = io_size, .start = &start };
+        pthread_create(&tids[i], NULL, data_worker, &workers[i]);
+    }
+    pthread_barrier_wait(&start);
+
+    // From the first worker starting to the last one finishing
+    samples_t all = { NULL, 0 };
+    size_t total = 0;
+    int failed = 0;
+    uint64_t began = UINT64_MAX;
+    uint64_t ended = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        total += workers[i].lat.count;
+        failed |= workers[i].failed;
+        if (workers[i].began < began) began = workers[i].began;
+        if (workers[i].ended > ended) ended = workers[i].ended;
+    }
+
+    // Writes are only done once they are on disk
+    if (workload == SEQ_WRITE || workload == RAND_WRITE || workload == APPEND) {
+        if (fs_sync() == -1) failed = 1;
+        ended = now_ns();
+    }
+    uint64_t elapsed = ended - began;
+
+    all.ns = malloc((total ? total : 1) * sizeof(uint64_t));
+    for (int i = 0; i < threads; i++) {
+        if (all.ns) memcpy(all.ns + all.count, workers[i].lat.ns, workers[i].lat.count * sizeof(uint64_t));
+        all.count += workers[i].lat.count;
+        free(workers[i].lat.ns);
+    }
+    pthread_barrier_destroy(&start);
+    if (!all.ns) return -1;
+
+    size_t io = workload == APPEND ? cfg.append_size : io_size;
+    if (cfg.enabled[workload]) report(workload, file_size, io, threads, &all, all.count * io, elapsed, failed);
+    free(all.ns);
+    return 0;
+}
+
+static int open_files(const char *prefix, int threads, int *fds) {
+    for (int i = 0; i < threads; i++) {
+        char name[MAX_FILE_NAME + 1];
+        snprintf(name, sizeof(name), "%s%d", prefix, i);
+        if (fs_create(name) == -1 || (fds[i] = fs_open(name)) == -1) return -1;
+    }
+    return 0;
+}
+
+// Sequential and random I/O for one file size, I/O size and thread count.
+// The sequential write lays the files out for the runs after it.
+static int bench_data(size_t file_size, size_t io_size, int threads) {
+    int fds[MAX_FD];
+    if (setup_fs() == -1) return -1;
+    if (open_files("data", threads, fds) == -1) {
+        fprintf(stderr, "Error creating files\n");
+        umount_fs(cfg.disk);
+        return -1;
+    }
+
+    int order[] = { SEQ_WRITE, SEQ_READ, RAND_WRITE, RAND_READ };
+    int ret = 0;
+    for (int i = 0; i < 4 && ret == 0; i++) {
+        // Later runs need the files the sequential write fills
+        if (cfg.enabled[order[i]] || order[i] == SEQ_WRITE) ret = run_data(order[i], file_size, io_size, threads, fds);
+    }
+    umount_fs(cfg.disk);
+    return ret;
+}
+
+static int bench_append(size_t file_size, int threads) {
+    int fds[MAX_FD];
+    if (setup_fs() == -1) return -1;
+    int ret = open_files("append", threads, fds);
+    if (ret == 0) ret = run_data(APPEND, file_size, cfg.append_size, threads, fds);
+    umount_fs(cfg.disk);
+    return ret;
+}
+
+// ---- metadata workloads ----
+
+typedef struct {
+    int id;
+    int threads;
+    int workload;
+    samples_t lat;
+    pthread_barrier_t *start;
+    uint64_t began;
+    uint64_t ended;
+    int failed;
+} meta_worker_t;
+
+static void *meta_worker(void *arg) {
+    meta_worker_t *w = arg;
+    int count = cfg.files / w->threads + (w->id < cfg.files % w->threads);
+    w->lat.ns = malloc((count ? count : 1) * sizeof(uint64_t));
+    w->lat.count = 0;
+    if (!w->lat.ns) w->failed = 1;
+    pthread_barrier_wait(w->start);
+    w->began = now_ns();
+
+    // Creates and deletes go through fs_create_many and fs_delete_many in
+    // batches with -k, each name charged an equal share of its batch's time
+    int batch = w->workload == OPEN ? 1 : cfg.batch;
+    char names[MAX_BATCH][MAX_FILE_NAME + 1];
+    char *list[MAX_BATCH];
+    for (int i = 0; i < count && !w->failed; i += batch) {
+        int n = count - i < batch ? count - i : batch;
+        for (int j = 0; j < n; j++) {
+            snprintf(names[j], sizeof(names[j]), "m%d_%d", w->id, i + j);
+            list[j] = names[j];
+        }
+        uint64_t t0 = now_ns();
+        int ret;
+        if (batch > 1) {
+            ret = w->workload == CREATE ? fs_create_many(list, n) : fs_delete_many(list, n);
+            if (ret != n) ret = -1;
+        } else if (w->workload == CREATE) {
+            ret = fs_create(list[0]);
+        } else if (w->workload == DELETE) {
+            ret = fs_delete(list[0]);
+        } else {
+            int fd = fs_open(list[0]);
+            ret = fd == -1 ? -1 : fs_close(fd);
+        }
+        uint64_t ns = (now_ns() - t0) / n;
+        for (int j = 0; j < n; j++) w->lat.ns[w->lat.count++] = ns;
+        if (ret == -1) w->failed = 1;
+    }
+    w->ended = now_ns();
+    return NULL;
+}
+
+static int run_meta(int workload, int threads) {
+    pthread_t tids[MAX_FD];
+    meta_worker_t workers[MAX_FD];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, threads + 1);
+
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (meta_worker_t){ .id = i, .threads = threads, .workload = workload, .start = &start };
+        pthread_create(&tids[i], NULL, meta_worker, &workers[i]);
+    }
+    pthread_barrier_wait(&start);
+
+    int failed = 0;
+    samples_t all = { malloc((cfg.files ? cfg.files : 1) * sizeof(uint64_t)), 0 };
+    uint64_t began = UINT64_MAX;
+    uint64_t ended = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        failed |= workers[i].failed;
+        if (workers[i].began < began) began = workers[i].began;
+        if (workers[i].ended > ended) ended = workers[i].ended;
+    }
+    if (workload != OPEN) {
+        if (fs_sync() == -1) failed = 1;
+        ended = now_ns();
+    }
+    uint64_t elapsed = ended - began;
+
+    for (int i = 0; i < threads; i++) {
+        if (all.ns) memcpy(all.ns + all.count, workers[i].lat.ns, workers[i].lat.count * sizeof(uint64_t));
+        all.count += workers[i].lat.count;
+        free(workers[i].lat.ns);
+    }
+    pthread_barrier_destroy(&start);
+    if (!all.ns) return -1;
+    if (cfg.enabled[workload]) report(workload, 0, 0, threads, &all, 0, elapsed, failed);
+    free(all.ns);
+    return 0;
+}
+
+// Creates, opens and deletes cfg.files files, split between the threads
+static int bench_meta(int threads) {
+    if (setup_fs() == -1) return -1;
+    int ret = 0;
+    int order[] = { CREATE, OPEN, DELETE };
+    for (int i = 0; i < 3 && ret == 0; i++) {
+        // Open and delete need the files the create run makes
+        if (cfg.enabled[order[i]] || order[i] == CREATE) ret = run_meta(order[i], threads);
+    }
+    umount_fs(cfg.disk);
+    return ret;
+}
+
+// Mounts and unmounts a volume holding cfg.files files
+static int bench_mount() {
+    if (setup_fs() == -1) return -1;
+    for (int i = 0; i < cfg.files; i++) {
+        char name[MAX_FILE_NAME + 1];
+        snprintf(name, sizeof(name), "m%d", i);
+        if (fs_create(name) == -1) break;
+    }
+    if (umount_fs(cfg.disk) == -1) return -1;
+
+    samples_t mount = { malloc(cfg.mounts * sizeof(uint64_t)), 0 };
+    samples_t umount = { malloc(cfg.mounts * sizeof(uint64_t)), 0 };
+    uint64_t mount_total = 0;
+    uint64_t umount_total = 0;
+    int failed = 0;
+    for (int i = 0; i < cfg.mounts && mount.ns && umount.ns; i++) {
+        uint64_t t0 = now_ns();
+        if (mount_fs(cfg.disk) == -1) {
+            failed = 1;
+            break;
+        }
+        uint64_t t1 = now_ns();
+        if (umount_fs(cfg.disk) == -1) failed = 1;
+        uint64_t t2 = now_ns();
+        mount.ns[mount.count++] = t1 - t0;
+        umount.ns[umount.count++] = t2 - t1;
+        mount_total += t1 - t0;
+        umount_total += t2 - t1;
+    }
+    if (cfg.enabled[MOUNT]) report(MOUNT, 0, 0, 1, &mount, 0, mount_total, failed);
+    if (cfg.enabled[UMOUNT]) report(UMOUNT, 0, 0, 1, &umount, 0, umount_total, failed);
+    free(mount.ns);
+    free(umount.ns);
+    return 0;
+}
+
+// ---- command line ----
+
+static size_t parse_size(const char *s) {
+    char *end;
+    size_t v = strtoull(s, &end, 10);
+    if (*end == 'k' || *end == 'K') v *= 1024;
+    else if (*end == 'm' || *end == 'M') v *= 1024 * 1024;
+    else if (*end == 'g' || *end == 'G') v *= 1024 * 1024 * 1024;
+    return v;
+}
+
+static int parse_sizes(char *list, size_t *out) {
+    int n = 0;
+    char *save;
+    for (char *p = strtok_r(list, ",", &save); p && n < MAX_LIST; p = strtok_r(NULL, ",", &save)) {
+        out[n++] = parse_size(p);
+    }
+    return n;
+}
+
+static int parse_workloads(char *list) {
+    memset(cfg.enabled, 0, sizeof(cfg.enabled));
+    char *save;
+    for (char *p = strtok_r(list, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+        int found = 0;
+        for (int i = 0; i < NUM_WORKLOADS; i++) {
+            if (strcmp(p, workload_names[i]) == 0) cfg.enabled[i] = found = 1;
+        }
+        if (!found) return -1;
+    }
+    return 0;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: fs_bench [-f file_sizes] [-b io_sizes] [-t threads] [-a append_size]\n"
+                    "                [-n files] [-m mounts] [-y sync_interval] [-S seed]\n"
+                    "                [-w workloads] [-d disk] [-B block_size] [-V volume_size]\n"
+                    "                [-R readahead] [-W write_buffer] [-k batch] [-s]\n"
+                    "workloads:");
+    for (int i = 0; i < NUM_WORKLOADS; i++) fprintf(stderr, " %s", workload_names[i]);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+    cfg.file_sizes[0] = 1024 * 1024;
+    cfg.num_file_sizes = 1;
+    cfg.io_sizes[0] = 4096;
+    cfg.io_sizes[1] = 64 * 1024;
+    cfg.num_io_sizes = 2;
+    cfg.threads[0] = 1;
+    cfg.threads[1] = 4;
+    cfg.num_threads = 2;
+    cfg.append_size = 64;
+    cfg.files = 1000;
+    cfg.mounts = 10;
+    cfg.sync_interval = 0;
+    cfg.seed = 1;
+    cfg.disk = BENCH_DISK;
+    cfg.block_size = BLOCK_SIZE;
+    cfg.volume_size = (size_t)NUM_BLOCKS * BLOCK_SIZE;
+    cfg.readahead = 1024 * 1024;
+    cfg.write_buffer = 64 * 1024;
+    cfg.batch = 1;
+    for (int i = 0; i < NUM_WORKLOADS; i++) cfg.enabled[i] = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:b:t:a:n:m:y:S:w:d:B:V:R:W:k:sh")) != -1) {
+        switch (opt) {
+        case 'f': cfg.num_file_sizes = parse_sizes(optarg, cfg.file_sizes); break;
+        case 'b': cfg.num_io_sizes = parse_sizes(optarg, cfg.io_sizes); break;
+        case 't': {
+            size_t t[MAX_LIST];
+            cfg.num_threads = parse_sizes(optarg, t);
+            for (int i = 0; i < cfg.num_threads; i++) cfg.threads[i] = t[i];
+            break;
+        }
+        case 'a': cfg.append_size = parse_size(optarg); break;
+        case 'n': cfg.files = atoi(optarg); break;
+        case 'm': cfg.mounts = atoi(optarg); break;
+        case 'y': cfg.sync_interval = atoi(optarg); break;
+        case 'S': cfg.seed = strtoul(optarg, NULL, 10); break;
+        case 'w':
+            if (parse_workloads(optarg) == -1) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'd': cfg.disk = optarg; break;
+        case 'B': cfg.block_size = parse_size(optarg); break;
+        case 'V': cfg.volume_size = parse_size(optarg); break;
+        case 'R': cfg.readahead = parse_size(optarg); break;
+        case 'W': cfg.write_buffer = parse_size(optarg); break;
+        case 'k': cfg.batch = atoi(optarg); break;
+        case 's': cfg.stats = 1; break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    for (int i = 0; i < cfg.num_threads; i++) {
+        if (cfg.threads[i] < 1 || cfg.threads[i] > MAX_FD - 1) {
+            fprintf(stderr, "threads must be between 1 and %d\n", MAX_FD - 1);
+            return 1;
+        }
+    }
+    if (cfg.append_size == 0 || cfg.files < 0 || cfg.mounts < 1 || cfg.batch < 1 || cfg.batch > MAX_BATCH) {
+        usage();
+        return 1;
+    }
+    size_t blocks = cfg.block_size ? cfg.volume_size / cfg.block_size : 0;
+    if (blocks > UINT32_MAX || fs_set_geometry(cfg.block_size, blocks) == -1) {
+        fprintf(stderr, "unsupported geometry: %zu byte blocks, %zu bytes\n", cfg.block_size, cfg.volume_size);
+        return 1;
+    }
+    if (cfg.readahead > UINT32_MAX || fs_set_readahead(cfg.readahead) == -1 ||
+        cfg.write_buffer > UINT32_MAX || fs_set_write_buffer(cfg.write_buffer) == -1) {
+        usage();
+        return 1;
+    }
+
+    // Roughly what the data region holds once the FAT and journal are taken
+    size_t capacity = (blocks - 2 - JOURNAL_BLOCKS - blocks / (cfg.block_size / 4)) * cfg.block_size;
+
+    printf("workload,file_size,io_size,threads,ops,bytes,seconds,mb_s,ops_s,p50_us,p99_us,errors\n");
+    int data = cfg.enabled[SEQ_WRITE] || cfg.enabled[SEQ_READ] || cfg.enabled[RAND_WRITE] || cfg.enabled[RAND_READ];
+    int ret = 0;
+    for (int t = 0; t < cfg.num_threads; t++) {
+        int threads = cfg.threads[t];
+        for (int f = 0; f < cfg.num_file_sizes; f++) {
+            size_t file_size = cfg.file_sizes[f];
+            if ((size_t)threads * file_size > capacity) {
+                fprintf(stderr, "skipping %d x %zu bytes: larger than the volume\n", threads, file_size);
+                continue;
+            }
+            for (int b = 0; b < cfg.num_io_sizes && data; b++) {
+                size_t io_size = cfg.io_sizes[b];
+                if (io_size == 0 || io_size > file_size) continue;
+                if (bench_data(file_size, io_size, threads) == -1) ret = 1;
+            }
+            if (cfg.enabled[APPEND] && bench_append(file_size, threads) == -1) ret = 1;
+        }
+        if ((cfg.enabled[CREATE] || cfg.enabled[OPEN] || cfg.enabled[DELETE]) && bench_meta(threads) == -1) ret = 1;
+    }
+    if ((cfg.enabled[MOUNT] || cfg.enabled[UMOUNT]) && bench_mount() == -1) ret = 1;
+    return ret;
+}
@@ -0,0 +1,548 @@
+#define _GNU_SOURCE
+#include "fs_client.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define CHUNK_IOV 64            // caller's buffers per request
+#define BATCH_MAX 4096          // fs_read_batch entries per request
+
+static int sock = -1;
+static char *shm = NULL;
+static size_t shm_size = 0;
+static uint32_t next_id = 0;
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Drops the connection, after which every call fails until fs_connect
+static void hang_up() {
+    close(sock);
+    sock = -1;
+    if (shm) munmap(shm, shm_size);
+    shm = NULL;
+    shm_size = 0;
+}
+
+// Moves the front of iov past n bytes, dropping the buffers used up
+static void iov_advance(struct iovec **iov, int *iovcnt, size_t n) {
+    while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+// Sends all of iov, which it consumes. fd, unless -1, goes along with the
+// first bytes through SCM_RIGHTS.
+static int send_all(struct iovec *iov, int iovcnt, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    iov_advance(&iov, &iovcnt, 0);
+    while (iovcnt > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        if (fd != -1) {
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type = SCM_RIGHTS;
+            cm->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+        }
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return -1;
+        fd = -1;
+        iov_advance(&iov, &iovcnt, n);
+    }
+    return 0;
+}
+
+// Fills all of iov, which it consumes
+static int recv_all(struct iovec *iov, int iovcnt) {
+    iov_advance(&iov, &iovcnt, 0);
+    while (iovcnt > 0) {
+        ssize_t n = readv(sock, iov, iovcnt);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        iov_advance(&iov, &iovcnt, n);
+    }
+    return 0;
+}
+
+// Sends a request with the cnt buffers of payload, at most CHUNK_IOV
+static int send_req(fs_msg_t *req, const struct iovec *payload, int cnt) {
+    struct iovec iov[CHUNK_IOV + 1];
+    iov[0] = (struct iovec){ req, sizeof(fs_msg_t) };
+    req->len = 0;
+    for (int i = 0; i < cnt; i++) {
+        iov[i + 1] = payload[i];
+        req->len += payload[i].iov_len;
+    }
+    req->id = next_id++;
+    if (send_all(iov, cnt + 1, -1) == -1) {
+        hang_up();
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the header of the reply to request id, which must be the next one
+static int recv_reply(uint32_t id, fs_msg_t *rep) {
+    struct iovec iov = { rep, sizeof(fs_msg_t) };
+    if (recv_all(&iov, 1) == -1 || rep->id != id || rep->len > FS_MSG_MAX) {
+        hang_up();
+        return -1;
+    }
+    return 0;
+}
+
+// A request that moves no data, carrying up to two names
+static int64_t call(uint16_t op, int fildes, int64_t arg, char *name, char *name2) {
+    struct iovec iov[2];
+    int cnt = 0;
+    if (name) iov[cnt++] = (struct iovec){ name, strnlen(name, MAX_FILE_NAME + 1) + 1 };
+    if (name2) iov[cnt++] = (struct iovec){ name2, strnlen(name2, MAX_FILE_NAME + 1) + 1 };
+    for (int i = 0; i < cnt; i++) {
+        if (iov[i].iov_len > MAX_FILE_NAME + 1) return -1;
+    }
+
+    fs_msg_t req = { .op = op, .fildes = fildes, .arg = arg };
+    fs_msg_t rep;
+    int64_t result = -1;
+    pthread_mutex_lock(&conn_lock);
+    if (sock != -1 && send_req(&req, iov, cnt) == 0 && recv_reply(req.id, &rep) == 0) {
+        if (rep.len == 0) result = rep.arg;
+        else hang_up();
+    }
+    pthread_mutex_unlock(&conn_lock);
+    return result;
+}
+
+// The first n bytes of cnt buffers; returns how many buffers they span
+static int iov_trim(struct iovec *iov, int cnt, size_t n) {
+    int i = 0;
+    for (; i < cnt && n > 0; i++) {
+        if (iov[i].iov_len > n) iov[i].iov_len = n;
+        n -= iov[i].iov_len;
+    }
+    return i;
+}
+
+// Copies n bytes between the shared buffer and iov
+static void shm_copy(struct iovec *iov, int cnt, size_t n, int to_shm) {
+    size_t pos = 0;
+    for (int i = 0; i < cnt && pos < n; i++) {
+        size_t len = iov[i].iov_len < n - pos ? iov[i].iov_len : n - pos;
+        if (to_shm) memcpy(shm + pos, iov[i].iov_base, len);
+        else memcpy(iov[i].iov_base, shm + pos, len);
+        pos += len;
+    }
+}
+
+// Moves the bytes of iov with read or write requests, each as large as the
+// shared buffer or, for less than FS_SHM_MIN, one message. Stops at the first
+// short one. The caller holds conn_lock.
+static int transfer(uint16_t op, int fildes, const struct iovec *iov, int iovcnt, off_t offset) {
+    int write = op == FS_REQ_WRITE || op == FS_REQ_PWRITE;
+    if (sock == -1 || iovcnt < 0 || (iovcnt > 0 && !iov)) return -1;
+    size_t left = 0;
+    for (int i = 0; i < iovcnt && left < INT_MAX; i++) left += iov[i].iov_len;
+    if (left > INT_MAX) left = INT_MAX;
+
+    size_t total = 0;
+    int i = 0;
+    size_t skip = 0;
+    do {
+        // The next request's share of iov
+        int use_shm = shm && left >= FS_SHM_MIN;
+        size_t max = use_shm ? shm_size : FS_MSG_MAX;
+        struct iovec part[CHUNK_IOV];
+        int cnt = 0;
+        size_t len = 0;
+        while (cnt < CHUNK_IOV && len < max && len < left && i < iovcnt) {
+            size_t n = iov[i].iov_len - skip;
+            if (n > max - len) n = max - len;
+            if (n > left - len) n = left - len;
+            if (n > 0) part[cnt++] = (struct iovec){ (char *)iov[i].iov_base + skip, n };
+            len += n;
+            skip += n;
+            if (skip == iov[i].iov_len) {
+                i++;
+                skip = 0;
+            }
+        }
+
+        fs_msg_t req = { .op = op, .flags = use_shm ? FS_MSG_SHM : 0, .fildes = fildes, .arg = offset + total, .nbyte = len };
+        fs_msg_t rep;
+        if (use_shm && write) shm_copy(part, cnt, len, 1);
+        int inline_write = write && !use_shm;
+        if (send_req(&req, part, inline_write ? cnt : 0) == -1 || recv_reply(req.id, &rep) == -1) return -1;
+        int64_t result = rep.arg;
+        size_t data = !write && !use_shm && result > 0 ? result : 0;
+        if (result < -1 || result > (int64_t)len || rep.len != data) {
+            hang_up();
+            return -1;
+        }
+        if (!write && result > 0) {
+            cnt = iov_trim(part, cnt, result);
+            if (use_shm) shm_copy(part, cnt, result, 0);
+            else if (recv_all(part, cnt) == -1) {
+                hang_up();
+                return -1;
+            }
+        }
+        if (result == -1) return total > 0 ? (int)total : -1;
+        total += result;
+        left -= result;
+        if ((size_t)result < len) break;
+    } while (left > 0);
+    return total;
+}
+
+static int locked_transfer(uint16_t op, int fildes, const struct iovec *iov, int iovcnt, off_t offset) {
+    pthread_mutex_lock(&conn_lock);
+    int result = transfer(op, fildes, iov, iovcnt, offset);
+    pthread_mutex_unlock(&conn_lock);
+    return result;
+}
+
+int fs_connect(char *socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (!socket_path) socket_path = FS_SOCKET;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, socket_path);
+
+    pthread_mutex_lock(&conn_lock);
+    if (sock != -1) {
+        pthread_mutex_unlock(&conn_lock);
+        return -1;
+    }
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        if (sock != -1) close(sock);
+        sock = -1;
+        pthread_mutex_unlock(&conn_lock);
+        return -1;
+    }
+
+    // The shared buffer is sealed at its size so the server can map it
+    // safely. Without one, everything travels through the socket.
+    int fd = memfd_create("fs_client", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd != -1 && ftruncate(fd, FS_SHM_SIZE) == 0 &&
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0) {
+        shm = mmap(NULL, FS_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (shm == MAP_FAILED) shm = NULL;
+        else shm_size = FS_SHM_SIZE;
+    }
+
+    fs_msg_t req = { .id = next_id++, .op = FS_REQ_HELLO, .nbyte = shm_size };
+    fs_msg_t rep;
+    struct iovec iov = { &req, sizeof(req) };
+    int ret = 0;
+    if (send_all(&iov, 1, shm ? fd : -1) == -1) {
+        hang_up();
+        ret = -1;
+    } else if (recv_reply(req.id, &rep) == -1) {
+        ret = -1;
+    } else if (rep.arg == -1 && shm) {
+        munmap(shm, shm_size);
+        shm = NULL;
+        shm_size = 0;
+    }
+    if (fd != -1) close(fd);
+    pthread_mutex_unlock(&conn_lock);
+    return ret;
+}
+
+int fs_disconnect() {
+    pthread_mutex_lock(&conn_lock);
+    int ret = sock == -1 ? -1 : 0;
+    if (sock != -1) hang_up();
+    pthread_mutex_unlock(&conn_lock);
+    return ret;
+}
+
+int fs_sync() {
+    return call(FS_REQ_SYNC, -1, 0, NULL, NULL);
+}
+
+int fs_create(char *name) {
+    return name ? call(FS_REQ_CREATE, -1, 0, name, NULL) : -1;
+}
+
+int fs_delete(char *name) {
+    return name ? call(FS_REQ_DELETE, -1, 0, name, NULL) : -1;
+}
+
+int fs_open(char *name) {
+    return name ? call(FS_REQ_OPEN, -1, 0, name, NULL) : -1;
+}
+
+int fs_close(int fildes) {
+    return call(FS_REQ_CLOSE, fildes, 0, NULL, NULL);
+}
+
+int fs_read(int fildes, void *buf, size_t nbyte) {
+    struct iovec iov = { buf, nbyte };
+    return locked_transfer(FS_REQ_READ, fildes, &iov, 1, 0);
+}
+
+int fs_write(int fildes, void *buf, size_t nbyte) {
+    struct iovec iov = { buf, nbyte };
+    return locked_transfer(FS_REQ_WRITE, fildes, &iov, 1, 0);
+}
+
+int fs_pread(int fildes, void *buf, size_t nbyte, off_t offset) {
+    struct iovec iov = { buf, nbyte };
+    return offset < 0 ? -1 : locked_transfer(FS_REQ_PREAD, fildes, &iov, 1, offset);
+}
+
+int fs_pwrite(int fildes, void *buf, size_t nbyte, off_t offset) {
+    struct iovec iov = { buf, nbyte };
+    return offset < 0 ? -1 : locked_transfer(FS_REQ_PWRITE, fildes, &iov, 1, offset);
+}
+
+int fs_readv(int fildes, const struct iovec *iov, int iovcnt) {
+    return locked_transfer(FS_REQ_READ, fildes, iov, iovcnt, 0);
+}
+
+int fs_writev(int fildes, const struct iovec *iov, int iovcnt) {
+    return locked_transfer(FS_REQ_WRITE, fildes, iov, iovcnt, 0);
+}
+
+off_t fs_get_filesize(int fildes) {
+    return call(FS_REQ_GET_FILESIZE, fildes, 0, NULL, NULL);
+}
+
+int fs_lseek(int fildes, off_t offset) {
+    return call(FS_REQ_LSEEK, fildes, offset, NULL, NULL);
+}
+
+int fs_truncate(int fildes, off_t length) {
+    return call(FS_REQ_TRUNCATE, fildes, length, NULL, NULL);
+}
+
+int fs_fallocate(int fildes, off_t length) {
+    return call(FS_REQ_FALLOCATE, fildes, length, NULL, NULL);
+}
+
+int fs_set_compression(int fildes, int enable) {
+    return call(FS_REQ_SET_COMPRESSION, fildes, enable, NULL, NULL);
+}
+
+int fs_set_dedup(int fildes, int enable) {
+    return call(FS_REQ_SET_DEDUP, fildes, enable, NULL, NULL);
+}
+
+int fs_defrag(uint32_t max_blocks) {
+    return call(FS_REQ_DEFRAG, -1, max_blocks, NULL, NULL);
+}
+
+int fs_clone(char *src, char *dst) {
+    return src && dst ? call(FS_REQ_CLONE, -1, 0, src, dst) : -1;
+}
+
+int fs_snapshot() {
+    return call(FS_REQ_SNAPSHOT, -1, 0, NULL, NULL);
+}
+
+int fs_open_snapshot(int snapshot, char *name) {
+    return name ? call(FS_REQ_OPEN_SNAPSHOT, -1, snapshot, name, NULL) : -1;
+}
+
+int fs_delete_snapshot(int snapshot) {
+    return call(FS_REQ_DELETE_SNAPSHOT, -1, snapshot, NULL, NULL);
+}
+
+// Sends the names in requests of up to FS_MSG_MAX bytes, FS_PIPELINE of them
+// in flight at once, and adds up how many each one changed
+static int change_many(uint16_t op, char **names, int count) {
+    if (count < 0 || (count > 0 && !names)) return -1;
+    char *buf = malloc(FS_MSG_MAX);
+    if (!buf) return -1;
+
+    pthread_mutex_lock(&conn_lock);
+    int done = sock == -1 ? -1 : 0;
+    uint32_t ids[FS_PIPELINE];
+    int sent = 0;
+    int got = 0;
+    int i = 0;
+    while (done != -1 && (i < count || got < sent)) {
+        if (i < count && sent - got < FS_PIPELINE) {
+            size_t len = 0;
+            uint64_t n = 0;
+            for (; i < count; i++) {
+                // Names the server would refuse are skipped here
+                size_t name_len = names[i] ? strnlen(names[i], MAX_FILE_NAME + 1) + 1 : 0;
+                if (name_len == 0 || name_len > MAX_FILE_NAME + 1) continue;
+                if (len + name_len > FS_MSG_MAX) break;
+                memcpy(buf + len, names[i], name_len);
+                len += name_len;
+                n++;
+            }
+            fs_msg_t req = { .op = op, .nbyte = n };
+            struct iovec iov = { buf, len };
+            if (send_req(&req, &iov, 1) == -1) done = -1;
+            else ids[sent++ % FS_PIPELINE] = req.id;
+        } else {
+            fs_msg_t rep;
+            if (recv_reply(ids[got++ % FS_PIPELINE], &rep) == -1) {
+                done = -1;
+            } else if (rep.len != 0) {
+                hang_up();
+                done = -1;
+            } else if (rep.arg > 0) {
+                done += rep.arg;
+            }
+        }
+    }
+    pthread_mutex_unlock(&conn_lock);
+    free(buf);
+    return done;
+}
+
+int fs_create_many(char **names, int count) {
+    return change_many(FS_REQ_CREATE_MANY, names, count);
+}
+
+int fs_delete_many(char **names, int count) {
+    return change_many(FS_REQ_DELETE_MANY, names, count);
+}
+
+// One FS_REQ_READ_BATCH request: entries [first, first + count)
+typedef struct {
+    uint32_t id;
+    int first;
+    int count;
+    int shm;                // uses the shared buffer
+} batch_msg_t;
+
+// Too big to fit a batch request, so read on its own
+static int batch_alone(fs_read_req_t *r) {
+    int to_shm = shm && r->nbyte >= FS_SHM_MIN && r->nbyte <= shm_size;
+    return !to_shm && r->nbyte > FS_MSG_MAX - sizeof(int32_t);
+}
+
+// Takes in the reply to m, storing the result and data of each of its
+// requests. Returns how many succeeded, or -1 when the connection failed.
+static int batch_reply(batch_msg_t *m, fs_batch_entry_t *ent, int *idx, fs_read_req_t *reqs) {
+    int32_t results[BATCH_MAX];
+    fs_msg_t rep;
+    if (recv_reply(m->id, &rep) == -1) return -1;
+    if (rep.arg == -1 && rep.len == 0) return 0;
+
+    size_t len = m->count * sizeof(int32_t);
+    struct iovec iov = { results, len };
+    if (rep.len < len || recv_all(&iov, 1) == -1) {
+        hang_up();
+        return -1;
+    }
+    int done = 0;
+    for (int k = 0; k < m->count; k++) {
+        fs_batch_entry_t *e = &ent[m->first + k];
+        fs_read_req_t *r = &reqs[idx[m->first + k]];
+        int32_t result = results[k];
+        size_t data = result > 0 && !(e->flags & FS_MSG_SHM) ? result : 0;
+        if (result < -1 || (result > 0 && (uint64_t)result > e->nbyte) || len + data > rep.len) {
+            hang_up();
+            return -1;
+        }
+        iov = (struct iovec){ r->buf, data };
+        if (data > 0 && recv_all(&iov, 1) == -1) {
+            hang_up();
+            return -1;
+        }
+        if (result > 0 && (e->flags & FS_MSG_SHM)) memcpy(r->buf, shm + e->shm, result);
+        len += data;
+        r->result = result;
+        if (result != -1) done++;
+    }
+    if (len != rep.len) {
+        hang_up();
+        return -1;
+    }
+    return done;
+}
+
+// Packs the reads into batch requests, each within one message of inline
+// data and the shared buffer, and keeps up to FS_PIPELINE of them in flight.
+// One that uses the shared buffer waits for the replies before it.
+int fs_read_batch(fs_read_req_t *reqs, int count) {
+    if (count < 0 || (count > 0 && !reqs)) return -1;
+    fs_batch_entry_t *ent = malloc((count ? count : 1) * sizeof(fs_batch_entry_t));
+    int *idx = malloc((count ? count : 1) * sizeof(int));
+    batch_msg_t *msgs = malloc((count ? count : 1) * sizeof(batch_msg_t));
+    if (!ent || !idx || !msgs) {
+        free(ent);
+        free(idx);
+        free(msgs);
+        return -1;
+    }
+
+    pthread_mutex_lock(&conn_lock);
+    int done = sock == -1 ? -1 : 0;
+    int n = 0;
+    int nmsg = 0;
+    size_t inline_len = 0;
+    size_t shm_used = 0;
+    for (int i = 0; i < count; i++) {
+        fs_read_req_t *r = &reqs[i];
+        r->result = -1;
+        if (batch_alone(r)) continue;
+        int to_shm = shm && r->nbyte >= FS_SHM_MIN && r->nbyte <= shm_size;
+        batch_msg_t *m = nmsg > 0 ? &msgs[nmsg - 1] : NULL;
+        if (!m || m->count == BATCH_MAX || (to_shm && r->nbyte > shm_size - shm_used) ||
+            (!to_shm && (m->count + 1) * sizeof(int32_t) + inline_len + r->nbyte > FS_MSG_MAX)) {
+            m = &msgs[nmsg++];
+            *m = (batch_msg_t){ .first = n };
+            inline_len = 0;
+            shm_used = 0;
+        }
+        ent[n] = (fs_batch_entry_t){ .fildes = r->fildes, .flags = to_shm ? FS_MSG_SHM : 0, .offset = r->offset,
+                                     .nbyte = r->nbyte, .shm = to_shm ? shm_used : 0 };
+        idx[n++] = i;
+        m->count++;
+        m->shm |= to_shm;
+        if (to_shm) shm_used += r->nbyte;
+        else inline_len += r->nbyte;
+    }
+
+    int sent = 0;
+    int got = 0;
+    while (done != -1 && got < nmsg) {
+        batch_msg_t *m = &msgs[sent];
+        if (sent < nmsg && sent - got < FS_PIPELINE && !(m->shm && got < sent)) {
+            fs_msg_t req = { .op = FS_REQ_READ_BATCH, .nbyte = m->count };
+            struct iovec iov = { &ent[m->first], m->count * sizeof(fs_batch_entry_t) };
+            if (send_req(&req, &iov, 1) == -1) done = -1;
+            m->id = req.id;
+            sent++;
+        } else {
+            int result = batch_reply(&msgs[got++], ent, idx, reqs);
+            done = result == -1 ? -1 : done + result;
+        }
+    }
+    for (int i = 0; i < count && done != -1; i++) {
+        struct iovec iov = { reqs[i].buf, reqs[i].nbyte };
+        if (!batch_alone(&reqs[i])) continue;
+        reqs[i].result = reqs[i].offset < 0 ? -1 : transfer(FS_REQ_PREAD, reqs[i].fildes, &iov, 1, reqs[i].offset);
+        if (reqs[i].result != -1) done++;
+    }
+    pthread_mutex_unlock(&conn_lock);
+    free(ent);
+    free(idx);
+    free(msgs);
+    return done;
+}
@@ -0,0 +1,26 @@
+#ifndef FS_CLIENT_H
+#define FS_CLIENT_H
+
+#include "fs.h"
+#include "fs_proto.h"
+
+// Client side of fs_server. A program links build/libfs_client.a in place of
+// the library objects and makes the fs.h file calls as usual, each one served
+// from the volume the server has mounted: fs_sync, fs_create, fs_delete,
+// fs_open, fs_close, fs_read, fs_write, fs_pread, fs_pwrite, fs_readv,
+// fs_writev, fs_get_filesize, fs_lseek, fs_truncate, fs_fallocate,
+// fs_set_compression, fs_set_dedup, fs_defrag, fs_clone, fs_snapshot,
+// fs_open_snapshot, fs_delete_snapshot, fs_create_many, fs_delete_many and
+// fs_read_batch. Formatting, mounting and tuning are left to the server;
+// fs_read_view and the async calls are not offered. Threads share the
+// connection and take turns on it.
+
+// Connects to the server listening at socket_path, or FS_SOCKET when NULL.
+// Transfers of FS_SHM_MIN bytes or more then go through a buffer shared with
+// the server rather than through the socket.
+int fs_connect(char *socket_path);
+
+// Closes the connection; the server closes any files left open
+int fs_disconnect();
+
+#endif
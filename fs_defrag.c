@@ -0,0 +1,98 @@
+#include "fs.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Reports how fragmented the files of a disk image are, then defragments it
+// with fs_defrag and reports again:
+//   ./fs_defrag [-b blocks_per_step] [-n] [-v] disk
+// -n only reports, -v lists every file rather than just the totals.
+
+#define DEFAULT_STEP 1024
+
+static void usage() {
+    fprintf(stderr, "usage: fs_defrag [-b blocks_per_step] [-n] [-v] disk\n");
+}
+
+static int report(const char *when, int verbose) {
+    int count = fs_fragmentation(NULL, 0);
+    if (count == -1) return -1;
+    fs_frag_t *files = calloc(count > 0 ? count : 1, sizeof(fs_frag_t));
+    if (!files) return -1;
+    int listed = fs_fragmentation(files, count);
+    if (listed == -1) {
+        free(files);
+        return -1;
+    }
+    if (listed > count) listed = count;
+
+    uint64_t blocks = 0;
+    uint64_t extents = 0;
+    int fragmented = 0;
+    uint32_t worst = 0;
+    for (int i = 0; i < listed; i++) {
+        if (verbose) printf("  %-16s %10u blocks %8u extents\n", files[i].name, files[i].blocks, files[i].extents);
+        blocks += files[i].blocks;
+        extents += files[i].extents;
+        if (files[i].extents > 1) fragmented++;
+        if (files[i].extents > worst) worst = files[i].extents;
+    }
+    printf("%s: %d files, %llu blocks in %llu extents, %d fragmented, %.2f extents per file, at most %u\n", when, listed,
+           (unsigned long long)blocks, (unsigned long long)extents, fragmented, listed ? (double)extents / listed : 0.0,
+           worst);
+    free(files);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    long step = DEFAULT_STEP;
+    int dry_run = 0;
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:nvh")) != -1) {
+        switch (opt) {
+        case 'b': step = strtol(optarg, NULL, 10); break;
+        case 'n': dry_run = 1; break;
+        case 'v': verbose = 1; break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1 || step < 1 || step > UINT32_MAX) {
+        usage();
+        return 1;
+    }
+    char *disk = argv[optind];
+
+    if (mount_fs(disk) == -1) {
+        fprintf(stderr, "cannot mount %s\n", disk);
+        return 1;
+    }
+    int ret = report("before", verbose) == -1;
+
+    // One bounded step at a time until no file can be improved
+    if (!dry_run && !ret) {
+        uint64_t moved = 0;
+        int steps = 0;
+        int n;
+        while ((n = fs_defrag(step)) > 0) {
+            moved += n;
+            steps++;
+        }
+        if (n == -1) {
+            fprintf(stderr, "fs_defrag failed after %d steps\n", steps);
+            ret = 1;
+        }
+        printf("moved %llu blocks in %d steps\n", (unsigned long long)moved, steps);
+        if (report("after", verbose) == -1) ret = 1;
+    }
+
+    if (umount_fs(disk) == -1) {
+        fprintf(stderr, "cannot unmount %s\n", disk);
+        ret = 1;
+    }
+    return ret;
+}
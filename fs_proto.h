@@ -0,0 +1,55 @@
+#ifndef FS_PROTO_H
+#define FS_PROTO_H
+
+#include <stdint.h>
+
+// Wire protocol between fs_server and the client library. A request is a
+// header and len bytes of payload; its reply is a header with the same id and
+// its own payload. Replies come back in request order, so a client may send
+// several requests before reading any of them.
+
+#define FS_SOCKET "/tmp/fs_server.sock"
+#define FS_MSG_MAX (1024 * 1024)        // largest payload either way
+#define FS_SHM_SIZE (8 * 1024 * 1024)   // shared buffer each client offers
+#define FS_SHM_MIN (32 * 1024)          // smaller transfers travel inline
+#define FS_PIPELINE 8                   // requests a client keeps in flight
+
+#define FS_MSG_SHM 0x1                  // data is in the shared buffer at shm
+
+enum {
+    FS_REQ_HELLO, FS_REQ_SYNC, FS_REQ_CREATE, FS_REQ_DELETE,
+    FS_REQ_OPEN, FS_REQ_CLOSE, FS_REQ_READ, FS_REQ_WRITE,
+    FS_REQ_PREAD, FS_REQ_PWRITE, FS_REQ_GET_FILESIZE, FS_REQ_LSEEK,
+    FS_REQ_TRUNCATE, FS_REQ_FALLOCATE, FS_REQ_SET_COMPRESSION, FS_REQ_SET_DEDUP,
+    FS_REQ_DEFRAG, FS_REQ_CLONE, FS_REQ_SNAPSHOT, FS_REQ_OPEN_SNAPSHOT,
+    FS_REQ_DELETE_SNAPSHOT, FS_REQ_CREATE_MANY, FS_REQ_DELETE_MANY, FS_REQ_READ_BATCH,
+    FS_REQ_COUNT
+};
+
+// Names travel as NUL-terminated strings in the payload: one for most calls,
+// source then destination for FS_REQ_CLONE, nbyte of them for the _MANY
+// calls. FS_REQ_HELLO passes a memfd of nbyte bytes with SCM_RIGHTS, which
+// the server maps as the connection's shared buffer.
+typedef struct {
+    uint32_t len;
+    uint32_t id;
+    uint16_t op;
+    uint16_t flags;
+    int32_t fildes;
+    int64_t arg;            // offset, length, flag or snapshot; the result in replies
+    uint64_t nbyte;         // bytes to move, or how many names or entries
+    uint64_t shm;           // offset of the data with FS_MSG_SHM
+} fs_msg_t;
+
+// One read of FS_REQ_READ_BATCH, nbyte of which make up the payload. The
+// reply payload is an int32_t result per entry, then the bytes read by each
+// inline entry, in order.
+typedef struct {
+    int32_t fildes;
+    uint32_t flags;
+    int64_t offset;
+    uint64_t nbyte;
+    uint64_t shm;
+} fs_batch_entry_t;
+
+#endif
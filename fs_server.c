@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+#include "fs.h"
+#include "fs_proto.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Serves a mounted volume to other processes over a Unix socket:
+//   ./fs_server [-c] [-s socket] disk
+// -c formats the disk before mounting it. One epoll loop runs every request,
+// so the library sees the calls of all clients one at a time. A client can
+// only use descriptors it opened, and those are closed when it goes away.
+
+#define MAX_EVENTS 64
+#define IN_SIZE (sizeof(fs_msg_t) + FS_MSG_MAX)
+#define OUT_LIMIT (4 * FS_PIPELINE * (size_t)FS_MSG_MAX)  // unread replies before we stop reading
+
+typedef struct conn {
+    int sock;
+    char *in;               // requests read so far, the last maybe partial
+    size_t in_len;
+    char *out;              // replies not yet sent
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    char *shm;              // the client's shared buffer
+    size_t shm_size;
+    int passed_fd;          // from SCM_RIGHTS, until FS_REQ_HELLO takes it
+    uint32_t events;
+    uint8_t owned[MAX_FD];
+    struct conn *prev;
+    struct conn *next;
+} conn_t;
+
+static int epoll_fd = -1;
+static int listen_fd = -1;
+static int signal_fd = -1;
+static conn_t *conns = NULL;
+
+static void drop_conn(conn_t *c) {
+    for (int i = 0; i < MAX_FD; i++) {
+        if (c->owned[i]) fs_close(i);
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->sock, NULL);
+    close(c->sock);
+    if (c->passed_fd != -1) close(c->passed_fd);
+    if (c->shm) munmap(c->shm, c->shm_size);
+    if (c->prev) c->prev->next = c->next;
+    else conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+static void accept_conns() {
+    for (;;) {
+        int sock = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock == -1) return;
+        conn_t *c = calloc(1, sizeof(conn_t));
+        if (c) c->in = malloc(IN_SIZE);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (!c || !c->in || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+            if (c) free(c->in);
+            free(c);
+            close(sock);
+            continue;
+        }
+        c->sock = sock;
+        c->passed_fd = -1;
+        c->events = EPOLLIN;
+        c->next = conns;
+        if (conns) conns->prev = c;
+        conns = c;
+    }
+}
+
+// Makes room for a reply with up to n bytes of payload and returns where the
+// payload goes, or NULL when out of memory
+static char *reply_space(conn_t *c, size_t n) {
+    size_t need = sizeof(fs_msg_t) + n;
+    if (c->out_cap - c->out_len < need && c->out_sent > 0) {
+        memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+        c->out_len -= c->out_sent;
+        c->out_sent = 0;
+    }
+    if (c->out_cap - c->out_len < need) {
+        size_t cap = c->out_cap ? c->out_cap : 64 * 1024;
+        while (cap - c->out_len < need) cap *= 2;
+        char *out = realloc(c->out, cap);
+        if (!out) return NULL;
+        c->out = out;
+        c->out_cap = cap;
+    }
+    return c->out + c->out_len + sizeof(fs_msg_t);
+}
+
+// Queues the reply whose len bytes of payload are already in place
+static void reply(conn_t *c, fs_msg_t *req, int64_t result, uint16_t flags, size_t len) {
+    fs_msg_t rep = { .len = len, .id = req->id, .op = req->op, .flags = flags, .fildes = req->fildes, .arg = result };
+    memcpy(c->out + c->out_len, &rep, sizeof(rep));
+    c->out_len += sizeof(rep) + len;
+}
+
+static int owns(conn_t *c, int fildes) {
+    return fildes >= 0 && fildes < MAX_FD && c->owned[fildes];
+}
+
+// The shared buffer's bytes [off, off + n), or NULL if they are not all there
+static char *shm_at(conn_t *c, uint64_t off, uint64_t n) {
+    if (!c->shm || off > c->shm_size || n > c->shm_size - off) return NULL;
+    return c->shm + off;
+}
+
+// Maps the client's shared buffer. It must be a memfd sealed against
+// shrinking, so the client cannot pull pages out from under us.
+static void hello(conn_t *c, fs_msg_t *req) {
+    int64_t result = 0;
+    if (req->nbyte > 0) {
+        struct stat st;
+        int fd = c->passed_fd;
+        int seals = fd != -1 ? fcntl(fd, F_GET_SEALS) : -1;
+        result = -1;
+        if (!c->shm && seals != -1 && (seals & F_SEAL_SHRINK) && req->nbyte <= INT_MAX &&
+            fstat(fd, &st) == 0 && (uint64_t)st.st_size >= req->nbyte) {
+            void *shm = mmap(NULL, req->nbyte, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (shm != MAP_FAILED) {
+                c->shm = shm;
+                c->shm_size = req->nbyte;
+                result = 0;
+            }
+        }
+    }
+    if (c->passed_fd != -1) close(c->passed_fd);
+    c->passed_fd = -1;
+    reply(c, req, result, 0, 0);
+}
+
+// Reads into the shared buffer or straight into the reply
+static int serve_read(conn_t *c, fs_msg_t *req) {
+    int shm = req->flags & FS_MSG_SHM;
+    int valid = owns(c, req->fildes);
+    char *buf = NULL;
+    if (valid && shm) buf = shm_at(c, req->shm, req->nbyte);
+    else if (valid && req->nbyte <= FS_MSG_MAX && !(buf = reply_space(c, req->nbyte))) return -1;
+
+    int64_t result = -1;
+    if (buf && req->op == FS_REQ_READ) result = fs_read(req->fildes, buf, req->nbyte);
+    else if (buf) result = fs_pread(req->fildes, buf, req->nbyte, req->arg);
+    reply(c, req, result, shm, !shm && result > 0 ? result : 0);
+    return 0;
+}
+
+// Hands the entries to fs_read_batch, inline ones reading into the reply,
+// then packs the inline data behind the results
+static int serve_batch(conn_t *c, fs_msg_t *req, char *payload) {
+    uint64_t count = req->nbyte;
+    size_t len = count * sizeof(int32_t);
+    if (count > FS_MSG_MAX / sizeof(fs_batch_entry_t) || req->len != count * sizeof(fs_batch_entry_t)) len = SIZE_MAX;
+    for (uint64_t i = 0; i < count && len <= FS_MSG_MAX; i++) {
+        fs_batch_entry_t e;
+        memcpy(&e, payload + i * sizeof(e), sizeof(e));
+        if (!(e.flags & FS_MSG_SHM)) len = e.nbyte <= FS_MSG_MAX ? len + e.nbyte : SIZE_MAX;
+    }
+    if (len > FS_MSG_MAX) {
+        reply(c, req, -1, 0, 0);
+        return 0;
+    }
+
+    char *out = reply_space(c, len);
+    fs_read_req_t *reqs = malloc((count ? count : 1) * sizeof(fs_read_req_t));
+    if (!out || !reqs) {
+        free(reqs);
+        return -1;
+    }
+    size_t pos = count * sizeof(int32_t);
+    for (uint64_t i = 0; i < count; i++) {
+        fs_batch_entry_t e;
+        memcpy(&e, payload + i * sizeof(e), sizeof(e));
+        char *buf = e.flags & FS_MSG_SHM ? shm_at(c, e.shm, e.nbyte) : out + pos;
+        if (!(e.flags & FS_MSG_SHM)) pos += e.nbyte;
+        int valid = buf && owns(c, e.fildes) && e.nbyte <= INT_MAX;
+        reqs[i] = (fs_read_req_t){ .fildes = valid ? e.fildes : -1, .offset = e.offset, .nbyte = e.nbyte, .buf = buf };
+    }
+    int done = fs_read_batch(reqs, count);
+
+    pos = count * sizeof(int32_t);
+    for (uint64_t i = 0; i < count; i++) {
+        int32_t result = reqs[i].result;
+        memcpy(out + i * sizeof(int32_t), &result, sizeof(result));
+        if (reqs[i].buf < (void *)out || reqs[i].buf >= (void *)(out + len)) continue;
+        if (result > 0) memmove(out + pos, reqs[i].buf, result);
+        if (result > 0) pos += result;
+    }
+    free(reqs);
+    reply(c, req, done, 0, pos);
+    return 0;
+}
+
+static int serve_many(conn_t *c, fs_msg_t *req, char *payload) {
+    int64_t result = -1;
+    if (req->nbyte <= req->len) {
+        char **names = malloc((req->nbyte ? req->nbyte : 1) * sizeof(char *));
+        if (!names) return -1;
+        // The payload must be exactly nbyte NUL-terminated names
+        size_t pos = 0;
+        uint64_t i = 0;
+        for (; i < req->nbyte; i++) {
+            char *end = memchr(payload + pos, '\0', req->len - pos);
+            if (!end) break;
+            names[i] = payload + pos;
+            pos = end - payload + 1;
+        }
+        if (i == req->nbyte && pos == req->len) {
+            result = req->op == FS_REQ_CREATE_MANY ? fs_create_many(names, i) : fs_delete_many(names, i);
+        }
+        free(names);
+    }
+    reply(c, req, result, 0, 0);
+    return 0;
+}
+
+// Runs one request and queues its reply. Returns -1 to drop the client.
+static int handle(conn_t *c, fs_msg_t *req, char *payload) {
+    if (!reply_space(c, 0)) return -1;
+    char *name = req->len > 0 && payload[req->len - 1] == '\0' ? payload : NULL;
+    int fildes = owns(c, req->fildes) ? req->fildes : -1;
+    int arg = req->arg < INT_MIN || req->arg > INT_MAX ? -1 : req->arg;
+    int64_t result = -1;
+    char *data;
+
+    switch (req->op) {
+    case FS_REQ_HELLO:
+        hello(c, req);
+        return 0;
+    case FS_REQ_READ:
+    case FS_REQ_PREAD:
+        return serve_read(c, req);
+    case FS_REQ_READ_BATCH:
+        return serve_batch(c, req, payload);
+    case FS_REQ_CREATE_MANY:
+    case FS_REQ_DELETE_MANY:
+        return serve_many(c, req, payload);
+    case FS_REQ_SYNC: result = fs_sync(); break;
+    case FS_REQ_CREATE: if (name) result = fs_create(name); break;
+    case FS_REQ_DELETE: if (name) result = fs_delete(name); break;
+    case FS_REQ_OPEN:
+    case FS_REQ_OPEN_SNAPSHOT:
+        if (name) result = req->op == FS_REQ_OPEN ? fs_open(name) : fs_open_snapshot(arg, name);
+        if (result >= 0 && result < MAX_FD) c->owned[result] = 1;
+        break;
+    case FS_REQ_CLOSE:
+        if (fildes != -1 && (result = fs_close(fildes)) == 0) c->owned[fildes] = 0;
+        break;
+    case FS_REQ_WRITE:
+    case FS_REQ_PWRITE:
+        if (req->flags & FS_MSG_SHM) data = shm_at(c, req->shm, req->nbyte);
+        else data = req->nbyte == req->len ? payload : NULL;
+        if (fildes == -1 || !data) break;
+        if (req->op == FS_REQ_WRITE) result = fs_write(fildes, data, req->nbyte);
+        else result = fs_pwrite(fildes, data, req->nbyte, req->arg);
+        break;
+    case FS_REQ_GET_FILESIZE: if (fildes != -1) result = fs_get_filesize(fildes); break;
+    case FS_REQ_LSEEK: if (fildes != -1) result = fs_lseek(fildes, req->arg); break;
+    case FS_REQ_TRUNCATE: if (fildes != -1) result = fs_truncate(fildes, req->arg); break;
+    case FS_REQ_FALLOCATE: if (fildes != -1) result = fs_fallocate(fildes, req->arg); break;
+    case FS_REQ_SET_COMPRESSION: if (fildes != -1) result = fs_set_compression(fildes, arg); break;
+    case FS_REQ_SET_DEDUP: if (fildes != -1) result = fs_set_dedup(fildes, arg); break;
+    case FS_REQ_DEFRAG: if (req->arg >= 0 && req->arg <= UINT32_MAX) result = fs_defrag(req->arg); break;
+    case FS_REQ_CLONE:
+        data = name ? memchr(payload, '\0', req->len) + 1 : NULL;
+        if (data && data < payload + req->len) result = fs_clone(payload, data);
+        break;
+    case FS_REQ_SNAPSHOT: result = fs_snapshot(); break;
+    case FS_REQ_DELETE_SNAPSHOT: result = fs_delete_snapshot(arg); break;
+    }
+    reply(c, req, result, 0, 0);
+    return 0;
+}
+
+// Reads what has arrived, keeping a descriptor passed along with it.
+// Returns -1 when the client is gone.
+static int read_in(conn_t *c) {
+    while (c->in_len < IN_SIZE) {
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = { c->in + c->in_len, IN_SIZE - c->in_len };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+        ssize_t n = recvmsg(c->sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n == 0) return -1;
+        if (n == -1) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+            if (c->passed_fd != -1) close(c->passed_fd);
+            memcpy(&c->passed_fd, CMSG_DATA(cm), sizeof(int));
+        }
+        c->in_len += n;
+    }
+    return 0;
+}
+
+// Runs the complete requests that have arrived, unless the client already
+// has too many replies waiting
+static int process(conn_t *c) {
+    size_t pos = 0;
+    while (c->out_len - c->out_sent < OUT_LIMIT && c->in_len - pos >= sizeof(fs_msg_t)) {
+        fs_msg_t req;
+        memcpy(&req, c->in + pos, sizeof(req));
+        if (req.len > FS_MSG_MAX) return -1;
+        if (c->in_len - pos < sizeof(req) + req.len) break;
+        if (handle(c, &req, c->in + pos + sizeof(req)) == -1) return -1;
+        pos += sizeof(req) + req.len;
+    }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    return 0;
+}
+
+// Sends what the socket takes of the replies; -1 when the client is gone
+static int flush_out(conn_t *c) {
+    while (c->out_sent < c->out_len) {
+        ssize_t n = send(c->sock, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (n == -1) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        c->out_sent += n;
+    }
+    c->out_len = 0;
+    c->out_sent = 0;
+    return 0;
+}
+
+// Waits for requests while the client keeps up with replies, and for room
+// in the socket while replies are left
+static int watch(conn_t *c) {
+    size_t pending = c->out_len - c->out_sent;
+    uint32_t events = (pending < OUT_LIMIT ? EPOLLIN : 0) | (pending > 0 ? EPOLLOUT : 0);
+    if (events == c->events) return 0;
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    c->events = events;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->sock, &ev);
+}
+
+static void serve_conn(conn_t *c, uint32_t events) {
+    if ((events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN)) {
+        drop_conn(c);
+        return;
+    }
+    if (flush_out(c) == -1 || ((events & EPOLLIN) && read_in(c) == -1) || process(c) == -1 ||
+        flush_out(c) == -1 || watch(c) == -1) {
+        drop_conn(c);
+    }
+}
+
+static int listen_on(char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd == -1 || listen_fd == -1 || epoll_fd == -1) return -1;
+
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, SOMAXCONN) == -1) return -1;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_fd };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) return -1;
+    ev.data.ptr = &signal_fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+}
+
+static void usage() {
+    fprintf(stderr, "usage: fs_server [-c] [-s socket] disk\n");
+}
+
+int main(int argc, char **argv) {
+    char *path = FS_SOCKET;
+    int format = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "cs:h")) != -1) {
+        switch (opt) {
+        case 'c': format = 1; break;
+        case 's': path = optarg; break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return 1;
+    }
+    char *disk = argv[optind];
+
+    if ((format && make_fs(disk) == -1) || mount_fs(disk) == -1) {
+        fprintf(stderr, "Error mounting %s\n", disk);
+        return 1;
+    }
+    int ret = 0;
+    if (listen_on(path) == -1) {
+        perror(path);
+        ret = 1;
+    }
+
+    while (ret == 0) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) ret = 1;
+        int stop = 0;
+        for (int i = 0; i < n; i++) {
+            void *p = events[i].data.ptr;
+            if (p == &listen_fd) accept_conns();
+            else if (p == &signal_fd) stop = 1;
+            else serve_conn(p, events[i].events);
+        }
+        if (stop) break;
+    }
+
+    while (conns) drop_conn(conns);
+    if (listen_fd != -1) unlink(path);
+    if (umount_fs(disk) == -1) {
+        fprintf(stderr, "Error unmounting %s\n", disk);
+        ret = 1;
+    }
+    return ret;
+}
@@ -0,0 +1,333 @@
+#include "journal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "fs.h"
+#include "disk.h"
+#include "stats.h"
+
+#define JOURNAL_MAGIC 0x4a524e4c    // "JRNL", first block of the region
+#define JOURNAL_HEADER 0x4a484452   // "JHDR"
+#define JOURNAL_COMMIT 0x4a434d54   // "JCMT"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;               // sequence number of the first transaction
+} journal_super_t;
+
+// A transaction is one or more segments, each a header block and the
+// payload blocks it lists, linked through next; the last one is followed by
+// the commit block. Segments after the first are right behind it in the
+// region, or in runs lent by the spill allocator when it is too small.
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t count;             // payload blocks in this segment
+    uint32_t next;              // disk block of the next header, 0 for the commit
+    uint32_t blocks[JOURNAL_TXN_MAX];
+} journal_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t count;             // payload blocks of the whole transaction
+    uint32_t checksum;          // header blocks and payload
+} journal_commit_t;
+
+static uint32_t journal_start = 0;
+static uint32_t journal_blocks = 0;
+static uint32_t head = 1;           // next free block in the region
+static uint32_t next_seq = 1;
+static uint32_t home_seq = 1;       // read by other threads
+static int journal_attached = 0;
+static uint32_t (*spill_alloc)(uint32_t want, uint32_t *got) = NULL;
+static void (*spill_free)(uint32_t start, uint32_t n) = NULL;
+
+// Spill runs holding transactions not yet checkpointed
+typedef struct {
+    uint32_t start;
+    uint32_t n;
+} spill_run_t;
+
+static spill_run_t *spilled = NULL;
+static uint32_t spill_count = 0;
+static uint32_t spill_cap = 0;
+
+static uint32_t checksum(uint32_t h, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int write_super(uint32_t seq) {
+    char *block = calloc(1, disk_block_size());
+    if (!block) return -1;
+    journal_super_t js = { JOURNAL_MAGIC, seq };
+    memcpy(block, &js, sizeof(js));
+    int ret = block_write(journal_start, block);
+    free(block);
+    return ret;
+}
+
+static int in_region(uint32_t block) {
+    return block > journal_start && block < journal_start + journal_blocks;
+}
+
+// Follows the segments of transaction seq from region block pos and checks
+// it is whole, then copies it home when apply is set. Returns the region
+// blocks it takes, or 0 when there is no complete transaction there.
+static uint32_t scan_txn(uint32_t pos, uint32_t seq, int apply, char *hdr_block, char *data) {
+    size_t bsize = disk_block_size();
+    uint32_t used = 0;
+    for (int pass = 0; pass < (apply ? 2 : 1); pass++) {
+        uint32_t at = journal_start + pos;
+        uint32_t sum = 2166136261u;
+        uint64_t total = 0;
+        journal_header_t hdr;
+        used = 0;
+        for (uint32_t segments = 0; ; segments++) {
+            // A torn header could point anywhere, so no more segments are
+            // followed than a transaction of every disk block would have
+            if (segments > (uint32_t)-1 / JOURNAL_TXN_MAX) return 0;
+            if (block_read(at, hdr_block) == -1) return 0;
+            memcpy(&hdr, hdr_block, sizeof(hdr));
+            if (hdr.magic != JOURNAL_HEADER || hdr.seq != seq || hdr.count > JOURNAL_TXN_MAX) return 0;
+            uint32_t len = hdr.count + 1 + (hdr.next == 0);
+            if (in_region(at) && at + len > journal_start + journal_blocks) return 0;
+            sum = checksum(sum, hdr_block, bsize);
+            for (uint32_t i = 0; i < hdr.count; i++) {
+                if (block_read(at + 1 + i, data) == -1) return 0;
+                sum = checksum(sum, data, bsize);
+                if (pass == 1 && block_write(hdr.blocks[i], data) == -1) return 0;
+            }
+            if (in_region(at)) used = at - journal_start - pos + len;
+            total += hdr.count;
+            if (hdr.next == 0) break;
+            at = hdr.next;
+        }
+        
+        // A torn transaction fails the checksum and ends the log
+        journal_commit_t cmt;
+        if (block_read(at + 1 + hdr.count, data) == -1) return 0;
+        memcpy(&cmt, data, sizeof(cmt));
+        if (cmt.magic != JOURNAL_COMMIT || cmt.seq != seq || cmt.count != total || cmt.checksum != sum) return 0;
+    }
+    return used;
+}
+
+// Walks the committed transactions, copying them home when apply is set.
+// Sets *end and *seq to the first free block and the next sequence number.
+static int scan(int apply, uint32_t *end, uint32_t *seq, int *found) {
+    size_t bsize = disk_block_size();
+    char *bufs = malloc(2 * bsize);
+    if (!bufs) return -1;
+    
+    journal_super_t js;
+    if (block_read(journal_start, bufs) == -1) {
+        free(bufs);
+        return -1;
+    }
+    memcpy(&js, bufs, sizeof(js));
+    if (js.magic != JOURNAL_MAGIC) {
+        free(bufs);
+        return -1;
+    }
+    
+    uint32_t pos = 1;
+    *seq = js.seq;
+    *found = 0;
+    while (pos + 2 <= journal_blocks) {
+        uint32_t used = scan_txn(pos, *seq, apply, bufs, bufs + bsize);
+        if (used == 0) break;
+        pos += used;
+        (*seq)++;
+        (*found)++;
+    }
+    
+    free(bufs);
+    *end = pos;
+    return 0;
+}
+
+// Takes a spill run for the rest of a transaction, rest payload blocks, and
+// returns its first block, or 0
+static uint32_t spill_take(uint32_t rest, uint32_t *got) {
+    if (!spill_alloc) return 0;
+    if (spill_count == spill_cap) {
+        uint32_t cap = spill_cap ? spill_cap * 2 : 8;
+        spill_run_t *runs = realloc(spilled, cap * sizeof(spill_run_t));
+        if (!runs) return 0;
+        spilled = runs;
+        spill_cap = cap;
+    }
+    uint32_t want = rest + (rest + JOURNAL_TXN_MAX - 1) / JOURNAL_TXN_MAX + 1;
+    uint32_t start = spill_alloc(want, got);
+    if (start == (uint32_t)-1) return 0;
+    if (*got < 3) {
+        spill_free(start, *got);
+        return 0;
+    }
+    spilled[spill_count++] = (spill_run_t){ start, *got };
+    return start;
+}
+
+static void spill_release(uint32_t from) {
+    for (uint32_t i = from; i < spill_count; i++) spill_free(spilled[i].start, spilled[i].n);
+    spill_count = from;
+}
+
+int journal_format(uint32_t start, uint32_t nblocks) {
+    if (nblocks < JOURNAL_TXN_MAX + 3) return -1;
+    journal_start = start;
+    journal_blocks = nblocks;
+    return write_super(1);
+}
+
+int journal_open(uint32_t start, uint32_t nblocks) {
+    if (nblocks < JOURNAL_TXN_MAX + 3) return -1;
+    journal_start = start;
+    journal_blocks = nblocks;
+    journal_attached = 1;
+    head = 1;
+    
+    uint32_t end;
+    int found;
+    if (scan(1, &end, &next_seq, &found) == -1) {
+        journal_attached = 0;
+        return -1;
+    }
+    
+    // Anything replayed is now home; start the log over
+    if (found > 0) {
+        if (disk_sync() == -1 || write_super(next_seq) == -1 || disk_sync() == -1) {
+            journal_attached = 0;
+            return -1;
+        }
+    }
+    __atomic_store_n(&home_seq, next_seq, __ATOMIC_RELEASE);
+    return found;
+}
+
+void journal_set_spill(uint32_t (*alloc)(uint32_t want, uint32_t *got), void (*release)(uint32_t start, uint32_t n)) {
+    spill_alloc = alloc;
+    spill_free = release;
+}
+
+// Runs still lent are dropped with the allocator they came from
+void journal_close() {
+    journal_attached = 0;
+    free(spilled);
+    spilled = NULL;
+    spill_count = 0;
+    spill_cap = 0;
+    spill_alloc = NULL;
+    spill_free = NULL;
+}
+
+int journal_checkpoint() {
+    if (!journal_attached) return -1;
+    if (head == 1) return 0;
+    
+    uint32_t end, seq;
+    int found;
+    if (scan(1, &end, &seq, &found) == -1) return -1;
+    if (disk_sync() == -1) return -1;
+    
+    // Only once every home block is durable may the log be dropped
+    if (write_super(next_seq) == -1 || disk_sync() == -1) return -1;
+    head = 1;
+    spill_release(0);
+    __atomic_store_n(&home_seq, next_seq, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int journal_commit(const uint32_t *blocks, char *const *data, uint32_t count) {
+    if (!journal_attached) return -1;
+    if (count == 0) return 0;
+    uint32_t headers = (count + JOURNAL_TXN_MAX - 1) / JOURNAL_TXN_MAX;
+    if (head + count + headers + 1 > journal_blocks && journal_checkpoint() == -1) return -1;
+    
+    size_t bsize = disk_block_size();
+    char *hdr_block = calloc(2, bsize);
+    if (!hdr_block) return -1;
+    char *cmt_block = hdr_block + bsize;
+    
+    // A segment at a time, into the region from head and then into spill
+    // runs, each written with one pwritev; one sync for the whole batch
+    struct iovec iov[JOURNAL_TXN_MAX + 2];
+    uint32_t spill_from = spill_count;
+    uint32_t at = journal_start + head;
+    uint32_t room = journal_blocks - head;
+    uint32_t region = 0;
+    uint32_t sum = 2166136261u;
+    uint32_t done = 0;
+    int ret = 0;
+    while (ret == 0) {
+        // Always room for a header, a payload block and the commit block
+        uint32_t n = count - done < JOURNAL_TXN_MAX ? count - done : JOURNAL_TXN_MAX;
+        if (n > room - 2) n = room - 2;
+        int last = done + n == count;
+        uint32_t used = n + 1 + last;
+        uint32_t next = 0;
+        uint32_t got = room - used;
+        if (!last) next = got >= 3 ? at + used : spill_take(count - done - n, &got);
+        if (!last && next == 0) {
+            ret = -1;
+            break;
+        }
+        
+        journal_header_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = JOURNAL_HEADER;
+        hdr.seq = next_seq;
+        hdr.count = n;
+        hdr.next = next;
+        memcpy(hdr.blocks, blocks + done, n * sizeof(uint32_t));
+        memset(hdr_block, 0, bsize);
+        memcpy(hdr_block, &hdr, sizeof(hdr));
+        sum = checksum(sum, hdr_block, bsize);
+        iov[0].iov_base = hdr_block;
+        iov[0].iov_len = bsize;
+        for (uint32_t i = 0; i < n; i++) {
+            sum = checksum(sum, data[done + i], bsize);
+            iov[i + 1].iov_base = data[done + i];
+            iov[i + 1].iov_len = bsize;
+        }
+        if (last) {
+            journal_commit_t cmt = { JOURNAL_COMMIT, next_seq, count, sum };
+            memset(cmt_block, 0, bsize);
+            memcpy(cmt_block, &cmt, sizeof(cmt));
+            iov[n + 1].iov_base = cmt_block;
+            iov[n + 1].iov_len = bsize;
+        }
+        ret = block_writev(at, iov, used);
+        if (in_region(at)) region += used;
+        done += n;
+        if (last) break;
+        at = next;
+        room = got;
+    }
+    free(hdr_block);
+    if (ret == -1 || disk_sync() == -1) {
+        spill_release(spill_from);
+        return -1;
+    }
+    STAT_INC(meta_flushes);
+    STAT_ADD(meta_flush_bytes, (uint64_t)(count + headers + 1) * bsize);
+    head += region;
+    next_seq++;
+    
+    // Spill runs are handed back once their blocks are home
+    if (spill_count > spill_from) journal_checkpoint();
+    return 0;
+}
+
+uint32_t journal_next_seq() {
+    return next_seq;
+}
+
+uint32_t journal_home_seq() {
+    return __atomic_load_n(&home_seq, __ATOMIC_ACQUIRE);
+}
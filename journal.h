@@ -0,0 +1,44 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+// Write-ahead log of whole metadata blocks. A transaction is a header block
+// listing the home block numbers, the new contents of those blocks, and a
+// commit block whose checksum covers the rest, all made durable with one
+// fsync; a bigger one chains several headers before its commit block. Home
+// locations are only written when the journal is checkpointed, by copying
+// committed blocks out of it.
+
+#define JOURNAL_TXN_MAX 510 // blocks per header
+
+// Sets up an empty journal in nblocks blocks starting at disk block start
+int journal_format(uint32_t start, uint32_t nblocks);
+
+// Attaches to the journal at start and replays any committed transactions
+// into their home blocks. Returns the number replayed, or -1.
+int journal_open(uint32_t start, uint32_t nblocks);
+void journal_close();
+
+// Where a transaction too big for the region continues: alloc lends a run
+// of up to want free disk blocks, setting *got, or returns -1; release
+// takes it back once the transaction is checkpointed
+void journal_set_spill(uint32_t (*alloc)(uint32_t want, uint32_t *got), void (*release)(uint32_t start, uint32_t n));
+
+// Logs count blocks (data[i] is the new content of disk block blocks[i])
+// as one atomic transaction and syncs the disk. Checkpoints first when the
+// journal is too full to take it, and right after when it had to spill.
+int journal_commit(const uint32_t *blocks, char *const *data, uint32_t count);
+
+// Copies every committed block to its home location, syncs and empties
+// the journal
+int journal_checkpoint();
+
+// Sequence number the next transaction will get
+uint32_t journal_next_seq();
+
+// Transactions numbered below this have been checkpointed, so what they
+// logged can be read back from the home blocks
+uint32_t journal_home_seq();
+
+#endif
@@ -0,0 +1,145 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+#define TAIL_LITERALS 5     // matches never run into the last few bytes
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Lengths past 14 spill into extra bytes of 255 each, ending with a smaller one
+static uint8_t *put_length(uint8_t *op, uint8_t *oend, size_t n) {
+    while (n >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        n -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+// One sequence: literals, then a match unless this is the last one
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t nlit, size_t offset,
+                             size_t match, int last) {
+    if (op >= oend) return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit >= 15 ? 15 : nlit) << 4);
+    if (nlit >= 15 && !(op = put_length(op, oend, nlit - 15))) return NULL;
+    if ((size_t)(oend - op) < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (last) return op;
+
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match -= MIN_MATCH;
+    *token |= match >= 15 ? 15 : match;
+    if (match >= 15 && !(op = put_length(op, oend, match - 15))) return NULL;
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+    const uint8_t *in = src;
+    const uint8_t *ip = in;
+    const uint8_t *anchor = in;
+    const uint8_t *end = in + len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + cap;
+    uint32_t table[1 << HASH_BITS];
+
+    if (len > MIN_MATCH + TAIL_LITERALS) {
+        memset(table, 0, sizeof(table));
+        const uint8_t *limit = end - MIN_MATCH - TAIL_LITERALS;
+        ip++;
+        while (ip < limit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash(seq);
+            const uint8_t *ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                // Step faster through data that is not matching
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            const uint8_t *m = ip + MIN_MATCH;
+            const uint8_t *r = ref + MIN_MATCH;
+            while (m < end - TAIL_LITERALS && *m == *r) {
+                m++;
+                r++;
+            }
+            op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip, 0);
+            if (!op) return 0;
+            ip = m;
+            anchor = ip;
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, end - anchor, 0, 0, 1);
+    if (!op) return 0;
+    return op - (uint8_t *)dst;
+}
+
+long lz_decompress(const void *src, size_t len, void *dst, size_t cap) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + len;
+    uint8_t *ostart = dst;
+    uint8_t *op = ostart;
+    uint8_t *oend = op + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                nlit += b;
+            } while (b == 255);
+        }
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - ostart)) return -1;
+        size_t match = token & 15;
+        if (match == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                match += b;
+            } while (b == 255);
+        }
+        match += MIN_MATCH;
+        if (match > (size_t)(oend - op)) return -1;
+
+        const uint8_t *ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+            op += match;
+        } else {
+            // Overlapping copy repeats the last offset bytes
+            while (match--) *op++ = *ref++;
+        }
+    }
+    return op - ostart;
+}
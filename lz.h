@@ -0,0 +1,18 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+// Small LZ77 codec in the LZ4 block style: a token byte holding literal and
+// match lengths, the literals, then a 16-bit match offset. Greedy, one hash
+// probe per position, so it trades ratio for speed.
+
+// Compresses len bytes into dst, which has room for cap bytes. Returns the
+// compressed length, or 0 when the result would not fit.
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+// Returns the decompressed length, or -1 when the input is corrupt or would
+// overflow the cap bytes of dst
+long lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif
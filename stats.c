@@ -0,0 +1,198 @@
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef FS_STATS
+
+static const char *op_names[FS_OP_COUNT] = {
+    "make_fs", "mount_fs", "umount_fs", "fs_sync",
+    "fs_create", "fs_delete", "fs_open", "fs_close",
+    "fs_read", "fs_write", "fs_pread", "fs_pwrite",
+    "fs_get_filesize", "fs_lseek", "fs_truncate", "fs_fallocate",
+    "fs_read_view", "fs_read_async", "fs_write_async", "fs_aio_wait",
+    "fs_defrag", "fs_clone", "fs_snapshot", "fs_create_many",
+    "fs_delete_many", "fs_readv", "fs_writev", "fs_read_batch",
+    "fs_set_compression", "fs_set_dedup", "fs_fragmentation", "fs_open_snapshot",
+    "fs_delete_snapshot",
+};
+
+// Every thread's counters, kept after the thread exits so nothing is lost
+typedef struct stats_node {
+    fs_stats_t stats;
+    struct stats_node *next;
+} stats_node_t;
+
+__thread fs_stats_t *stats_tls = NULL;
+static stats_node_t *threads = NULL;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static fs_stats_t fallback;         // when a thread's counters cannot be allocated
+
+// Periodic dump
+static pthread_t dump_thread;
+static int dump_running = 0;
+static int dump_interval = 0;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_cond = PTHREAD_COND_INITIALIZER;
+
+fs_stats_t *stats_register() {
+    stats_node_t *node = calloc(1, sizeof(stats_node_t));
+    if (!node) return &fallback;
+    pthread_mutex_lock(&threads_lock);
+    node->next = threads;
+    threads = node;
+    pthread_mutex_unlock(&threads_lock);
+    stats_tls = &node->stats;
+    return stats_tls;
+}
+
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void stats_op_done(int op, uint64_t start, int failed) {
+    uint64_t ns = stats_now() - start;
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= FS_STATS_BUCKETS) bucket = FS_STATS_BUCKETS - 1;
+    STAT_INC(ops[op].calls);
+    STAT_ADD(ops[op].errors, failed);
+    STAT_ADD(ops[op].total_ns, ns);
+    STAT_INC(ops[op].hist[bucket]);
+}
+
+int fs_get_stats(fs_stats_t *stats) {
+    if (!stats) return -1;
+    memset(stats, 0, sizeof(fs_stats_t));
+
+    // The structure is nothing but counters, so add it up word by word
+    uint64_t *sum = (uint64_t *)stats;
+    pthread_mutex_lock(&threads_lock);
+    for (stats_node_t *node = threads; node; node = node->next) {
+        uint64_t *part = (uint64_t *)&node->stats;
+        for (size_t i = 0; i < sizeof(fs_stats_t) / sizeof(uint64_t); i++) {
+            sum[i] += __atomic_load_n(&part[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+    return 0;
+}
+
+int fs_reset_stats() {
+    pthread_mutex_lock(&threads_lock);
+    for (stats_node_t *node = threads; node; node = node->next) {
+        uint64_t *part = (uint64_t *)&node->stats;
+        for (size_t i = 0; i < sizeof(fs_stats_t) / sizeof(uint64_t); i++) {
+            __atomic_store_n(&part[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+    return 0;
+}
+
+// Upper bound, in microseconds, of the bucket holding the given fraction of
+// calls
+static double percentile(const fs_op_stats_t *op, double fraction) {
+    uint64_t want = (uint64_t)(op->calls * fraction);
+    uint64_t seen = 0;
+    for (int i = 0; i < FS_STATS_BUCKETS; i++) {
+        seen += op->hist[i];
+        if (seen > want) return (double)(2ULL << i) / 1e3;
+    }
+    return (double)(2ULL << (FS_STATS_BUCKETS - 1)) / 1e3;
+}
+
+int fs_dump_stats(int fd) {
+    fs_stats_t s;
+    fs_get_stats(&s);
+
+    dprintf(fd, "%-18s %10s %8s %10s %10s %10s\n", "op", "calls", "errors", "avg_us", "p50_us", "p99_us");
+    for (int i = 0; i < FS_OP_COUNT; i++) {
+        const fs_op_stats_t *op = &s.ops[i];
+        if (op->calls == 0) continue;
+        dprintf(fd, "%-18s %10llu %8llu %10.2f %10.2f %10.2f\n", op_names[i], (unsigned long long)op->calls,
+                (unsigned long long)op->errors, op->total_ns / 1e3 / op->calls, percentile(op, 0.5), percentile(op, 0.99));
+    }
+    dprintf(fd, "bytes read %llu, written %llu\n", (unsigned long long)s.bytes_read, (unsigned long long)s.bytes_written);
+    dprintf(fd, "block_read %llu, block_write %llu, block_readv %llu, block_writev %llu, syscalls %llu\n",
+            (unsigned long long)s.block_reads, (unsigned long long)s.block_writes, (unsigned long long)s.block_readvs,
+            (unsigned long long)s.block_writevs, (unsigned long long)s.syscalls);
+    dprintf(fd, "read-modify-write blocks %llu, FAT hops %llu\n", (unsigned long long)s.rmw_blocks, (unsigned long long)s.fat_hops);
+    dprintf(fd, "allocations %llu, free runs scanned %llu\n", (unsigned long long)s.alloc_calls, (unsigned long long)s.alloc_scanned);
+    dprintf(fd, "metadata flushes %llu, %llu bytes\n", (unsigned long long)s.meta_flushes, (unsigned long long)s.meta_flush_bytes);
+    dprintf(fd, "compressed chunks %llu bytes in, %llu out\n", (unsigned long long)s.chunk_bytes_in, (unsigned long long)s.chunk_bytes_out);
+    dprintf(fd, "dedup hits %llu\n", (unsigned long long)s.dedup_hits);
+    dprintf(fd, "readahead %llu bytes, %llu used\n", (unsigned long long)s.ra_bytes, (unsigned long long)s.ra_hit_bytes);
+    dprintf(fd, "coalesced writes %llu\n", (unsigned long long)s.coalesced_writes);
+    dprintf(fd, "defrag moved %llu blocks\n", (unsigned long long)s.defrag_blocks);
+    dprintf(fd, "metadata blocks read in %llu, dropped %llu\n", (unsigned long long)s.meta_reads, (unsigned long long)s.meta_drops);
+    return 0;
+}
+
+static void *dump_main(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&dump_lock);
+    while (dump_interval > 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += dump_interval;
+        if (pthread_cond_timedwait(&dump_cond, &dump_lock, &ts) != 0 && dump_interval > 0) {
+            fs_dump_stats(STDERR_FILENO);
+        }
+    }
+    pthread_mutex_unlock(&dump_lock);
+    return NULL;
+}
+
+int fs_set_stats_dump(int seconds) {
+    if (seconds < 0) return -1;
+    pthread_mutex_lock(&dump_lock);
+    dump_interval = seconds;
+    pthread_cond_signal(&dump_cond);
+    int running = dump_running;
+    if (seconds > 0 && !running) {
+        if (pthread_create(&dump_thread, NULL, dump_main, NULL) != 0) {
+            dump_interval = 0;
+            pthread_mutex_unlock(&dump_lock);
+            return -1;
+        }
+        dump_running = 1;
+    }
+    pthread_mutex_unlock(&dump_lock);
+
+    // Stopped: wait for the thread so a new one can start cleanly
+    if (seconds == 0 && running) {
+        pthread_join(dump_thread, NULL);
+        pthread_mutex_lock(&dump_lock);
+        dump_running = 0;
+        pthread_mutex_unlock(&dump_lock);
+    }
+    return 0;
+}
+
+#else
+
+int fs_get_stats(fs_stats_t *stats) {
+    (void)stats;
+    return -1;
+}
+
+int fs_reset_stats() {
+    return -1;
+}
+
+int fs_dump_stats(int fd) {
+    (void)fd;
+    return -1;
+}
+
+int fs_set_stats_dump(int seconds) {
+    (void)seconds;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include "fs.h"
+
+// Counter hooks for fs_get_stats. Each thread counts into its own
+// fs_stats_t, so hot paths never share a cache line; readers add them up.
+// Without FS_STATS every hook compiles to nothing.
+
+#ifdef FS_STATS
+
+extern __thread fs_stats_t *stats_tls;
+fs_stats_t *stats_register();
+uint64_t stats_now();
+void stats_op_done(int op, uint64_t start, int failed);
+
+static inline fs_stats_t *stats_local() {
+    return stats_tls ? stats_tls : stats_register();
+}
+
+// Only the owning thread writes its counters
+#define STAT_ADD(field, n) do { \
+    fs_stats_t *s_ = stats_local(); \
+    __atomic_store_n(&s_->field, s_->field + (n), __ATOMIC_RELAXED); \
+} while (0)
+
+static inline uint64_t stat_begin() {
+    return stats_now();
+}
+
+static inline int stat_end(int op, uint64_t start, int ret) {
+    stats_op_done(op, start, ret == -1);
+    return ret;
+}
+
+#else
+
+#define STAT_ADD(field, n) ((void)0)
+
+static inline uint64_t stat_begin() {
+    return 0;
+}
+
+static inline int stat_end(int op, uint64_t start, int ret) {
+    (void)op;
+    (void)start;
+    return ret;
+}
+
+#endif
+
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+#endif
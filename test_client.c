@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include "fs_client.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// Runs from the build directory, next to fs_server
+#define SERVER "./fs_server"
+#define SOCKET "client_test.sock"
+#define DISK "client_test.disk"
+
+// Reports the failed condition and fails the enclosing test
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("❌ %s, line %d: %s\n", __func__, __LINE__, #cond); \
+        return -1; \
+    } \
+} while (0)
+
+#define BIG (9 * 1024 * 1024)   // more than the shared buffer moves at once
+#define SMALL 3000
+
+static char *data;
+static char *back;
+
+static void fill(char *buf, size_t len, int seed) {
+    for (size_t i = 0; i < len; i++) buf[i] = (char)(seed * 131 + i * 7 + i / 4096);
+}
+
+// Starts a server on a freshly made volume and connects to it once it
+// listens. Returns its pid, or -1.
+static pid_t start_server() {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(SERVER, SERVER, "-c", "-s", SOCKET, DISK, (char *)NULL);
+        _exit(127);
+    }
+    for (int i = 0; pid != -1 && i < 500; i++) {
+        if (fs_connect(SOCKET) == 0) return pid;
+        usleep(10000);
+    }
+    if (pid != -1) kill(pid, SIGKILL);
+    return -1;
+}
+
+// Reads and writes both through the shared buffer and inline in the
+// messages, including one too big for the shared buffer in one go
+static int test_transfers() {
+    char *names[] = { "big", "small" };
+    CHECK(fs_create_many(names, 2) == 2);
+
+    int fd = fs_open("big");
+    CHECK(fd != -1);
+    fill(data, BIG, 1);
+    CHECK(fs_write(fd, data, BIG) == BIG);
+    CHECK(fs_get_filesize(fd) == BIG);
+    CHECK(fs_pread(fd, back, BIG, 0) == BIG && memcmp(back, data, BIG) == 0);
+
+    memcpy(data + 100, "inline", 6);
+    CHECK(fs_pwrite(fd, "inline", 6, 100) == 6);
+    CHECK(fs_pread(fd, back, 1000, 0) == 1000 && memcmp(back, data, 1000) == 0);
+    CHECK(fs_lseek(fd, 5000) == 0);
+    CHECK(fs_read(fd, back, 20000) == 20000 && memcmp(back, data + 5000, 20000) == 0);
+    CHECK(fs_read(fd, back, 40000) == 40000 && memcmp(back, data + 25000, 40000) == 0);
+
+    // One small buffer and one large, from the current offset
+    fill(data + 65000, 60100, 2);
+    struct iovec iov[2] = { { data + 65000, 100 }, { data + 65100, 60000 } };
+    CHECK(fs_writev(fd, iov, 2) == 60100);
+    CHECK(fs_lseek(fd, 65000) == 0);
+    iov[0].iov_base = back;
+    iov[1].iov_base = back + 100;
+    CHECK(fs_readv(fd, iov, 2) == 60100 && memcmp(back, data + 65000, 60100) == 0);
+    CHECK(fs_close(fd) == 0);
+
+    fd = fs_open("small");
+    CHECK(fd != -1);
+    CHECK(fs_write(fd, data, SMALL) == SMALL);
+    CHECK(fs_close(fd) == 0);
+
+    CHECK(fs_disconnect() == 0);
+    CHECK(fs_connect(SOCKET) == 0);
+    fd = fs_open("big");
+    CHECK(fd != -1);
+    CHECK(fs_pread(fd, back, BIG, 0) == BIG && memcmp(back, data, BIG) == 0);
+    CHECK(fs_close(fd) == 0);
+    printf("✅ Shared-buffer and inline transfers round trip\n");
+    return 0;
+}
+
+// Reads of two files in one batch: inline, through the shared buffer, too
+// big for it, short at the end of a file, and on a bad descriptor
+static int test_read_batch() {
+    int big = fs_open("big");
+    int small = fs_open("small");
+    CHECK(big != -1 && small != -1);
+
+    static char buf[5][64 * 1024];
+    fs_read_req_t reqs[] = {
+        { big, 1 << 20, 40000, buf[0], 0 },
+        { small, 10, 2000, buf[1], 0 },
+        { big, 0, 100, buf[2], 0 },
+        { small, SMALL - 10, 100, buf[3], 0 },
+        { big, 0, BIG, back, 0 },
+        { MAX_FD - 1, 0, 100, buf[4], 0 },
+    };
+    int count = sizeof(reqs) / sizeof(reqs[0]);
+    memset(back, 0, BIG);
+    CHECK(fs_read_batch(reqs, count) == count - 1);
+    CHECK(reqs[0].result == 40000 && memcmp(buf[0], data + (1 << 20), 40000) == 0);
+    CHECK(reqs[1].result == 2000 && memcmp(buf[1], data + 10, 2000) == 0);
+    CHECK(reqs[2].result == 100 && memcmp(buf[2], data, 100) == 0);
+    CHECK(reqs[3].result == 10 && memcmp(buf[3], data + SMALL - 10, 10) == 0);
+    CHECK(reqs[4].result == BIG && memcmp(back, data, BIG) == 0);
+    CHECK(reqs[5].result == -1);
+
+    CHECK(fs_close(big) == 0 && fs_close(small) == 0);
+    printf("✅ Batched reads got what fs_pread would\n");
+    return 0;
+}
+
+// Another client over its own connection: it cannot use this one's
+// descriptors, and the server closes its own when it goes away
+static int test_ownership() {
+    int mine = fs_open("big");
+    CHECK(mine != -1);
+    int opened[2], done[2];
+    CHECK(pipe(opened) == 0 && pipe(done) == 0);
+
+    pid_t pid = fork();
+    CHECK(pid != -1);
+    if (pid == 0) {
+        // Only the parent writes done, so its exit ends the wait below
+        char c = 0;
+        close(opened[0]);
+        close(done[1]);
+        fs_disconnect();
+        int ok = fs_connect(SOCKET) == 0 && fs_read(mine, back, 100) == -1 &&
+                 fs_close(mine) == -1 && fs_open("small") != -1;
+        if (write(opened[1], &c, 1) != 1 || read(done[0], &c, 1) != 1) ok = 0;
+        _exit(ok ? 0 : 1);
+    }
+    char c = 0;
+    CHECK(read(opened[0], &c, 1) == 1);
+    CHECK(fs_delete("small") == -1);
+    CHECK(write(done[1], &c, 1) == 1);
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    close(opened[0]);
+    close(opened[1]);
+    close(done[0]);
+    close(done[1]);
+
+    // The server notices the hang-up in its own time
+    int deleted = -1;
+    for (int i = 0; deleted == -1 && i < 500; i++) {
+        if ((deleted = fs_delete("small")) == -1) usleep(10000);
+    }
+    CHECK(deleted == 0);
+    CHECK(fs_pread(mine, back, 100, 0) == 100 && memcmp(back, data, 100) == 0);
+    CHECK(fs_close(mine) == 0);
+    printf("✅ Descriptors stayed with the client that opened them\n");
+    return 0;
+}
+
+// A connection of its own, speaking the protocol directly
+static int raw_connect() {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, SOCKET);
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s != -1 && connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(s);
+        s = -1;
+    }
+    return s;
+}
+
+// Sends req with len bytes of payload and fd, unless -1, and reads the
+// reply header, dropping any reply payload
+static int raw_call(int s, fs_msg_t *req, const char *payload, int fd, fs_msg_t *rep) {
+    char control[CMSG_SPACE(sizeof(int))] = { 0 };
+    struct iovec iov[2] = { { req, sizeof(*req) }, { (char *)payload, req->len } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = req->len ? 2 : 1 };
+    if (fd != -1) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+    if (sendmsg(s, &msg, MSG_NOSIGNAL) != (ssize_t)(sizeof(*req) + req->len)) return -1;
+    if (recv(s, rep, sizeof(*rep), MSG_WAITALL) != sizeof(*rep) || rep->id != req->id) return -1;
+    for (uint32_t left = rep->len; left > 0; ) {
+        ssize_t n = recv(s, back, left < BIG ? left : BIG, 0);
+        if (n <= 0) return -1;
+        left -= n;
+    }
+    return 0;
+}
+
+// Offers fd as the shared buffer on a new connection, then shrinks it and
+// asks for a read into it. Returns the results of both.
+static int offer_buffer(int fd, int64_t *hello, int64_t *read) {
+    int s = raw_connect();
+    CHECK(s != -1);
+    CHECK(ftruncate(fd, FS_SHM_SIZE) == 0);
+    fs_msg_t req = { .id = 1, .op = FS_REQ_HELLO, .nbyte = FS_SHM_SIZE };
+    fs_msg_t rep;
+    CHECK(raw_call(s, &req, NULL, fd, &rep) == 0);
+    *hello = rep.arg;
+
+    CHECK(ftruncate(fd, 0) == 0);
+    req = (fs_msg_t){ .len = 4, .id = 2, .op = FS_REQ_OPEN, .fildes = -1 };
+    CHECK(raw_call(s, &req, "big", -1, &rep) == 0 && rep.arg >= 0);
+    req = (fs_msg_t){ .id = 3, .op = FS_REQ_PREAD, .flags = FS_MSG_SHM, .fildes = rep.arg, .nbyte = 4096 };
+    CHECK(raw_call(s, &req, NULL, -1, &rep) == 0);
+    *read = rep.arg;
+    close(s);
+    return 0;
+}
+
+// The server only maps a shared buffer sealed against shrinking, so a
+// client cannot truncate it under a read. Neither a plain file nor an
+// unsealed memfd is taken, and the server carries on.
+static int test_unsealed_buffer() {
+    int fds[2];
+    fds[0] = open("client_test.buffer", O_RDWR | O_CREAT | O_TRUNC, 0600);
+    fds[1] = memfd_create("client_test", MFD_CLOEXEC);
+    CHECK(fds[0] != -1 && fds[1] != -1);
+    unlink("client_test.buffer");
+    for (int i = 0; i < 2; i++) {
+        int64_t hello = 0, read = 0;
+        CHECK(offer_buffer(fds[i], &hello, &read) == 0);
+        CHECK(hello == -1 && read == -1);
+        close(fds[i]);
+    }
+
+    int fd = fs_open("big");
+    CHECK(fd != -1);
+    CHECK(fs_pread(fd, back, 100000, 0) == 100000 && memcmp(back, data, 100000) == 0);
+    CHECK(fs_close(fd) == 0);
+    printf("✅ Unsealed shared buffers were refused\n");
+    return 0;
+}
+
+int main() {
+    data = malloc(BIG);
+    back = malloc(BIG);
+    if (!data || !back) return 1;
+
+    pid_t server = start_server();
+    if (server == -1) {
+        printf("❌ Error starting %s\n", SERVER);
+        return 1;
+    }
+    int failed = test_transfers() == -1 || test_read_batch() == -1 || test_ownership() == -1 ||
+                 test_unsealed_buffer() == -1;
+
+    // The server unmounts on SIGTERM
+    fs_disconnect();
+    int status;
+    kill(server, SIGTERM);
+    if (waitpid(server, &status, 0) != server || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("❌ Server did not shut down cleanly\n");
+        failed = 1;
+    }
+    free(data);
+    free(back);
+    return failed;
+}
@@ -1,15 +1,614 @@
 #include "fs.h"
+#include "disk.h"
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#define DISK "test.disk"
+
+// Reports the failed condition and fails the enclosing test
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("❌ %s, line %d: %s\n", __func__, __LINE__, #cond); \
+        return -1; \
+    } \
+} while (0)
+
+#define BIG (160 * 1024)
+
+static char pattern[BIG];
+static char readback[BIG + 1];
+
+// Fills len bytes of buf with data that differs for every seed
+static void fill(char *buf, size_t len, int seed) {
+    for (size_t i = 0; i < len; i++) buf[i] = (char)(seed * 131 + i * 7 + i / 4096);
+}
+
+static int write_file(char *name, size_t len, int seed) {
+    fill(pattern, len, seed);
+    int fd = fs_open(name);
+    CHECK(fd != -1);
+    CHECK(fs_write(fd, pattern, len) == (int)len);
+    CHECK(fs_close(fd) == 0);
+    return 0;
+}
+
+// Whether the file open as fd holds exactly the len bytes at want, then
+// closes it
+static int check_fd(int fd, const char *want, size_t len) {
+    CHECK(fd != -1);
+    CHECK(fs_get_filesize(fd) == (int)len);
+    CHECK(fs_lseek(fd, 0) == 0);
+    CHECK(fs_read(fd, readback, sizeof(readback)) == (int)len);
+    CHECK(memcmp(readback, want, len) == 0);
+    CHECK(fs_close(fd) == 0);
+    return 0;
+}
+
+static int check_data(char *name, const char *want, size_t len) {
+    return check_fd(fs_open(name), want, len);
+}
+
+// Whether name holds exactly what write_file(name, len, seed) wrote
+static int check_file(char *name, size_t len, int seed) {
+    fill(pattern, len, seed);
+    return check_data(name, pattern, len);
+}
+
+// Runs work in a child that mounts the volume, holds metadata back until
+// fs_sync and then dies without unmounting. The block cache is off, so what
+// it wrote is on disk as a crash would leave it.
+static int crash_after(int (*work)()) {
+    pid_t pid = fork();
+    CHECK(pid != -1);
+    if (pid == 0) {
+        disk_set_cache_size(0);
+        if (mount_fs(DISK) == -1 || fs_set_sync_interval(-1) == -1 || work() == -1) _exit(1);
+        _exit(0);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    return 0;
+}
+
+// The views of a file on the mmap backend point at what was written, and
+// stop at the end of the file
+static int test_read_view() {
+    CHECK(mount_fs_backend(DISK, FS_BACKEND_MMAP) == 0);
+    CHECK(fs_create("view") == 0);
+    int fd = fs_open("view");
+    CHECK(fd != -1);
+    fill(pattern, BIG - 100, 1);
+    CHECK(fs_write(fd, pattern, BIG - 100) == BIG - 100);
+
+    CHECK(fs_lseek(fd, 0) == 0);
+    struct iovec iov[64];
+    size_t got = 0;
+    int n;
+    while ((n = fs_read_view(fd, iov, 64, BIG)) > 0) {
+        for (int i = 0; i < n; i++) {
+            CHECK(got + iov[i].iov_len <= BIG - 100);
+            memcpy(readback + got, iov[i].iov_base, iov[i].iov_len);
+            got += iov[i].iov_len;
+        }
+    }
+    CHECK(n == 0 && got == BIG - 100);
+    CHECK(memcmp(readback, pattern, got) == 0);
+
+    // From an offset inside a block, a view matches fs_read
+    CHECK(fs_lseek(fd, 5000) == 0);
+    CHECK(fs_read_view(fd, iov, 1, 3000) == 1);
+    CHECK(iov[0].iov_len == 3000 && memcmp(iov[0].iov_base, pattern + 5000, 3000) == 0);
+    CHECK(fs_read(fd, readback, 100) == 100 && memcmp(readback, pattern + 8000, 100) == 0);
+
+    CHECK(fs_close(fd) == 0);
+    CHECK(fs_delete("view") == 0);
+    CHECK(umount_fs(DISK) == 0);
+    printf("✅ Read views on the mmap backend match the file\n");
+    return 0;
+}
+
+// Records the result of an async call in the int at arg
+static void aio_done(int fildes, int result, void *arg) {
+    (void)fildes;
+    *(int *)arg = result;
+}
+
+// Async writes and reads, some unaligned, complete with their byte
+// counts and move the same data as fs_read would. Unmounting waits for
+// calls still in flight.
+static int test_async() {
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(fs_create("async") == 0);
+    int fd = fs_open("async");
+    CHECK(fd != -1);
+    fill(pattern, BIG - 100, 2);
+    int res[3] = { 0, 0, 0 };
+    CHECK(fs_write_async(fd, pattern, 1000, aio_done, &res[0]) == 0);
+    CHECK(fs_aio_wait(1) == 1);
+    CHECK(fs_write_async(fd, pattern + 1000, BIG - 1100, aio_done, &res[1]) == 0);
+    CHECK(fs_aio_wait(1) == 1);
+    CHECK(res[0] == 1000 && res[1] == BIG - 1100);
+    CHECK(fs_get_filesize(fd) == BIG - 100);
+
+    CHECK(fs_lseek(fd, 0) == 0);
+    CHECK(fs_read(fd, readback, BIG) == BIG - 100);
+    CHECK(memcmp(readback, pattern, BIG - 100) == 0);
+
+    CHECK(fs_lseek(fd, 3000) == 0);
+    memset(readback, 0, BIG);
+    CHECK(fs_read_async(fd, readback, BIG, aio_done, &res[2]) == 0);
+    CHECK(fs_aio_wait(1) == 1);
+    CHECK(res[2] == BIG - 3100 && memcmp(readback, pattern + 3000, BIG - 3100) == 0);
+
+    res[2] = 0;
+    CHECK(fs_lseek(fd, 0) == 0);
+    CHECK(fs_read_async(fd, readback, BIG, aio_done, &res[2]) == 0);
+    CHECK(fs_close(fd) == 0);
+    CHECK(umount_fs(DISK) == 0);
+    CHECK(res[2] == BIG - 100 && memcmp(readback, pattern, BIG - 100) == 0);
+    printf("✅ Async reads and writes completed with the file's data\n");
+    return 0;
+}
+
+static char *batch[] = { "b0", "b1", "b2", "b3", "b4", "b5", "b6", "b7" };
+#define BATCH (int)(sizeof(batch) / sizeof(batch[0]))
+
+// Changes after the last fs_sync are lost. A new mount allocates from the
+// start of the disk, where keep is, so reuse would be given keep's blocks,
+// and keep's tail slot next to other's, if they were not held back until
+// the delete is committed, and keep would be overwritten.
+static int crash_unsynced() {
+    CHECK(fs_create_many(batch, BATCH) == BATCH);
+    CHECK(fs_sync() == 0);
+    CHECK(fs_delete_many(batch, BATCH) == BATCH);
+    CHECK(fs_delete("keep") == 0);
+    CHECK(fs_create("reuse") == 0);
+    CHECK(write_file("reuse", 2 * 4096 + 1500, 2) == 0);
+    CHECK(fs_create("new") == 0);
+    CHECK(write_file("new", 1000, 1) == 0);
+    return 0;
+}
+
+static int crash_synced() {
+    CHECK(fs_create("durable") == 0);
+    CHECK(write_file("durable", 40000, 3) == 0);
+    CHECK(fs_delete("keep") == 0);
+    CHECK(fs_sync() == 0);
+    return 0;
+}
+
+// Mount replays what was committed to the journal before a crash, and only
+// that
+static int test_crash_replay() {
+    CHECK(make_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(fs_create("keep") == 0);
+    CHECK(write_file("keep", 15 * 4096 + 1500, 4) == 0);
+    CHECK(fs_create("other") == 0);
+    CHECK(write_file("other", 1500, 5) == 0);
+    CHECK(umount_fs(DISK) == 0);
+
+    CHECK(crash_after(crash_unsynced) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(check_file("keep", 15 * 4096 + 1500, 4) == 0);
+    CHECK(check_file("other", 1500, 5) == 0);
+    CHECK(fs_open("new") == -1 && fs_open("reuse") == -1);
+    for (int i = 0; i < BATCH; i++) CHECK(check_file(batch[i], 0, 0) == 0);
+    CHECK(umount_fs(DISK) == 0);
+
+    CHECK(crash_after(crash_synced) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(check_file("durable", 40000, 3) == 0);
+    CHECK(fs_open("keep") == -1);
+    CHECK(umount_fs(DISK) == 0);
+    printf("✅ Crash replay kept synced changes only\n");
+    return 0;
+}
+
+#define STRIPED "stripe0.disk,stripe1.disk,stripe2.disk"
+
+// A file spanning many stripes of a three-image volume reads back the same,
+// whole and from inside a stripe, before and after a remount
+static int test_striping() {
+    CHECK(fs_set_stripe_blocks(4) == 0);
+    CHECK(make_fs(STRIPED) == 0);
+    CHECK(fs_set_stripe_blocks(16) == 0);
+    CHECK(mount_fs(STRIPED) == 0);
+    CHECK(fs_create("striped") == 0);
+    CHECK(write_file("striped", BIG - 100, 6) == 0);
+    CHECK(check_file("striped", BIG - 100, 6) == 0);
+
+    int fd = fs_open("striped");
+    CHECK(fd != -1);
+    CHECK(fs_lseek(fd, 5 * 4096 - 10) == 0);
+    CHECK(fs_read(fd, readback, 9 * 4096) == 9 * 4096);
+    CHECK(memcmp(readback, pattern + 5 * 4096 - 10, 9 * 4096) == 0);
+    CHECK(fs_close(fd) == 0);
+    CHECK(umount_fs(STRIPED) == 0);
+
+    CHECK(mount_fs(STRIPED) == 0);
+    CHECK(check_file("striped", BIG - 100, 6) == 0);
+    CHECK(umount_fs(STRIPED) == 0);
+    printf("✅ Striped volume read back what was written\n");
+    return 0;
+}
+
+// Writes bytes from..to of the seed's data to name, which holds the bytes
+// before them
+static int grow_file(char *name, size_t from, size_t to, int seed) {
+    fill(pattern, to, seed);
+    int fd = fs_open(name);
+    CHECK(fd != -1);
+    CHECK(fs_lseek(fd, from) == 0);
+    CHECK(fs_write(fd, pattern + from, to - from) == (int)(to - from));
+    CHECK(fs_close(fd) == 0);
+    return 0;
+}
+
+// Files growing out of their directory entry, into a shared tail block,
+// and past the tail limit into blocks of their own, next to a file that
+// keeps its tail in the same tail block
+static int test_small_files() {
+    CHECK(make_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(fs_create("grows") == 0 && fs_create("stays") == 0);
+    CHECK(write_file("stays", 4096 + 700, 8) == 0);
+
+    size_t sizes[] = { 50, 84, 85, 1000, 2048, 2049, 4096 + 1000, 4096 + 3000, 3 * 4096 + 10 };
+    size_t at = 0;
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        CHECK(grow_file("grows", at, sizes[i], 7) == 0);
+        at = sizes[i];
+        CHECK(check_file("grows", at, 7) == 0);
+        CHECK(check_file("stays", 4096 + 700, 8) == 0);
+    }
+    CHECK(umount_fs(DISK) == 0);
+
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(check_file("grows", at, 7) == 0);
+    CHECK(check_file("stays", 4096 + 700, 8) == 0);
+    CHECK(umount_fs(DISK) == 0);
+    printf("✅ Inline and tail-packed files grew with their data intact\n");
+    return 0;
+}
+
+static char packed_data[BIG];
+
+// A compressed file cut by truncate inside a chunk and written again at the
+// new end, read back whole and from inside a chunk, and after a remount
+static int test_compression() {
+    CHECK(make_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(fs_create("packed") == 0);
+
+    fill(packed_data, BIG, 6);
+    int fd = fs_open("packed");
+    CHECK(fd != -1);
+    CHECK(fs_set_compression(fd, 1) == 0);
+    CHECK(fs_write(fd, packed_data, BIG) == BIG);
+    CHECK(fs_truncate(fd, 70001) == 0);
+    CHECK(fs_pwrite(fd, "end", 3, 70001) == 3);
+    memcpy(packed_data + 70001, "end", 3);
+    CHECK(fs_pread(fd, readback, 5000, 40000) == 5000);
+    CHECK(memcmp(readback, packed_data + 40000, 5000) == 0);
+    CHECK(fs_close(fd) == 0);
+
+    CHECK(check_data("packed", packed_data, 70004) == 0);
+    CHECK(umount_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(check_data("packed", packed_data, 70004) == 0);
+    CHECK(umount_fs(DISK) == 0);
+    printf("✅ Compressed file survived truncate and remount\n");
+    return 0;
+}
+
+static char dup1_data[BIG];
+static char dup2_data[BIG];
+
+// Shared blocks are copied when written, so an overwrite lost in a crash
+// leaves them as they were
+static int crash_dedup_overwrite() {
+    int fd = fs_open("dup2");
+    CHECK(fd != -1);
+    fill(pattern, BIG, 8);
+    CHECK(fs_pwrite(fd, pattern, BIG, 0) == BIG);
+    CHECK(fs_close(fd) == 0);
+    return 0;
+}
+
+// Two dedup files with the same data share every block until one is
+// written, then one is cut inside a block and the other on a block boundary,
+// and they read back after a remount and after a crash
+static int test_dedup() {
+    CHECK(make_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    char *names[] = { "dup1", "dup2" };
+    fill(dup1_data, BIG, 7);
+    fill(dup2_data, BIG, 7);
+    for (int i = 0; i < 2; i++) {
+        CHECK(fs_create(names[i]) == 0);
+        int fd = fs_open(names[i]);
+        CHECK(fd != -1);
+        CHECK(fs_set_dedup(fd, 1) == 0);
+        CHECK(fs_write(fd, dup1_data, BIG) == BIG);
+        CHECK(fs_close(fd) == 0);
+    }
+    int fd = fs_open("dup1");
+    CHECK(fd != -1);
+    memset(dup1_data + 5000, 'x', 4000);
+    CHECK(fs_pwrite(fd, dup1_data + 5000, 4000, 5000) == 4000);
+    CHECK(fs_truncate(fd, 12 * 4096) == 0);
+    CHECK(fs_close(fd) == 0);
+    fd = fs_open("dup2");
+    CHECK(fd != -1);
+    CHECK(fs_truncate(fd, 10000) == 0);
+    CHECK(fs_pwrite(fd, "end", 3, 10000) == 3);
+    CHECK(fs_close(fd) == 0);
+    memcpy(dup2_data + 10000, "end", 3);
+
+    CHECK(check_data("dup1", dup1_data, 12 * 4096) == 0);
+    CHECK(check_data("dup2", dup2_data, 10003) == 0);
+    CHECK(umount_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(check_data("dup1", dup1_data, 12 * 4096) == 0);
+    CHECK(check_data("dup2", dup2_data, 10003) == 0);
+    CHECK(umount_fs(DISK) == 0);
+
+    CHECK(crash_after(crash_dedup_overwrite) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(check_data("dup1", dup1_data, 12 * 4096) == 0);
+    CHECK(check_data("dup2", dup2_data, 10003) == 0);
+    CHECK(umount_fs(DISK) == 0);
+    printf("✅ Dedup files kept their own data through writes and truncate\n");
+    return 0;
+}
+
+// Reads fd from from to to in steps of step bytes, comparing with want
+static int read_steps(int fd, const char *want, size_t from, size_t to, size_t step) {
+    CHECK(fs_lseek(fd, from) == 0);
+    for (size_t at = from; at < to; at += step) {
+        size_t n = to - at < step ? to - at : step;
+        CHECK(fs_read(fd, readback, n) == (int)n);
+        CHECK(memcmp(readback, want + at, n) == 0);
+    }
+    return 0;
+}
+
+// Sequential reads served by readahead see the file's data, including a
+// write made through another descriptor while they run, and keep doing so
+// after seeking back
+static int test_readahead() {
+    CHECK(make_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(fs_create("ahead") == 0);
+    CHECK(write_file("ahead", BIG, 9) == 0);
+
+    int fd = fs_open("ahead");
+    int other = fs_open("ahead");
+    CHECK(fd != -1 && other != -1);
+    CHECK(read_steps(fd, pattern, 0, BIG / 2, 3000) == 0);
+    memset(pattern + BIG / 2 + 10000, 'w', 20000);
+    CHECK(fs_pwrite(other, pattern + BIG / 2 + 10000, 20000, BIG / 2 + 10000) == 20000);
+    CHECK(read_steps(fd, pattern, BIG / 2, BIG, 3000) == 0);
+    CHECK(read_steps(fd, pattern, 1000, BIG, 8192) == 0);
+    CHECK(fs_read(fd, readback, 100) == 0);
+    CHECK(fs_close(fd) == 0 && fs_close(other) == 0);
+    CHECK(umount_fs(DISK) == 0);
+    printf("✅ Readahead returned the file's current data\n");
+    return 0;
+}
+
+// Appends bytes from..to of pattern to fd in 64-byte writes
+static int append_small(int fd, size_t from, size_t to) {
+    for (size_t at = from; at < to; at += 64) {
+        size_t n = to - at < 64 ? to - at : 64;
+        CHECK(fs_write(fd, pattern + at, n) == (int)n);
+    }
+    return 0;
+}
+
+// Small appends collected in a descriptor's write buffer are in the file
+// for a read or fs_lseek on the same descriptor, for other descriptors and
+// after close
+static int test_write_buffer() {
+    CHECK(make_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(fs_create("appends") == 0);
+    fill(pattern, BIG, 10);
+    int fd = fs_open("appends");
+    int other = fs_open("appends");
+    CHECK(fd != -1 && other != -1);
+
+    CHECK(append_small(fd, 0, 10000) == 0);
+    CHECK(fs_lseek(fd, 2000) == 0);
+    CHECK(fs_read(fd, readback, 8000) == 8000 && memcmp(readback, pattern + 2000, 8000) == 0);
+    CHECK(append_small(fd, 10000, 30000) == 0);
+    CHECK(fs_read(other, readback, 30000) == 30000 && memcmp(readback, pattern, 30000) == 0);
+    CHECK(append_small(fd, 30000, 50000) == 0);
+    CHECK(fs_lseek(fd, 0) == 0);
+    CHECK(fs_read(fd, readback, BIG) == 50000 && memcmp(readback, pattern, 50000) == 0);
+    CHECK(append_small(fd, 50000, 70001) == 0);
+    CHECK(fs_close(fd) == 0 && fs_close(other) == 0);
+
+    CHECK(check_data("appends", pattern, 70001) == 0);
+    CHECK(umount_fs(DISK) == 0);
+    printf("✅ Buffered small writes were seen by reads and seeks\n");
+    return 0;
+}
+
+static char frag_data[2][BIG];
+
+// Extents of name in fs_fragmentation's report, or -1
+static int extents_of(char *name) {
+    fs_frag_t files[8];
+    int n = fs_fragmentation(files, 8);
+    for (int i = 0; i < n && i < 8; i++) {
+        if (strcmp(files[i].name, name) == 0) return files[i].extents;
+    }
+    return -1;
+}
+
+// Two files grown a block at a time in turn are fragmented. fs_defrag
+// leaves one with an async call in flight alone until it completes, and
+// makes both contiguous with their data unchanged.
+static int test_defrag() {
+    CHECK(make_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    char *names[] = { "frag0", "frag1" };
+    int fd[2];
+    for (int i = 0; i < 2; i++) {
+        CHECK(fs_create(names[i]) == 0);
+        fd[i] = fs_open(names[i]);
+        CHECK(fd[i] != -1);
+        fill(frag_data[i], 20 * 4096, 11 + i);
+    }
+    for (int b = 0; b < 20; b++) {
+        for (int i = 0; i < 2; i++) {
+            CHECK(fs_pwrite(fd[i], frag_data[i] + b * 4096, 4096, b * 4096) == 4096);
+        }
+    }
+    CHECK(extents_of("frag0") > 1 && extents_of("frag1") > 1);
+
+    int res = 0;
+    CHECK(fs_read_async(fd[1], readback, 4096, aio_done, &res) == 0);
+    int moved;
+    while ((moved = fs_defrag(8)) > 0) {}
+    CHECK(moved == 0);
+    CHECK(extents_of("frag0") == 1 && extents_of("frag1") > 1);
+    CHECK(fs_aio_wait(1) == 1 && res == 4096 && memcmp(readback, frag_data[1], 4096) == 0);
+    while ((moved = fs_defrag(8)) > 0) {}
+    CHECK(moved == 0);
+    CHECK(extents_of("frag0") == 1 && extents_of("frag1") == 1);
+    CHECK(fs_close(fd[0]) == 0 && fs_close(fd[1]) == 0);
+
+    for (int i = 0; i < 2; i++) CHECK(check_data(names[i], frag_data[i], 20 * 4096) == 0);
+    CHECK(umount_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    for (int i = 0; i < 2; i++) CHECK(check_data(names[i], frag_data[i], 20 * 4096) == 0);
+    CHECK(umount_fs(DISK) == 0);
+    printf("✅ Defragmented files became contiguous with their data intact\n");
+    return 0;
+}
+
+static char taken[BIG];
+
+// What snapshot holds: the files as they were when it was taken, read-only
+static int check_snapshot(int snapshot) {
+    CHECK(check_fd(fs_open_snapshot(snapshot, "src"), taken, BIG) == 0);
+    CHECK(check_fd(fs_open_snapshot(snapshot, "small"), "small", 5) == 0);
+    CHECK(check_fd(fs_open_snapshot(snapshot, "gone"), taken, 3 * 4096) == 0);
+    CHECK(fs_open_snapshot(snapshot, "copy") == -1);
+    int fd = fs_open_snapshot(snapshot, "src");
+    CHECK(fd != -1);
+    CHECK(fs_write(fd, "x", 1) == -1 && fs_truncate(fd, 0) == -1);
+    CHECK(fs_close(fd) == 0);
+    return 0;
+}
+
+// A snapshot keeps the blocks its files had while the live files are
+// overwritten, cut, grown, cloned and deleted, across a remount, and
+// deleting it leaves the live files alone
+static int test_snapshot() {
+    CHECK(make_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    char *names[] = { "src", "small", "gone" };
+    for (int i = 0; i < 3; i++) CHECK(fs_create(names[i]) == 0);
+    fill(taken, BIG, 9);
+    CHECK(write_file("src", BIG, 9) == 0);
+    int fd = fs_open("small");
+    CHECK(fd != -1 && fs_write(fd, "small", 5) == 5 && fs_close(fd) == 0);
+    CHECK(write_file("gone", 3 * 4096, 9) == 0);
+
+    int snapshot = fs_snapshot();
+    CHECK(snapshot > 0);
+
+    // Every block src shared with the snapshot is written or dropped
+    fill(pattern, BIG, 10);
+    fd = fs_open("src");
+    CHECK(fd != -1);
+    CHECK(fs_pwrite(fd, pattern + 4000, 20000, 4000) == 20000);
+    CHECK(fs_truncate(fd, 50000) == 0);
+    CHECK(fs_pwrite(fd, pattern + 50000, BIG - 50000, 50000) == BIG - 50000);
+    CHECK(fs_pwrite(fd, pattern, 4000, 0) == 4000);
+    CHECK(fs_pwrite(fd, pattern + 24000, 26000, 24000) == 26000);
+    CHECK(fs_close(fd) == 0);
+    CHECK(fs_clone("src", "copy") == 0);
+    fd = fs_open("copy");
+    CHECK(fd != -1 && fs_pwrite(fd, "copy", 4, 0) == 4 && fs_close(fd) == 0);
+    fd = fs_open("small");
+    CHECK(fd != -1 && fs_pwrite(fd, pattern, 10000, 0) == 10000 && fs_close(fd) == 0);
+    CHECK(fs_delete("gone") == 0);
+
+    CHECK(check_snapshot(snapshot) == 0);
+    CHECK(umount_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(check_snapshot(snapshot) == 0);
+    CHECK(check_data("src", pattern, BIG) == 0);
+    CHECK(check_data("small", pattern, 10000) == 0);
+    memcpy(pattern, "copy", 4);
+    CHECK(check_data("copy", pattern, BIG) == 0);
+    CHECK(fs_open("gone") == -1);
+
+    CHECK(fs_delete_snapshot(snapshot) == 0);
+    CHECK(fs_open_snapshot(snapshot, "src") == -1);
+    CHECK(umount_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(fs_open_snapshot(snapshot, "src") == -1);
+    CHECK(check_data("copy", pattern, BIG) == 0);
+    fill(pattern, BIG, 10);
+    CHECK(check_data("src", pattern, BIG) == 0);
+    CHECK(umount_fs(DISK) == 0);
+    printf("✅ Snapshot kept its files while they were changed\n");
+    return 0;
+}
+
+// Files made and removed in batches, skipping names that cannot be, and
+// vectored writes and reads moving the same bytes as one buffer would
+static int test_batched() {
+    CHECK(make_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    char *names[] = { "v0", "v1", "v0", "a name too long to fit", "v2" };
+    CHECK(fs_create_many(names, 5) == 3);
+
+    fill(pattern, BIG, 13);
+    int fd = fs_open("v1");
+    CHECK(fd != -1);
+    struct iovec iov[3] = { { pattern, 100 }, { pattern + 100, 5000 }, { pattern + 5100, BIG - 5100 } };
+    CHECK(fs_writev(fd, iov, 3) == BIG);
+    CHECK(fs_lseek(fd, 50) == 0);
+    memset(readback, 0, BIG);
+    struct iovec back[3] = { { readback, 4000 }, { readback + 4000, 1 }, { readback + 4001, BIG } };
+    CHECK(fs_readv(fd, back, 3) == BIG - 50);
+    CHECK(memcmp(readback, pattern + 50, BIG - 50) == 0);
+    CHECK(fs_close(fd) == 0);
+    CHECK(check_data("v1", pattern, BIG) == 0);
+
+    fd = fs_open("v2");
+    CHECK(fd != -1);
+    CHECK(fs_delete_many(names, 5) == 2);
+    CHECK(fs_open("v0") == -1 && fs_open("v1") == -1);
+    CHECK(fs_close(fd) == 0);
+    CHECK(fs_delete_many(names + 4, 1) == 1);
+    CHECK(umount_fs(DISK) == 0);
+    CHECK(mount_fs(DISK) == 0);
+    CHECK(fs_open("v0") == -1 && fs_open("v1") == -1 && fs_open("v2") == -1);
+    CHECK(umount_fs(DISK) == 0);
+    printf("✅ Batched and vectored calls matched their single forms\n");
+    return 0;
+}
 
 int main() {
     // Create and mount the file system
-    if (make_fs("test.disk") == -1) {
+    if (make_fs(DISK) == -1) {
         printf("❌ Error creating file system\n");
         return 1;
     }
 
-    if (mount_fs("test.disk") == -1) {
+    if (mount_fs(DISK) == -1) {
         printf("❌ Error mounting file system\n");
         return 1;
     }
@@ -35,13 +634,19 @@ int main() {
     }
     printf("✅ Wrote to file: \"%s\"\n", data);
 
+    // Flush cached blocks and metadata to the image
+    if (fs_sync() == -1) {
+        printf("❌ Error syncing file system\n");
+        return 1;
+    }
+
     // Check file size
-    int size = fs_get_filesize(fd);
+    off_t size = fs_get_filesize(fd);
     if (size == -1) {
         printf("❌ Error getting file size\n");
         return 1;
     }
-    printf("📦 File size: %d bytes\n", size);
+    printf("📦 File size: %lld bytes\n", (long long)size);
 
     // Seek to beginning
     if (fs_lseek(fd, 0) == -1) {
@@ -89,11 +694,18 @@ int main() {
     printf("🗑️  Deleted file \"test.txt\"\n");
 
     // Unmount file system
-    if (umount_fs("test.disk") == -1) {
+    if (umount_fs(DISK) == -1) {
         printf("❌ Error unmounting file system\n");
         return 1;
     }
     printf("✅ File system unmounted successfully\n");
 
+    if (test_read_view() == -1 || test_async() == -1 || test_crash_replay() == -1 ||
+        test_striping() == -1 || test_small_files() == -1 ||
+        test_compression() == -1 || test_dedup() == -1 ||
+        test_readahead() == -1 || test_write_buffer() == -1 ||
+        test_defrag() == -1 || test_snapshot() == -1 ||
+        test_batched() == -1) return 1;
+
     return 0;
 }